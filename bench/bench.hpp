@@ -0,0 +1,81 @@
+/*
+ *  bench/bench.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef BENCH_BENCH_HPP_
+#define BENCH_BENCH_HPP_
+
+
+#include <fcntl.h>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include <kvm.hpp>
+#include <vm.hpp>
+
+
+constexpr int  BENCH_TIMEOUT_S = 60;
+constexpr char BENCH_CMDLINE[] = "console=ttyS0 earlyprintk=serial "
+    "noapic noacpi notsc nowatchdog nmi_watchdog=0 mitigations=off lapic "
+    "tsc_early_khz=2000 rdinit=/init init=/init";
+
+
+using Clock = std::chrono::steady_clock;
+
+// std::cout as it was before QuietCout silenced it
+static std::ostream out(std::cout.rdbuf());
+
+static inline double ms_since(Clock::time_point t) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - t)
+        .count();
+}
+
+
+// VM and KVM log to std::cout; while one of these lives only what a
+// benchmark writes to out gets through
+class QuietCout {
+ public:
+    QuietCout() : saved(std::cout.rdbuf(nullptr)) {}
+    ~QuietCout() { std::cout.rdbuf(saved); }
+
+ private:
+    std::streambuf* saved;
+};
+
+
+// From kvmCreateVM() until the console printed marker, the way VMPool
+// boots its VMs. The VM is left running in *vm and *started is when
+// Start() was called. False if a step failed, the constructor threw on a
+// kernel it cannot boot or the marker did not come in BENCH_TIMEOUT_S.
+static inline bool boot_to_marker(KVM* kvm, const vm_config& conf,
+        const char* marker, std::unique_ptr<VM>* vm,
+        Clock::time_point* started = nullptr) {
+    static const int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    VM* p;
+
+    try {
+        if (kvm->kvmCreateVM(&p, conf) < 0)
+            return false;
+    } catch (const std::exception&) {
+        return false;
+    }
+    vm->reset(p);
+    (*vm)->setConsoleFd(null);
+    (*vm)->setConsoleMarker(marker);
+    if ((*vm)->initMachine() || (*vm)->initRAM(BENCH_CMDLINE))
+        return false;
+    if (started)
+        *started = Clock::now();
+
+    return !(*vm)->Start()
+        && (*vm)->waitConsoleMarker(BENCH_TIMEOUT_S*1000);
+}
+
+
+#endif  // BENCH_BENCH_HPP_
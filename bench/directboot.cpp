@@ -0,0 +1,142 @@
+/*
+ *  bench/directboot.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <bench.hpp>
+#include <image.hpp>
+#include <kvm.hpp>
+#include <vm.hpp>
+
+
+// From kvmCreateVM() until the console printed marker. The kernel load
+// is initRAM()'s share of that.
+static void boot(KVM* kvm, const char* name, const char* kernel,
+        bool boot64, int threads, uint64_t ram_size, const char* initramfs,
+        const char* marker, int boots) {
+    std::vector<double> ms, load_ms;
+    std::unique_ptr<VM> vm;
+    load_stats st;
+    vm_config conf {
+        .vcpu_num = 1,
+        .ram_size = ram_size,
+        .kernel_path = kernel,
+        .initramfs_path = initramfs,
+        .is_64bit_boot = boot64,
+        .kernel_load_threads = threads,
+    };
+
+    out << std::setw(18) << name << std::flush;
+
+    for (int i = 0; i < boots; ++i) {
+        auto t = Clock::now();
+
+        if (!boot_to_marker(kvm, conf, marker, &vm) || vm->getLoadStats(&st))
+            break;
+        ms.push_back(ms_since(t));
+        load_ms.push_back(st.ns / 1e6);
+        vm.reset();
+    }
+    vm.reset();
+
+    if (ms.empty()) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+    std::sort(ms.begin(), ms.end());
+    std::sort(load_ms.begin(), load_ms.end());
+    out << std::fixed << std::setprecision(2)
+        << std::setw(8) << st.threads
+        << std::setw(10) << load_ms[load_ms.size() / 2] << "ms"
+        << std::setprecision(1)
+        << std::setw(10) << ms[ms.size() / 2] << "ms"
+        << std::setw(10) << ms.front() << "ms"
+        << std::setw(10) << ms.back() << "ms" << std::endl;
+}
+
+
+int main(int argc, char** argv) {
+    int opt, boots = 5, threads = 0;
+    uint64_t ram_size = 1ULL << 30;
+    const char *bzimage = nullptr, *vmlinux = nullptr;
+    const char* initramfs = "initramfs";
+    const char* marker = "Welcome to u-root!";
+    QuietCout quiet;  // outlives kvm, which logs as it closes
+    std::unique_ptr<KVM> kvm;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "m:b:v:i:r:n:t:")) != -1) {
+        switch (opt) {
+            case 'm':
+                ram_size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 'b':
+                bzimage = optarg;
+                break;
+            case 'v':
+                vmlinux = optarg;
+                break;
+            case 'i':
+                initramfs = optarg;
+                break;
+            case 'r':
+                marker = optarg;
+                break;
+            case 'n':
+                boots = std::atoi(optarg);
+                break;
+            case 't':
+                threads = std::atoi(optarg);
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-m RAM_MB] "
+                    "[-b BZIMAGE] [-v VMLINUX] [-i INITRAMFS] [-r MARKER] "
+                    "[-n BOOTS] [-t LOAD_THREADS]" << std::endl;
+                return EXIT_FAILURE;
+        }
+    }
+    if (!bzimage && !vmlinux) {
+        std::cerr << "nothing to boot; give -b and/or -v" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if ((fd = KVM::getKVMFD()) < 0)
+        return EXIT_FAILURE;
+    kvm.reset(new KVM(fd));
+
+    out << "boot to \"" << marker << "\", " << (ram_size >> 20)
+        << " MiB RAM, " << boots << " boots\n"
+        << "            kernel threads  load med  boot med         min"
+        "         max" << std::endl;
+    if (bzimage) {
+        boot(kvm.get(), "bzImage 32-bit", bzimage, false, threads, ram_size,
+                initramfs, marker, boots);
+        boot(kvm.get(), "bzImage 64-bit", bzimage, true, threads, ram_size,
+                initramfs, marker, boots);
+    }
+    if (vmlinux) {
+        boot(kvm.get(), "vmlinux PVH", vmlinux, false, 1, ram_size,
+                initramfs, marker, boots);
+        boot(kvm.get(), "vmlinux PVH", vmlinux, false, threads, ram_size,
+                initramfs, marker, boots);
+        boot(kvm.get(), "vmlinux 64-bit", vmlinux, true, threads, ram_size,
+                initramfs, marker, boots);
+    }
+
+    return EXIT_SUCCESS;
+}
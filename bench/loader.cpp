@@ -0,0 +1,201 @@
+/*
+ *  bench/loader.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <bench.hpp>
+#include <image.hpp>
+#include <kvm.hpp>
+#include <rambacking.hpp>
+#include <vm.hpp>
+
+
+// What this process holds privately, in bytes: guest RAM that is not
+// page cache
+static uint64_t private_rss() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    uint64_t kb = 0;
+
+    while (std::getline(status, line)) {
+        if (!line.compare(0, 8, "RssAnon:") || !line.compare(0, 9, "RssShmem:"))
+            kb += std::strtoull(line.c_str() + line.find(':') + 1, nullptr,
+                    10);
+    }
+
+    return kb << 10;
+}
+
+// Not zeros, so that nothing can share the copies
+static int make_initramfs(char* path, uint64_t size) {
+    std::vector<uint64_t> buf(1 << 16);
+    uint64_t x = 0x9e3779b97f4a7c15;
+    int fd = mkstemp(path);
+
+    if (fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    for (uint64_t done = 0; done < size; ) {
+        const uint64_t n = std::min<uint64_t>(buf.size()*8, size - done);
+
+        for (uint64_t& v : buf) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            v = x;
+        }
+        if (write(fd, buf.data(), n) != static_cast<ssize_t>(n)) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    close(fd);
+
+    return 0;
+}
+
+// vms VMs loaded one after another and all kept, so that RSS adds up
+static void load(KVM* kvm, const ram_backing& backing, uint64_t ram_size,
+        bool map, const char* kernel, const char* initramfs, int vms) {
+    std::vector<std::unique_ptr<VM>> keep;
+    std::vector<uint64_t> us;
+    uint64_t copied = 0, mapped = 0, saved = 0, rss = 0;
+    VM* p;
+    vm_config conf {
+        .vcpu_num = 1,
+        .ram_size = ram_size,
+        .kernel_path = kernel,
+        .initramfs_path = initramfs,
+        .is_64bit_boot = false,
+        .backing = backing,
+        .map_initramfs = map,
+    };
+
+    out << std::setw(18) << ram_backing_name(backing)
+        << std::setw(6) << (map ? "map" : "copy") << std::flush;
+
+    for (int i = 0; i < vms; ++i) {
+        load_stats st;
+        uint64_t before;
+
+        if (kvm->kvmCreateVM(&p, conf) < 0)
+            break;
+        keep.emplace_back(p);
+        if (p->initMachine())
+            break;
+
+        before = private_rss();
+        if (p->initRAM(BENCH_CMDLINE) || p->getLoadStats(&st))
+            break;
+        rss += private_rss() - before;
+        us.push_back(st.ns / 1000);
+        copied += st.copied;
+        mapped += st.mapped;
+        saved += st.saved;
+    }
+
+    if (us.empty()) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+    std::sort(us.begin(), us.end());
+    out << std::setw(10) << us[us.size() / 2] << "us"
+        << std::setw(10) << us.back() << "us"
+        << std::setw(10) << (copied / us.size() >> 10) << "KiB"
+        << std::setw(10) << (mapped / us.size() >> 10) << "KiB"
+        << std::setw(10) << (saved / us.size() >> 10) << "KiB"
+        << std::setw(10) << (rss / us.size() >> 10) << "KiB" << std::endl;
+}
+
+
+int main(int argc, char** argv) {
+    int opt, vms = 4;
+    uint64_t ram_size = 512ULL << 20, size = 64ULL << 20;
+    const char *kernel = "bzImage", *initramfs = nullptr;
+    char tmp[] = "/tmp/loader-initramfs-XXXXXX";
+    std::vector<ram_backing> backings;
+    QuietCout quiet;  // outlives kvm, which logs as it closes
+    std::unique_ptr<KVM> kvm;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "m:s:k:i:n:")) != -1) {
+        switch (opt) {
+            case 'm':
+                ram_size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 's':
+                size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 'k':
+                kernel = optarg;
+                break;
+            case 'i':
+                initramfs = optarg;
+                break;
+            case 'n':
+                vms = std::atoi(optarg);
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-m RAM_MB] "
+                    "[-k BZIMAGE] [-i INITRAMFS | -s INITRAMFS_MB] "
+                    "[-n VMS] [BACKING...]" << std::endl;
+                return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        backings.emplace_back();
+        if (ram_backing_parse(argv[i], &backings.back()))
+            return EXIT_FAILURE;
+    }
+    if (backings.empty()) {
+        for (const char* name : { "anon", "thp" }) {
+            backings.emplace_back();
+            ram_backing_parse(name, &backings.back());
+        }
+    }
+
+    if (!initramfs) {
+        if (make_initramfs(tmp, size))
+            return EXIT_FAILURE;
+        initramfs = tmp;
+    }
+
+    if ((fd = KVM::getKVMFD()) < 0)
+        return EXIT_FAILURE;
+    kvm.reset(new KVM(fd));
+
+    out << "kernel and initramfs loading, " << vms << " VMs of "
+        << (ram_size >> 20) << " MiB, initramfs " << initramfs
+        << "; sizes per VM\n"
+        << "           backing  mode    median         max"
+        "      copied      mapped       saved   RSS added" << std::endl;
+    for (const ram_backing& b : backings) {
+        load(kvm.get(), b, ram_size, false, kernel, initramfs, vms);
+        load(kvm.get(), b, ram_size, true, kernel, initramfs, vms);
+    }
+
+    if (initramfs == tmp)
+        unlink(tmp);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+/*
+ *  bench/pipeline.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <compress.hpp>
+#include <pipeline.hpp>
+#include <zeropage.hpp>
+
+
+constexpr size_t BENCH_AREA_SIZE = 256*1024*1024;
+constexpr size_t BENCH_PAGE_SIZE = 4096;
+
+
+// A quarter each of zero, text-like, sparse and random pages
+static void fill(uint8_t* area) {
+    uint32_t x = 1;
+
+    for (size_t off = 0; off < BENCH_AREA_SIZE; off += BENCH_PAGE_SIZE) {
+        uint8_t* p = area + off;
+        switch (off / BENCH_PAGE_SIZE % 4) {
+            case 0:
+                std::memset(p, 0, BENCH_PAGE_SIZE);
+                break;
+            case 1:
+                for (size_t i = 0; i < BENCH_PAGE_SIZE; ++i)
+                    p[i] = "struct page *page = pfn_to_page(pfn);\n"[i % 38];
+                break;
+            case 2:
+                std::memset(p, 0, BENCH_PAGE_SIZE);
+                for (size_t i = 0; i < BENCH_PAGE_SIZE; i += 64)
+                    p[i] = i;
+                break;
+            default:
+                for (size_t i = 0; i < BENCH_PAGE_SIZE; ++i) {
+                    x = x * 1103515245 + 12345;
+                    p[i] = x >> 24;
+                }
+        }
+    }
+}
+
+static void run(const uint8_t* area, int threads, uint32_t batch) {
+    std::vector<std::unique_ptr<uint16_t[]>> tables;
+    uint64_t out_bytes = 0;
+
+    for (int i = 0; i < threads; ++i)
+        tables.emplace_back(new uint16_t[LZ_HASH_ENTRIES]);
+
+    PagePipeline pipeline(threads, batch,
+        [&](int w, uint64_t page, std::vector<uint8_t>* out) {
+            const uint8_t* src = area + page*BENCH_PAGE_SIZE;
+            size_t pos = out->size();
+            int len = 0;
+
+            out->resize(pos + BENCH_PAGE_SIZE);
+            if (!is_zero_page(src)
+                    && (len = lz_compress(src, BENCH_PAGE_SIZE,
+                            out->data() + pos, BENCH_PAGE_SIZE - 1,
+                            tables[w].get())) < 0) {
+                std::memcpy(out->data() + pos, src, BENCH_PAGE_SIZE);
+                len = BENCH_PAGE_SIZE;
+            }
+            out->resize(pos + len);
+        },
+        [&](const page_batch& b) {
+            out_bytes += b.out.size();
+            return 0;
+        });
+
+    auto start = std::chrono::steady_clock::now();
+    pipeline.Run([](const std::function<void(uint64_t)>& emit) {
+        for (uint64_t i = 0; i < BENCH_AREA_SIZE / BENCH_PAGE_SIZE; ++i)
+            emit(i);
+    });
+    double sec = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::setw(7) << threads << std::setw(7) << batch
+        << std::setw(10) << std::fixed << std::setprecision(2)
+        << BENCH_AREA_SIZE / sec / 1e9 << " GB/s"
+        << std::setw(8) << std::setprecision(1)
+        << 100.0*out_bytes / BENCH_AREA_SIZE << "%"
+        << std::setw(10) << pipeline.Stats().writer_stall_ns / 1000000
+        << "ms" << std::endl;
+}
+
+
+int main(int argc, char** argv) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 1 ? std::atoi(argv[1]) : 2*ncpu;
+    const uint32_t batches[] = {16, 64, 256};
+    uint8_t* area = static_cast<uint8_t*>(mmap(nullptr, BENCH_AREA_SIZE,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    fill(area);
+
+    std::cout << "compression pipeline, " << BENCH_AREA_SIZE / (1024*1024)
+        << " MiB, " << ncpu << " CPUs\n"
+        << "threads  batch  throughput   ratio  writer stall" << std::endl;
+
+    for (int t = 1; t <= max_threads; t *= 2) {
+        for (uint32_t b : batches)
+            run(area, t, b);
+    }
+
+    munmap(area, BENCH_AREA_SIZE);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+/*
+ *  bench/prefault.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <bench.hpp>
+#include <kvm.hpp>
+#include <prefault.hpp>
+#include <rambacking.hpp>
+#include <vm.hpp>
+
+
+// initMachine() and prefaultRAM() with threads prefault threads, over all
+// of RAM or only the boot ranges of kernel and initramfs
+static void populate(KVM* kvm, const ram_backing& backing, uint64_t ram_size,
+        int threads, bool boot, const char* kernel, const char* initramfs) {
+    std::unique_ptr<VM> vm;
+    VM* p;
+    Clock::time_point t;
+    double setup_ms;
+    vm_config conf {
+        .vcpu_num = 1,
+        .ram_size = ram_size,
+        .kernel_path = kernel,
+        .initramfs_path = initramfs,
+        .is_64bit_boot = false,
+        .backing = backing,
+        .prefault_threads = threads,
+        .prefault_boot = boot,
+    };
+
+    out << std::setw(18) << ram_backing_name(backing)
+        << std::setw(8) << (boot ? "boot" : "all")
+        << std::setw(8) << threads << std::flush;
+
+    if (kvm->kvmCreateVM(&p, conf) < 0) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+    vm.reset(p);
+    t = Clock::now();
+    if (vm->initMachine() || vm->prefaultRAM()) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+    setup_ms = ms_since(t);
+
+    const prefault_stats& st = vm->getPrefaultStats();
+    out << std::fixed << std::setprecision(1)
+        << std::setw(10) << (st.bytes >> 20) << "MiB"
+        << std::setw(10) << st.ns / 1e6 << "ms"
+        << std::setw(10) << std::setprecision(2)
+        << (st.ns ? st.bytes / (st.ns / 1e6) / 1e6 : 0) << " GB/s"
+        << std::setw(10) << std::setprecision(1) << setup_ms << "ms  "
+        << (st.populate ? "populate" : "touch") << std::endl;
+}
+
+// From kvmCreateVM() until the console printed marker; the part after
+// Start() is where the faults used to be
+static void boot(KVM* kvm, const ram_backing& backing, uint64_t ram_size,
+        int threads, bool boot_only, const char* kernel,
+        const char* initramfs, const char* marker, int boots) {
+    std::vector<double> total, guest;
+    std::unique_ptr<VM> vm;
+    vm_config conf {
+        .vcpu_num = 1,
+        .ram_size = ram_size,
+        .kernel_path = kernel,
+        .initramfs_path = initramfs,
+        .is_64bit_boot = false,
+        .backing = backing,
+        .prefault_threads = threads,
+        .prefault_boot = boot_only,
+    };
+
+    out << std::setw(18) << ram_backing_name(backing)
+        << std::setw(8) << (!threads ? "none" : boot_only ? "boot" : "all")
+        << std::flush;
+
+    for (int i = 0; i < boots; ++i) {
+        auto t = Clock::now();
+        Clock::time_point start;
+
+        if (!boot_to_marker(kvm, conf, marker, &vm, &start))
+            break;
+        total.push_back(ms_since(t));
+        guest.push_back(ms_since(start));
+        vm.reset();
+    }
+    vm.reset();
+
+    if (total.empty()) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+    std::sort(total.begin(), total.end());
+    std::sort(guest.begin(), guest.end());
+    out << std::fixed << std::setprecision(1)
+        << std::setw(10) << total[total.size() / 2] << "ms"
+        << std::setw(10) << total.back() << "ms"
+        << std::setw(10) << guest[guest.size() / 2] << "ms"
+        << std::setw(10) << guest.back() << "ms" << std::endl;
+}
+
+
+int main(int argc, char** argv) {
+    int opt, boots = 3;
+    int max_threads = std::max(4U, std::thread::hardware_concurrency());
+    uint64_t ram_size = 1ULL << 30;
+    const char *kernel = nullptr, *initramfs = "initramfs";
+    const char* marker = "Welcome to u-root!";
+    std::vector<ram_backing> backings;
+    QuietCout quiet;  // outlives kvm, which logs as it closes
+    std::unique_ptr<KVM> kvm;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "m:t:k:i:r:n:")) != -1) {
+        switch (opt) {
+            case 'm':
+                ram_size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 't':
+                max_threads = std::atoi(optarg);
+                break;
+            case 'k':
+                kernel = optarg;
+                break;
+            case 'i':
+                initramfs = optarg;
+                break;
+            case 'r':
+                marker = optarg;
+                break;
+            case 'n':
+                boots = std::atoi(optarg);
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-m RAM_MB] "
+                    "[-t MAX_THREADS] [-k BZIMAGE [-i INITRAMFS] "
+                    "[-r MARKER] [-n BOOTS]] [BACKING...]" << std::endl;
+                return EXIT_FAILURE;
+        }
+    }
+    if (max_threads < 1) {
+        std::cerr << "at least one thread" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        backings.emplace_back();
+        if (ram_backing_parse(argv[i], &backings.back()))
+            return EXIT_FAILURE;
+    }
+    if (backings.empty()) {
+        for (const char* name : { "memfd", "anon", "thp" }) {
+            backings.emplace_back();
+            ram_backing_parse(name, &backings.back());
+        }
+    }
+
+    if ((fd = KVM::getKVMFD()) < 0)
+        return EXIT_FAILURE;
+    kvm.reset(new KVM(fd));
+
+    out << "prefault before initRAM(), " << (ram_size >> 20)
+        << " MiB RAM, " << std::thread::hardware_concurrency()
+        << " host CPUs\n"
+        << "           backing  ranges threads   prefaulted        wall"
+        "      bandwidth       setup  method" << std::endl;
+    for (const ram_backing& b : backings) {
+        for (int t = 1; t <= max_threads; t *= 2)
+            populate(kvm.get(), b, ram_size, t, false, "/dev/null",
+                    "/dev/null");
+        if (kernel)
+            populate(kvm.get(), b, ram_size, max_threads, true, kernel,
+                    initramfs);
+    }
+
+    if (kernel) {
+        out << "\nboot to \"" << marker << "\", " << boots << " boots, "
+            << max_threads << " threads\n"
+            << "           backing  ranges      median         max"
+            "  guest median   guest max" << std::endl;
+        for (const ram_backing& b : backings) {
+            boot(kvm.get(), b, ram_size, 0, false, kernel, initramfs,
+                    marker, boots);
+            boot(kvm.get(), b, ram_size, max_threads, true, kernel,
+                    initramfs, marker, boots);
+            boot(kvm.get(), b, ram_size, max_threads, false, kernel,
+                    initramfs, marker, boots);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,273 @@
+/*
+ *  bench/rambacking.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <bench.hpp>
+#include <boot.hpp>
+#include <kvm.hpp>
+#include <membank.hpp>
+#include <rambacking.hpp>
+#include <vm.hpp>
+
+
+constexpr uint64_t BENCH_BUF_GPA = 16 << 20;
+
+
+static uint64_t minflt() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+static void put32(std::vector<uint8_t>* code, uint32_t v) {
+    for (int i = 0; i < 4; ++i)
+        code->push_back(v >> 8*i);
+}
+
+// 32-bit protected mode, paging off, entered at HIGHMEM_BASE. Fills the
+// buffer once, prints 'A' on COM1, fills it passes more times, prints 'B'
+// and halts.
+static std::vector<uint8_t> guest_code(uint64_t size, uint32_t passes) {
+    std::vector<uint8_t> c = { 0x66, 0xba, 0xf8, 0x03 };  // mov dx, 0x3f8
+    size_t loop;
+
+    c.push_back(0xbf);  // mov edi, buf
+    put32(&c, BENCH_BUF_GPA);
+    c.push_back(0xb9);  // mov ecx, size/4
+    put32(&c, size / 4);
+    // xor eax, eax; cld; rep stosd
+    c.insert(c.end(), { 0x31, 0xc0, 0xfc, 0xf3, 0xab });
+    c.insert(c.end(), { 0xb0, 'A', 0xee });  // mov al, 'A'; out dx, al
+    c.push_back(0xbb);  // mov ebx, passes
+    put32(&c, passes);
+
+    loop = c.size();
+    c.push_back(0xbf);
+    put32(&c, BENCH_BUF_GPA);
+    c.push_back(0xb9);
+    put32(&c, size / 4);
+    c.insert(c.end(), { 0xf3, 0xab, 0x4b });  // rep stosd; dec ebx
+    c.insert(c.end(), { 0x75, static_cast<uint8_t>(loop - c.size() - 2) });
+
+    c.insert(c.end(), { 0xb0, 'B', 0xee });
+    c.insert(c.end(), { 0xf4, 0xeb, 0xfd });  // hlt; jmp hlt
+
+    return c;
+}
+
+// Reads the console pipe until c comes out
+static bool wait_byte(int fd, char c) {
+    char b;
+
+    while (read(fd, &b, 1) == 1) {
+        if (b == c)
+            return true;
+    }
+
+    return false;
+}
+
+static void bandwidth(KVM* kvm, const ram_backing& backing, uint64_t ram_size,
+        uint64_t size, uint32_t passes) {
+    std::unique_ptr<VM> vm;
+    VM* p;
+    int pipefd[2];
+    Clock::time_point t;
+    double setup_ms, touch_ms, pass_ms;
+    uint64_t flt;
+    std::vector<uint8_t> code = guest_code(size, passes);
+    vm_config conf {
+        .vcpu_num = 1,
+        .ram_size = ram_size,
+        .kernel_path = "/dev/null",
+        .initramfs_path = "/dev/null",
+        .is_64bit_boot = false,
+        .backing = backing,
+    };
+
+    out << std::setw(18) << ram_backing_name(backing) << std::flush;
+
+    t = Clock::now();
+    if (kvm->kvmCreateVM(&p, conf) < 0) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+    vm.reset(p);
+    if (vm->initMachine()) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+    setup_ms = ms_since(t);
+
+    if (pipe(pipefd) < 0) {
+        perror("pipe");
+        return;
+    }
+    vm->setConsoleFd(pipefd[1]);
+    std::memcpy(static_cast<uint8_t*>(vm->ram_start) + HIGHMEM_BASE,
+            code.data(), code.size());
+
+    flt = minflt();
+    t = Clock::now();
+    vm->Start();
+    wait_byte(pipefd[0], 'A');
+    touch_ms = ms_since(t);
+    flt = minflt() - flt;
+    t = Clock::now();
+    wait_byte(pipefd[0], 'B');
+    pass_ms = ms_since(t);
+
+    vm.reset();
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    out << std::fixed << std::setprecision(1)
+        << std::setw(10) << setup_ms << "ms"
+        << std::setw(10) << touch_ms << "ms"
+        << std::setw(10) << flt
+        << std::setw(10) << std::setprecision(2)
+        << size*passes / pass_ms / 1e6 << " GB/s" << std::endl;
+}
+
+// From kvmCreateVM() until the console printed marker, the way VMPool
+// boots its VMs
+static void boot(KVM* kvm, const ram_backing& backing, uint64_t ram_size,
+        const char* kernel, const char* initramfs, const char* marker,
+        int boots) {
+    std::vector<double> ms;
+    std::unique_ptr<VM> vm;
+    vm_config conf {
+        .vcpu_num = 1,
+        .ram_size = ram_size,
+        .kernel_path = kernel,
+        .initramfs_path = initramfs,
+        .is_64bit_boot = false,
+        .backing = backing,
+    };
+
+    out << std::setw(18) << ram_backing_name(backing) << std::flush;
+
+    for (int i = 0; i < boots; ++i) {
+        auto t = Clock::now();
+
+        if (!boot_to_marker(kvm, conf, marker, &vm))
+            break;
+        ms.push_back(ms_since(t));
+        vm.reset();
+    }
+    vm.reset();
+
+    if (ms.empty()) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+    std::sort(ms.begin(), ms.end());
+    out << std::fixed << std::setprecision(1)
+        << std::setw(10) << ms[ms.size() / 2] << "ms"
+        << std::setw(10) << ms.front() << "ms"
+        << std::setw(10) << ms.back() << "ms" << std::endl;
+}
+
+
+int main(int argc, char** argv) {
+    int opt, boots = 3;
+    uint64_t ram_size = 1ULL << 30, size = 256ULL << 20;
+    uint32_t passes = 8;
+    const char *kernel = nullptr, *initramfs = "initramfs";
+    const char* marker = "Welcome to u-root!";
+    std::vector<ram_backing> backings;
+    QuietCout quiet;  // outlives kvm, which logs as it closes
+    std::unique_ptr<KVM> kvm;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "m:s:p:k:i:r:n:")) != -1) {
+        switch (opt) {
+            case 'm':
+                ram_size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 's':
+                size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 'p':
+                passes = std::strtoul(optarg, nullptr, 0);
+                break;
+            case 'k':
+                kernel = optarg;
+                break;
+            case 'i':
+                initramfs = optarg;
+                break;
+            case 'r':
+                marker = optarg;
+                break;
+            case 'n':
+                boots = std::atoi(optarg);
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-m RAM_MB] "
+                    "[-s BUF_MB] [-p PASSES] [-k BZIMAGE [-i INITRAMFS] "
+                    "[-r MARKER] [-n BOOTS]] [BACKING...]" << std::endl;
+                return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        backings.emplace_back();
+        if (ram_backing_parse(argv[i], &backings.back()))
+            return EXIT_FAILURE;
+    }
+    if (backings.empty()) {
+        for (const char* name : { "memfd", "anon", "thp", "hugetlb:2M",
+                    "memfd-hugetlb:2M", "hugetlb:1G" }) {
+            backings.emplace_back();
+            ram_backing_parse(name, &backings.back());
+        }
+    }
+
+    if (size == 0 || passes == 0
+            || BENCH_BUF_GPA + size > std::min(ram_size, MEMBANK_HOLE_START)) {
+        std::cerr << "the buffer must fit in RAM below the hole, and take "
+            "at least one pass" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if ((fd = KVM::getKVMFD()) < 0)
+        return EXIT_FAILURE;
+    kvm.reset(new KVM(fd));
+
+    out << "guest RAM backings, " << (ram_size >> 20) << " MiB RAM, "
+        << passes << " passes over " << (size >> 20) << " MiB\n"
+        << "           backing       setup first touch    faults"
+        "      bandwidth" << std::endl;
+    for (const ram_backing& b : backings)
+        bandwidth(kvm.get(), b, ram_size, size, passes);
+
+    if (kernel) {
+        out << "\nboot to \"" << marker << "\", " << boots << " boots\n"
+            << "           backing      median         min         max"
+            << std::endl;
+        for (const ram_backing& b : backings)
+            boot(kvm.get(), b, ram_size, kernel, initramfs, marker, boots);
+    }
+
+    return EXIT_SUCCESS;
+}
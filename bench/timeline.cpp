@@ -0,0 +1,132 @@
+/*
+ *  bench/timeline.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <bench.hpp>
+#include <kvm.hpp>
+#include <rambacking.hpp>
+#include <timeline.hpp>
+#include <util.hpp>
+#include <vm.hpp>
+
+
+int main(int argc, char** argv) {
+    int opt, boots = 20;
+    uint64_t ram_size = 1ULL << 30;
+    const char *kernel = "bzImage", *initramfs = "initramfs";
+    const char* marker = "Welcome to u-root!";
+    bool boot64 = false, each = false;
+    ram_backing backing = {};
+    std::vector<std::string> names;  // in the order they first came
+    std::map<std::string, std::vector<uint64_t>> phase_ns;
+    std::vector<uint64_t> total_ns;
+    QuietCout quiet;  // outlives kvm, which logs as it closes
+    std::unique_ptr<KVM> kvm;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "m:g:k:i:r:n:ej")) != -1) {
+        switch (opt) {
+            case 'm':
+                ram_size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 'g':
+                if (ram_backing_parse(optarg, &backing))
+                    return EXIT_FAILURE;
+                break;
+            case 'k':
+                kernel = optarg;
+                break;
+            case 'i':
+                initramfs = optarg;
+                break;
+            case 'r':
+                marker = optarg;
+                break;
+            case 'n':
+                boots = std::atoi(optarg);
+                break;
+            case 'e':
+                boot64 = true;
+                break;
+            case 'j':
+                each = true;
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-m RAM_MB] "
+                    "[-g BACKING] [-k KERNEL] [-i INITRAMFS] [-r MARKER] "
+                    "[-n BOOTS] [-e] [-j]" << std::endl;
+                return EXIT_FAILURE;
+        }
+    }
+
+    vm_config conf {
+        .vcpu_num = 1,
+        .ram_size = ram_size,
+        .kernel_path = kernel,
+        .initramfs_path = initramfs,
+        .is_64bit_boot = boot64,
+        .backing = backing,
+    };
+
+    if ((fd = KVM::getKVMFD()) < 0)
+        return EXIT_FAILURE;
+    kvm.reset(new KVM(fd));
+
+    for (int i = 0; i < boots; ++i) {
+        std::unique_ptr<VM> vm;
+        std::vector<timeline_event> events;
+
+        // The way main() boots with --timeline
+        if (!boot_to_marker(kvm.get(), conf, marker, &vm)) {
+            std::cerr << "boot " << i << " failed" << std::endl;
+            break;
+        }
+        events = vm->getTimeline()->Events();
+        if (each)
+            out << timeline_format(events) << std::endl;
+
+        for (const timeline_event& p : timeline_phases(events)) {
+            if (!phase_ns.count(p.name))
+                names.push_back(p.name);
+            phase_ns[p.name].push_back(p.ns);
+        }
+        total_ns.push_back(events.back().ns);
+    }
+
+    if (total_ns.empty())
+        return EXIT_FAILURE;
+
+    out << "boot phases of " << kernel << " to \"" << marker << "\", "
+        << total_ns.size() << " boots, " << (ram_size >> 20) << " MiB "
+        << ram_backing_name(backing) << "\n"
+        << "              phase     median        p99" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    for (const std::string& name : names) {
+        std::vector<uint64_t>* ns = &phase_ns[name];
+
+        out << std::setw(19) << name
+            << std::setw(9) << percentile(ns, 50) / 1e6 << "ms"
+            << std::setw(9) << percentile(ns, 99) / 1e6 << "ms" << std::endl;
+    }
+    out << std::setw(19) << "total"
+        << std::setw(9) << percentile(&total_ns, 50) / 1e6 << "ms"
+        << std::setw(9) << percentile(&total_ns, 99) / 1e6 << "ms"
+        << std::endl;
+
+    return EXIT_SUCCESS;
+}
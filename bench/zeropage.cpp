@@ -0,0 +1,81 @@
+/*
+ *  bench/zeropage.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <sys/mman.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+#include <zeropage.hpp>
+
+
+constexpr size_t BENCH_AREA_SIZE = 256*1024*1024;
+constexpr int    BENCH_ROUNDS    = 8;
+
+
+// Scans the whole area BENCH_ROUNDS times; returns GB/s
+static double run(ZeroPageFunc func, const uint8_t* area, uint64_t* hits) {
+    auto start = std::chrono::steady_clock::now();
+
+    *hits = 0;
+    for (int r = 0; r < BENCH_ROUNDS; ++r) {
+        for (size_t off = 0; off < BENCH_AREA_SIZE; off += ZERO_PAGE_SIZE)
+            *hits += func(area + off);
+    }
+
+    double sec = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    return static_cast<double>(BENCH_AREA_SIZE)*BENCH_ROUNDS / sec / 1e9;
+}
+
+
+int main() {
+    uint64_t hits;
+    uint8_t* area = static_cast<uint8_t*>(mmap(nullptr, BENCH_AREA_SIZE,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    // Populate with real zero pages, not the shared zero page.
+    std::memset(area, 1, BENCH_AREA_SIZE);
+    std::memset(area, 0, BENCH_AREA_SIZE);
+
+    std::cout << "zero page scan, " << BENCH_AREA_SIZE / (1024*1024)
+        << " MiB x " << BENCH_ROUNDS << ", selected kernel: "
+        << zero_page_kernel_name() << std::endl;
+
+    for (size_t k = 0; k < ZERO_PAGE_KERNEL_NUM; ++k) {
+        const zero_page_kernel& kernel = zero_page_kernels[k];
+
+        if (!kernel.supported()) {
+            std::cout << std::setw(8) << kernel.name << ": unsupported"
+                << std::endl;
+            continue;
+        }
+
+        double gbps = run(kernel.func, area, &hits);
+        std::cout << std::setw(8) << kernel.name << ": " << std::fixed
+            << std::setprecision(2) << gbps << " GB/s" << std::endl;
+
+        if (hits != BENCH_AREA_SIZE / ZERO_PAGE_SIZE * BENCH_ROUNDS) {
+            std::cerr << kernel.name << ": missed zero pages" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    munmap(area, BENCH_AREA_SIZE);
+
+    return EXIT_SUCCESS;
+}
@@ -30,6 +30,7 @@ constexpr uint64_t REALMODE_IVT_START  = 0x0000'0000;
 constexpr uint64_t BOOT_PARAMS_ADDR    = 0x0001'0000;
 constexpr uint64_t COMMANDLINE_ADDR    = 0x0002'0000;
 constexpr uint64_t BOOT_PAGETABLE_BASE = 0x0003'0000;
+constexpr uint64_t PVH_START_INFO_ADDR = 0x0004'0000;
 constexpr uint64_t EBDA_START          = 0x0009'fc00;
 constexpr uint64_t VGARAM_START        = 0x000a'0000;
 constexpr uint64_t MBBIOS_START        = 0x000f'0000;
@@ -83,7 +84,9 @@ constexpr uint32_t BOOT_E820_TYPE_RESERVED = 2;
 
 constexpr int      SETUP_HEADER_ADDR       = 0x0000'01f1;
 constexpr uint16_t BOOT_HDR_VID_MODE_NML   = 0xffff;
-constexpr uint16_t BOOT_HDR_BOOT_FLAG      = 0xaaff;
+// The boot sector signature at 0x1fe, per the boot protocol. It read
+// 0xaaff while nothing used it; only a made-up vmlinux header does.
+constexpr uint16_t BOOT_HDR_BOOT_FLAG      = 0xaa55;
 constexpr uint32_t BOOT_HDR_MAGIC          = static_cast<uint32_t>('S') << 24
                                            | static_cast<uint32_t>('r') << 16
                                            | static_cast<uint32_t>('d') << 8
@@ -95,12 +98,20 @@ constexpr uint8_t  BOOT_HDR_LF_QUIET       = 0b0001'0000;  // W  early msg off
 constexpr uint8_t  BOOT_HDR_LF_KEEP_SGMT   = 0b0100'0000;  // Ob 2.07+ obsolute
 constexpr uint8_t  BOOT_HDR_LF_HEAP        = 0b1000'0000;  // W
 constexpr uint32_t BOOT_HDR_HEAPEND_OFFSET = 0x200;
+constexpr uint16_t BOOT_HDR_XLF_KERNEL_64  = 0b0000'0001;  // R  2.12+
+constexpr uint32_t BOOT_HDR_KERNEL_ALIGN   = 0x0100'0000;  // for vmlinux
+// startup_64 of a bzImage, from the start of its protected-mode part
+constexpr uint64_t BOOT_ENTRY_64_OFFSET    = 0x200;
+
+// xen/include/public/arch-x86/hvm/start_info.h
+constexpr uint32_t PVH_START_MAGIC   = 0x336e'c578;
+constexpr uint32_t PVH_START_VERSION = 1;
 
 constexpr int      ELF_MAGIC_SIZE            = 4;
 constexpr char     ELF_MAGIC[ELF_MAGIC_SIZE] = {0x7f, 'E', 'L', 'F'};
 
 
-#pragma pack(1)
+#pragma pack(push, 1)
 struct mpfps {
     uint32_t signature = MPFPS_INTEL_SIGNATURE;
     uint32_t phys_addr_ptr;
@@ -228,6 +239,44 @@ struct boot_params {
  public:
     void add_e820_entry(uint64_t addr, uint64_t size, uint32_t type);
 };
+#pragma pack(1)
+struct hvm_start_info {
+    uint32_t magic = PVH_START_MAGIC;
+    uint32_t version = PVH_START_VERSION;
+    uint32_t flags = 0;
+    uint32_t nr_modules = 0;
+    uint64_t modlist_paddr = 0;
+    uint64_t cmdline_paddr = 0;
+    uint64_t rsdp_paddr = 0;
+    uint64_t memmap_paddr = 0;
+    uint32_t memmap_entries = 0;
+    uint32_t reserved = 0;
+};
+
+#pragma pack(1)
+struct hvm_modlist_entry {
+    uint64_t paddr = 0;
+    uint64_t size = 0;
+    uint64_t cmdline_paddr = 0;
+    uint64_t reserved = 0;
+};
+
+#pragma pack(1)
+struct hvm_memmap_table_entry {
+    uint64_t addr = 0;
+    uint64_t size = 0;
+    uint32_t type = 0;  // e820 types
+    uint32_t reserved = 0;
+};
+
+// What PVH_START_INFO_ADDR holds: the initramfs is the one module
+#pragma pack(1)
+struct pvh_boot_info {
+    hvm_start_info start_info;
+    hvm_modlist_entry module;
+    hvm_memmap_table_entry memmap[BOOT_E820_MAP_MAX];
+};
+#pragma pack(pop)
 
 
 template <typename MpPtr>
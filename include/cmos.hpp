@@ -50,6 +50,15 @@ constexpr uint8_t  CMOS_REG_STAT_D_VRB = 1 << 7;
 constexpr uint8_t  CMOS_DT_MAX         = 99;
 
 
+// CMOS::SaveState() record
+struct cmos_state {
+    uint8_t index;
+    uint8_t data[CMOS_MEM_SIZE];
+};
+static_assert(sizeof(cmos_state) <= IODEV_STATE_MAX,
+        "cmos_state does not fit in an iodev_state");
+
+
 static inline int bin_to_bcd(uint8_t bin) {
     if (bin > CMOS_DT_MAX)
         return 1;
@@ -63,8 +72,12 @@ class CMOS : public IODev {
     int Read(uint16_t, char*, uint8_t) override;
     int Write(uint16_t port, char*, uint8_t) override;
 
+    size_t StateSize() const override { return sizeof(cmos_state); }
+    void SaveState(void* record) const override;
+    int LoadState(const void* record) override;
+
  private:
-    uint8_t index;
+    uint8_t index = 0;
     uint8_t data[CMOS_MEM_SIZE] = { 0 };
 };
 
@@ -40,6 +40,20 @@ constexpr uint8_t COM1_REG_LCR_DLAB          = 0b1000'0000;
 constexpr uint8_t COM1_REG_LCR_EDHR          = 0b0100'0000;
 constexpr uint8_t COM1_REG_LCR_ETHR          = 0b0010'0000;
 
+// COM1::SaveState() record
+struct com1_state {
+    uint8_t THR, RBR, DLL;
+    uint8_t IER, DLH;
+    uint8_t IIR, FCR;
+    uint8_t LCR;
+    uint8_t MCR;
+    uint8_t LSR;
+    uint8_t MSR;
+    uint8_t SR;
+};
+static_assert(sizeof(com1_state) <= IODEV_STATE_MAX,
+        "com1_state does not fit in an iodev_state");
+
 
 class COM1 : public IODev {
  public:
@@ -47,6 +61,10 @@ class COM1 : public IODev {
     int Read(uint16_t port, char* data_ptr, uint8_t) override;
     int Write(uint16_t port, char* data_ptr, uint8_t) override;
 
+    size_t StateSize() const override { return sizeof(com1_state); }
+    void SaveState(void* record) const override;
+    int LoadState(const void* record) override;
+
  private:
     // Registers (port offset/DLAB/RW)
     // - We have all registers in 16750; Most of them do nothing, however.
@@ -0,0 +1,38 @@
+/*
+ *  include/compress.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_COMPRESS_HPP_
+#define INCLUDE_COMPRESS_HPP_
+
+
+#include <cstddef>
+#include <cstdint>
+
+
+constexpr int      LZ_HASH_BITS    = 10;
+constexpr size_t   LZ_HASH_ENTRIES = 1 << LZ_HASH_BITS;
+constexpr size_t   LZ_MIN_MATCH    = 4;
+constexpr size_t   LZ_MAX_INPUT    = 1 << 16;  // offsets are 16-bit
+
+
+// A byte-oriented LZ77 in the spirit of LZ4: a sequence is
+//   token (literal length << 4 | match length - 4), extra literal length
+//   bytes, literals, 16-bit offset, extra match length bytes
+// where a nibble of 15 is continued by bytes added up until one is < 255.
+// The last sequence has literals only. Speed matters far more than ratio.
+//
+// table is caller-owned scratch of LZ_HASH_ENTRIES entries, so that
+// callers can keep one per thread. Returns the compressed size, or -1 if
+// it would exceed dst_cap.
+int lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap,
+        uint16_t* table);
+// Returns the decompressed size, or -1 on malformed input or overflow
+int lz_decompress(const uint8_t* src, size_t len, uint8_t* dst,
+        size_t dst_cap);
+
+
+#endif  // INCLUDE_COMPRESS_HPP_
@@ -30,6 +30,16 @@
 #define AMD_FEAT_SVM_SHIFT 2
 
 
+// Vendor independent
+#define CPUID_LEAF_FEAT           0x00000001
+#define CPUID_LEAF_EXT_FEAT       0x00000007
+#define FEAT_EDX_SSE2_SHIFT       26
+#define FEAT_ECX_OSXSAVE_SHIFT    27
+#define FEAT_ECX_AVX_SHIFT        28
+#define EXT_FEAT_EBX_AVX2_SHIFT   5
+#define XCR0_SSE_AVX              0x6  /* XMM and YMM state enabled by OS */
+
+
 struct cpuid_regs {
     uint32_t eax, ebx, ecx, edx;
 };
@@ -43,7 +53,44 @@ static inline void cpuid(cpuid_regs* regs) {
              "0" (regs->eax), "2" (regs->ecx));
 }
 
-bool cpuSupportsVM() {
+static inline uint64_t xgetbv(uint32_t index) {
+    uint32_t eax, edx;
+
+    asm volatile("xgetbv" : "=a" (eax), "=d" (edx) : "c" (index));
+
+    return static_cast<uint64_t>(edx) << 32 | eax;
+}
+
+static inline bool cpuSupportsSSE2() {
+    cpuid_regs regs = { CPUID_LEAF_FEAT, 0, 0, 0 };
+
+    cpuid(&regs);
+
+    return regs.edx & 1 << FEAT_EDX_SSE2_SHIFT;
+}
+
+static inline bool cpuSupportsAVX2() {
+    cpuid_regs regs = { 0, 0, 0, 0 };
+
+    cpuid(&regs);
+    if (regs.eax < CPUID_LEAF_EXT_FEAT)
+        return false;
+
+    // The OS has to save YMM state too, or the registers are unusable.
+    regs = { CPUID_LEAF_FEAT, 0, 0, 0 };
+    cpuid(&regs);
+    if (!(regs.ecx & 1 << FEAT_ECX_OSXSAVE_SHIFT)
+            || !(regs.ecx & 1 << FEAT_ECX_AVX_SHIFT)
+            || (xgetbv(0) & XCR0_SSE_AVX) != XCR0_SSE_AVX)
+        return false;
+
+    regs = { CPUID_LEAF_EXT_FEAT, 0, 0, 0 };
+    cpuid(&regs);
+
+    return regs.ebx & 1 << EXT_FEAT_EBX_AVX2_SHIFT;
+}
+
+static inline bool cpuSupportsVM() {
     // NOT sure this works on AMD.
     cpuid_regs regs = { 0, 0, 0, 0 };
     uint32_t eax_feat;
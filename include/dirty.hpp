@@ -0,0 +1,217 @@
+/*
+ *  include/dirty.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_DIRTY_HPP_
+#define INCLUDE_DIRTY_HPP_
+
+
+#include <linux/kvm.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <membank.hpp>
+#include <paging.hpp>
+
+
+class VM;
+class Vcpu;
+
+
+constexpr uint32_t DIRTY_PAGE_SHIFT = PAGE_SHIFT_4KB;
+constexpr uint32_t DIRTY_PAGE_SIZE  = PAGE_SIZE_4KB;
+constexpr uint32_t DIRTY_WORD_BITS  = 64;
+
+
+// [first, first+npages) in units of DIRTY_PAGE_SIZE from the start of
+// guest RAM
+struct dirty_run {
+    uint64_t first;
+    uint64_t npages;
+};
+
+
+class DirtyBitmap {
+ public:
+    class RunIterator {
+     public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type        = dirty_run;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = const dirty_run*;
+        using reference         = const dirty_run&;
+
+        RunIterator(const uint64_t* words, uint64_t nwords, uint64_t pos);
+
+        reference operator*() const { return run; }
+        pointer operator->() const { return &run; }
+        RunIterator& operator++();
+        bool operator==(const RunIterator& rhs) const {
+            return pos == rhs.pos;
+        }
+        bool operator!=(const RunIterator& rhs) const {
+            return pos != rhs.pos;
+        }
+
+     private:
+        const uint64_t* words;
+        uint64_t nwords;
+        uint64_t pos;  // bit index right after the current run
+        dirty_run run = { 0, 0 };
+
+        void FindNextRun(uint64_t from);
+    };
+
+    explicit DirtyBitmap(uint64_t npages);
+    ~DirtyBitmap();
+
+    DirtyBitmap(const DirtyBitmap&) = delete;
+    DirtyBitmap& operator=(const DirtyBitmap&) = delete;
+
+    // Handed to KVM as it is. KVM wants the buffer long-aligned and
+    // rounded up to a multiple of 64 bits.
+    uint64_t* Data() { return words; }
+    const uint64_t* Data() const { return words; }
+    uint64_t NumWords() const { return nwords; }
+    uint64_t NumPages() const { return npages; }
+
+    bool Test(uint64_t page) const;
+    void Set(uint64_t page);
+    void SetAtomic(uint64_t page);  // for concurrent producers
+    void Clear();
+    uint64_t Count() const;
+
+    RunIterator begin() const;
+    RunIterator end() const;
+
+ private:
+    uint64_t  npages;
+    uint64_t  nwords;
+    uint64_t* words = static_cast<uint64_t*>(nullptr);
+};
+
+
+struct dirty_log_stats {
+    uint64_t rounds;
+    uint64_t last_dirty_pages;
+    uint64_t last_runs;
+    uint64_t last_harvest_ns;
+    uint64_t total_dirty_pages;
+};
+
+using DirtyLogCallback =
+    std::function<void(const DirtyBitmap&, const dirty_log_stats&)>;
+
+
+// Common part of the dirty tracking backends. Harvest() publishes the pages
+// dirtied since the previous Harvest() in Bitmap(); the bitmap is only
+// valid until the next round.
+class DirtyTracker {
+ public:
+    virtual ~DirtyTracker();
+
+    virtual int Harvest() = 0;
+    virtual const DirtyBitmap& Bitmap() const = 0;
+
+    int StartPeriodic(int interval_ms, DirtyLogCallback cb);
+    void StopPeriodic();
+
+    dirty_log_stats Stats();
+
+    // Callers hold this across Harvest() and their walk of Bitmap(), as the
+    // periodic harvester does around its callback.
+    std::mutex mtx;
+
+ protected:
+    dirty_log_stats stats = { 0, 0, 0, 0, 0 };
+
+    // words == nullptr means every word of the bitmap
+    void Account(const DirtyBitmap& bitmap, const uint64_t* words,
+            uint64_t nwords, std::chrono::steady_clock::time_point start);
+
+ private:
+    std::thread harvester;
+    std::condition_variable cv;
+    bool stop_requested = false;
+
+    void PeriodicLoop(int interval_ms, DirtyLogCallback cb);
+};
+
+
+// Harvests KVM_GET_DIRTY_LOG for every bank's memslot, registered with
+// KVM_MEM_LOG_DIRTY_PAGES. Each slot has its own range of the bitmap, at
+// its RAM offset, and KVM copies its bitmap straight into that range and
+// clears its own, so each round costs exactly one copy; consumers walk the
+// result in place.
+class DirtyLog : public DirtyTracker {
+ public:
+    DirtyLog(VM* vm, const std::vector<mem_bank>& banks);
+    ~DirtyLog();
+
+    int Harvest() override;
+    const DirtyBitmap& Bitmap() const override { return bitmap; }
+
+ private:
+    VM* vm;
+    const std::vector<mem_bank> banks;
+    DirtyBitmap bitmap;
+};
+
+
+// KVM_CAP_DIRTY_LOG_RING backend. Every vCPU pushes the GFNs it dirties
+// into its own ring; a reaper thread drains them into a pending bitmap and
+// resets the rings, so the cost follows the number of dirtied pages rather
+// than the size of RAM. Harvest() swaps the pending bitmap out and only
+// clears the words that were touched.
+class DirtyRing : public DirtyTracker {
+ public:
+    DirtyRing(VM* vm, const std::vector<mem_bank>& banks,
+            int reap_interval_ms);
+    ~DirtyRing();
+
+    int Harvest() override;
+    const DirtyBitmap& Bitmap() const override { return *bitmap; }
+
+    // Drains one vCPU ring and resets it. Called by the reaper and by the
+    // vCPU itself on KVM_EXIT_DIRTY_RING_FULL.
+    int ReapVcpu(Vcpu* vcpu);
+
+    // For Vcpu::CollectDirtyRing(); reap_mtx is held.
+    void Mark(uint32_t slot, uint64_t offset);
+
+    uint64_t RingFullExits() const { return ring_full_exits; }
+
+ private:
+    VM* vm;
+    const std::vector<mem_bank> banks;  // indexed by slot
+    std::unique_ptr<DirtyBitmap> pending, bitmap;
+    std::vector<uint64_t> pending_words, bitmap_words;
+
+    std::mutex reap_mtx;
+    std::atomic<uint64_t> ring_full_exits{0};
+    uint64_t dropped = 0;  // entries for other slots; should stay zero
+
+    std::thread reaper;
+    std::condition_variable reaper_cv;
+    bool reaper_stop = false;
+
+    int ReapAllLocked();
+    int ResetRings();
+    void ReaperLoop(int interval_ms);
+};
+
+
+#endif  // INCLUDE_DIRTY_HPP_
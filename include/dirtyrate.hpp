@@ -0,0 +1,109 @@
+/*
+ *  include/dirtyrate.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_DIRTYRATE_HPP_
+#define INCLUDE_DIRTYRATE_HPP_
+
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+constexpr uint64_t DIRTY_RATE_PAGE_SIZE         = 4096;
+constexpr int      DIRTY_RATE_WINDOW_MS_DEFAULT = 1000;
+constexpr uint32_t DIRTY_RATE_SAMPLES_PER_GB    = 512;
+constexpr int      DIRTY_RATE_WSS_WINDOWS       = 10;  // at most 32
+constexpr uint64_t DIRTY_RATE_BANDWIDTH_DEFAULT = 1ULL << 30;  // bytes/s
+
+
+struct dirty_rate_config {
+    int window_ms = DIRTY_RATE_WINDOW_MS_DEFAULT;
+    uint32_t samples_per_gb = DIRTY_RATE_SAMPLES_PER_GB;
+    int wss_windows = DIRTY_RATE_WSS_WINDOWS;
+    uint64_t seed = 0;  // 0: pick one
+};
+
+// Extrapolated from the sampled pages to all of RAM
+struct dirty_rate_estimate {
+    uint64_t windows = 0;
+    uint64_t ram_pages = 0;
+    uint64_t sample_pages = 0;
+    uint64_t dirty_samples = 0;      // changed in the last window
+    uint64_t dirty_pages_per_s = 0;
+    uint64_t wss_pages = 0;          // written in any of the last windows
+    uint64_t wss_windows = 0;        // how many windows that covers
+    uint64_t sample_ns = 0;          // cost of hashing the samples once
+};
+
+struct downtime_prediction {
+    bool converges = false;
+    int iterations = 0;
+    uint64_t downtime_ms = 0;  // sending what is left once stopped
+    uint64_t total_ms = 0;
+};
+
+typedef std::function<void(const dirty_rate_estimate&)> DirtyRateCallback;
+
+
+// Estimates the dirty rate and writable working set without dirty
+// logging: a fixed random set of pages is hashed at the end of every
+// window, and the share of them that changed stands for all of RAM. A
+// page written many times in a window counts once, which is what a
+// pre-copy round has to resend anyway.
+class DirtyRateEstimator {
+ public:
+    DirtyRateEstimator(const uint8_t* ram, uint64_t ram_size,
+            dirty_rate_config conf);
+    ~DirtyRateEstimator();
+
+    DirtyRateEstimator(const DirtyRateEstimator&) = delete;
+    DirtyRateEstimator& operator=(const DirtyRateEstimator&) = delete;
+
+    // Samples every window_ms on a thread of its own; cb, if any, runs
+    // there after each window.
+    int Start(DirtyRateCallback cb = nullptr);
+    void Stop();
+
+    // Ends the current window now
+    void Sample();
+    dirty_rate_estimate Estimate();
+
+ private:
+    const uint8_t* ram;
+    const dirty_rate_config conf;
+    std::vector<uint64_t> samples;  // page indices
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> history;  // bit i: changed i windows ago
+    std::chrono::steady_clock::time_point last;
+    dirty_rate_estimate est;
+
+    std::thread sampler;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stop_requested = false;
+
+    void HashSamples(uint64_t* changed);
+    void SampleLoop(DirtyRateCallback cb);
+};
+
+
+// Plays pre-copy forward: every round sends what the previous one left
+// at bandwidth bytes/s, while the guest dirties pages at the estimated
+// rate, never more than its working set.
+downtime_prediction predict_downtime(const dirty_rate_estimate& est,
+        uint64_t bandwidth, int downtime_limit_ms, int max_iterations);
+
+void print_dirty_rate(const dirty_rate_estimate& est,
+        const downtime_prediction& p, uint64_t bandwidth);
+
+
+#endif  // INCLUDE_DIRTYRATE_HPP_
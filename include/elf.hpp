@@ -0,0 +1,50 @@
+/*
+ *  include/elf.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_ELF_HPP_
+#define INCLUDE_ELF_HPP_
+
+
+#include <cstdint>
+#include <vector>
+
+#include <paging.hpp>
+
+
+// XEN_ELFNOTE_PHYS32_ENTRY, in a note named "Xen"
+constexpr uint32_t ELF_NOTE_PVH_ENTRY = 18;
+// What one thread copies or clears at a time
+constexpr uint64_t ELF_LOAD_CHUNK = PAGE_SIZE_2MB;
+
+
+struct elf_segment {
+    uint64_t paddr;   // guest physical address
+    uint64_t offset;  // in the file
+    uint64_t filesz;
+    uint64_t memsz;   // the rest after filesz is zeroed
+};
+
+// An uncompressed x86-64 kernel, vmlinux
+struct elf_kernel {
+    uint64_t entry = 0;      // 64-bit entry, physical, from e_entry
+    uint64_t pvh_entry = 0;  // 32-bit PVH entry, 0 without the note
+    std::vector<elf_segment> segments;  // PT_LOAD, in file order
+};
+
+
+// -ENOEXEC unless image is a 64-bit x86 executable whose PT_LOAD
+// segments, notes and entry make sense
+int elf_parse(const uint8_t* image, uint64_t size, elf_kernel* kernel);
+
+// Copies segments[i] from image to dst[i] and zeroes its tail, in
+// ELF_LOAD_CHUNK pieces shared out among threads. Returns the number of
+// threads used.
+int elf_load(const uint8_t* image, const std::vector<elf_segment>& segments,
+        const std::vector<uint8_t*>& dst, int threads);
+
+
+#endif  // INCLUDE_ELF_HPP_
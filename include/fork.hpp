@@ -0,0 +1,85 @@
+/*
+ *  include/fork.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_FORK_HPP_
+#define INCLUDE_FORK_HPP_
+
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <kvm.hpp>
+#include <vm.hpp>
+
+
+struct fork_stats {
+    uint64_t capture_us = 0;    // parent paused until its state was read
+    uint64_t state_bytes = 0;   // vCPU and device state handed to each child
+    uint64_t children = 0;
+    uint64_t spawn_ms = 0;      // all children, created and started
+    uint64_t clone_p50_us = 0;  // one child: VM, vCPUs, RAM mapping, state
+    uint64_t clone_p99_us = 0;
+    uint64_t clone_max_us = 0;
+    uint64_t parent_pages = 0;  // resident guest RAM of the parent
+
+    // Measure()
+    uint64_t private_pages = 0;  // guest pages the children copied, summed
+    uint64_t private_max = 0;    // the most any one child copied
+    int64_t  rss_anon_kb = 0;    // process growth since before Spawn()
+
+    uint64_t teardown_us = 0;
+};
+
+
+// Clones a booted VM into children that start where it stopped. The
+// parent is paused for good and becomes the template: each child maps its
+// guest RAM memfd MAP_PRIVATE, so pages are shared until a child writes
+// one, and its own copy of the page is all that child costs. The parent's
+// RAM must not change while children use it, hence it is never resumed.
+//
+// Children are torn down, vCPU threads and all, by Teardown() or the
+// destructor; the parent is left paused.
+class VMFork {
+ public:
+    VMFork(KVM* kvm, VM* parent);
+    ~VMFork();
+
+    VMFork(const VMFork&) = delete;
+    VMFork& operator=(const VMFork&) = delete;
+
+    // Pauses the parent and reads its state
+    int Capture();
+    // Adds n running children
+    int Spawn(int n);
+    // Samples the children's memory into the stats
+    void Measure();
+    void Teardown();
+
+    VM* Child(int i) { return children[i].get(); }
+    int NumChildren() const { return children.size(); }
+    const fork_stats& Stats() const { return stats; }
+
+ private:
+    KVM* kvm;
+    VM* parent;
+    std::vector<std::unique_ptr<VM>> children;
+    std::vector<std::vector<uint8_t>> vcpu_state;
+    vm_device_state devices;
+    bool captured = false;
+    std::vector<uint64_t> clone_us;
+    uint64_t rss_before_kb = 0;
+    fork_stats stats;
+
+    int Clone(VM** out);
+};
+
+
+void print_fork_stats(const fork_stats& stats);
+
+
+#endif  // INCLUDE_FORK_HPP_
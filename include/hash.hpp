@@ -0,0 +1,34 @@
+/*
+ *  include/hash.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_HASH_HPP_
+#define INCLUDE_HASH_HPP_
+
+
+#include <cstddef>
+#include <cstdint>
+
+
+// Non-cryptographic 64-bit hash in the style of xxHash64, good enough to
+// tell whether a page changed. len must be a multiple of 32.
+uint64_t page_hash64(const uint8_t* data, size_t len, uint64_t seed = 0);
+
+struct hash128 {
+    uint64_t lo;
+    uint64_t hi;
+
+    bool operator==(const hash128& o) const {
+        return lo == o.lo && hi == o.hi;
+    }
+};
+
+// The same four lanes, finished two different ways: wide enough to name a
+// page by its contents. len must be a multiple of 32.
+hash128 page_hash128(const uint8_t* data, size_t len, uint64_t seed = 0);
+
+
+#endif  // INCLUDE_HASH_HPP_
@@ -0,0 +1,58 @@
+/*
+ *  include/image.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_IMAGE_HPP_
+#define INCLUDE_IMAGE_HPP_
+
+
+#include <cstdint>
+#include <string>
+
+
+// Of one initRAM(): how the kernel and the initramfs got into guest RAM
+struct load_stats {
+    uint64_t ns     = 0;  // kernel and initramfs, from the mapped files
+    int      threads = 1;  // that copied the kernel
+    uint64_t copied = 0;  // bytes memcpy'd into guest RAM
+    uint64_t mapped = 0;  // bytes mapped copy-on-write from the file instead
+    uint64_t saved  = 0;  // of those, not yet copied by a guest write
+};
+
+
+// A kernel or initramfs file, mapped read-only for as long as the object
+// lives, so loading it is a memcpy rather than reads through a stream.
+// An empty file, or /dev/null, maps nothing and has Size() 0.
+class BootImage {
+ public:
+    explicit BootImage(const std::string& path);
+    ~BootImage();
+
+    BootImage(const BootImage&) = delete;
+    BootImage& operator=(const BootImage&) = delete;
+
+    int Open();
+
+    const uint8_t* Data() const { return data; }
+    uint64_t Size() const { return size; }
+
+    // Maps the file from offset on at dst, privately, over whatever was
+    // there. dst and offset must be page-aligned; the tail of the last
+    // page reads as zeros.
+    int MapAt(void* dst, uint64_t offset) const;
+
+ private:
+    const std::string path;
+    int fd = -1;
+    uint8_t* data = nullptr;
+    uint64_t size = 0;
+};
+
+
+void print_load_stats(const load_stats& stats);
+
+
+#endif  // INCLUDE_IMAGE_HPP_
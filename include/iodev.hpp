@@ -9,13 +9,24 @@
 #define INCLUDE_IODEV_HPP_
 
 
+#include <cstddef>
 #include <cstdint>
 
-#include <vm.hpp>
-
 
 class VM;
 
+// Largest device record; see IODev::SaveState(). cmos_state, 129 bytes,
+// rounded up to 8. Each record asserts that it fits.
+constexpr size_t IODEV_STATE_MAX = 136;
+
+// One device's registers, as saved in vm_device_state. Matched to the
+// device by port on load.
+struct iodev_state {
+    uint16_t port;
+    uint16_t len;  // 0: unused slot
+    uint8_t  data[IODEV_STATE_MAX];
+};
+
 
 class IODev {
  public:
@@ -27,6 +38,13 @@ class IODev {
 
     virtual int Read(uint16_t port, char* data_ptr, uint8_t size) = 0;
     virtual int Write(uint16_t port, char* data_ptr, uint8_t size) = 0;
+
+    // Devices with registers worth keeping copy them to or from a
+    // fixed-size POD record of StateSize() bytes. Neither may allocate:
+    // SaveState() runs with the guest stopped.
+    virtual size_t StateSize() const { return 0; }
+    virtual void SaveState(void*) const {}
+    virtual int LoadState(const void*) { return 0; }
 };
 
 
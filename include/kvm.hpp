@@ -18,6 +18,7 @@
 #include <cerrno>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <baseclass.hpp>
 #include <vm.hpp>
@@ -36,6 +37,11 @@ constexpr const int KVM_CAP_CHECK[] = {
     KVM_CAP_NR_VCPUS,
     KVM_CAP_MAX_VCPUS,
     KVM_CAP_COALESCED_MMIO,
+    KVM_CAP_XSAVE,
+    KVM_CAP_XSAVE2,
+    KVM_CAP_XCRS,
+    KVM_CAP_VCPU_EVENTS,
+    KVM_CAP_DEBUGREGS,
 };
 
 
@@ -46,6 +52,11 @@ struct kvm_cap {
     int soft_vcpus_limit;
     int hard_vcpus_limit;
     int coalesced_mmio;
+    int xsave;
+    int xsave2;  // size of the KVM_GET_XSAVE2 buffer, 0 if unsupported
+    int xcrs;
+    int vcpu_events;
+    int debugregs;
 };
 
 class KVM : public BaseClass {
@@ -70,11 +81,17 @@ class KVM : public BaseClass {
     int kvmCreateVM(VM** ptr_vm, vm_config vm_conf);
     int getSupportedCPUID(kvm_cpuid2* kvm_cpuid);
 
+    const kvm_cap& getCap() const { return cap; }
+    // MSRs KVM saves and restores, from KVM_GET_MSR_INDEX_LIST
+    const std::vector<uint32_t>& getMSRIndexList() const { return msr_list; }
+
  private:
     int api_ver;
     kvm_cap cap;
+    std::vector<uint32_t> msr_list;
 
     int kvmCapCheck();
+    int kvmGetMSRIndexList();
 };
 
 
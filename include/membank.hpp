@@ -0,0 +1,62 @@
+/*
+ *  include/membank.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_MEMBANK_HPP_
+#define INCLUDE_MEMBANK_HPP_
+
+
+#include <cstdint>
+#include <vector>
+
+#include <paging.hpp>
+
+
+struct e820entry;
+
+
+// Banks start and end on 2MiB boundaries, both in the guest and in guest
+// RAM, so a huge page never straddles two memslots and every bank's part
+// of a dirty bitmap starts on a word of its own.
+constexpr uint64_t MEMBANK_ALIGN      = PAGE_SIZE_2MB;
+// RAM stops here below 4GiB; TSS_BASE, IDENTITY_MAP_BASE and APIC_BASE
+// live in the hole above it
+constexpr uint64_t MEMBANK_HOLE_START = 0x0000'c000'0000;
+constexpr uint64_t MEMBANK_HIGH_BASE  = 0x0001'0000'0000;
+constexpr uint64_t MEMBANK_NONE       = UINT64_MAX;
+
+
+// [gpa, gpa+size) of guest physical memory, backed by [offset,
+// offset+size) of guest RAM and registered as memslot slot
+struct mem_bank {
+    uint32_t slot;
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t offset;
+};
+
+
+// Lays ram_size bytes out below MEMBANK_HOLE_START and, for the rest, from
+// MEMBANK_HIGH_BASE up, cut into banks of at most bank_size bytes (0: no
+// limit). Offsets follow the guest physical order, so a RAM offset means
+// the same address whatever bank_size is. -EINVAL if the sizes are not
+// MEMBANK_ALIGN multiples or it takes more than max_slots banks.
+int membank_layout(uint64_t ram_size, uint64_t bank_size,
+        uint32_t max_slots, std::vector<mem_bank>* banks);
+
+// The RAM offset of [gpa, gpa+len), or MEMBANK_NONE unless one bank holds
+// all of it
+uint64_t membank_offset(const std::vector<mem_bank>& banks, uint64_t gpa,
+        uint64_t len);
+
+// The guest's e820 map: the banks as RAM, minus the legacy areas below
+// HIGHMEM_BASE, plus the TSS and identity map pages in the hole. Adjacent
+// banks come out as one entry. -E2BIG past BOOT_E820_MAP_MAX entries.
+int membank_e820(const std::vector<mem_bank>& banks,
+        std::vector<e820entry>* map);
+
+
+#endif  // INCLUDE_MEMBANK_HPP_
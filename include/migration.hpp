@@ -0,0 +1,335 @@
+/*
+ *  include/migration.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_MIGRATION_HPP_
+#define INCLUDE_MIGRATION_HPP_
+
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <dirty.hpp>
+#include <pipeline.hpp>
+#include <stream.hpp>
+#include <vm.hpp>
+#include <xbzrle.hpp>
+
+
+constexpr uint32_t MIG_MAGIC   = 0x47494d4c;  // "LMIG"
+constexpr uint32_t MIG_VERSION = 4;
+
+constexpr uint64_t MIG_PAGE_SIZE   = DIRTY_PAGE_SIZE;
+constexpr uint32_t MIG_BATCH_PAGES = 64;
+
+constexpr int MIG_MAX_ITERATIONS_DEFAULT = 30;
+constexpr int MIG_DOWNTIME_LIMIT_MS_DEFAULT = 300;
+constexpr int MIG_MAX_CHANNELS = 64;
+
+// Auto-converge: after two rounds in a row that dirtied more than
+// TRIGGER_PCT of what they sent, throttle to INITIAL_PCT, then STEP_PCT
+// more each time.
+constexpr int MIG_THROTTLE_TRIGGER_PCT = 50;
+constexpr int MIG_THROTTLE_INITIAL_PCT = 20;
+constexpr int MIG_THROTTLE_STEP_PCT    = 10;
+
+
+struct mig_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vcpu_num;
+    uint32_t channels;  // extra connections carrying RAM pages
+    uint64_t ram_size;
+};
+
+// Every record is one of these followed by len bytes of payload
+struct mig_record {
+    uint32_t type;
+    uint32_t len;
+    uint64_t arg;
+};
+
+enum mig_record_type : uint32_t {
+    MIG_REC_PAGES    = 1,  // arg: number of pages
+    MIG_REC_ITER_END = 2,  // arg: iteration number
+    MIG_REC_VCPU     = 3,  // arg: cpu_id, payload: Vcpu::SaveState()
+    MIG_REC_DEVICES  = 4,  // payload: vm_device_state
+    MIG_REC_END      = 5,
+    MIG_REC_RESUMED  = 6,  // destination -> source
+    MIG_REC_POSTCOPY = 7,  // start now, the pages follow
+    MIG_REC_PAGE_REQ = 8,  // destination -> source, arg: page index
+    MIG_REC_CHANNEL  = 9,  // first on a channel, arg: channel number
+    MIG_REC_SYNC     = 10, // arg: round, on every channel and then the main
+};                         // stream once all channels have sent theirs
+
+// Each page in a MIG_REC_PAGES payload: this header, then len bytes
+struct mig_page_hdr {
+    uint64_t index;  // RAM offset / MIG_PAGE_SIZE
+    uint32_t len;
+    uint8_t  enc;    // mig_page_enc
+    uint8_t  padding[3];
+};
+
+enum mig_page_enc : uint8_t {
+    MIG_PAGE_RAW  = 0,
+    MIG_PAGE_ZERO = 1,  // len is 0
+    MIG_PAGE_XBZRLE = 2,  // xbzrle_encode() delta against the last copy
+    MIG_PAGE_LZ     = 3,  // lz_compress()ed
+};
+
+struct migration_config {
+    int max_iterations = MIG_MAX_ITERATIONS_DEFAULT;
+    int downtime_limit_ms = MIG_DOWNTIME_LIMIT_MS_DEFAULT;
+    bool postcopy = false;
+    uint64_t xbzrle_cache_size = 0;  // in bytes, 0: no delta encoding
+    int compress_threads = 0;        // 0: no compression
+    uint32_t compress_batch_pages = PIPELINE_BATCH_PAGES_DEFAULT;
+    bool auto_converge = false;
+    int throttle_initial_pct = MIG_THROTTLE_INITIAL_PCT;
+    int throttle_step_pct = MIG_THROTTLE_STEP_PCT;
+};
+
+struct mig_channel_stats {
+    uint64_t pages = 0;
+    uint64_t zero_pages = 0;
+    uint64_t bytes = 0;
+    uint64_t send_ns = 0;  // blocked writing to the socket
+    uint64_t wait_ns = 0;  // done, waiting for the other channels to sync
+};
+
+struct migration_stats {
+    uint64_t total_ms = 0;
+    uint64_t downtime_ms = 0;
+    uint64_t iterations = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t pages_sent = 0;
+    uint64_t final_dirty_pages = 0;
+    uint64_t bandwidth = 0;  // bytes/s, measured over the last iteration
+    uint64_t zero_pages = 0;
+    uint64_t pages_requested = 0;  // post-copy only
+
+    // vCPU state, captured while the guest is stopped
+    uint64_t vcpu_state_bytes = 0;  // summed over vCPUs
+    uint64_t vcpu_save_us = 0;      // summed over vCPUs
+    uint64_t vcpu_save_max_us = 0;
+
+    // XBZRLE, from the second round on
+    uint64_t xbzrle_hits = 0;
+    uint64_t xbzrle_misses = 0;
+    uint64_t xbzrle_pages = 0;      // sent as a delta
+    uint64_t xbzrle_bytes = 0;      // size of those deltas
+    uint64_t xbzrle_overflows = 0;  // delta not smaller, sent in full
+    uint64_t xbzrle_encode_ns = 0;
+    uint64_t xbzrle_encode_pages = 0;
+
+    // compression pipeline
+    uint64_t lz_pages = 0;
+    uint64_t lz_bytes = 0;        // compressed size of those
+    uint64_t lz_overflows = 0;    // did not shrink, sent in full
+    uint64_t lz_worker_ns = 0;    // summed over workers
+    uint64_t lz_writer_stall_ns = 0;
+    uint64_t lz_scanner_stall_ns = 0;
+
+    std::vector<mig_channel_stats> channels;  // multifd only
+
+    // auto-converge
+    int throttle_pct = 0;          // when the guest was stopped
+    uint64_t throttled_ms = 0;     // summed over vCPUs
+    uint64_t guest_run_pct = 100;  // vCPU time left to the guest before
+};                                 // the stop
+
+// Destination side of post-copy
+struct postcopy_stats {
+    uint64_t faults = 0;
+    uint64_t fault_p50_us = 0;
+    uint64_t fault_p90_us = 0;
+    uint64_t fault_p99_us = 0;
+    uint64_t fault_max_us = 0;
+    uint64_t resident_ms = 0;  // from vCPU start until all pages are in
+};
+
+
+// Pre-copy: the guest keeps running while RAM is copied, then each round
+// resends what it dirtied. Once the remainder fits in the downtime limit
+// at the measured bandwidth, the guest is paused for the final round and
+// the vCPU and device state.
+//
+// Post-copy: the guest is paused right away and only its state is sent.
+// RAM is then pushed in order, except that pages the destination faults
+// on jump the queue.
+//
+// With channels, pre-copy RAM goes over those instead of out, one sender
+// thread each. A round hands out bitmap words to whichever channel asks
+// next, so a page is on exactly one channel per round and the destination
+// may install it in any order. Every channel ends the round with a
+// MIG_REC_SYNC, and out repeats it once all of them have, so a page resent
+// next round can never overtake its older copy.
+class MigrationSource {
+ public:
+    MigrationSource(VM* vm, Stream* out, migration_config conf,
+            std::vector<Stream*> streams = {});
+    ~MigrationSource();
+
+    int Run();
+    const migration_stats& Stats() const { return stats; }
+
+ private:
+    VM* vm;
+    Stream* out;
+    const migration_config conf;
+    migration_stats stats;
+
+    uint64_t npages;
+    DirtyBitmap to_send;
+    std::vector<uint8_t> batch;
+    uint32_t batch_pages = 0;
+
+    std::unique_ptr<PageCache> cache;
+    std::unique_ptr<uint8_t[]> xbzrle_page, xbzrle_delta;
+
+    // Per compression worker; aligned so counters do not share lines
+    struct alignas(64) compress_worker {
+        std::unique_ptr<uint16_t[]> table;
+        uint64_t zero = 0, lz = 0, lz_bytes = 0, overflows = 0;
+    };
+    std::vector<compress_worker> compress_workers;
+    std::unique_ptr<PagePipeline> pipeline;
+
+    void CompressPage(int worker, uint64_t index, std::vector<uint8_t>* out);
+    void CollectCompressStats();
+
+    int SendHeader();
+    const uint8_t* EncodeDelta(uint64_t index, const uint8_t* page,
+            mig_page_hdr* hdr);
+    int SendPage(uint64_t index);
+    int FlushPages();
+    int SendAll();
+    int SendDirty();
+    int SendState();
+    int SendRecord(uint32_t type, uint64_t arg, const void* data,
+            uint32_t len);
+    int Collect();
+    int WaitResumed();
+
+    // post-copy
+    std::mutex req_mtx;
+    std::condition_variable req_cv;
+    std::deque<uint64_t> requests;
+    bool peer_done = false;
+    int peer_error = 0;
+    std::chrono::steady_clock::time_point resumed_at;
+
+    int RunPostcopy();
+    void RequestLoop();
+
+    // multifd
+    struct alignas(64) send_channel {
+        Stream* stream;
+        std::thread thread;
+        std::vector<uint8_t> batch;
+        uint32_t batch_pages = 0;
+        std::chrono::steady_clock::time_point done_at;
+        mig_channel_stats stats;
+    };
+    std::vector<send_channel> channels;
+    std::mutex chan_mtx;
+    std::condition_variable chan_cv, chan_done_cv;
+    uint64_t chan_round = 0;
+    int chan_busy = 0;
+    int chan_error = 0;
+    bool chan_stop = false;
+    bool chan_all = false;
+    std::atomic<uint64_t> chan_word{0};
+
+    int dirty_rate_high = 0;
+
+    uint64_t BytesSent() const;
+    uint64_t ThrottledNs() const;
+    int Converge(uint64_t sent, uint64_t dirtied);
+    int RunPrecopy();
+    int StartChannels();
+    int StopChannels(bool ok);
+    int SendChannels(bool all);
+    void ChannelLoop(int id);
+    int ChannelSend(send_channel* ch, uint64_t round);
+    int ChannelFlush(send_channel* ch);
+};
+
+
+// Receives into an initialized but not started VM and starts it. For
+// post-copy, guest RAM is registered with userfaultfd before the vCPUs
+// start, and a fault thread asks the source for each missing page.
+//
+// If the source asks for channels, they are accepted on listen_fd and
+// each gets a receiver thread. Those block at every MIG_REC_SYNC until
+// the main stream reaches the same round.
+class MigrationDestination {
+ public:
+    MigrationDestination(VM* vm, Stream* in, int listen_fd = -1);
+    ~MigrationDestination();
+
+    int Run();
+    bool IsPostcopy() const { return postcopy; }
+    const postcopy_stats& Stats() const { return pc_stats; }
+
+ private:
+    VM* vm;
+    Stream* in;
+    uint64_t npages;
+    std::atomic<uint64_t> pages_received{0};
+
+    bool postcopy = false;
+    int uffd = -1;
+    int stop_fd = -1;
+    std::thread fault_thread;
+    std::mutex write_mtx;
+    std::unique_ptr<uint8_t[]> bounce;
+    DirtyBitmap resident;
+    // first fault time per page, 0 if none
+    std::unique_ptr<std::atomic<uint64_t>[]> fault_ns;
+    std::vector<uint64_t> fault_latency_ns;
+    std::chrono::steady_clock::time_point started_at;
+    postcopy_stats pc_stats;
+
+    // multifd
+    struct recv_channel {
+        std::unique_ptr<Stream> stream;
+        std::unique_ptr<uint8_t[]> bounce;
+        std::thread thread;
+    };
+    int listen_fd;
+    std::vector<recv_channel> channels;
+    std::mutex chan_mtx;
+    std::condition_variable chan_cv;
+    int chan_synced = 0;
+    uint64_t chan_released = 0;
+    int chan_error = 0;
+
+    int RecvHeader();
+    int RecvPages(Stream* s, uint8_t* buf, uint64_t count, uint32_t len);
+    int PlacePage(uint64_t index, uint8_t enc, const uint8_t* src);
+    int AcceptChannels(uint32_t count);
+    void ChannelLoop(int id);
+    int Sync(uint64_t round);
+    int StartPostcopy();
+    int FinishPostcopy();
+    int SendRecord(uint32_t type, uint64_t arg);
+    void FaultLoop();
+};
+
+
+void print_migration_stats(const migration_stats& stats);
+void print_postcopy_stats(const postcopy_stats& stats);
+
+
+#endif  // INCLUDE_MIGRATION_HPP_
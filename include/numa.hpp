@@ -0,0 +1,59 @@
+/*
+ *  include/numa.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_NUMA_HPP_
+#define INCLUDE_NUMA_HPP_
+
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+constexpr int  NUMA_MAX_NODES = 1024;
+constexpr char NUMA_SYSFS_NODE[] = "/sys/devices/system/node/node";
+// How often the periodic dirty log line also walks RAM for bank residency
+constexpr int  NUMA_BANK_STATS_MS = 10'000;
+
+
+struct numa_vcpu_stats {
+    int node;         // host node the vCPU thread is pinned to
+    int cpus;         // host CPUs it may run on
+    uint64_t local;   // pages it dirtied in banks on its own node
+    uint64_t remote;  // and in banks on other nodes
+};
+
+struct numa_bank_stats {
+    uint32_t slot;
+    int node;           // host node the bank is bound to
+    uint64_t resident;  // pages of the bank in memory
+    uint64_t on_node;   // of those, the ones on node
+};
+
+struct numa_stats {
+    std::vector<numa_vcpu_stats> vcpus;
+    std::vector<numa_bank_stats> banks;
+};
+
+
+// "0,1,1": one host node per entry. -EINVAL on anything else.
+int numa_parse_nodes(const std::string& s, std::vector<int>* nodes);
+// The sysfs cpulist format, "0-3,8,10-11"
+int numa_parse_cpulist(const std::string& s, std::vector<int>* cpus);
+// The CPUs of a host node, from sysfs
+int numa_node_cpus(int node, std::vector<int>* cpus);
+
+// MPOL_BIND for [addr, addr+len), moving what is already there
+int numa_bind(void* addr, uint64_t len, int node);
+// Walks the resident pages of [addr, addr+len) with move_pages(2)
+int numa_count_pages(void* addr, uint64_t len, int node,
+        uint64_t* resident, uint64_t* on_node);
+
+void print_numa_stats(const numa_stats& stats);
+
+
+#endif  // INCLUDE_NUMA_HPP_
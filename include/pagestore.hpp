@@ -0,0 +1,101 @@
+/*
+ *  include/pagestore.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_PAGESTORE_HPP_
+#define INCLUDE_PAGESTORE_HPP_
+
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <hash.hpp>
+
+
+constexpr uint64_t PAGESTORE_PAGE_SIZE = 4096;
+
+// The reference of an all-zero page; those are never stored
+constexpr uint64_t PAGESTORE_ZERO = UINT64_MAX;
+
+// Files in the store directory
+constexpr char PAGESTORE_PAGES_FILE[] = "pages";  // slot i at i*PAGE_SIZE
+constexpr char PAGESTORE_INDEX_FILE[] = "index";  // hash128 of slot i at
+                                                  // i*sizeof(hash128)
+
+
+struct pagestore_stats {
+    uint64_t pages = 0;        // handed to Put()
+    uint64_t zero_pages = 0;
+    uint64_t new_pages = 0;    // appended to the store
+    uint64_t dup_local = 0;    // same as an earlier page of this Put()
+    uint64_t dup_store = 0;    // already in the store before it
+    uint64_t collisions = 0;   // hash matched, bytes did not
+    uint64_t store_pages = 0;  // in the store afterwards
+    uint64_t hash_ns = 0;      // wall time of the parallel hashing
+    int hash_threads = 0;
+};
+
+
+// A directory of unique guest pages, named by page_hash128(). Pages are
+// only ever appended, so a slot number stays valid for as long as the
+// store exists and a snapshot can keep a list of them in place of RAM.
+// Page data is written and synced before the index entries that name
+// it, so after a crash the index never names a slot whose data is
+// missing; Open() ignores a torn tail.
+//
+// Put() takes an exclusive flock on the index, and picks up what other
+// processes appended since, so several VMs may share one store.
+//
+// A hash match only nominates a slot, whose bytes are compared before it
+// is reused: page_hash128() is not collision-resistant, and a guest must
+// not be able to craft a page that another VM's restore picks up in
+// place of its own. Pages that collide get slots of their own.
+class PageStore {
+ public:
+    // hash_threads: 0 for one per CPU
+    explicit PageStore(const std::string& dir, int hash_threads = 0);
+    ~PageStore();
+
+    PageStore(const PageStore&) = delete;
+    PageStore& operator=(const PageStore&) = delete;
+
+    // Creates the directory if needed
+    int Open();
+
+    // Fills refs with the slot of each of the npages pages at ram, or
+    // PAGESTORE_ZERO, storing the pages not seen before.
+    int Put(const uint8_t* ram, uint64_t npages, std::vector<uint64_t>* refs);
+
+    const std::string& Dir() const { return dir; }
+    uint64_t NumPages() const { return npages; }
+    const pagestore_stats& Stats() const { return stats; }
+
+ private:
+    struct hash128_hasher {
+        size_t operator()(const hash128& h) const { return h.lo; }
+    };
+
+    const std::string dir;
+    const int hash_threads;
+    int pages_fd = -1;
+    int index_fd = -1;
+    uint64_t npages = 0;
+    std::unordered_multimap<hash128, uint64_t, hash128_hasher> index;
+    pagestore_stats stats;
+
+    int Refresh();
+    void Hash(const uint8_t* ram, uint64_t n, std::vector<hash128>* hashes,
+            std::vector<uint64_t>* refs);
+};
+
+
+void print_pagestore_stats(const pagestore_stats& stats);
+
+
+#endif  // INCLUDE_PAGESTORE_HPP_
@@ -12,6 +12,8 @@
 #include <cstdint>
 #include <vector>
 
+#include <iodev.hpp>
+
 constexpr uint16_t PIO_PORT_PCI_CONFIG_ADDR_START = 0x0CF8;
 constexpr uint16_t PIO_PORT_PCI_CONFIG_ADDR_END   = 0x0CF9;
 constexpr uint16_t PIO_PORT_PCI_CONFIG_DATA_START = 0x0CFC;
@@ -35,6 +37,13 @@ constexpr uint32_t PCI_ADDR_ENABLE_BIT      = 31;
 constexpr uint32_t PCI_BAR_MMIO             = 0;
 constexpr uint32_t PCI_BAR_PIO              = 1;
 
+// PCI::SaveState() record
+struct pci_state {
+    uint32_t addr = 0;
+};
+static_assert(sizeof(pci_state) <= IODEV_STATE_MAX,
+        "pci_state does not fit in an iodev_state");
+
 class PCIDevice {
     virtual int read(uint16_t port, char* data_ptr, uint8_t size)  = 0;
     virtual int write(uint16_t port, char* data_ptr, uint8_t size) = 0;
@@ -54,6 +63,10 @@ class PCI {
 
     int config_addr_in(uint16_t, char* data_ptr, uint8_t size);
     int config_addr_out(uint16_t, char* data_ptr, uint8_t size);
+
+    // Same shape as IODev::SaveState(), which PCI is not
+    void SaveState(pci_state* s) const { s->addr = addr; }
+    int LoadState(const pci_state* s) { addr = s->addr; return 0; }
     // int config_data_in(uint16_t port, char* data_ptr, uint8_t size);
     // int config_data_out(uint16_t port, char* data_ptr, uint8_t size);
 };
@@ -0,0 +1,102 @@
+/*
+ *  include/pipeline.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_PIPELINE_HPP_
+#define INCLUDE_PIPELINE_HPP_
+
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+constexpr int      PIPELINE_THREADS_DEFAULT     = 4;
+constexpr uint32_t PIPELINE_BATCH_PAGES_DEFAULT = 64;
+
+
+struct page_batch {
+    std::vector<uint64_t> pages;
+    std::vector<uint8_t>  out;  // encoded pages, ready to be written
+};
+
+struct pipeline_stats {
+    uint64_t batches = 0;
+    uint64_t pages = 0;
+    uint64_t scanner_stall_ns = 0;  // no free slot to fill
+    uint64_t writer_stall_ns = 0;   // next batch in order not encoded yet
+    std::vector<uint64_t> worker_busy_ns;
+};
+
+
+// scanner thread -> N encoding workers -> writer thread
+//
+// The scanner cuts the pages it is given into batches, workers encode
+// whole batches in parallel, and the writer hands them on in scan order.
+// Batches live in a ring of 2*N slots whose buffers are reused, so a
+// pass allocates nothing once the buffers have grown to size. Workers
+// and the writer live as long as the pipeline; each Run() is one pass.
+class PagePipeline {
+ public:
+    // On a worker thread: append the encoding of page to out
+    typedef std::function<void(int worker, uint64_t page,
+            std::vector<uint8_t>* out)> EncodeFunc;
+    // On the writer thread, in scan order; an error ends the pass
+    typedef std::function<int(const page_batch& batch)> WriteFunc;
+    // On the scanner thread: call emit for every page to process
+    typedef std::function<void(const std::function<void(uint64_t)>& emit)>
+        ScanFunc;
+
+    PagePipeline(int nworkers, uint32_t batch_pages, EncodeFunc encode,
+            WriteFunc write);
+    ~PagePipeline();
+
+    PagePipeline(const PagePipeline&) = delete;
+    PagePipeline& operator=(const PagePipeline&) = delete;
+
+    // Returns once every batch of the pass is written, or the first error
+    int Run(const ScanFunc& scan);
+
+    int NumWorkers() const { return workers.size(); }
+    uint32_t BatchPages() const { return batch_pages; }
+    const pipeline_stats& Stats() const { return stats; }
+
+ private:
+    enum slot_state { SLOT_FREE, SLOT_FILLED, SLOT_BUSY, SLOT_ENCODED };
+
+    struct slot {
+        page_batch batch;
+        slot_state state = SLOT_FREE;
+    };
+
+    const uint32_t batch_pages;
+    EncodeFunc encode;
+    WriteFunc write;
+
+    std::vector<slot> slots;
+    std::mutex mtx;
+    std::condition_variable cv;
+    // batch sequence numbers; slot of batch n is slots[n % slots.size()]
+    uint64_t fill_seq = 0, work_seq = 0, write_seq = 0;
+    bool stop = false;
+    int error = 0;
+    pipeline_stats stats;
+
+    std::vector<std::thread> workers;
+    std::thread writer;
+
+    void Scan(const ScanFunc& scan);
+    slot* AcquireFree();
+    void Publish(slot* s);
+    void WorkerLoop(int id);
+    void WriterLoop();
+};
+
+
+#endif  // INCLUDE_PIPELINE_HPP_
@@ -0,0 +1,115 @@
+/*
+ *  include/pool.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_POOL_HPP_
+#define INCLUDE_POOL_HPP_
+
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <kvm.hpp>
+#include <vm.hpp>
+
+
+constexpr int    POOL_SIZE_DEFAULT       = 4;
+constexpr int    POOL_BOOT_TIMEOUT_MS    = 10*1000;
+constexpr int    POOL_BOOT_RETRY_MS      = 1000;
+constexpr size_t POOL_CMD_MAX            = 64;
+constexpr char   POOL_READY_MARKER_DEFAULT[] = "Welcome to u-root!";
+
+
+struct pool_config {
+    int size = POOL_SIZE_DEFAULT;
+    std::string marker = POOL_READY_MARKER_DEFAULT;
+    std::string cmdline;
+    int boot_timeout_ms = POOL_BOOT_TIMEOUT_MS;
+};
+
+struct pool_stats {
+    uint64_t served = 0;
+    uint64_t cold = 0;            // found the pool empty and waited
+    uint64_t serve_p50_us = 0;    // request read until the guest runs
+    uint64_t serve_p99_us = 0;
+    uint64_t serve_max_us = 0;
+    uint64_t booted = 0;
+    uint64_t boot_failures = 0;
+    uint64_t boot_p50_ms = 0;     // new VM until paused at the marker
+    uint64_t boot_max_ms = 0;
+    uint64_t refill_busy_ms = 0;  // refill thread not idle
+    uint64_t released = 0;
+    uint64_t release_us = 0;      // teardown, summed
+};
+
+
+// Keeps conf.size VMs booted up to the console marker and paused, and
+// hands them out over a unix socket. A client connects and sends one
+// line:
+//
+//   get    "ok <id>\n", then the guest's console until the client closes
+//          the connection, which tears the VM down
+//   stats  one line of pool_stats, then the connection is closed
+//   quit   "bye\n"; Run() returns
+//
+// One refill thread boots replacements, one at a time, as soon as a VM
+// is handed out. Run() serves the socket on the calling thread, so a get
+// that finds the pool empty holds up later requests until a boot is done.
+class VMPool {
+ public:
+    VMPool(KVM* kvm, const vm_config& conf, pool_config pconf);
+    ~VMPool();
+
+    VMPool(const VMPool&) = delete;
+    VMPool& operator=(const VMPool&) = delete;
+
+    int Run(const char* path);
+    pool_stats Stats();
+
+ private:
+    struct lease {
+        int fd;
+        int id;
+        std::unique_ptr<VM> vm;
+    };
+
+    KVM* kvm;
+    const vm_config conf;
+    const pool_config pconf;
+    int null_fd = -1;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::unique_ptr<VM>> ready;
+    bool stop = false;
+    std::thread refill_thread;
+    std::chrono::nanoseconds refill_busy{0};
+    std::vector<uint64_t> serve_us, boot_us;
+    pool_stats stats;
+
+    std::vector<lease> leases;
+    int next_id = 0;
+
+    void RefillLoop();
+    int BootOne(std::unique_ptr<VM>* out);
+    // Returns 1 on quit
+    int Serve(int fd);
+    int Lease(int fd);
+    void Release(size_t i);
+};
+
+
+void print_pool_stats(const pool_stats& stats);
+
+
+#endif  // INCLUDE_POOL_HPP_
@@ -0,0 +1,52 @@
+/*
+ *  include/prefault.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_PREFAULT_HPP_
+#define INCLUDE_PREFAULT_HPP_
+
+
+#include <cstdint>
+#include <vector>
+
+#include <paging.hpp>
+
+
+// What one thread takes at a time; a THP or a 2MiB hugetlb page
+constexpr uint64_t PREFAULT_CHUNK = PAGE_SIZE_2MB;
+
+
+struct prefault_range {
+    uint64_t offset;  // from the start of the mapping
+    uint64_t size;
+};
+
+struct prefault_stats {
+    int      threads  = 0;
+    uint64_t chunks   = 0;
+    uint64_t bytes    = 0;
+    uint64_t ns       = 0;
+    bool     populate = false;  // MADV_POPULATE_WRITE rather than touching
+};
+
+
+// Widens every range to align, merges the ones that overlap or touch and
+// cuts the result into pieces of at most chunk bytes. Both must be powers
+// of two, chunk no smaller than align.
+void prefault_split(const std::vector<prefault_range>& ranges,
+        uint64_t chunk, uint64_t align, std::vector<prefault_range>* chunks);
+
+// Populates ranges of the writable mapping at base with threads threads
+// taking chunks in turn. align is the mapping's page size. Falls back to
+// writing every page back to itself where MADV_POPULATE_WRITE is
+// unknown, so it must run before anyone else writes to the ranges.
+int prefault(void* base, const std::vector<prefault_range>& ranges,
+        uint64_t align, int threads, prefault_stats* stats);
+
+void print_prefault_stats(const prefault_stats& stats);
+
+
+#endif  // INCLUDE_PREFAULT_HPP_
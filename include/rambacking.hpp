@@ -0,0 +1,51 @@
+/*
+ *  include/rambacking.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_RAMBACKING_HPP_
+#define INCLUDE_RAMBACKING_HPP_
+
+
+#include <cstdint>
+#include <string>
+
+#include <paging.hpp>
+
+
+constexpr uint64_t RAM_HUGEPAGE_2MB = PAGE_SIZE_2MB;
+constexpr uint64_t RAM_HUGEPAGE_1GB = 1ULL << 30;
+
+
+enum ram_backing_type : int {
+    RAM_BACKING_MEMFD,          // shared memfd, the default; VMFork needs it
+    RAM_BACKING_ANON,           // private anonymous memory
+    RAM_BACKING_THP,            // private anonymous with MADV_HUGEPAGE
+    RAM_BACKING_HUGETLB,        // MAP_HUGETLB
+    RAM_BACKING_MEMFD_HUGETLB,  // MFD_HUGETLB memfd
+};
+
+struct ram_backing {
+    ram_backing_type type = RAM_BACKING_MEMFD;
+    uint64_t page_size = PAGE_SIZE_4KB;  // hugetlb: 2MiB or 1GiB
+
+    bool is_hugetlb() const { return page_size > PAGE_SIZE_4KB; }
+};
+
+
+// "memfd", "anon", "thp", "hugetlb" or "memfd-hugetlb"; the hugetlb ones
+// take ":2M" (the default) or ":1G". -EINVAL if none of them.
+int ram_backing_parse(const std::string& s, ram_backing* backing);
+std::string ram_backing_name(const ram_backing& backing);
+
+// Maps size bytes of guest RAM at an address aligned to the larger of
+// MEMBANK_ALIGN and the page size, so that each bank's address agrees with
+// its guest physical address in the bits below its huge page size. *fd is
+// the memfd behind the mapping, or -1.
+int ram_backing_map(const ram_backing& backing, uint64_t size, void** addr,
+        int* fd);
+
+
+#endif  // INCLUDE_RAMBACKING_HPP_
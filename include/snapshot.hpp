@@ -0,0 +1,248 @@
+/*
+ *  include/snapshot.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_SNAPSHOT_HPP_
+#define INCLUDE_SNAPSHOT_HPP_
+
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirty.hpp>
+#include <pagestore.hpp>
+#include <vm.hpp>
+
+
+constexpr uint32_t SNAP_MAGIC   = 0x504e534c;  // "LSNP"
+constexpr uint32_t SNAP_VERSION = 2;
+
+// RAM is mapped straight from the file, so it starts on a page boundary
+constexpr uint64_t SNAP_RAM_ALIGN = 4096;
+constexpr uint64_t SNAP_PAGE_SIZE = 4096;
+constexpr uint32_t SNAP_MAX_SECTIONS = 1024;
+constexpr int      SNAP_MAX_LAYERS   = 64;
+
+// Runs of a layer at least this long are mapped from its file; shorter
+// ones are read in place, so a scattered layer cannot use up the
+// process's mappings.
+constexpr uint64_t SNAP_MAP_MIN_PAGES = 16;
+
+// At most this many mappings restore a snapshot from a page store, the
+// longest runs first; pages left over are read in place.
+constexpr uint64_t SNAP_STORE_MAX_MAPS = 16384;
+
+// SaveLive() claims this many pages at a time; a vCPU writing to one of
+// them waits until the run is out.
+constexpr uint64_t SNAP_LIVE_RUN_PAGES = 32;
+
+
+// A snapshot file is this header, then nsections snap_section entries,
+// then the payloads they point to. A full snapshot has a SNAP_SEC_RAM, or
+// a SNAP_SEC_STORE and SNAP_SEC_PAGE_REFS in its place; a layer has
+// SNAP_SEC_PARENT and only the pages dirtied since that parent was saved.
+struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nsections;
+    uint32_t vcpu_num;
+    uint64_t ram_size;
+};
+
+struct snap_section {
+    uint32_t type;
+    uint32_t padding;
+    uint64_t arg;
+    uint64_t offset;  // from the start of the file
+    uint64_t size;
+};
+
+// Readers skip types they do not know
+enum snap_section_type : uint32_t {
+    SNAP_SEC_RAM     = 1,  // guest RAM as is, at a SNAP_RAM_ALIGN offset
+    SNAP_SEC_VCPU    = 2,  // arg: cpu_id, payload: Vcpu::SaveState()
+    SNAP_SEC_DEVICES = 3,  // vm_device_state
+    SNAP_SEC_PARENT  = 4,  // parent path, relative to this file's directory
+                           // unless absolute
+    SNAP_SEC_PAGES   = 5,  // arg: count, payload: ascending uint64_t page
+                           // indices
+    SNAP_SEC_PAGE_DATA = 6,  // those pages in the same order, at a
+                             // SNAP_RAM_ALIGN offset
+    SNAP_SEC_STORE     = 7,  // PageStore directory, like SNAP_SEC_PARENT
+    SNAP_SEC_PAGE_REFS = 8,  // arg: count, payload: uint64_t store slot of
+                             // every RAM page, or PAGESTORE_ZERO
+};
+
+// What write_snapshot() puts in a file. Without a parent, ram is stored
+// whole, or as refs into the page store if one is named; with a parent,
+// only the listed pages are.
+struct snap_contents {
+    const std::vector<std::vector<uint8_t>>* vcpu_state;
+    const vm_device_state* devices;
+    const uint8_t* ram;
+    uint64_t ram_size;
+    std::string parent;
+    const std::vector<uint64_t>* pages;
+    std::string store;
+    const std::vector<uint64_t>* refs;
+};
+
+// One file of a chain, open and with its section table read and checked
+struct snap_file {
+    std::string path;
+    int fd = -1;
+    struct stat st;
+    snap_header hdr;
+    std::vector<snap_section> sections;
+
+    snap_file() = default;
+    snap_file(const snap_file&) = delete;
+    snap_file& operator=(const snap_file&) = delete;
+    ~snap_file() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    const snap_section* Find(uint32_t type) const {
+        for (const snap_section& sec : sections)
+            if (sec.type == type)
+                return &sec;
+        return nullptr;
+    }
+};
+
+// Newest first
+using snap_chain = std::vector<std::unique_ptr<snap_file>>;
+
+struct snap_layer_stats {
+    std::string path;
+    uint64_t disk_bytes = 0;     // allocated, holes excluded
+    uint64_t pages = 0;          // stored in this layer
+    uint64_t pages_used = 0;     // not overridden by a newer layer
+    uint64_t pages_mapped = 0;
+    uint64_t pages_copied = 0;   // in runs shorter than SNAP_MAP_MIN_PAGES
+};
+
+struct snapshot_stats {
+    uint64_t save_ms = 0;
+    uint64_t load_us = 0;
+    uint64_t file_size = 0;
+    uint64_t bytes_written = 0;
+    uint64_t zero_pages = 0;      // left as holes in the file
+    uint64_t pages_touched = 0;   // RAM faulted in by the load itself
+    uint64_t vcpu_state_bytes = 0;
+    uint64_t vcpu_save_us = 0;    // summed over vCPUs
+    uint64_t dirty_pages = 0;     // layers only: pages written
+
+    // SaveLive() only
+    uint64_t stop_us = 0;         // guest paused to capture state
+    uint64_t cbw_pages = 0;       // copied out before the guest's write
+    uint64_t stall_us = 0;        // summed over those write faults
+    uint64_t stall_p99_us = 0;
+    uint64_t stall_max_us = 0;
+
+    // Page store
+    pagestore_stats store;        // Save() only
+    uint64_t store_mapped = 0;    // restored pages mapped from the store
+    uint64_t store_maps = 0;      // in this many mappings
+    uint64_t store_copied = 0;    // past SNAP_STORE_MAX_MAPS, read in place
+    std::vector<snap_layer_stats> layers;  // loaded chain, newest first
+};
+
+
+// Saves a paused or stopped VM to a file, or loads one into a VM that went
+// through initMachine() only. Loading maps the RAM section MAP_PRIVATE
+// over guest memory, so it costs a few syscalls whatever the RAM size,
+// and the guest faults pages in from the page cache as it touches them.
+// Pages it writes become private copies; the file is never modified.
+//
+// After StartTracking(), Save() with a parent writes a layer: only the
+// pages the guest dirtied since the previous Save(), found with the
+// memslot's dirty log. Load() follows the parents down to the full
+// snapshot, maps that, then maps over it the newest copy of each page
+// the layers hold.
+//
+// SaveLive() stops a running guest only to capture its state and
+// write-protect RAM with userfaultfd. A writer thread then streams RAM
+// while the vCPUs run; the first write to a page not yet out faults, and
+// the fault thread copies the page aside, lets the vCPU go and writes the
+// copy. Either way the file holds RAM as it was at the stop.
+//
+// With a PageStore set, a full Save() puts RAM in the store and the file
+// only lists slots. Load() maps each run of consecutive slots from the
+// store's page file, so a page shared by many snapshots, or many times
+// within one, sits once in the page cache.
+class Snapshot {
+ public:
+    explicit Snapshot(VM* vm);
+    ~Snapshot();
+
+    // Not owned; nullptr to save RAM in the file again
+    void SetStore(PageStore* s) { store = s; }
+    int StartTracking();
+    int Save(const char* path, const char* parent = nullptr);
+    int SaveLive(const char* path);
+    int Load(const char* path);
+
+    // Guest RAM pages currently backed by memory in this process
+    uint64_t ResidentPages() const;
+    const snapshot_stats& Stats() const { return stats; }
+
+ private:
+    VM* vm;
+    snapshot_stats stats;
+    PageStore* store = nullptr;
+    std::unique_ptr<DirtyBitmap> dirty;  // since the previous Save()
+
+    // SaveLive()
+    int uffd = -1;
+    int stop_fd = -1;
+    int live_fd = -1;
+    uint64_t live_offset = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> saved;  // one bit per page
+    std::unique_ptr<uint8_t[]> bounce;
+    std::vector<uint64_t> stall_ns;
+    uint64_t cbw_bytes = 0, cbw_zero = 0;
+    std::atomic<int> live_error{0};
+    std::thread fault_thread;
+
+    int Collect();
+    bool Claim(uint64_t page);
+    int Unprotect(uint64_t page, uint64_t npages);
+    int StartLive();
+    void StopLive();
+    void FaultLoop();
+};
+
+
+// Merges the chain ending in path into a full snapshot at out, without a
+// VM.
+int snapshot_compact(const char* path, const char* out,
+        snapshot_stats* stats);
+
+void print_snapshot_stats(const snapshot_stats& stats);
+
+#ifdef UNITTEST
+int write_snapshot(const char* path, const snap_contents& c,
+        snapshot_stats* stats);
+int open_snapshot(const std::string& path, snap_file* f);
+int open_chain(const char* path, snap_chain* chain);
+int overlay_layers(const snap_chain& chain, uint8_t* ram,
+        snapshot_stats* stats);
+int read_state(const snap_file& f,
+        std::vector<std::vector<uint8_t>>* vcpu_state,
+        vm_device_state* devices);
+#endif  // UNITTEST
+
+
+#endif  // INCLUDE_SNAPSHOT_HPP_
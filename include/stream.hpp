@@ -0,0 +1,58 @@
+/*
+ *  include/stream.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_STREAM_HPP_
+#define INCLUDE_STREAM_HPP_
+
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+
+constexpr size_t STREAM_BUF_SIZE           = 256*1024;
+constexpr int    UNIX_CONNECT_TIMEOUT_MS   = 10*1000;
+constexpr int    UNIX_CONNECT_RETRY_MS     = 50;
+
+
+// Buffered reader/writer over a socket or file descriptor. Writes of at
+// least STREAM_BUF_SIZE bypass the buffer, so callers that already batch
+// their payload do not pay for a second copy. Owns fd.
+class Stream {
+ public:
+    explicit Stream(int fd);
+    ~Stream();
+
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+
+    int Write(const void* data, size_t size);
+    int Flush();
+    int Read(void* data, size_t size);
+
+    int Fd() const { return fd; }
+    uint64_t BytesWritten() const { return bytes_written; }
+    uint64_t BytesRead() const { return bytes_read; }
+
+ private:
+    int fd;
+    std::unique_ptr<uint8_t[]> wbuf, rbuf;
+    size_t wlen = 0;
+    size_t rpos = 0, rlen = 0;
+    uint64_t bytes_written = 0, bytes_read = 0;
+
+    int WriteAll(const void* data, size_t size);
+};
+
+
+// Both return a connected fd or -errno.
+int unix_listen(const char* path);
+int unix_accept(int listen_fd);
+int unix_connect(const char* path, int timeout_ms);
+
+
+#endif  // INCLUDE_STREAM_HPP_
@@ -0,0 +1,58 @@
+/*
+ *  include/timeline.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_TIMELINE_HPP_
+#define INCLUDE_TIMELINE_HPP_
+
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// How long the VM is given to print the marker the timeline ends with
+constexpr int TIMELINE_MARKER_TIMEOUT_MS = 60'000;
+
+
+struct timeline_event {
+    std::string name;
+    uint64_t ns;  // since the timeline started
+};
+
+
+// Monotonic timestamps of named points of a VM's startup, from whichever
+// thread reaches them. Starts when constructed.
+class BootTimeline {
+ public:
+    BootTimeline() : start(std::chrono::steady_clock::now()) {}
+
+    void Mark(const std::string& name);
+    // Only the first mark of name counts
+    void MarkOnce(const std::string& name);
+
+    // In the order they were marked
+    std::vector<timeline_event> Events() const;
+
+ private:
+    const std::chrono::steady_clock::time_point start;
+    mutable std::mutex mtx;
+    std::vector<timeline_event> events;
+};
+
+
+// What each event took: the time since the one before it, or since the
+// start for the first
+std::vector<timeline_event> timeline_phases(
+        const std::vector<timeline_event>& events);
+
+// {"boot_timeline_ns":[["vm_created",1234],...]}, on one line
+std::string timeline_format(const std::vector<timeline_event>& events);
+
+
+#endif  // INCLUDE_TIMELINE_HPP_
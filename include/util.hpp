@@ -9,42 +9,152 @@
 #define INCLUDE_UTIL_HPP_
 
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
-#include <ios>
 #include <iostream>
+#include <string>
+#include <vector>
 
+#include <boot.hpp>
 
-static inline std::streamsize get_ifs_size(std::ifstream& file) {
-    std::ios::pos_type original_pos = file.tellg();
 
-    if (!file) {
-        std::cerr << __func__ << ": invalid ifstream given" << std::endl;
+static inline bool is_kernel_elf(const uint8_t* image, uint64_t size) {
+    if (size < ELF_MAGIC_SIZE)
         return false;
+
+    return std::equal(image, image+ELF_MAGIC_SIZE, ELF_MAGIC);
+};
+
+static inline uint64_t ns_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - t).count();
+}
+
+static inline uint64_t us_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - t).count();
+}
+
+// pwrite()/pread() until all of size is done, retrying on EINTR. A
+// short file is -EPROTO.
+static inline int pwrite_all(int fd, const void* data, size_t size,
+        uint64_t off) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    ssize_t r;
+
+    while (size) {
+        if ((r = pwrite(fd, p, size, off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror((std::string(__func__) + ": pwrite").c_str());
+            return -errno;
+        }
+        p += r;
+        off += r;
+        size -= r;
     }
 
-    file.seekg(0, std::ios::end);
-    std::streamsize size = file.tellg();
+    return 0;
+}
 
-    file.seekg(original_pos, std::ios::beg);
+static inline int pread_all(int fd, void* data, size_t size, uint64_t off) {
+    uint8_t* p = static_cast<uint8_t*>(data);
+    ssize_t r;
+
+    while (size) {
+        if ((r = pread(fd, p, size, off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror((std::string(__func__) + ": pread").c_str());
+            return -errno;
+        }
+        if (r == 0) {
+            std::cerr << __func__ << ": unexpected EOF" << std::endl;
+            return -EPROTO;
+        }
+        p += r;
+        off += r;
+        size -= r;
+    }
 
-    return size;
+    return 0;
 }
 
-static inline bool is_kernel_elf(std::ifstream& kernel) {
-    char buf[ELF_MAGIC_SIZE];
-    std::ios::pos_type original_pos = kernel.tellg();
+// Nearest-rank percentile; sorts samples in place
+static inline uint64_t percentile(std::vector<uint64_t>* samples, int pct) {
+    size_t rank;
 
-    if (!kernel) {
-        std::cerr << __func__ << ": invalid ifstream given" << std::endl;
-        return false;
+    if (samples->empty())
+        return 0;
+
+    std::sort(samples->begin(), samples->end());
+    rank = (samples->size()*pct + 99) / 100;
+
+    return (*samples)[rank ? rank - 1 : 0];
+}
+
+constexpr uint64_t PAGEMAP_PRESENT     = 1ULL << 63;
+constexpr uint64_t PAGEMAP_FILE_SHARED = 1ULL << 61;  // page cache or shmem
+
+// Pages of [addr, addr+len) whose /proc/self/pagemap entry has all of
+// mask set and none of clear; 0 if that cannot be read
+static inline uint64_t pagemap_count(const void* addr, uint64_t len,
+        uint64_t mask, uint64_t clear = 0) {
+    const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t first = reinterpret_cast<uint64_t>(addr) / page_size;
+    uint64_t count = len / page_size, n = 0, k;
+    std::vector<uint64_t> buf(4096);
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return 0;
+
+    for (uint64_t i = 0; i < count; i += k) {
+        k = std::min<uint64_t>(buf.size(), count - i);
+        if (pread(fd, buf.data(), k*sizeof(uint64_t),
+                    (first + i)*sizeof(uint64_t))
+                != static_cast<ssize_t>(k*sizeof(uint64_t)))
+            break;
+        for (uint64_t j = 0; j < k; ++j)
+            n += (buf[j] & (mask | clear)) == mask;
     }
+    close(fd);
+
+    return n;
+}
 
-    kernel.seekg(0, std::ios::beg);
-    kernel.read(buf, ELF_MAGIC_SIZE);
-    kernel.seekg(original_pos);
+// Pages of [addr, addr+len) mapped into this process
+static inline uint64_t resident_pages(const void* addr, uint64_t len) {
+    return pagemap_count(addr, len, PAGEMAP_PRESENT);
+}
 
-    return std::equal(buf, buf+ELF_MAGIC_SIZE, ELF_MAGIC);
-};
+// Of those, the ones that are this mapping's own anonymous copies, e.g.
+// written through a MAP_PRIVATE file mapping
+static inline uint64_t private_pages(const void* addr, uint64_t len) {
+    return pagemap_count(addr, len, PAGEMAP_PRESENT, PAGEMAP_FILE_SHARED);
+}
+
+// RssAnon of this process in kB, from /proc/self/status; 0 if unknown
+static inline uint64_t rss_anon_kb() {
+    std::ifstream status("/proc/self/status");
+    std::string key;
+    uint64_t kb;
+
+    while (status >> key) {
+        if (key == "RssAnon:" && status >> kb)
+            return kb;
+        status.ignore(4096, '\n');
+    }
+
+    return 0;
+}
 
 
 #endif  // INCLUDE_UTIL_HPP_
@@ -9,12 +9,22 @@
 
 
 #include <linux/kvm.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 
 #include <baseclass.hpp>
 #include <kvm.hpp>
 
 
 class KVM;
+class VM;
+class DirtyRing;
 
 constexpr uint32_t KVM_CPUID_ENTRIES_NUM = 100;
 constexpr uint32_t KVM_CPUID_SIGNATURE   = 0x40000000;
@@ -23,6 +33,32 @@ constexpr uint32_t KVM_CPUID_EBX         = 0x4b4d564b;
 constexpr uint32_t KVM_CPUID_ECX         = 0x564b4d56;
 constexpr uint32_t KVM_CPUID_EDX         = 0x0000004d;
 
+// Sent to a vCPU thread to force KVM_RUN out; see Vcpu::Kick()
+constexpr int SIG_VCPU_KICK = SIGUSR1;
+
+// A throttled vCPU sleeps at most every this often; see VM::setThrottle()
+constexpr int VCPU_THROTTLE_SLICE_MS = 10;
+constexpr int VCPU_THROTTLE_MAX_PCT  = 99;
+
+// Vcpu::SaveState() output is a sequence of these, each followed by len
+// bytes of payload: the struct the matching KVM_GET_* ioctl fills in.
+// Unknown types are skipped on load, and so are missing ones.
+struct vcpu_state_entry {
+    uint32_t type;
+    uint32_t len;
+};
+
+constexpr uint32_t VCPU_STATE_REGS      = 1;
+constexpr uint32_t VCPU_STATE_SREGS     = 2;
+constexpr uint32_t VCPU_STATE_FPU       = 3;  // without KVM_CAP_XSAVE
+constexpr uint32_t VCPU_STATE_XSAVE     = 4;  // kvm_xsave or KVM_GET_XSAVE2
+constexpr uint32_t VCPU_STATE_XCRS      = 5;
+constexpr uint32_t VCPU_STATE_MSRS      = 6;  // kvm_msrs and its entries
+constexpr uint32_t VCPU_STATE_MP_STATE  = 7;
+constexpr uint32_t VCPU_STATE_LAPIC     = 8;
+constexpr uint32_t VCPU_STATE_EVENTS    = 9;
+constexpr uint32_t VCPU_STATE_DEBUGREGS = 10;
+
 constexpr uint64_t CR0_PE = 1;
 constexpr uint64_t CR0_MP = 1 << 1;
 constexpr uint64_t CR0_EM = 1 << 2;
@@ -33,7 +69,7 @@ constexpr uint64_t CR0_WP = 1 << 16;
 constexpr uint64_t CR0_AM = 1 << 18;
 constexpr uint64_t CR0_NW = 1 << 29;
 constexpr uint64_t CR0_CD = 1 << 30;
-constexpr uint64_t CR0_PG = 1 << 31;
+constexpr uint64_t CR0_PG = 1ULL << 31;
 
 constexpr uint64_t CR3_PWT       = 1 << 3;
 constexpr uint64_t CR3_PCD       = 1 << 4;
@@ -82,7 +118,7 @@ constexpr uint64_t RF_VIF  = 1 << 19;
 constexpr uint64_t RF_VIP  = 1 << 20;
 constexpr uint64_t RF_ID   = 1 << 21;
 constexpr uint64_t RF_AES  = 1 << 30;
-constexpr uint64_t RF_AI   = 1 << 31;
+constexpr uint64_t RF_AI   = 1ULL << 31;
 
 constexpr uint64_t MSR_IA32_EFER_SCE   = 1;
 constexpr uint64_t MSR_IA32_EFER_LME   = 1 << 8;
@@ -156,10 +192,35 @@ class Vcpu : public BaseClass {
     int SetGuestDebug(bool enable, bool singlestep);
 #endif  // GUEST_DEBUG
 
-    int InitRegs(uint64_t rip, uint64_t rsi);
+    int InitRegs(uint64_t rip, uint64_t rsi, uint64_t rbx = 0);
     int InitSregs(bool is_elfclass64);
     int RunLoop();
 
+    // Makes the vCPU thread leave KVM_RUN with KVM_EXIT_INTR as soon as
+    // possible. SetThread() must have been called.
+    void Kick();
+    void SetThread(pthread_t t) { thread = t; }
+
+    // Time spent in throttling sleeps since the vCPU started
+    uint64_t ThrottledNs() const { return throttled_ns.load(); }
+
+    // SaveState() resizes out to StateSize(); reusing the same vector
+    // keeps it from allocating. LoadState() applies entries in the order
+    // KVM needs them, whatever their order in data.
+    int SaveState(std::vector<uint8_t>* out);
+    int LoadState(const uint8_t* data, size_t size);
+    size_t StateSize() const { return state_size; }
+    uint64_t LastSaveNs() const { return last_save_ns; }
+
+    // Returns the number of entries drained; ring may be nullptr to
+    // discard them. The caller resets the rings afterwards.
+    uint32_t CollectDirtyRing(DirtyRing* ring);
+
+    // Pages this vCPU dirtied in banks on its own host node and on
+    // others, counted from its dirty ring
+    uint64_t NumaLocal() const { return numa_local.load(); }
+    uint64_t NumaRemote() const { return numa_remote.load(); }
+
  private:
     KVM* kvm;
     VM*  vm;
@@ -168,6 +229,33 @@ class Vcpu : public BaseClass {
     kvm_cpuid2* kvm_cpuid = static_cast<kvm_cpuid2*>(nullptr);
     kvm_run* run = static_cast<kvm_run*>(nullptr);
 
+    kvm_dirty_gfn* dirty_gfns = static_cast<kvm_dirty_gfn*>(nullptr);
+    uint32_t dirty_ring_entries = 0;
+    uint32_t dirty_fetch_index = 0;
+
+    pthread_t thread = 0;
+
+    std::chrono::steady_clock::time_point throttle_since;
+    std::atomic<uint64_t> throttled_ns{0};
+
+    std::atomic<uint64_t> numa_local{0}, numa_remote{0};
+
+    // One per state entry, in load order. Built once by InitState(); buf
+    // points into state_buf and, for MSRs, holds the indices to read.
+    struct state_req {
+        uint32_t type;
+        unsigned long get, set;
+        uint32_t len;
+        uint8_t* buf;
+    };
+    std::vector<state_req> state_reqs;
+    std::vector<uint8_t> state_buf;
+    size_t state_size = 0;
+    uint64_t last_save_ns = 0;
+
+    void InitState();
+    std::vector<uint32_t> ProbeMSRs();
+
     int GetRegs(vcpu_regs *regs);
     int GetSregs(vcpu_sregs *sregs);
 
@@ -181,6 +269,7 @@ class Vcpu : public BaseClass {
 
     int Run();
     int RunOnce();
+    void Throttle();
 };
 
 
@@ -10,20 +10,33 @@
 
 
 #include <linux/kvm.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <baseclass.hpp>
 #include <boot.hpp>
+#include <dirty.hpp>
+#include <elf.hpp>
+#include <image.hpp>
 #include <iodev.hpp>
 #include <kvm.hpp>
+#include <membank.hpp>
+#include <numa.hpp>
 #include <pci.hpp>
 #include <pio.hpp>
+#include <prefault.hpp>
+#include <rambacking.hpp>
+#include <timeline.hpp>
 #include <vcpu.hpp>
 
 
@@ -33,7 +46,8 @@ class KVM;
 class IODev;
 
 
-constexpr const int INITMACHINE_FUNC_NUM = 10;
+constexpr const int INITMACHINE_FUNC_NUM = 11;
+constexpr const int DIRTY_RING_REAP_MS_DEFAULT = 10;
 
 
 struct vm_config {
@@ -43,6 +57,18 @@ struct vm_config {
     const char *kernel_path;
     const char *initramfs_path;
     const bool is_64bit_boot;
+    const bool dirty_log = false;          // KVM_MEM_LOG_DIRTY_PAGES on RAM
+    const int  dirty_log_interval_ms = 0;  // 0: harvest on demand only
+    const uint32_t dirty_ring_entries = 0;  // !0: per-vCPU dirty rings
+    const int  dirty_ring_reap_ms = DIRTY_RING_REAP_MS_DEFAULT;
+    const uint64_t mem_bank_size = 0;  // !0: no memslot larger than this
+    const ram_backing backing = {};    // of guest RAM
+    // Host nodes; bank slot i and vCPU i go to entry i % size
+    const std::vector<int> numa_nodes = {};
+    const int  prefault_threads = 0;   // !0: populate RAM in initRAM()
+    const bool prefault_boot = false;  // only what initRAM() will write
+    const bool map_initramfs = false;  // copy-on-write from the file
+    const int  kernel_load_threads = 0;  // vmlinux only; 0: one per CPU
     /*
      * padding:
      *   I don't know why, but without padding,
@@ -51,8 +77,31 @@ struct vm_config {
      */
 };
 
+// Device records kept in vm_device_state; see VM::saveDeviceState()
+constexpr int VM_IODEV_STATE_NUM = 8;
+
+// Everything outside the vCPUs, in one fixed-size record so it can be
+// captured with the guest stopped without allocating
+struct vm_device_state {
+    // in-kernel
+    kvm_pit_state2 pit;
+    kvm_irqchip    pic_master;
+    kvm_irqchip    pic_slave;
+    kvm_irqchip    ioapic;
+    kvm_clock_data clock;
+
+    // userspace
+    pci_state      pci;
+    iodev_state    iodev[VM_IODEV_STATE_NUM];
+};
+
 typedef int (VM::*InitMachineFunc)();
 
+struct InitMachineStep {
+    const char* name;  // of its event on the boot timeline
+    InitMachineFunc func;
+};
+
 
 class VM : public BaseClass {
  public:
@@ -66,15 +115,91 @@ class VM : public BaseClass {
 
     int initMachine();
     int initRAM(std::string cmdline);
+    // The prefault initRAM() starts with. Only a cold boot wants it; RAM
+    // that a migration, a snapshot or a fork parent fills is left alone.
+    int prefaultRAM();
+    // Puts a private mapping of fd at ram_start instead of the memfd from
+    // initMachine(), which is closed
+    int mapGuestRAM(int fd, uint64_t offset);
+    // The memfd behind guest RAM, -1 once mapGuestRAM() replaced it
+    int getRAMFd() const { return ram_fd; }
+    // Guest RAM is one mapping at ram_start; each bank is a memslot over
+    // its part of it
+    const std::vector<mem_bank>& getMemBanks() const { return mem_banks; }
+    // nullptr unless [gpa, gpa+len) is all in one bank
+    void* gpaToHva(uint64_t gpa, uint64_t len);
+
+    // Host node of a bank or vCPU, -1 without numa_nodes
+    int getBankNode(uint32_t slot) const;
+    int getVcpuNode(int i) const;
+    // The per-vCPU counters, and with banks the residency of every bank,
+    // which walks all of its resident pages; see numa_count_pages()
+    int getNumaStats(numa_stats* stats, bool banks = true);
+
+    // Of prefaultRAM(), zero without prefault_threads or before it ran
+    const prefault_stats& getPrefaultStats() const { return prefault_st; }
+    // Of initRAM(), with saved counted again now
+    int getLoadStats(load_stats* stats);
+
+    // From construction on: vm_created, each initMachine() step, the
+    // initram_* stages, vcpu_start, first_kvm_run, first_com1_byte and
+    // console_marker
+    BootTimeline* getTimeline() { return &timeline; }
 
     int Boot();
+
+    // vCPU thread control; Boot() is Start() followed by Join(). Stop()
+    // ends the vCPU threads for good, paused or not.
+    int Start();
+    int Pause();
+    int Resume();
+    int Stop();
+    int Join();
+    bool isPausePending() const { return pause_req.load(); }
+    bool isStopPending() const { return stop_req.load(); }
+    void parkVcpu();
+    void vcpuExited();
+
+    // Each vCPU is held off for pct% of the wall clock, 0 to turn off
+    int setThrottle(int pct);
+    int getThrottle() const { return throttle_pct.load(); }
+
+    int saveDeviceState(vm_device_state* state);
+    int loadDeviceState(const vm_device_state* state);
+
+    // Serial console: COM1 output goes to the console fd and is matched
+    // against the marker, if one is set
+    void setConsoleFd(int fd) { console_fd = fd; }
+    int getConsoleFd() const { return console_fd.load(); }
+    void setConsoleMarker(const std::string& marker);
+    void consoleOutput(char c);
+    // False on timeout
+    bool waitConsoleMarker(int timeout_ms);
+
+    const vm_config& getConfig() const { return vm_conf; }
     int irqLine(uint32_t irq, uint32_t level);
     int flapIRQLine(uint32_t irq);
 
+    int enableDirtyLog(bool enable);
+    DirtyTracker* getDirtyTracker() { return dirty_tracker.get(); }
+    int reapDirtyRing(Vcpu* vcpu);
+    uint32_t getDirtyRingEntries() const { return vm_conf.dirty_ring_entries; }
+
+    int getVcpuNum() const { return vm_conf.vcpu_num; }
+    Vcpu* getVcpu(int i);
+
  private:
     KVM* kvm;
     const vm_config vm_conf;
-    std::ifstream kernel, initramfs;
+    BootImage kernel, initramfs;
+    load_stats load_st;
+    BootTimeline timeline;
+    // A bzImage's real-mode or 64-bit entry, or for a vmlinux its PVH
+    // entry if it has one and is_64bit_boot is off, its 64-bit one if not
+    elf_kernel kernel_elf;  // no segments for a bzImage
+    uint64_t boot_entry = 0;
+    bool boot_long_mode = false;  // with createPageTable()'s tables
+    bool boot_pvh = false;        // ebx: PVH_START_INFO_ADDR
 
     static constexpr const kvm_pit_config pit_config = {
         .flags = {0},
@@ -82,20 +207,52 @@ class VM : public BaseClass {
     };
 
     Vcpu* vcpus = static_cast<Vcpu*>(nullptr);
-    kvm_userspace_memory_region user_memory_region;  // TMP
+    int vcpus_created = 0;
+    int ram_fd = -1;
+    std::vector<std::thread> vcpu_threads;
+    std::mutex run_mtx;
+    std::condition_variable run_cv;
+    std::atomic<bool> pause_req{false};
+    std::atomic<bool> stop_req{false};
+    int vcpus_parked = 0;
+    int vcpus_alive = 0;
+
+    std::atomic<int> console_fd{STDOUT_FILENO};
+    std::mutex console_mtx;
+    std::condition_variable console_cv;
+    std::string console_marker, console_tail;
+    bool console_marker_seen = false;
+    bool console_output_seen = false;
+
+    std::atomic<int> throttle_pct{0};
+    std::thread throttle_thread;
+    std::mutex throttle_mtx;
+    std::condition_variable throttle_cv;
+    void throttleLoop();
+
+    std::vector<mem_bank> mem_banks;
+    uint32_t mem_flags = 0;  // of every bank's memslot
+    std::vector<std::vector<int>> numa_cpus;  // of each numa_nodes entry
+    prefault_stats prefault_st;
+    std::unique_ptr<DirtyTracker> dirty_tracker;
+    // dirty_tracker as vCPU threads see it in reapDirtyRing()
+    std::mutex tracker_mtx;
 
     // TODO: use std::function!
-    const InitMachineFunc initmachine_func[INITMACHINE_FUNC_NUM] = {
-        &VM::setTSSAddr,          // not needed for unrestricted_guest = 1?
-        &VM::setIdentityMapAddr,  // not needed for unrestricted_guest = 1?
-        &VM::createIRQChip,
-        &VM::createPIT2,
-        &VM::createVcpu,
-        &VM::allocGuestRAM,
-        &VM::setUserMemRegion,
-        &VM::initPIOHandler,
-        &VM::initVcpuRegs,
-        &VM::initVcpuSregs,
+    const InitMachineStep initmachine_func[INITMACHINE_FUNC_NUM] = {
+        // not needed for unrestricted_guest = 1?
+        { "setTSSAddr",         &VM::setTSSAddr },
+        { "setIdentityMapAddr", &VM::setIdentityMapAddr },
+        { "createIRQChip",      &VM::createIRQChip },
+        { "createPIT2",         &VM::createPIT2 },
+        // must precede vCPU creation
+        { "enableDirtyRing",    &VM::enableDirtyRing },
+        { "createVcpu",         &VM::createVcpu },
+        { "allocGuestRAM",      &VM::allocGuestRAM },
+        { "setUserMemRegion",   &VM::setUserMemRegion },
+        { "initPIOHandler",     &VM::initPIOHandler },
+        { "initVcpuRegs",       &VM::initVcpuRegs },
+        { "initVcpuSregs",      &VM::initVcpuSregs },
     };
 
     int registerPIOHandler(uint16_t port_start, uint16_t port_end,
@@ -109,6 +266,7 @@ class VM : public BaseClass {
     int setIdentityMapAddr();
     int createIRQChip();
     int createPIT2();
+    int enableDirtyRing();
     int createVcpu();
     int allocGuestRAM();
     int setUserMemRegion();
@@ -116,6 +274,19 @@ class VM : public BaseClass {
     int initVcpuRegs();
     int initVcpuSregs();
 
+    int setMemSlot(const mem_bank& bank, uint32_t flags);
+    int bindMemBanks();
+    void pinVcpu(int i);
+    void bootRanges(std::vector<prefault_range>* ranges);
+    bool mapsInitramfs(const void* dst) const;
+    int loadInitramfs();
+    int loadElfKernel();
+    int writePvhStartInfo(uint64_t ramdisk_size,
+            const std::vector<e820entry>& e820);
+
+    // dirty tracking
+    DirtyTracker* newDirtyTracker();
+
     // initRAM()
     int createPageTable(uint64_t boot_pgtable_base);
 
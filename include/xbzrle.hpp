@@ -0,0 +1,75 @@
+/*
+ *  include/xbzrle.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_XBZRLE_HPP_
+#define INCLUDE_XBZRLE_HPP_
+
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+
+constexpr size_t XBZRLE_PAGE_SIZE = 4096;
+
+
+// The delta between two versions of a page is a list of
+//   uleb128 unchanged_len, uleb128 changed_len, changed_len XOR bytes
+// with trailing unchanged bytes left out. Returns the encoded length, or
+// -1 if it would not fit in dst_len.
+int xbzrle_encode(const uint8_t* old_page, const uint8_t* new_page,
+        uint8_t* dst, size_t dst_len);
+// Applies a delta to page in place; -EINVAL on malformed input
+int xbzrle_decode(const uint8_t* src, size_t len, uint8_t* page);
+
+
+struct page_cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Contents of recently sent pages, keyed by page index, evicting the
+// least recently used entry once capacity pages are cached.
+class PageCache {
+ public:
+    explicit PageCache(uint64_t capacity);
+
+    PageCache(const PageCache&) = delete;
+    PageCache& operator=(const PageCache&) = delete;
+
+    // nullptr on a miss; a hit becomes the most recently used entry
+    uint8_t* Lookup(uint64_t index);
+    // Caches data for index, which must not be cached yet
+    void Insert(uint64_t index, const uint8_t* data);
+    void Erase(uint64_t index);
+
+    uint64_t Capacity() const { return capacity; }
+    uint64_t Size() const { return map.size(); }
+    const page_cache_stats& Stats() const { return stats; }
+
+ private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    const uint64_t capacity;
+    std::unique_ptr<uint8_t[]> data;
+    std::unordered_map<uint64_t, uint32_t> map;  // index -> slot
+    // per-slot LRU links, head is the most recently used
+    std::vector<uint64_t> slot_index;
+    std::vector<uint32_t> prev, next;
+    std::vector<uint32_t> free_slots;
+    uint32_t head = NIL, tail = NIL;
+    page_cache_stats stats;
+
+    void Unlink(uint32_t slot);
+    void PushFront(uint32_t slot);
+};
+
+
+#endif  // INCLUDE_XBZRLE_HPP_
@@ -0,0 +1,35 @@
+/*
+ *  include/zeropage.hpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#ifndef INCLUDE_ZEROPAGE_HPP_
+#define INCLUDE_ZEROPAGE_HPP_
+
+
+#include <cstddef>
+
+
+constexpr size_t ZERO_PAGE_SIZE = 4096;
+
+
+typedef bool (*ZeroPageFunc)(const void* page);
+
+struct zero_page_kernel {
+    const char*  name;
+    ZeroPageFunc func;
+    bool         (*supported)();
+};
+
+// Fastest first; is_zero_page() uses the first one the CPU supports.
+extern const zero_page_kernel zero_page_kernels[];
+extern const size_t ZERO_PAGE_KERNEL_NUM;
+
+// page must be ZERO_PAGE_SIZE bytes and 32-byte aligned
+bool is_zero_page(const void* page);
+const char* zero_page_kernel_name();
+
+
+#endif  // INCLUDE_ZEROPAGE_HPP_
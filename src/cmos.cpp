@@ -8,7 +8,9 @@
 #include <cmos.hpp>
 
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <ctime>
 
 #include <iodev.hpp>
@@ -133,5 +135,21 @@ int CMOS::Write(uint16_t port, char* data_ptr, uint8_t size) {
     return 0;
 }
 
+void CMOS::SaveState(void* record) const {
+    cmos_state* s = static_cast<cmos_state*>(record);
+
+    s->index = index;
+    std::memcpy(s->data, data, sizeof(data));
+}
+
+int CMOS::LoadState(const void* record) {
+    const cmos_state* s = static_cast<const cmos_state*>(record);
+
+    index = s->index & CMOS_INDEX_MASK;
+    std::memcpy(data, s->data, sizeof(data));
+
+    return 0;
+}
+
 CMOS::CMOS(VM* vm)\
         : IODev(PIO_PORT_CMOS_START, PIO_PORT_CMOS_SIZE, vm) {}
@@ -10,6 +10,7 @@
 
 #include <com1.hpp>
 
+#include <cstddef>
 #include <cstdint>
 #include <unistd.h>
 
@@ -66,12 +67,15 @@ int COM1::Write(uint16_t port, char* data_ptr, uint8_t) {
     switch (port) {
         case PIO_PORT_COM1_THR_RBR_DLL:
             if (!is_dlab_set()) {  // THR
-                r = write(STDOUT_FILENO, data_ptr, 1);
+                r = write(vm ? vm->getConsoleFd() : STDOUT_FILENO,
+                        data_ptr, 1);
                 if (r == -1) {
                     perror(("COM1::" + std::string(__func__) +
                                 ": write").c_str());
                     return -errno;
                 }
+                if (vm)
+                    vm->consoleOutput(data_ptr[0]);
             } else {               // DLL
                 DLL = data_ptr[0];
             }
@@ -109,4 +113,34 @@ int COM1::Write(uint16_t port, char* data_ptr, uint8_t) {
     return 0;
 }
 
+void COM1::SaveState(void* record) const {
+    com1_state* s = static_cast<com1_state*>(record);
+
+    *s = {
+        .THR = THR, .RBR = RBR, .DLL = DLL,
+        .IER = IER, .DLH = DLH,
+        .IIR = IIR, .FCR = FCR,
+        .LCR = LCR,
+        .MCR = MCR,
+        .LSR = LSR,
+        .MSR = MSR,
+        .SR  = SR,
+    };
+}
+
+int COM1::LoadState(const void* record) {
+    const com1_state* s = static_cast<const com1_state*>(record);
+
+    THR = s->THR; RBR = s->RBR; DLL = s->DLL;
+    IER = s->IER; DLH = s->DLH;
+    IIR = s->IIR; FCR = s->FCR;
+    LCR = s->LCR;
+    MCR = s->MCR;
+    LSR = s->LSR;
+    MSR = s->MSR;
+    SR  = s->SR;
+
+    return 0;
+}
+
 COM1::COM1(VM* vm) : IODev(PIO_PORT_COM1_START, PIO_PORT_COM1_SIZE, vm) {}
@@ -0,0 +1,192 @@
+/*
+ *  src/compress.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <compress.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+// Matches may not start closer than this to the end, which keeps the
+// word-at-a-time loops below inside the input.
+constexpr size_t LZ_TAIL = 8;
+
+
+static inline uint32_t load32(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the remainder of a length whose nibble was 15
+static inline uint8_t* put_len(uint8_t* op, const uint8_t* oend, size_t n) {
+    while (n >= 255) {
+        if (op >= oend)
+            return nullptr;
+        *op++ = 255;
+        n -= 255;
+    }
+    if (op >= oend)
+        return nullptr;
+    *op++ = n;
+
+    return op;
+}
+
+static inline uint8_t* put_sequence(uint8_t* op, const uint8_t* oend,
+        const uint8_t* lit, size_t nlit, size_t offset, size_t mlen) {
+    uint8_t* token = op++;
+    size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+    if (token >= oend)
+        return nullptr;
+
+    *token = (nlit >= 15 ? 15 : nlit) << 4 | (mcode >= 15 ? 15 : mcode);
+    if (nlit >= 15 && !(op = put_len(op, oend, nlit - 15)))
+        return nullptr;
+
+    if (static_cast<size_t>(oend - op) < nlit)
+        return nullptr;
+    std::memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (!mlen)
+        return op;
+
+    if (oend - op < 2)
+        return nullptr;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    if (mcode >= 15 && !(op = put_len(op, oend, mcode - 15)))
+        return nullptr;
+
+    return op;
+}
+
+int lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap,
+        uint16_t* table) {
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* iend = src + len;
+    const uint8_t* mlimit = len > LZ_TAIL ? iend - LZ_TAIL : src;
+    const uint8_t* ref;
+    const uint8_t* oend = dst + dst_cap;
+    uint8_t* op = dst;
+    uint32_t h;
+    size_t mlen;
+
+    if (len > LZ_MAX_INPUT)
+        return -1;
+
+    std::memset(table, 0, LZ_HASH_ENTRIES*sizeof(*table));
+
+    while (ip < mlimit) {
+        h = lz_hash(load32(ip));
+        ref = src + table[h];
+        table[h] = ip - src;
+
+        if (ref >= ip || load32(ref) != load32(ip)) {
+            ++ip;
+            continue;
+        }
+
+        // extend the match eight bytes at a time, then finish bytewise
+        mlen = LZ_MIN_MATCH;
+        while (ip + mlen + 8 <= mlimit) {
+            uint64_t diff = load64(ip + mlen) ^ load64(ref + mlen);
+            if (diff) {
+                mlen += __builtin_ctzll(diff) / 8;
+                break;
+            }
+            mlen += 8;
+        }
+        while (ip + mlen < mlimit && ip[mlen] == ref[mlen])
+            ++mlen;
+
+        if (!(op = put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                        mlen)))
+            return -1;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    if (!(op = put_sequence(op, oend, anchor, iend - anchor, 0, 0)))
+        return -1;
+
+    return op - dst;
+}
+
+static inline bool get_len(const uint8_t** ip, const uint8_t* iend,
+        size_t* n) {
+    uint8_t b;
+
+    do {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+
+    return true;
+}
+
+int lz_decompress(const uint8_t* src, size_t len, uint8_t* dst,
+        size_t dst_cap) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_cap;
+    size_t nlit, mlen, offset;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        nlit = token >> 4;
+        if (nlit == 15 && !get_len(&ip, iend, &nlit))
+            return -1;
+        if (static_cast<size_t>(iend - ip) < nlit
+                || static_cast<size_t>(oend - op) < nlit)
+            return -1;
+        std::memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend)
+            break;  // the last sequence has no match
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        mlen = token & 0xf;
+        if (mlen == 15 && !get_len(&ip, iend, &mlen))
+            return -1;
+        mlen += LZ_MIN_MATCH;
+
+        if (!offset || offset > static_cast<size_t>(op - dst)
+                || static_cast<size_t>(oend - op) < mlen)
+            return -1;
+
+        // may overlap the output, so byte by byte
+        for (size_t i = 0; i < mlen; ++i, ++op)
+            *op = *(op - offset);
+    }
+
+    return op - dst;
+}
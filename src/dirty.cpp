@@ -0,0 +1,351 @@
+/*
+ *  src/dirty.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <dirty.hpp>
+
+#include <linux/kvm.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <vcpu.hpp>
+#include <vm.hpp>
+
+
+constexpr uint64_t RUN_ITER_END = UINT64_MAX;
+
+
+DirtyBitmap::RunIterator::RunIterator(const uint64_t* words,
+        uint64_t nwords, uint64_t pos)
+        : words(words), nwords(nwords), pos(pos) {
+    if (pos != RUN_ITER_END)
+        FindNextRun(pos);
+}
+
+DirtyBitmap::RunIterator& DirtyBitmap::RunIterator::operator++() {
+    FindNextRun(pos);
+    return *this;
+}
+
+void DirtyBitmap::RunIterator::FindNextRun(uint64_t from) {
+    uint64_t wi = from / DIRTY_WORD_BITS;
+    uint64_t w, inv, start;
+
+    if (wi >= nwords) {
+        pos = RUN_ITER_END;
+        return;
+    }
+
+    w = words[wi] & (~0ULL << (from % DIRTY_WORD_BITS));
+    while (w == 0) {
+        // Mostly clean bitmaps are the common case, so test four words
+        // per branch until something shows up.
+        ++wi;
+        while (wi + 4 <= nwords
+                && (words[wi] | words[wi+1] | words[wi+2] | words[wi+3]) == 0)
+            wi += 4;
+        if (wi >= nwords) {
+            pos = RUN_ITER_END;
+            return;
+        }
+        w = words[wi];
+    }
+
+    start = wi*DIRTY_WORD_BITS + __builtin_ctzll(w);
+
+    inv = ~words[wi] & (~0ULL << (start % DIRTY_WORD_BITS));
+    while (inv == 0) {
+        if (++wi >= nwords)
+            break;
+        inv = ~words[wi];
+    }
+
+    pos = wi >= nwords ? nwords*DIRTY_WORD_BITS
+                       : wi*DIRTY_WORD_BITS + __builtin_ctzll(inv);
+    run = { start, pos - start };
+}
+
+DirtyBitmap::DirtyBitmap(uint64_t npages)
+        : npages(npages),
+          nwords((npages + DIRTY_WORD_BITS - 1) / DIRTY_WORD_BITS) {
+    words = new uint64_t[nwords]();
+}
+
+DirtyBitmap::~DirtyBitmap() {
+    delete[] words;
+}
+
+bool DirtyBitmap::Test(uint64_t page) const {
+    return words[page / DIRTY_WORD_BITS] >> (page % DIRTY_WORD_BITS) & 1;
+}
+
+void DirtyBitmap::Set(uint64_t page) {
+    if (page >= npages)
+        return;
+    words[page / DIRTY_WORD_BITS] |= 1ULL << (page % DIRTY_WORD_BITS);
+}
+
+void DirtyBitmap::SetAtomic(uint64_t page) {
+    if (page >= npages)
+        return;
+    __atomic_fetch_or(&words[page / DIRTY_WORD_BITS],
+            1ULL << (page % DIRTY_WORD_BITS), __ATOMIC_RELAXED);
+}
+
+void DirtyBitmap::Clear() {
+    std::memset(words, 0, nwords*sizeof(*words));
+}
+
+uint64_t DirtyBitmap::Count() const {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < nwords; ++i)
+        n += __builtin_popcountll(words[i]);
+    return n;
+}
+
+DirtyBitmap::RunIterator DirtyBitmap::begin() const {
+    return RunIterator(words, nwords, 0);
+}
+
+DirtyBitmap::RunIterator DirtyBitmap::end() const {
+    return RunIterator(words, nwords, RUN_ITER_END);
+}
+
+
+DirtyTracker::~DirtyTracker() {}
+
+void DirtyTracker::Account(const DirtyBitmap& bitmap, const uint64_t* idx,
+        uint64_t nidx, std::chrono::steady_clock::time_point start) {
+    uint64_t pages = 0, runs = 0;
+    const uint64_t* words = bitmap.Data();
+    uint64_t n = idx ? nidx : bitmap.NumWords();
+
+    // A run starts at every set bit whose lower neighbour is clear.
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t wi = idx ? idx[i] : i;
+        uint64_t w = words[wi];
+        uint64_t carry = wi ? words[wi-1] >> (DIRTY_WORD_BITS - 1) : 0;
+        pages += __builtin_popcountll(w);
+        runs  += __builtin_popcountll(w & ~(w << 1 | carry));
+    }
+
+    stats.rounds++;
+    stats.last_dirty_pages = pages;
+    stats.last_runs = runs;
+    stats.total_dirty_pages += pages;
+    stats.last_harvest_ns = std::chrono::duration_cast<
+        std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+}
+
+int DirtyTracker::StartPeriodic(int interval_ms, DirtyLogCallback cb) {
+    if (interval_ms <= 0 || harvester.joinable())
+        return -EINVAL;
+
+    stop_requested = false;
+    harvester = std::thread(&DirtyTracker::PeriodicLoop, this,
+            interval_ms, cb);
+
+    std::cout << "DirtyTracker::" << __func__ << ": harvesting every "
+        << interval_ms << "ms" << std::endl;
+
+    return 0;
+}
+
+void DirtyTracker::StopPeriodic() {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stop_requested = true;
+    }
+    cv.notify_all();
+
+    if (harvester.joinable())
+        harvester.join();
+}
+
+void DirtyTracker::PeriodicLoop(int interval_ms, DirtyLogCallback cb) {
+    std::unique_lock<std::mutex> lk(mtx);
+
+    while (!cv.wait_for(lk, std::chrono::milliseconds(interval_ms),
+                [this] { return stop_requested; })) {
+        if (Harvest() < 0)
+            return;
+        if (cb)
+            cb(Bitmap(), stats);
+    }
+}
+
+dirty_log_stats DirtyTracker::Stats() {
+    std::lock_guard<std::mutex> lk(mtx);
+    return stats;
+}
+
+
+int DirtyLog::Harvest() {
+    int r;
+    kvm_dirty_log log = {};
+    auto start = std::chrono::steady_clock::now();
+
+    // Bank offsets are MEMBANK_ALIGN aligned, so every slot starts on a
+    // word of the bitmap and fills whole words
+    for (const mem_bank& b : banks) {
+        log.slot = b.slot;
+        log.dirty_bitmap = bitmap.Data()
+            + (b.offset >> DIRTY_PAGE_SHIFT) / DIRTY_WORD_BITS;
+
+        r = vm->kvmIoctl(KVM_GET_DIRTY_LOG, &log);
+        if (r < 0) {
+            perror(("DirtyLog::" + std::string(__func__)
+                        + ": kvmIoctl").c_str());
+            return -errno;
+        }
+    }
+
+    Account(bitmap, nullptr, 0, start);
+
+    return 0;
+}
+
+DirtyLog::DirtyLog(VM* vm, const std::vector<mem_bank>& banks)
+        : vm(vm), banks(banks),
+          bitmap((banks.back().offset + banks.back().size)
+                  >> DIRTY_PAGE_SHIFT) {
+    std::cout << "DirtyLog: " << banks.size() << " slots: "
+        << bitmap.NumPages() << " pages, "
+        << bitmap.NumWords()*sizeof(uint64_t) << " bytes of bitmap"
+        << std::endl;
+}
+
+DirtyLog::~DirtyLog() {
+    StopPeriodic();
+}
+
+
+void DirtyRing::Mark(uint32_t slot, uint64_t offset) {
+    uint64_t page, wi;
+
+    if (slot >= banks.size()
+            || offset >= banks[slot].size >> DIRTY_PAGE_SHIFT) {
+        dropped++;
+        return;
+    }
+
+    page = (banks[slot].offset >> DIRTY_PAGE_SHIFT) + offset;
+    wi = page / DIRTY_WORD_BITS;
+    if (pending->Data()[wi] == 0)
+        pending_words.push_back(wi);
+    pending->Set(page);
+}
+
+int DirtyRing::ResetRings() {
+    int r;
+
+    r = vm->kvmIoctl(KVM_RESET_DIRTY_RINGS, 0);
+    if (r < 0) {
+        perror(("DirtyRing::" + std::string(__func__)
+                    + ": kvmIoctl").c_str());
+        return -errno;
+    }
+
+    return 0;
+}
+
+int DirtyRing::ReapVcpu(Vcpu* vcpu) {
+    std::lock_guard<std::mutex> lk(reap_mtx);
+
+    // Nothing to drain here means the reaper got there first; the ring is
+    // already reset and the vCPU can go back in.
+    ring_full_exits++;
+    if (vcpu->CollectDirtyRing(this) == 0)
+        return 0;
+
+    return ResetRings();
+}
+
+int DirtyRing::ReapAllLocked() {
+    uint32_t n = 0;
+
+    for (int i = 0; i < vm->getVcpuNum(); ++i)
+        n += vm->getVcpu(i)->CollectDirtyRing(this);
+
+    return n ? ResetRings() : 0;
+}
+
+void DirtyRing::ReaperLoop(int interval_ms) {
+    std::unique_lock<std::mutex> lk(reap_mtx);
+
+    while (!reaper_cv.wait_for(lk, std::chrono::milliseconds(interval_ms),
+                [this] { return reaper_stop; })) {
+        if (ReapAllLocked() < 0)
+            return;
+    }
+}
+
+int DirtyRing::Harvest() {
+    int r;
+    auto start = std::chrono::steady_clock::now();
+
+    // Only the words handed out last round can be non-zero.
+    for (uint64_t wi : bitmap_words)
+        bitmap->Data()[wi] = 0;
+    bitmap_words.clear();
+
+    {
+        std::lock_guard<std::mutex> lk(reap_mtx);
+
+        if ((r = ReapAllLocked()) < 0)
+            return r;
+
+        std::swap(pending, bitmap);
+        std::swap(pending_words, bitmap_words);
+    }
+
+    Account(*bitmap, bitmap_words.data(), bitmap_words.size(), start);
+
+    if (dropped)
+        std::cerr << "DirtyRing::" << __func__ << ": " << dropped
+            << " entries for unknown slots" << std::endl;
+
+    return 0;
+}
+
+DirtyRing::DirtyRing(VM* vm, const std::vector<mem_bank>& banks,
+        int reap_interval_ms)
+        : vm(vm), banks(banks),
+          pending(new DirtyBitmap((banks.back().offset + banks.back().size)
+                      >> DIRTY_PAGE_SHIFT)),
+          bitmap(new DirtyBitmap(pending->NumPages())) {
+    std::cout << "DirtyRing: " << banks.size() << " slots: "
+        << bitmap->NumPages() << " pages, reaping every "
+        << reap_interval_ms << "ms" << std::endl;
+
+    if (reap_interval_ms > 0)
+        reaper = std::thread(&DirtyRing::ReaperLoop, this, reap_interval_ms);
+}
+
+DirtyRing::~DirtyRing() {
+    StopPeriodic();
+
+    {
+        std::lock_guard<std::mutex> lk(reap_mtx);
+        reaper_stop = true;
+    }
+    reaper_cv.notify_all();
+
+    if (reaper.joinable())
+        reaper.join();
+}
@@ -0,0 +1,191 @@
+/*
+ *  src/dirtyrate.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <dirtyrate.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <hash.hpp>
+
+
+DirtyRateEstimator::DirtyRateEstimator(const uint8_t* ram,
+        uint64_t ram_size, dirty_rate_config conf)
+        : ram(ram), conf(conf) {
+    uint64_t npages = ram_size / DIRTY_RATE_PAGE_SIZE;
+    uint64_t n = std::max<uint64_t>(1,
+            (ram_size*conf.samples_per_gb) >> 30);
+    std::mt19937_64 rng(conf.seed ? conf.seed : std::random_device()());
+
+    n = std::min(n, npages);
+    if (n == npages) {
+        for (uint64_t i = 0; i < npages; ++i)
+            samples.push_back(i);
+    } else {
+        // Drawing twice is rare, so redraw until there are n distinct
+        while (samples.size() < n) {
+            for (uint64_t i = samples.size(); i < n; ++i)
+                samples.push_back(rng() % npages);
+            std::sort(samples.begin(), samples.end());
+            samples.erase(std::unique(samples.begin(), samples.end()),
+                    samples.end());
+        }
+    }
+
+    hashes.resize(samples.size());
+    history.resize(samples.size());
+    est.ram_pages = npages;
+    est.sample_pages = samples.size();
+
+    HashSamples(nullptr);
+    last = std::chrono::steady_clock::now();
+}
+
+DirtyRateEstimator::~DirtyRateEstimator() {
+    Stop();
+}
+
+// Samples are hashed in index order, so the walk over RAM stays forward
+void DirtyRateEstimator::HashSamples(uint64_t* changed) {
+    uint64_t h;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < samples.size(); ++i) {
+        h = page_hash64(ram + samples[i]*DIRTY_RATE_PAGE_SIZE,
+                DIRTY_RATE_PAGE_SIZE);
+        history[i] <<= 1;
+        if (changed && h != hashes[i]) {
+            history[i] |= 1;
+            (*changed)++;
+        }
+        hashes[i] = h;
+    }
+
+    est.sample_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+void DirtyRateEstimator::Sample() {
+    uint64_t changed = 0, wss = 0;
+    uint32_t mask = conf.wss_windows >= 32 ? UINT32_MAX
+                  : (1U << std::max(conf.wss_windows, 1)) - 1;
+    std::lock_guard<std::mutex> lk(mtx);
+    auto now = std::chrono::steady_clock::now();
+    uint64_t window_ns = std::max<uint64_t>(1,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now - last).count());
+
+    HashSamples(&changed);
+    last = now;
+
+    for (uint32_t h : history)
+        wss += (h & mask) != 0;
+
+    est.windows++;
+    est.dirty_samples = changed;
+    est.dirty_pages_per_s = static_cast<uint64_t>(
+            static_cast<double>(changed)*est.ram_pages / est.sample_pages
+            * 1e9 / window_ns);
+    est.wss_pages = wss*est.ram_pages / est.sample_pages;
+    est.wss_windows = std::min<uint64_t>(est.windows,
+            std::max(conf.wss_windows, 1));
+}
+
+dirty_rate_estimate DirtyRateEstimator::Estimate() {
+    std::lock_guard<std::mutex> lk(mtx);
+    return est;
+}
+
+int DirtyRateEstimator::Start(DirtyRateCallback cb) {
+    if (conf.window_ms <= 0 || sampler.joinable())
+        return -EINVAL;
+
+    stop_requested = false;
+    sampler = std::thread(&DirtyRateEstimator::SampleLoop, this, cb);
+
+    std::cout << "DirtyRateEstimator::" << __func__ << ": sampling "
+        << samples.size() << " pages every " << conf.window_ms << "ms"
+        << std::endl;
+
+    return 0;
+}
+
+void DirtyRateEstimator::Stop() {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stop_requested = true;
+    }
+    cv.notify_all();
+
+    if (sampler.joinable())
+        sampler.join();
+}
+
+void DirtyRateEstimator::SampleLoop(DirtyRateCallback cb) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            if (cv.wait_for(lk, std::chrono::milliseconds(conf.window_ms),
+                        [this] { return stop_requested; }))
+                return;
+        }
+
+        Sample();
+        if (cb)
+            cb(Estimate());
+    }
+}
+
+
+downtime_prediction predict_downtime(const dirty_rate_estimate& est,
+        uint64_t bandwidth, int downtime_limit_ms, int max_iterations) {
+    downtime_prediction p;
+    double remaining = est.ram_pages;
+    double cap = est.wss_pages ? est.wss_pages : est.ram_pages;
+    double send_ms;
+
+    if (!bandwidth)
+        return p;
+
+    for (p.iterations = 1; p.iterations <= max_iterations; ++p.iterations) {
+        send_ms = remaining*DIRTY_RATE_PAGE_SIZE*1000 / bandwidth;
+        p.total_ms += send_ms;
+
+        remaining = std::min(cap, est.dirty_pages_per_s*send_ms / 1000);
+        p.downtime_ms = remaining*DIRTY_RATE_PAGE_SIZE*1000 / bandwidth;
+        if (p.downtime_ms <= static_cast<uint64_t>(downtime_limit_ms)) {
+            p.converges = true;
+            break;
+        }
+    }
+    p.iterations = std::min(p.iterations, max_iterations);
+    p.total_ms += p.downtime_ms;
+
+    return p;
+}
+
+void print_dirty_rate(const dirty_rate_estimate& est,
+        const downtime_prediction& p, uint64_t bandwidth) {
+    std::cout << "dirty rate: " << est.dirty_pages_per_s << " pages/s ("
+        << est.dirty_pages_per_s*DIRTY_RATE_PAGE_SIZE / (1024*1024)
+        << " MiB/s, " << est.dirty_samples << "/" << est.sample_pages
+        << " samples), working set " << est.wss_pages*DIRTY_RATE_PAGE_SIZE
+            / (1024*1024) << " MiB over " << est.wss_windows << " windows"
+        << ", sampling took " << est.sample_ns / 1000 << "us" << std::endl;
+
+    std::cout << "dirty rate: at " << bandwidth / (1024*1024) << " MiB/s, "
+        << (p.converges ? "converges" : "does not converge") << " after "
+        << p.iterations << " iterations, ~" << p.downtime_ms
+        << "ms downtime, ~" << p.total_ms << "ms in total" << std::endl;
+}
@@ -0,0 +1,153 @@
+/*
+ *  src/elf.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <elf.hpp>
+
+#include <elf.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+
+// [off, off+len) within size, without overflowing
+static bool in_file(uint64_t off, uint64_t len, uint64_t size) {
+    return off <= size && len <= size - off;
+}
+
+static uint64_t note_align(uint64_t n) {
+    return (n + 3) & ~3ULL;
+}
+
+// The PVH entry from the notes in [p, p+len), 0 if there is none
+static uint64_t find_pvh_entry(const uint8_t* p, uint64_t len) {
+    Elf64_Nhdr nhdr;
+    uint64_t off = 0, desc;
+
+    while (len - off >= sizeof(nhdr)) {
+        std::memcpy(&nhdr, p + off, sizeof(nhdr));
+        off += sizeof(nhdr);
+        desc = off + note_align(nhdr.n_namesz);
+        if (desc > len || note_align(nhdr.n_descsz) > len - desc)
+            break;
+
+        if (nhdr.n_type == ELF_NOTE_PVH_ENTRY && nhdr.n_namesz == 4
+                && !std::memcmp(p + off, "Xen", 4)
+                && (nhdr.n_descsz == 4 || nhdr.n_descsz == 8)) {
+            uint64_t entry = 0;
+
+            // Linux writes a pointer-sized value; little-endian either way
+            std::memcpy(&entry, p + desc, nhdr.n_descsz);
+            return entry;
+        }
+        off = desc + note_align(nhdr.n_descsz);
+    }
+
+    return 0;
+}
+
+int elf_parse(const uint8_t* image, uint64_t size, elf_kernel* kernel) {
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+    bool entry_loaded = false;
+
+    *kernel = elf_kernel();
+    if (size < sizeof(ehdr))
+        return -ENOEXEC;
+    std::memcpy(&ehdr, image, sizeof(ehdr));
+
+    if (std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG)
+            || ehdr.e_ident[EI_CLASS] != ELFCLASS64
+            || ehdr.e_ident[EI_DATA] != ELFDATA2LSB
+            || ehdr.e_type != ET_EXEC || ehdr.e_machine != EM_X86_64
+            || ehdr.e_phentsize != sizeof(phdr)
+            || !in_file(ehdr.e_phoff, ehdr.e_phnum*sizeof(phdr), size)) {
+        std::cerr << "elf_parse: not a 64-bit x86 executable" << std::endl;
+        return -ENOEXEC;
+    }
+
+    for (int i = 0; i < ehdr.e_phnum; ++i) {
+        std::memcpy(&phdr, image + ehdr.e_phoff + i*sizeof(phdr),
+                sizeof(phdr));
+        if (!in_file(phdr.p_offset, phdr.p_filesz, size)) {
+            std::cerr << "elf_parse: segment " << i << " is past the end "
+                "of the file" << std::endl;
+            return -ENOEXEC;
+        }
+
+        if (phdr.p_type == PT_NOTE && !kernel->pvh_entry) {
+            kernel->pvh_entry = find_pvh_entry(image + phdr.p_offset,
+                    phdr.p_filesz);
+        } else if (phdr.p_type == PT_LOAD && phdr.p_memsz) {
+            if (phdr.p_filesz > phdr.p_memsz
+                    || phdr.p_paddr + phdr.p_memsz < phdr.p_paddr) {
+                std::cerr << "elf_parse: bad segment " << i << std::endl;
+                return -ENOEXEC;
+            }
+            kernel->segments.push_back({ phdr.p_paddr, phdr.p_offset,
+                    phdr.p_filesz, phdr.p_memsz });
+            if (ehdr.e_entry - phdr.p_paddr < phdr.p_memsz)
+                entry_loaded = true;
+        }
+    }
+
+    if (!entry_loaded) {
+        std::cerr << "elf_parse: the entry point is in no segment"
+            << std::endl;
+        return -ENOEXEC;
+    }
+    kernel->entry = ehdr.e_entry;
+
+    return 0;
+}
+
+int elf_load(const uint8_t* image, const std::vector<elf_segment>& segments,
+        const std::vector<uint8_t*>& dst, int threads) {
+    struct piece {
+        size_t seg;
+        uint64_t off, len;
+    };
+    std::vector<piece> pieces;
+    std::vector<std::thread> pool;
+    std::atomic<size_t> next{0};
+
+    for (size_t i = 0; i < segments.size(); ++i) {
+        for (uint64_t off = 0; off < segments[i].memsz; off += ELF_LOAD_CHUNK)
+            pieces.push_back({ i, off, std::min(ELF_LOAD_CHUNK,
+                        segments[i].memsz - off) });
+    }
+
+    auto work = [&]() {
+        size_t i;
+
+        while ((i = next.fetch_add(1)) < pieces.size()) {
+            const piece& p = pieces[i];
+            const elf_segment& s = segments[p.seg];
+            // Bytes of this piece that come from the file
+            uint64_t file = s.filesz > p.off
+                ? std::min(p.len, s.filesz - p.off) : 0;
+
+            std::memcpy(dst[p.seg] + p.off, image + s.offset + p.off, file);
+            std::memset(dst[p.seg] + p.off + file, 0, p.len - file);
+        }
+    };
+
+    threads = std::max<uint64_t>(1, std::min<uint64_t>(threads,
+                pieces.size()));
+    for (int t = 1; t < threads; ++t)
+        pool.emplace_back(work);
+    work();
+    for (std::thread& th : pool)
+        th.join();
+
+    return threads;
+}
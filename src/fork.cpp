@@ -0,0 +1,171 @@
+/*
+ *  src/fork.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <fork.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <kvm.hpp>
+#include <util.hpp>
+#include <vcpu.hpp>
+#include <vm.hpp>
+
+
+VMFork::VMFork(KVM* kvm, VM* parent) : kvm(kvm), parent(parent) {}
+
+VMFork::~VMFork() {
+    Teardown();
+}
+
+int VMFork::Capture() {
+    int r;
+    auto start = std::chrono::steady_clock::now();
+    const int vcpu_num = parent->getVcpuNum();
+
+    if (parent->getRAMFd() < 0) {
+        std::cerr << "VMFork::" << __func__
+            << ": the parent's RAM is not its own memfd" << std::endl;
+        return -EINVAL;
+    }
+
+    if ((r = parent->Pause()))
+        return r;
+
+    vcpu_state.assign(vcpu_num, {});
+    stats.state_bytes = sizeof(devices);
+    for (int i = 0; i < vcpu_num; ++i) {
+        if ((r = parent->getVcpu(i)->SaveState(&vcpu_state[i])))
+            return r;
+        stats.state_bytes += vcpu_state[i].size();
+    }
+    if ((r = parent->saveDeviceState(&devices)))
+        return r;
+
+    captured = true;
+    stats.capture_us = us_since(start);
+    stats.parent_pages = resident_pages(parent->ram_start,
+            parent->getConfig().ram_size);
+
+    return 0;
+}
+
+// The child gets its RAM and state before its vCPUs ever run
+int VMFork::Clone(VM** out) {
+    int r;
+    VM* vm;
+
+    if ((r = kvm->kvmCreateVM(&vm, parent->getConfig())) < 0)
+        return r;
+    children.emplace_back(vm);
+
+    if ((r = vm->initMachine())
+            || (r = vm->mapGuestRAM(parent->getRAMFd(), 0)))
+        return r;
+
+    for (int i = 0; i < vm->getVcpuNum(); ++i) {
+        if ((r = vm->getVcpu(i)->LoadState(vcpu_state[i].data(),
+                        vcpu_state[i].size())))
+            return r;
+    }
+    if ((r = vm->loadDeviceState(&devices)))
+        return r;
+
+    *out = vm;
+
+    return vm->Start();
+}
+
+int VMFork::Spawn(int n) {
+    int r;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point t;
+    std::vector<uint64_t> samples;
+    VM* vm;
+
+    if (!captured) {
+        std::cerr << "VMFork::" << __func__ << ": Capture() first"
+            << std::endl;
+        return -EINVAL;
+    }
+    if (children.empty())
+        rss_before_kb = rss_anon_kb();
+
+    for (int i = 0; i < n; ++i) {
+        t = std::chrono::steady_clock::now();
+        if ((r = Clone(&vm))) {
+            std::cerr << "VMFork::" << __func__ << ": child "
+                << children.size() - 1 << " failed: " << r << std::endl;
+            return r;
+        }
+        clone_us.push_back(us_since(t));
+    }
+
+    stats.children = children.size();
+    stats.spawn_ms += us_since(start) / 1000;
+    samples = clone_us;
+    stats.clone_p50_us = percentile(&samples, 50);
+    stats.clone_p99_us = percentile(&samples, 99);
+    stats.clone_max_us = percentile(&samples, 100);
+
+    return 0;
+}
+
+void VMFork::Measure() {
+    uint64_t n;
+
+    stats.private_pages = stats.private_max = 0;
+    for (const auto& vm : children) {
+        n = private_pages(vm->ram_start, vm->getConfig().ram_size);
+        stats.private_pages += n;
+        stats.private_max = std::max(stats.private_max, n);
+    }
+    stats.rss_anon_kb = static_cast<int64_t>(rss_anon_kb())
+        - static_cast<int64_t>(rss_before_kb);
+}
+
+void VMFork::Teardown() {
+    auto start = std::chrono::steady_clock::now();
+
+    if (children.empty())
+        return;
+
+    children.clear();
+    stats.teardown_us = us_since(start);
+}
+
+
+void print_fork_stats(const fork_stats& stats) {
+    const uint64_t n = std::max<uint64_t>(1, stats.children);
+
+    std::cout << "fork: parent paused and captured in " << stats.capture_us
+        << "us, " << stats.state_bytes << " bytes of state, "
+        << stats.parent_pages << " guest pages resident" << std::endl;
+
+    if (stats.children)
+        std::cout << "fork: " << stats.children << " children in "
+            << stats.spawn_ms << "ms, clone p50 " << stats.clone_p50_us
+            << "us, p99 " << stats.clone_p99_us << "us, max "
+            << stats.clone_max_us << "us" << std::endl;
+
+    if (stats.private_pages || stats.rss_anon_kb)
+        std::cout << "fork: per child " << stats.private_pages / n
+            << " private guest pages on average (" << stats.private_pages*4
+            / n << " kB), " << stats.private_max << " at most; RssAnon +"
+            << stats.rss_anon_kb / static_cast<int64_t>(n) << " kB"
+            << std::endl;
+
+    if (stats.teardown_us)
+        std::cout << "fork: torn down in " << stats.teardown_us << "us"
+            << std::endl;
+}
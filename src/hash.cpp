@@ -0,0 +1,89 @@
+/*
+ *  src/hash.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <hash.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+static constexpr uint64_t P1 = 0x9e3779b185ebca87ULL;
+static constexpr uint64_t P2 = 0xc2b2ae3d27d4eb4fULL;
+static constexpr uint64_t P3 = 0x165667b19e3779f9ULL;
+static constexpr uint64_t P4 = 0x85ebca77c2b2ae63ULL;
+static constexpr uint64_t P5 = 0x27d4eb2f165667c5ULL;
+
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return x << r | x >> (64 - r);
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t w) {
+    return rotl(acc + w*P2, 31)*P1;
+}
+
+static inline uint64_t hash_merge(uint64_t h, uint64_t acc) {
+    return (h ^ hash_round(0, acc))*P1 + P4;
+}
+
+static inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static void hash_lanes(const uint8_t* data, size_t len, uint64_t seed,
+        uint64_t acc[4]) {
+    uint64_t w[4];
+    uint64_t a0 = seed + P1 + P2, a1 = seed + P2, a2 = seed, a3 = seed - P1;
+
+    // Four independent lanes keep the multipliers busy
+    for (size_t i = 0; i + 32 <= len; i += 32) {
+        std::memcpy(w, data + i, sizeof(w));
+        a0 = hash_round(a0, w[0]);
+        a1 = hash_round(a1, w[1]);
+        a2 = hash_round(a2, w[2]);
+        a3 = hash_round(a3, w[3]);
+    }
+
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+}
+
+uint64_t page_hash64(const uint8_t* data, size_t len, uint64_t seed) {
+    uint64_t a[4], h;
+
+    hash_lanes(data, len, seed, a);
+    h = rotl(a[0], 1) + rotl(a[1], 7) + rotl(a[2], 12) + rotl(a[3], 18);
+    h = hash_merge(hash_merge(hash_merge(hash_merge(h, a[0]), a[1]), a[2]),
+            a[3]);
+
+    return avalanche(h + len);
+}
+
+// lo is page_hash64(); hi merges the lanes in the opposite order from
+// different rotations, so the halves do not collide together.
+hash128 page_hash128(const uint8_t* data, size_t len, uint64_t seed) {
+    uint64_t a[4], lo, hi;
+
+    hash_lanes(data, len, seed, a);
+    lo = rotl(a[0], 1) + rotl(a[1], 7) + rotl(a[2], 12) + rotl(a[3], 18);
+    lo = hash_merge(hash_merge(hash_merge(hash_merge(lo, a[0]), a[1]),
+                a[2]), a[3]);
+    hi = rotl(a[3], 3) ^ rotl(a[2], 17) ^ rotl(a[1], 29) ^ rotl(a[0], 41);
+    hi = hash_merge(hash_merge(hash_merge(hash_merge(hi, a[3]), a[2]),
+                a[1]), a[0]);
+
+    return { avalanche(lo + len), avalanche(hi*P3 + len + P5) };
+}
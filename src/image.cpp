@@ -0,0 +1,88 @@
+/*
+ *  src/image.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <image.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include <paging.hpp>
+
+
+BootImage::BootImage(const std::string& path) : path(path) {}
+
+BootImage::~BootImage() {
+    if (data)
+        munmap(data, size);
+    if (fd >= 0)
+        close(fd);
+}
+
+// errno is kept aside before perror(), which may change it
+int BootImage::Open() {
+    struct stat st;
+    void* p;
+    int r;
+
+    if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        r = -errno;
+        perror(("BootImage::" + std::string(__func__) + ": open "
+                    + path).c_str());
+        return r;
+    }
+    if (fstat(fd, &st) < 0) {
+        r = -errno;
+        perror(("BootImage::" + std::string(__func__) + ": fstat").c_str());
+        return r;
+    }
+    if (!S_ISREG(st.st_mode) || !st.st_size)
+        return 0;
+
+    p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        r = -errno;
+        perror(("BootImage::" + std::string(__func__) + ": mmap").c_str());
+        return r;
+    }
+    data = static_cast<uint8_t*>(p);
+    size = st.st_size;
+
+    return 0;
+}
+
+int BootImage::MapAt(void* dst, uint64_t offset) const {
+    uint64_t len;
+
+    if (offset >= size || offset % PAGE_SIZE_4KB
+            || reinterpret_cast<uintptr_t>(dst) % PAGE_SIZE_4KB)
+        return -EINVAL;
+    len = (size - offset + PAGE_SIZE_4KB - 1) & ~(PAGE_SIZE_4KB - 1ULL);
+
+    if (mmap(dst, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                offset) == MAP_FAILED) {
+        perror(("BootImage::" + std::string(__func__) + ": mmap").c_str());
+        return -errno;
+    }
+
+    return 0;
+}
+
+
+void print_load_stats(const load_stats& stats) {
+    std::cout << "load: " << stats.ns / 1000 << "us, " << stats.threads
+        << (stats.threads > 1 ? " threads, " : " thread, ") << stats.copied
+        << " bytes copied, " << stats.mapped << " mapped copy-on-write ("
+        << stats.saved << " not copied since)" << std::endl;
+}
@@ -15,6 +15,7 @@
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <cpufeat.hpp>
 
@@ -66,8 +67,8 @@ int KVM::kvmCapCheck() {
 
     if (cap.nr_as == 0) {
         std::cout << "KVM::" << __func__ << ": "
-            << "KVM_CAP_NR_MEMSLOTS unsupported."
-            << " Assume nr_slots = 1."<< '\n';
+            << "KVM_CAP_MULTI_ADDRESS_SPACE unsupported."
+            << " Assume nr_as = 1."<< '\n';
         cap.nr_as = 1;
     }
 
@@ -87,6 +88,31 @@ int KVM::kvmCapCheck() {
     return 0;
 }
 
+int KVM::kvmGetMSRIndexList() {
+    int r;
+    kvm_msr_list probe = {};
+    std::vector<uint32_t> buf;
+
+    // The first call only reports how many indices there are.
+    r = kvmIoctl(KVM_GET_MSR_INDEX_LIST, &probe);
+    if (r < 0 && r != -E2BIG) {
+        perror(("KVM::" + std::string(__func__) + ": kvmIoctl").c_str());
+        return r;
+    }
+
+    buf.resize(1 + probe.nmsrs);
+    buf[0] = probe.nmsrs;
+    r = kvmIoctl(KVM_GET_MSR_INDEX_LIST, buf.data());
+    if (r < 0) {
+        perror(("KVM::" + std::string(__func__) + ": kvmIoctl").c_str());
+        return r;
+    }
+
+    msr_list.assign(buf.begin() + 1, buf.begin() + 1 + buf[0]);
+
+    return 0;
+}
+
 // garbage workaround
 int KVM::getSupportedCPUID(kvm_cpuid2* kvm_cpuid) {
     int r;
@@ -108,10 +134,14 @@ KVM::KVM(int fd) : BaseClass(fd) {
     api_ver = kvmIoctlCtor(KVM_GET_API_VERSION, 0);
     kvmCapCheck();
     mmap_size = kvmIoctlCtor(KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (kvmGetMSRIndexList())
+        throw std::runtime_error("KVM::" + std::string(__func__)
+                + ": KVM_GET_MSR_INDEX_LIST failed");
 
     std::cout << "VMX/SVM detected." << std::endl;
     std::cout << "KVM.api_ver: " << api_ver << std::endl;
     std::cout << "KVM.mmap_size: " << mmap_size << std::endl;
+    std::cout << "KVM.msr_list: " << msr_list.size() << " MSRs" << std::endl;
 
     std::cout << "Constructed KVM." << std::endl;
 }
@@ -5,25 +5,623 @@
  */
 
 
+#include <getopt.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <boot.hpp>
+#include <dirtyrate.hpp>
+#include <fork.hpp>
 #include <kvm.hpp>
+#include <migration.hpp>
+#include <numa.hpp>
+#include <pool.hpp>
+#include <pagestore.hpp>
+#include <rambacking.hpp>
+#include <snapshot.hpp>
+#include <stream.hpp>
+#include <timeline.hpp>
 #include <vcpu.hpp>
 #include <vm.hpp>
 
 
-int main() {
-    int  r;
+static const char kernel_cmdline[] = "console=ttyS0 earlyprintk=serial "
+    "noapic noacpi notsc nowatchdog nmi_watchdog=0 debug apic=debug "
+    "show_lapic=all mitigations=off lapic tsc_early_khz=2000 rdinit=/init "
+    "init=/init -v";
+
+static const char short_options[] =
+    "d::R:t:f:a:D:I:PX:C:B:M:AE::S:b:s:l:L:c:wT:H:F:Q:N:r:m:k:g:u:p:oiK:ey:";
+
+static const option long_options[] = {
+    {"dirty-log", optional_argument, nullptr, 'd'},
+    {"dirty-ring", required_argument, nullptr, 'R'},
+    {"migrate-to", required_argument, nullptr, 't'},
+    {"migrate-from", required_argument, nullptr, 'f'},
+    {"migrate-after", required_argument, nullptr, 'a'},
+    {"downtime-limit", required_argument, nullptr, 'D'},
+    {"max-iterations", required_argument, nullptr, 'I'},
+    {"postcopy", no_argument, nullptr, 'P'},
+    {"xbzrle-cache", required_argument, nullptr, 'X'},
+    {"compress-threads", required_argument, nullptr, 'C'},
+    {"compress-batch", required_argument, nullptr, 'B'},
+    {"multifd", required_argument, nullptr, 'M'},
+    {"auto-converge", no_argument, nullptr, 'A'},
+    {"dirty-rate", optional_argument, nullptr, 'E'},
+    {"dirty-rate-samples", required_argument, nullptr, 'S'},
+    {"bandwidth", required_argument, nullptr, 'b'},
+    {"snapshot-save", required_argument, nullptr, 's'},
+    {"snapshot-load", required_argument, nullptr, 'l'},
+    {"snapshot-layers", required_argument, nullptr, 'L'},
+    {"snapshot-compact", required_argument, nullptr, 'c'},
+    {"snapshot-live", no_argument, nullptr, 'w'},
+    {"snapshot-store", required_argument, nullptr, 'T'},
+    {"hash-threads", required_argument, nullptr, 'H'},
+    {"fork", required_argument, nullptr, 'F'},
+    {"pool", required_argument, nullptr, 'Q'},
+    {"pool-size", required_argument, nullptr, 'N'},
+    {"ready-marker", required_argument, nullptr, 'r'},
+    {"memory", required_argument, nullptr, 'm'},
+    {"mem-bank", required_argument, nullptr, 'k'},
+    {"ram-backing", required_argument, nullptr, 'g'},
+    {"numa", required_argument, nullptr, 'u'},
+    {"prefault", required_argument, nullptr, 'p'},
+    {"prefault-boot", no_argument, nullptr, 'o'},
+    {"map-initramfs", no_argument, nullptr, 'i'},
+    {"kernel", required_argument, nullptr, 'K'},
+    {"boot64", no_argument, nullptr, 'e'},
+    {"timeline", required_argument, nullptr, 'y'},
+    {nullptr, 0, nullptr, 0},
+};
+
+static void usage(const char* prog) {
+    std::cerr << "usage: " << prog << " [options]\n"
+        << "  -d, --dirty-log[=MS]  log dirty RAM pages, "
+        "harvesting every MS milliseconds\n"
+        << "  -R, --dirty-ring=N    track dirty pages with N-entry "
+        "per-vCPU dirty rings\n"
+        << "  -t, --migrate-to=SOCK     boot, then pre-copy the VM to the "
+        "destination listening on SOCK\n"
+        << "  -f, --migrate-from=SOCK   listen on SOCK and run the "
+        "incoming VM\n"
+        << "  -a, --migrate-after=MS    start migrating or saving MS "
+        "milliseconds after boot (1000)\n"
+        << "  -D, --downtime-limit=MS   stop the guest once the rest fits "
+        "in MS milliseconds (300)\n"
+        << "  -I, --max-iterations=N    stop the guest after N pre-copy "
+        "rounds at most (30)\n"
+        << "  -P, --postcopy            with --migrate-to: start the guest "
+        "at the destination first and\n"
+        << "                            let it fetch RAM on demand\n"
+        << "  -X, --xbzrle-cache=MB     send re-dirtied pages as deltas "
+        "against an MB sized cache\n"
+        << "  -C, --compress-threads=N  compress pages on N worker threads\n"
+        << "  -B, --compress-batch=N    hand pages to the workers N at a "
+        "time (64)\n"
+        << "  -M, --multifd=N           send RAM over N parallel "
+        "connections\n"
+        << "  -A, --auto-converge       throttle the vCPUs while the "
+        "guest dirties RAM faster\n"
+        << "                            than it can be sent\n"
+        << "  -E, --dirty-rate[=MS]     estimate the dirty rate and working "
+        "set from sampled pages\n"
+        << "                            every MS milliseconds (1000)\n"
+        << "  -S, --dirty-rate-samples=N  sample N pages per GiB (512)\n"
+        << "  -b, --bandwidth=MB        predict pre-copy at MB MiB/s "
+        "(1024)\n"
+        << "  -s, --snapshot-save=FILE  boot, then stop the guest and save "
+        "it to FILE\n"
+        << "  -l, --snapshot-load=FILE  run the guest saved in FILE\n"
+        << "  -L, --snapshot-layers=N   after --snapshot-save, save N "
+        "layers FILE.1 to FILE.N of\n"
+        << "                            what changed, --migrate-after "
+        "milliseconds apart\n"
+        << "  -c, --snapshot-compact=OUT  merge the --snapshot-load chain "
+        "into one file OUT\n"
+        << "  -w, --snapshot-live       save with --snapshot-save while the "
+        "guest keeps running\n"
+        << "  -T, --snapshot-store=DIR  keep the RAM of --snapshot-save in "
+        "the deduplicating page\n"
+        << "                            store DIR, shared with other "
+        "snapshots\n"
+        << "  -H, --hash-threads=N      hash pages for the store on N "
+        "threads (one per CPU)\n"
+        << "  -F, --fork=N              boot, then clone the guest into N "
+        "copy-on-write children,\n"
+        << "                            run them --migrate-after "
+        "milliseconds and tear them down\n"
+        << "  -Q, --pool=SOCK           keep booted VMs paused and hand "
+        "them out on SOCK\n"
+        << "  -N, --pool-size=M         keep M VMs ready (4)\n"
+        << "  -r, --ready-marker=STR    a pool VM is ready once its console "
+        "printed STR\n"
+        << "                            (Welcome to u-root!)\n"
+        << "  -m, --memory=MB           give the guest MB MiB of RAM (1024);"
+        " what does not fit\n"
+        << "                            below 3GiB goes above 4GiB\n"
+        << "  -k, --mem-bank=MB         register RAM as memslots of at most "
+        "MB MiB\n"
+        << "  -g, --ram-backing=TYPE    back RAM with memfd (default), anon,"
+        " thp, hugetlb[:2M|:1G]\n"
+        << "                            or memfd-hugetlb[:2M|:1G]\n"
+        << "  -u, --numa=NODES          bind memslot i and pin vCPU i to "
+        "host node NODES[i % n];\n"
+        << "                            with -R and -d MS, also prints "
+        "local/remote writes\n"
+        << "  -p, --prefault=THREADS    populate guest RAM with THREADS "
+        "threads before a cold boot\n"
+        << "  -o, --prefault-boot       prefault only what the kernel, "
+        "initramfs and boot\n"
+        << "                            data will be copied to\n"
+        << "  -i, --map-initramfs       map the initramfs copy-on-write "
+        "instead of copying it;\n"
+        << "                            needs -g anon or -g thp\n"
+        << "  -K, --kernel=PATH         boot PATH, a bzImage or a vmlinux "
+        "(bzImage)\n"
+        << "  -e, --boot64              enter the kernel in 64-bit mode; "
+        "a vmlinux is\n"
+        << "                            otherwise entered at its PVH "
+        "note if it has one\n"
+        << "  -y, --timeline=STR        boot, and once the console printed "
+        "STR print when each\n"
+        << "                            startup phase ended as one line "
+        "of JSON, then stop\n";
+}
+
+static int migrate_to(VM* vm, const char* path, int after_ms,
+        migration_config mig_conf, int channels,
+        DirtyRateEstimator* estimator) {
+    int r;
+    std::vector<std::unique_ptr<Stream>> streams;
+    std::vector<Stream*> channel_streams;
+
+    if ((r = vm->Start()))
+        return r;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(after_ms));
+
+    // Sampling would only compete with the migration from here on
+    if (estimator)
+        estimator->Stop();
+
+    if ((r = unix_connect(path, UNIX_CONNECT_TIMEOUT_MS)) < 0)
+        return r;
+
+    Stream out(r);
+
+    for (int i = 0; i < channels; ++i) {
+        if ((r = unix_connect(path, UNIX_CONNECT_TIMEOUT_MS)) < 0)
+            return r;
+        streams.emplace_back(new Stream(r));
+        channel_streams.push_back(streams.back().get());
+    }
+
+    MigrationSource src(vm, &out, mig_conf, channel_streams);
+    if ((r = src.Run())) {
+        std::cerr << "migration failed: " << r << std::endl;
+        return r;
+    }
+
+    print_migration_stats(src.Stats());
+
+    // The guest lives on at the destination; the parked vCPU threads go
+    // away with the process.
+    return 0;
+}
+
+static int migrate_from(VM* vm, const char* path) {
+    int r, listen_fd;
+
+    if ((listen_fd = unix_listen(path)) < 0)
+        return listen_fd;
+
+    if ((r = unix_accept(listen_fd)) < 0) {
+        close(listen_fd);
+        unlink(path);
+        return r;
+    }
+
+    // Still listening, in case the source brings extra channels
+    {
+        Stream in(r);
+        MigrationDestination dst(vm, &in, listen_fd);
+        r = dst.Run();
+        close(listen_fd);
+        unlink(path);
+        if (r) {
+            std::cerr << "incoming migration failed: " << r << std::endl;
+            return r;
+        }
+        if (dst.IsPostcopy())
+            print_postcopy_stats(dst.Stats());
+    }
+
+    return vm->Join();
+}
+
+static int snapshot_save(VM* vm, const char* path, int after_ms,
+        int layers, bool live, const char* store_dir, int hash_threads) {
+    int r;
+    Snapshot snap(vm);
+    std::unique_ptr<PageStore> store;
+    std::string parent(path), layer;
+
+    if (store_dir) {
+        store.reset(new PageStore(store_dir, hash_threads));
+        if ((r = store->Open()))
+            return r;
+        snap.SetStore(store.get());
+    }
+
+    if ((r = vm->Start()))
+        return r;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(after_ms));
+
+    if (live)
+        r = snap.SaveLive(path);
+    else if (!(r = vm->Pause()))
+        r = snap.Save(path);
+    if (r) {
+        std::cerr << "saving the snapshot failed: " << r << std::endl;
+        return r;
+    }
+
+    print_snapshot_stats(snap.Stats());
+
+    if (layers && ((r = snap.StartTracking()) || (r = vm->Resume())))
+        return r;
+
+    for (int i = 1; i <= layers; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(after_ms));
+
+        layer = std::string(path) + "." + std::to_string(i);
+        if ((r = vm->Pause())
+                || (r = snap.Save(layer.c_str(), parent.c_str()))) {
+            std::cerr << "saving layer " << i << " failed: " << r
+                << std::endl;
+            return r;
+        }
+        print_snapshot_stats(snap.Stats());
+        parent = layer;
+
+        if (i < layers && (r = vm->Resume()))
+            return r;
+    }
+
+    return 0;
+}
+
+// The timeline is printed even if the marker never comes, with what it
+// got to. Either way the VM is stopped once it is out.
+static int boot_timeline(VM* vm, const char* marker) {
+    bool seen;
+    int r;
+
+    vm->setConsoleMarker(marker);
+    if ((r = vm->Start()))
+        return r;
+
+    if (!(seen = vm->waitConsoleMarker(TIMELINE_MARKER_TIMEOUT_MS)))
+        std::cerr << "the console did not print \"" << marker << "\" in "
+            << TIMELINE_MARKER_TIMEOUT_MS / 1000 << "s" << std::endl;
+    std::cout << timeline_format(vm->getTimeline()->Events()) << std::endl;
+
+    if ((r = vm->Stop()))
+        return r;
+
+    return seen ? 0 : -ETIMEDOUT;
+}
+
+static int fork_children(KVM* kvm, VM* vm, int n, int after_ms) {
+    int r;
+    VMFork fork(kvm, vm);
+
+    if ((r = vm->Start()))
+        return r;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(after_ms));
+
+    if ((r = fork.Capture()) || (r = fork.Spawn(n))) {
+        std::cerr << "forking the VM failed: " << r << std::endl;
+        return r;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(after_ms));
+
+    fork.Measure();
+    fork.Teardown();
+    print_fork_stats(fork.Stats());
+
+    // The parent stays paused; its vCPU threads go away with the process
+    return 0;
+}
+
+static int run_pool(KVM* kvm, const vm_config& vm_conf, const char* path,
+        pool_config pool_conf) {
+    int r;
+    VMPool pool(kvm, vm_conf, pool_conf);
+
+    if ((r = pool.Run(path))) {
+        std::cerr << "the pool failed: " << r << std::endl;
+        return r;
+    }
+
+    print_pool_stats(pool.Stats());
+
+    return 0;
+}
+
+static int snapshot_load(VM* vm, const char* path) {
+    int r;
+    Snapshot snap(vm);
+
+    if ((r = snap.Load(path))) {
+        std::cerr << "loading the snapshot failed: " << r << std::endl;
+        return r;
+    }
+
+    print_snapshot_stats(snap.Stats());
+
+    if ((r = vm->Start()))
+        return r;
+
+    return vm->Join();
+}
+
+static int snapshot_compact_to(const char* path, const char* out) {
+    int r;
+    snapshot_stats stats;
+
+    if ((r = snapshot_compact(path, out, &stats))) {
+        std::cerr << "compacting the snapshot failed: " << r << std::endl;
+        return r;
+    }
+
+    print_snapshot_stats(stats);
+
+    return 0;
+}
+
+
+int main(int argc, char** argv) {
+    int  r, opt;
     KVM* kvm;
     VM*  vm;
+    bool dirty_log = false;
+    int  dirty_log_interval_ms = 0;
+    uint32_t dirty_ring_entries = 0;
+    const char* migrate_to_path = nullptr;
+    const char* migrate_from_path = nullptr;
+    const char* snapshot_save_path = nullptr;
+    const char* snapshot_load_path = nullptr;
+    const char* snapshot_compact_path = nullptr;
+    int  snapshot_layers = 0;
+    bool snapshot_live = false;
+    const char* snapshot_store_dir = nullptr;
+    int  hash_threads = 0;
+    int  fork_num = 0;
+    uint64_t ram_size = static_cast<uint64_t>(1) << 30;
+    uint64_t mem_bank_size = 0;
+    ram_backing backing;
+    std::vector<int> numa_nodes;
+    int  prefault_threads = 0;
+    bool prefault_boot = false;
+    bool map_initramfs = false;
+    const char* kernel_path = "bzImage";
+    bool boot64 = false;
+    const char* timeline_marker = nullptr;
+    const char* pool_path = nullptr;
+    pool_config pool_conf;
+    int  migrate_after_ms = 1000;
+    int  migrate_channels = 0;
+    int  dirty_rate_ms = 0;
+    uint32_t dirty_rate_samples = DIRTY_RATE_SAMPLES_PER_GB;
+    uint64_t bandwidth = DIRTY_RATE_BANDWIDTH_DEFAULT;
+    std::unique_ptr<DirtyRateEstimator> estimator;
+    migration_config mig_conf;
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options,
+                    nullptr)) != -1) {
+        switch (opt) {
+            case 'd':
+                dirty_log = true;
+                if (optarg)
+                    dirty_log_interval_ms = std::atoi(optarg);
+                break;
+            case 'R':
+                dirty_log = true;
+                dirty_ring_entries = std::strtoul(optarg, nullptr, 0);
+                break;
+            case 't':
+                migrate_to_path = optarg;
+                break;
+            case 'f':
+                migrate_from_path = optarg;
+                break;
+            case 'a':
+                migrate_after_ms = std::atoi(optarg);
+                break;
+            case 'D':
+                mig_conf.downtime_limit_ms = std::atoi(optarg);
+                break;
+            case 'I':
+                mig_conf.max_iterations = std::atoi(optarg);
+                break;
+            case 'P':
+                mig_conf.postcopy = true;
+                break;
+            case 'X':
+                mig_conf.xbzrle_cache_size =
+                    std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 'C':
+                mig_conf.compress_threads = std::atoi(optarg);
+                break;
+            case 'B':
+                mig_conf.compress_batch_pages = std::strtoul(optarg,
+                        nullptr, 0);
+                break;
+            case 'M':
+                migrate_channels = std::atoi(optarg);
+                break;
+            case 'A':
+                mig_conf.auto_converge = true;
+                break;
+            case 'E':
+                dirty_rate_ms = optarg ? std::atoi(optarg)
+                                       : DIRTY_RATE_WINDOW_MS_DEFAULT;
+                break;
+            case 'S':
+                dirty_rate_samples = std::strtoul(optarg, nullptr, 0);
+                break;
+            case 's':
+                snapshot_save_path = optarg;
+                break;
+            case 'l':
+                snapshot_load_path = optarg;
+                break;
+            case 'L':
+                snapshot_layers = std::atoi(optarg);
+                break;
+            case 'c':
+                snapshot_compact_path = optarg;
+                break;
+            case 'w':
+                snapshot_live = true;
+                break;
+            case 'T':
+                snapshot_store_dir = optarg;
+                break;
+            case 'H':
+                hash_threads = std::atoi(optarg);
+                break;
+            case 'F':
+                fork_num = std::atoi(optarg);
+                break;
+            case 'Q':
+                pool_path = optarg;
+                break;
+            case 'N':
+                pool_conf.size = std::atoi(optarg);
+                break;
+            case 'r':
+                pool_conf.marker = optarg;
+                break;
+            case 'm':
+                ram_size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 'k':
+                mem_bank_size = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            case 'g':
+                if (ram_backing_parse(optarg, &backing)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'u':
+                if (numa_parse_nodes(optarg, &numa_nodes)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'p':
+                prefault_threads = std::atoi(optarg);
+                break;
+            case 'o':
+                prefault_boot = true;
+                break;
+            case 'i':
+                map_initramfs = true;
+                break;
+            case 'K':
+                kernel_path = optarg;
+                break;
+            case 'e':
+                boot64 = true;
+                break;
+            case 'y':
+                timeline_marker = optarg;
+                break;
+            case 'b':
+                bandwidth = std::strtoull(optarg, nullptr, 0) << 20;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (mig_conf.xbzrle_cache_size && mig_conf.compress_threads) {
+        std::cerr << "--xbzrle-cache and --compress-threads are exclusive"
+            << std::endl;
+        return -1;
+    }
+
+    if (migrate_channels < 0 || migrate_channels > MIG_MAX_CHANNELS
+            || (migrate_channels && (mig_conf.postcopy
+                    || mig_conf.xbzrle_cache_size
+                    || mig_conf.compress_threads))) {
+        std::cerr << "--multifd takes up to " << MIG_MAX_CHANNELS
+            << " channels and excludes --postcopy, --xbzrle-cache and "
+            "--compress-threads" << std::endl;
+        return -1;
+    }
+
+    if (snapshot_live && snapshot_layers) {
+        std::cerr << "--snapshot-live and --snapshot-layers are exclusive"
+            << std::endl;
+        return -1;
+    }
+
+    if (pool_path && pool_conf.size < 1) {
+        std::cerr << "--pool-size must be at least 1" << std::endl;
+        return -1;
+    }
+
+    if (snapshot_store_dir && snapshot_live) {
+        std::cerr << "--snapshot-store does not work with --snapshot-live"
+            << std::endl;
+        return -1;
+    }
+
+    // Needs no VM
+    if (snapshot_compact_path) {
+        if (!snapshot_load_path) {
+            std::cerr << "--snapshot-compact needs --snapshot-load"
+                << std::endl;
+            return -1;
+        }
+        return snapshot_compact_to(snapshot_load_path,
+                snapshot_compact_path) ? -1 : 0;
+    }
+
     vm_config vm_conf {
         .vcpu_num = 1,
-        .ram_size = static_cast<uint64_t>(1) << 30,
-        .kernel_path = "bzImage",
+        .ram_size = ram_size,
+        .kernel_path = kernel_path,
         .initramfs_path = "initramfs",
-        .is_64bit_boot = false,
+        .is_64bit_boot = boot64,
+        .dirty_log = dirty_log,
+        .dirty_log_interval_ms = dirty_log_interval_ms,
+        .dirty_ring_entries = dirty_ring_entries,
+        .mem_bank_size = mem_bank_size,
+        .backing = backing,
+        .numa_nodes = numa_nodes,
+        .prefault_threads = prefault_boot && !prefault_threads
+                                ? 1 : prefault_threads,
+        .prefault_boot = prefault_boot,
+        .map_initramfs = map_initramfs,
     };
 
     r = KVM::getKVMFD();
@@ -31,6 +629,13 @@ int main() {
         return -1;
 
     kvm = new KVM(r);
+
+    // Every VM comes from the pool
+    if (pool_path) {
+        pool_conf.cmdline = kernel_cmdline;
+        return run_pool(kvm, vm_conf, pool_path, pool_conf) ? -1 : 0;
+    }
+
     r = kvm->kvmCreateVM(&vm, vm_conf);
     if (r < 0) {
         std::cerr << "kvm->kvmCreateVM() failed" << std::endl;
@@ -43,13 +648,50 @@ int main() {
         return -1;
     }
 
+    // RAM, registers and devices all come from the source
+    if (migrate_from_path)
+        return migrate_from(vm, migrate_from_path) ? -1 : 0;
+    if (snapshot_load_path)
+        return snapshot_load(vm, snapshot_load_path) ? -1 : 0;
+
     //r = vm->initRAM("console=ttyS0 earlyprintk=serial noapic noacpi notsc nowatchdog nmi_watchdog=0 debug apic=debug show_lapic=all mitigations=off lapic tsc_early_khz=2000 dyndbg=\"file arch/x86/kernel/smpboot.c +plf ; file drivers/net/virtio_net.c +plf\" pci=realloc=off virtio_pci.force_legacy=1 rdinit=/init init=/init");
-    r = vm->initRAM("console=ttyS0 earlyprintk=serial noapic noacpi notsc nowatchdog nmi_watchdog=0 debug apic=debug show_lapic=all mitigations=off lapic tsc_early_khz=2000 rdinit=/init init=/init -v");
+    r = vm->initRAM(kernel_cmdline);
     if (r) {
         std::cerr << "vm->initRAM() failed" << std::endl;
         return -1;
     }
 
+    if (dirty_rate_ms > 0) {
+        dirty_rate_config dr_conf;
+
+        dr_conf.window_ms = dirty_rate_ms;
+        dr_conf.samples_per_gb = dirty_rate_samples;
+        estimator.reset(new DirtyRateEstimator(
+                    static_cast<uint8_t*>(vm->ram_start), vm_conf.ram_size,
+                    dr_conf));
+        estimator->Start([bandwidth, mig_conf](
+                    const dirty_rate_estimate& est) {
+            print_dirty_rate(est, predict_downtime(est, bandwidth,
+                        mig_conf.downtime_limit_ms, mig_conf.max_iterations),
+                    bandwidth);
+        });
+    }
+
+    if (fork_num > 0)
+        return fork_children(kvm, vm, fork_num, migrate_after_ms) ? -1 : 0;
+
+    if (snapshot_save_path)
+        return snapshot_save(vm, snapshot_save_path, migrate_after_ms,
+                snapshot_layers, snapshot_live, snapshot_store_dir,
+                hash_threads) ? -1 : 0;
+
+    if (migrate_to_path)
+        return migrate_to(vm, migrate_to_path, migrate_after_ms, mig_conf,
+                migrate_channels, estimator.get()) ? -1 : 0;
+
+    if (timeline_marker)
+        return boot_timeline(vm, timeline_marker) ? -1 : 0;
+
     r = vm->Boot();
 
     return 0;
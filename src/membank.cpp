@@ -0,0 +1,105 @@
+/*
+ *  src/membank.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <membank.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <boot.hpp>
+#include <paging.hpp>
+
+
+int membank_layout(uint64_t ram_size, uint64_t bank_size,
+        uint32_t max_slots, std::vector<mem_bank>* banks) {
+    uint64_t offset = 0, gpa = 0, end, size;
+
+    banks->clear();
+
+    if (ram_size == 0 || ram_size % MEMBANK_ALIGN
+            || bank_size % MEMBANK_ALIGN) {
+        std::cerr << "membank_layout: RAM and bank sizes must be multiples"
+            " of " << MEMBANK_ALIGN << " bytes" << std::endl;
+        return -EINVAL;
+    }
+
+    while (offset < ram_size) {
+        if (gpa == MEMBANK_HOLE_START)
+            gpa = MEMBANK_HIGH_BASE;
+        end = gpa < MEMBANK_HOLE_START ? MEMBANK_HOLE_START : UINT64_MAX;
+
+        size = std::min(ram_size - offset, end - gpa);
+        if (bank_size)
+            size = std::min(size, bank_size);
+
+        if (banks->size() >= max_slots) {
+            std::cerr << "membank_layout: " << ram_size << " bytes take "
+                "more than " << max_slots << " memslots" << std::endl;
+            banks->clear();
+            return -EINVAL;
+        }
+        banks->push_back({ static_cast<uint32_t>(banks->size()), gpa, size,
+                offset });
+
+        gpa += size;
+        offset += size;
+    }
+
+    return 0;
+}
+
+uint64_t membank_offset(const std::vector<mem_bank>& banks, uint64_t gpa,
+        uint64_t len) {
+    for (const mem_bank& b : banks) {
+        if (gpa >= b.gpa && gpa - b.gpa < b.size)
+            return len <= b.size - (gpa - b.gpa) ? b.offset + gpa - b.gpa
+                                                 : MEMBANK_NONE;
+    }
+
+    return MEMBANK_NONE;
+}
+
+int membank_e820(const std::vector<mem_bank>& banks,
+        std::vector<e820entry>* map) {
+    auto add = [map](uint64_t addr, uint64_t size, uint32_t type) {
+        if (!map->empty() && map->back().type == type
+                && map->back().addr + map->back().size == addr)
+            map->back().size += size;
+        else
+            map->push_back({ addr, size, type });
+    };
+
+    map->clear();
+
+    for (const mem_bank& b : banks) {
+        if (b.gpa == 0 && b.size > HIGHMEM_BASE) {
+            add(REALMODE_IVT_START, EBDA_START - REALMODE_IVT_START,
+                    BOOT_E820_TYPE_RAM);
+            add(EBDA_START, VGARAM_START - EBDA_START,
+                    BOOT_E820_TYPE_RESERVED);
+            add(MBBIOS_START, MBBIOS_SIZE, BOOT_E820_TYPE_RESERVED);
+            add(HIGHMEM_BASE, b.size - HIGHMEM_BASE, BOOT_E820_TYPE_RAM);
+        } else {
+            add(b.gpa, b.size, BOOT_E820_TYPE_RAM);
+        }
+
+        // Banks are in guest physical order; the hole comes right after
+        // the last one below it
+        if (b.gpa < MEMBANK_HIGH_BASE && (&b == &banks.back()
+                    || (&b)[1].gpa >= MEMBANK_HIGH_BASE))
+            add(TSS_BASE, IDENTITY_MAP_BASE + PAGE_SIZE_4KB - TSS_BASE,
+                    BOOT_E820_TYPE_RESERVED);
+    }
+
+    if (map->size() > BOOT_E820_MAP_MAX)
+        return -E2BIG;
+
+    return 0;
+}
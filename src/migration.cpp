@@ -0,0 +1,1402 @@
+/*
+ *  src/migration.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <migration.hpp>
+
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <compress.hpp>
+#include <dirty.hpp>
+#include <pipeline.hpp>
+#include <stream.hpp>
+#include <util.hpp>
+#include <vcpu.hpp>
+#include <vm.hpp>
+#include <zeropage.hpp>
+
+
+static uint64_t ms_since(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - t).count();
+}
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+MigrationSource::MigrationSource(VM* vm, Stream* out, migration_config conf,
+        std::vector<Stream*> streams)
+        : vm(vm), out(out), conf(conf),
+          npages(vm->getConfig().ram_size / MIG_PAGE_SIZE),
+          to_send(npages), channels(streams.size()) {
+    batch.reserve(MIG_BATCH_PAGES*(sizeof(mig_page_hdr) + MIG_PAGE_SIZE));
+
+    for (size_t i = 0; i < streams.size(); ++i) {
+        channels[i].stream = streams[i];
+        channels[i].batch.reserve(MIG_BATCH_PAGES*(sizeof(mig_page_hdr)
+                    + MIG_PAGE_SIZE));
+    }
+
+    if (conf.xbzrle_cache_size && !conf.postcopy) {
+        cache.reset(new PageCache(conf.xbzrle_cache_size / MIG_PAGE_SIZE));
+        xbzrle_page.reset(new uint8_t[MIG_PAGE_SIZE]);
+        xbzrle_delta.reset(new uint8_t[MIG_PAGE_SIZE]);
+
+        std::cout << "MigrationSource: XBZRLE cache of "
+            << cache->Capacity() << " pages" << std::endl;
+    }
+
+    if (conf.compress_threads > 0 && !conf.postcopy) {
+        compress_workers.resize(conf.compress_threads);
+        for (compress_worker& w : compress_workers)
+            w.table.reset(new uint16_t[LZ_HASH_ENTRIES]);
+
+        pipeline.reset(new PagePipeline(conf.compress_threads,
+                    conf.compress_batch_pages,
+                    [this](int worker, uint64_t index,
+                        std::vector<uint8_t>* out) {
+                        CompressPage(worker, index, out);
+                    },
+                    [this](const page_batch& batch) {
+                        stats.pages_sent += batch.pages.size();
+                        return SendRecord(MIG_REC_PAGES, batch.pages.size(),
+                                batch.out.data(), batch.out.size());
+                    }));
+
+        std::cout << "MigrationSource: compressing with "
+            << conf.compress_threads << " threads, "
+            << pipeline->BatchPages() << " pages per batch" << std::endl;
+    }
+}
+
+MigrationSource::~MigrationSource() {
+    StopChannels(false);
+}
+
+// Runs on a pipeline worker. out keeps its capacity from batch to batch,
+// so growing it here does not allocate after the first few batches.
+void MigrationSource::CompressPage(int worker, uint64_t index,
+        std::vector<uint8_t>* out) {
+    int len;
+    compress_worker& w = compress_workers[worker];
+    const uint8_t* page = static_cast<const uint8_t*>(vm->ram_start)
+                        + index*MIG_PAGE_SIZE;
+    size_t pos = out->size();
+    uint8_t* payload;
+    mig_page_hdr hdr = {
+        .index = index,
+        .len = 0,
+        .enc = MIG_PAGE_ZERO,
+        .padding = {0},
+    };
+
+    out->resize(pos + sizeof(hdr) + MIG_PAGE_SIZE);
+    payload = out->data() + pos + sizeof(hdr);
+
+    if (is_zero_page(page)) {
+        w.zero++;
+    } else if ((len = lz_compress(page, MIG_PAGE_SIZE, payload,
+                    MIG_PAGE_SIZE - 1, w.table.get())) >= 0) {
+        hdr.enc = MIG_PAGE_LZ;
+        hdr.len = len;
+        w.lz++;
+        w.lz_bytes += len;
+    } else {
+        hdr.enc = MIG_PAGE_RAW;
+        hdr.len = MIG_PAGE_SIZE;
+        std::memcpy(payload, page, MIG_PAGE_SIZE);
+        w.overflows++;
+    }
+
+    std::memcpy(out->data() + pos, &hdr, sizeof(hdr));
+    out->resize(pos + sizeof(hdr) + hdr.len);
+}
+
+void MigrationSource::CollectCompressStats() {
+    const pipeline_stats& ps = pipeline->Stats();
+
+    stats.zero_pages = stats.lz_pages = stats.lz_bytes = 0;
+    stats.lz_overflows = stats.lz_worker_ns = 0;
+    for (const compress_worker& w : compress_workers) {
+        stats.zero_pages += w.zero;
+        stats.lz_pages += w.lz;
+        stats.lz_bytes += w.lz_bytes;
+        stats.lz_overflows += w.overflows;
+    }
+    for (uint64_t ns : ps.worker_busy_ns)
+        stats.lz_worker_ns += ns;
+    stats.lz_writer_stall_ns = ps.writer_stall_ns;
+    stats.lz_scanner_stall_ns = ps.scanner_stall_ns;
+}
+
+int MigrationSource::SendRecord(uint32_t type, uint64_t arg,
+        const void* data, uint32_t len) {
+    int r;
+    mig_record rec = { .type = type, .len = len, .arg = arg };
+
+    if ((r = out->Write(&rec, sizeof(rec))))
+        return r;
+    if (len && (r = out->Write(data, len)))
+        return r;
+
+    return 0;
+}
+
+int MigrationSource::SendHeader() {
+    mig_header hdr = {
+        .magic = MIG_MAGIC,
+        .version = MIG_VERSION,
+        .vcpu_num = static_cast<uint32_t>(vm->getVcpuNum()),
+        .channels = static_cast<uint32_t>(channels.size()),
+        .ram_size = vm->getConfig().ram_size,
+    };
+
+    return out->Write(&hdr, sizeof(hdr));
+}
+
+int MigrationSource::FlushPages() {
+    int r;
+
+    if (!batch_pages)
+        return 0;
+
+    r = SendRecord(MIG_REC_PAGES, batch_pages, batch.data(), batch.size());
+    stats.pages_sent += batch_pages;
+    batch.clear();
+    batch_pages = 0;
+
+    return r;
+}
+
+// Returns what to send for page and sets hdr to match. The cache must hold
+// exactly what the destination ends up with, but the guest keeps writing,
+// so everything is done on a private copy.
+const uint8_t* MigrationSource::EncodeDelta(uint64_t index,
+        const uint8_t* page, mig_page_hdr* hdr) {
+    int len;
+    uint8_t* cached;
+    uint8_t* copy = xbzrle_page.get();
+    std::chrono::steady_clock::time_point start;
+
+    std::memcpy(copy, page, MIG_PAGE_SIZE);
+
+    if (!(cached = cache->Lookup(index))) {
+        cache->Insert(index, copy);
+        return copy;
+    }
+
+    start = std::chrono::steady_clock::now();
+    len = xbzrle_encode(cached, copy, xbzrle_delta.get(), MIG_PAGE_SIZE - 1);
+    stats.xbzrle_encode_ns += std::chrono::duration_cast<
+        std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    stats.xbzrle_encode_pages++;
+
+    std::memcpy(cached, copy, MIG_PAGE_SIZE);
+
+    if (len < 0) {
+        stats.xbzrle_overflows++;
+        return copy;
+    }
+
+    hdr->enc = MIG_PAGE_XBZRLE;
+    hdr->len = len;
+    stats.xbzrle_pages++;
+    stats.xbzrle_bytes += len;
+
+    return xbzrle_delta.get();
+}
+
+int MigrationSource::SendPage(uint64_t index) {
+    const uint8_t* page = static_cast<const uint8_t*>(vm->ram_start)
+                        + index*MIG_PAGE_SIZE;
+    const uint8_t* payload = page;
+    mig_page_hdr hdr = {
+        .index = index,
+        .len = static_cast<uint32_t>(MIG_PAGE_SIZE),
+        .enc = MIG_PAGE_RAW,
+        .padding = {0},
+    };
+
+    if (is_zero_page(page)) {
+        hdr.enc = MIG_PAGE_ZERO;
+        hdr.len = 0;
+        stats.zero_pages++;
+        if (cache)
+            cache->Erase(index);
+    } else if (cache && stats.iterations) {
+        // The first round only fills the destination; deltas pay off for
+        // pages that keep coming back.
+        payload = EncodeDelta(index, page, &hdr);
+    }
+
+    batch.insert(batch.end(), reinterpret_cast<uint8_t*>(&hdr),
+            reinterpret_cast<uint8_t*>(&hdr) + sizeof(hdr));
+    batch.insert(batch.end(), payload, payload + hdr.len);
+
+    if (++batch_pages == MIG_BATCH_PAGES)
+        return FlushPages();
+
+    return 0;
+}
+
+int MigrationSource::SendAll() {
+    int r;
+
+    if (!channels.empty())
+        return SendChannels(true);
+
+    if (pipeline) {
+        return pipeline->Run([this](const std::function<void(uint64_t)>& emit) {
+            for (uint64_t i = 0; i < npages; ++i)
+                emit(i);
+        });
+    }
+
+    for (uint64_t i = 0; i < npages; ++i) {
+        if ((r = SendPage(i)))
+            return r;
+    }
+
+    return FlushPages();
+}
+
+int MigrationSource::SendDirty() {
+    int r;
+
+    if (!channels.empty())
+        return SendChannels(false);
+
+    if (pipeline) {
+        r = pipeline->Run([this](const std::function<void(uint64_t)>& emit) {
+            for (const dirty_run& run : to_send) {
+                for (uint64_t i = run.first; i < run.first + run.npages; ++i)
+                    emit(i);
+            }
+        });
+        to_send.Clear();
+        return r;
+    }
+
+    for (const dirty_run& run : to_send) {
+        for (uint64_t i = run.first; i < run.first + run.npages; ++i) {
+            if ((r = SendPage(i)))
+                return r;
+        }
+    }
+    to_send.Clear();
+
+    return FlushPages();
+}
+
+// Folds the pages dirtied since the previous call into to_send, so pages
+// that were harvested but not yet sent are never lost.
+int MigrationSource::Collect() {
+    int r;
+    DirtyTracker* tracker = vm->getDirtyTracker();
+    std::lock_guard<std::mutex> lk(tracker->mtx);
+
+    if ((r = tracker->Harvest()) < 0)
+        return r;
+
+    const uint64_t* src = tracker->Bitmap().Data();
+    uint64_t* dst = to_send.Data();
+    uint64_t n = std::min(tracker->Bitmap().NumWords(), to_send.NumWords());
+
+    for (uint64_t i = 0; i < n; ++i)
+        dst[i] |= src[i];
+
+    return 0;
+}
+
+int MigrationSource::SendState() {
+    int r;
+    std::vector<uint8_t> buf;
+    vm_device_state devices;
+
+    for (int i = 0; i < vm->getVcpuNum(); ++i) {
+        Vcpu* vcpu = vm->getVcpu(i);
+        uint64_t us;
+
+        if ((r = vcpu->SaveState(&buf)))
+            return r;
+        us = vcpu->LastSaveNs() / 1000;
+        stats.vcpu_state_bytes += buf.size();
+        stats.vcpu_save_us += us;
+        stats.vcpu_save_max_us = std::max(stats.vcpu_save_max_us, us);
+        if ((r = SendRecord(MIG_REC_VCPU, i, buf.data(), buf.size())))
+            return r;
+    }
+
+    if ((r = vm->saveDeviceState(&devices)))
+        return r;
+
+    return SendRecord(MIG_REC_DEVICES, 0, &devices, sizeof(devices));
+}
+
+int MigrationSource::WaitResumed() {
+    int r;
+    mig_record rec;
+
+    if ((r = out->Read(&rec, sizeof(rec))))
+        return r;
+
+    if (rec.type != MIG_REC_RESUMED) {
+        std::cerr << "MigrationSource::" << __func__
+            << ": unexpected record " << rec.type << std::endl;
+        return -EPROTO;
+    }
+
+    return 0;
+}
+
+uint64_t MigrationSource::BytesSent() const {
+    uint64_t n = out->BytesWritten();
+
+    for (const send_channel& ch : channels)
+        n += ch.stream->BytesWritten();
+
+    return n;
+}
+
+int MigrationSource::StartChannels() {
+    int r;
+
+    for (size_t i = 0; i < channels.size(); ++i) {
+        mig_record rec = { .type = MIG_REC_CHANNEL, .len = 0, .arg = i };
+
+        if ((r = channels[i].stream->Write(&rec, sizeof(rec)))
+                || (r = channels[i].stream->Flush()))
+            return r;
+    }
+
+    for (size_t i = 0; i < channels.size(); ++i)
+        channels[i].thread = std::thread(&MigrationSource::ChannelLoop, this,
+                i);
+
+    if (!channels.empty())
+        std::cout << "MigrationSource::" << __func__ << ": sending RAM over "
+            << channels.size() << " channels" << std::endl;
+
+    return 0;
+}
+
+// Ends every channel with MIG_REC_END if ok. Otherwise the sockets are
+// shut down, so that no sender stays blocked on a peer that went away.
+int MigrationSource::StopChannels(bool ok) {
+    int r = 0;
+    mig_record rec = { .type = MIG_REC_END, .len = 0, .arg = 0 };
+
+    {
+        std::lock_guard<std::mutex> lk(chan_mtx);
+        if (chan_stop)
+            return 0;
+        chan_stop = true;
+    }
+    chan_cv.notify_all();
+
+    for (send_channel& ch : channels) {
+        if (!ok)
+            shutdown(ch.stream->Fd(), SHUT_RDWR);
+        if (ch.thread.joinable())
+            ch.thread.join();
+        if (ok && !r && !(r = ch.stream->Write(&rec, sizeof(rec))))
+            r = ch.stream->Flush();
+    }
+
+    return r;
+}
+
+// Sends one round over every channel and returns once all have synced,
+// then tells the destination on out.
+int MigrationSource::SendChannels(bool all) {
+    int r;
+    uint64_t pages_before = 0, zero_before = 0, pages = 0, zero = 0;
+    std::chrono::steady_clock::time_point last;
+    std::unique_lock<std::mutex> lk(chan_mtx);
+
+    for (const send_channel& ch : channels) {
+        pages_before += ch.stats.pages;
+        zero_before += ch.stats.zero_pages;
+    }
+
+    chan_all = all;
+    chan_word = 0;
+    chan_busy = channels.size();
+    chan_round++;
+    chan_cv.notify_all();
+    chan_done_cv.wait(lk, [this] { return chan_busy == 0; });
+
+    if ((r = chan_error))
+        return r;
+
+    last = channels[0].done_at;
+    for (const send_channel& ch : channels)
+        last = std::max(last, ch.done_at);
+
+    // Whatever a channel spends waiting here is imbalance
+    for (send_channel& ch : channels) {
+        ch.stats.wait_ns += std::chrono::duration_cast<
+            std::chrono::nanoseconds>(last - ch.done_at).count();
+        pages += ch.stats.pages;
+        zero += ch.stats.zero_pages;
+    }
+    stats.pages_sent += pages - pages_before;
+    stats.zero_pages += zero - zero_before;
+    lk.unlock();
+
+    if (!all)
+        to_send.Clear();
+
+    return SendRecord(MIG_REC_SYNC, chan_round, nullptr, 0);
+}
+
+void MigrationSource::ChannelLoop(int id) {
+    int r;
+    uint64_t round = 0;
+    send_channel& ch = channels[id];
+    std::unique_lock<std::mutex> lk(chan_mtx);
+
+    while (true) {
+        chan_cv.wait(lk, [&] { return chan_stop || chan_round != round; });
+        if (chan_stop)
+            return;
+        round = chan_round;
+
+        lk.unlock();
+        r = ChannelSend(&ch, round);
+        lk.lock();
+
+        ch.done_at = std::chrono::steady_clock::now();
+        if (r && !chan_error)
+            chan_error = r;
+        if (--chan_busy == 0)
+            chan_done_cv.notify_all();
+    }
+}
+
+int MigrationSource::ChannelFlush(send_channel* ch) {
+    int r;
+    uint64_t start = now_ns();
+    mig_record rec = {
+        .type = MIG_REC_PAGES,
+        .len = static_cast<uint32_t>(ch->batch.size()),
+        .arg = ch->batch_pages,
+    };
+
+    if (!ch->batch_pages)
+        return 0;
+
+    if (!(r = ch->stream->Write(&rec, sizeof(rec))))
+        r = ch->stream->Write(ch->batch.data(), ch->batch.size());
+    ch->stats.send_ns += now_ns() - start;
+    ch->batch.clear();
+    ch->batch_pages = 0;
+
+    return r;
+}
+
+// Claims one bitmap word at a time, so a channel that is held up by its
+// socket simply ends up with fewer pages this round.
+int MigrationSource::ChannelSend(send_channel* ch, uint64_t round) {
+    int r;
+    uint64_t wi, w, index, start;
+    uint64_t nwords = to_send.NumWords();
+    const uint64_t* words = to_send.Data();
+    const uint8_t* ram = static_cast<const uint8_t*>(vm->ram_start);
+    mig_record rec = { .type = MIG_REC_SYNC, .len = 0, .arg = round };
+
+    while ((wi = chan_word.fetch_add(1, std::memory_order_relaxed))
+            < nwords) {
+        w = chan_all ? ~0ULL : words[wi];
+        while (w) {
+            index = wi*DIRTY_WORD_BITS + __builtin_ctzll(w);
+            w &= w - 1;
+            if (index >= npages)
+                break;
+
+            const uint8_t* page = ram + index*MIG_PAGE_SIZE;
+            mig_page_hdr hdr = {
+                .index = index,
+                .len = static_cast<uint32_t>(MIG_PAGE_SIZE),
+                .enc = MIG_PAGE_RAW,
+                .padding = {0},
+            };
+
+            if (is_zero_page(page)) {
+                hdr.enc = MIG_PAGE_ZERO;
+                hdr.len = 0;
+                ch->stats.zero_pages++;
+            }
+
+            ch->batch.insert(ch->batch.end(),
+                    reinterpret_cast<uint8_t*>(&hdr),
+                    reinterpret_cast<uint8_t*>(&hdr) + sizeof(hdr));
+            ch->batch.insert(ch->batch.end(), page, page + hdr.len);
+            ch->stats.pages++;
+
+            if (++ch->batch_pages == MIG_BATCH_PAGES
+                    && (r = ChannelFlush(ch)))
+                return r;
+        }
+    }
+
+    if ((r = ChannelFlush(ch)))
+        return r;
+
+    start = now_ns();
+    if (!(r = ch->stream->Write(&rec, sizeof(rec))))
+        r = ch->stream->Flush();
+    ch->stats.send_ns += now_ns() - start;
+
+    return r;
+}
+
+uint64_t MigrationSource::ThrottledNs() const {
+    uint64_t ns = 0;
+
+    for (int i = 0; i < vm->getVcpuNum(); ++i)
+        ns += vm->getVcpu(i)->ThrottledNs();
+
+    return ns;
+}
+
+// Called after every round but the first, which sent all of RAM
+int MigrationSource::Converge(uint64_t sent, uint64_t dirtied) {
+    int pct = vm->getThrottle();
+
+    if (dirtied*100 <= sent*MIG_THROTTLE_TRIGGER_PCT) {
+        dirty_rate_high = 0;
+        return 0;
+    }
+    if (++dirty_rate_high < 2)
+        return 0;
+
+    dirty_rate_high = 0;
+    pct = pct ? std::min(pct + conf.throttle_step_pct, VCPU_THROTTLE_MAX_PCT)
+              : conf.throttle_initial_pct;
+
+    return vm->setThrottle(pct);
+}
+
+int MigrationSource::Run() {
+    int r, stop_r;
+    uint64_t throttled_ns = ThrottledNs();
+
+    if (conf.postcopy)
+        return RunPostcopy();
+
+    if ((r = StartChannels()))
+        return r;
+    r = RunPrecopy();
+    stop_r = StopChannels(!r);
+
+    // Past the pause, or failed and the guest carries on here
+    if (vm->getThrottle()) {
+        stats.throttled_ms = (ThrottledNs() - throttled_ns) / 1000000;
+        vm->setThrottle(0);
+    }
+
+    return r ? r : stop_r;
+}
+
+int MigrationSource::RunPrecopy() {
+    int r;
+    uint64_t iter_bytes, iter_pages, iter_us, remaining, expected_ms;
+    uint64_t throttled_ns = ThrottledNs();
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point iter_start, pause_start;
+
+    // A periodic harvester would steal the bits this loop depends on
+    if (vm->getDirtyTracker())
+        vm->getDirtyTracker()->StopPeriodic();
+    if ((r = vm->enableDirtyLog(true)))
+        return r;
+
+    // Anything dirtied so far is covered by the first full pass
+    if ((r = Collect()))
+        return r;
+    to_send.Clear();
+
+    // The destination only accepts the channels once it has this
+    if ((r = SendHeader()) || (r = out->Flush()))
+        return r;
+
+    while (true) {
+        iter_start = std::chrono::steady_clock::now();
+        iter_bytes = BytesSent();
+        iter_pages = stats.pages_sent;
+
+        r = stats.iterations ? SendDirty() : SendAll();
+        if (r || (r = SendRecord(MIG_REC_ITER_END, stats.iterations,
+                        nullptr, 0)) || (r = out->Flush()))
+            return r;
+
+        iter_bytes = BytesSent() - iter_bytes;
+        iter_pages = stats.pages_sent - iter_pages;
+        iter_us = std::max<uint64_t>(1,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - iter_start).count());
+        stats.bandwidth = iter_bytes*1000000 / iter_us;
+        stats.iterations++;
+
+        if ((r = Collect()))
+            return r;
+
+        // Zero pages and deltas make the cost per page vary a lot, so
+        // extrapolate from what a page took last round, not from its size.
+        remaining = to_send.Count();
+        expected_ms = iter_pages ? remaining*iter_us / iter_pages / 1000 : 0;
+
+        std::cout << "MigrationSource::" << __func__ << ": iteration "
+            << stats.iterations << ": " << iter_pages << " pages, "
+            << iter_bytes << " bytes in " << iter_us / 1000 << "ms, "
+            << remaining << " pages dirty, ~" << expected_ms
+            << "ms to finish";
+        if (conf.auto_converge)
+            std::cout << ", throttle " << vm->getThrottle() << "%";
+        std::cout << std::endl;
+
+        if (expected_ms <= static_cast<uint64_t>(conf.downtime_limit_ms)
+                || stats.iterations >= static_cast<uint64_t>(
+                    conf.max_iterations))
+            break;
+
+        if (conf.auto_converge && stats.iterations > 1
+                && (r = Converge(iter_pages, remaining)))
+            return r;
+    }
+
+    // What the throttle cost the guest while it was still running here
+    if (conf.auto_converge) {
+        stats.throttle_pct = vm->getThrottle();
+        stats.guest_run_pct = 100 - (ThrottledNs() - throttled_ns)*100
+            / std::max<uint64_t>(1, vm->getVcpuNum()*ms_since(start)*1000000);
+    }
+
+    pause_start = std::chrono::steady_clock::now();
+    if ((r = vm->Pause()))
+        return r;
+
+    if ((r = Collect()))
+        return r;
+    stats.final_dirty_pages = to_send.Count();
+
+    if ((r = SendDirty()) || (r = SendState())
+            || (r = SendRecord(MIG_REC_END, 0, nullptr, 0))
+            || (r = out->Flush()))
+        return r;
+
+    if ((r = WaitResumed()))
+        return r;
+
+    if (cache) {
+        stats.xbzrle_hits = cache->Stats().hits;
+        stats.xbzrle_misses = cache->Stats().misses;
+    }
+    if (pipeline)
+        CollectCompressStats();
+    for (const send_channel& ch : channels) {
+        stats.channels.push_back(ch.stats);
+        stats.channels.back().bytes = ch.stream->BytesWritten();
+    }
+    stats.downtime_ms = ms_since(pause_start);
+    stats.total_ms = ms_since(start);
+    stats.bytes_sent = BytesSent();
+
+    return 0;
+}
+
+
+void MigrationSource::RequestLoop() {
+    int r;
+    mig_record rec;
+
+    while (true) {
+        r = out->Read(&rec, sizeof(rec));
+
+        std::lock_guard<std::mutex> lk(req_mtx);
+        if (!r && rec.type == MIG_REC_PAGE_REQ) {
+            requests.push_back(rec.arg);
+        } else if (!r && rec.type == MIG_REC_RESUMED) {
+            resumed_at = std::chrono::steady_clock::now();
+        } else {
+            if (!r && rec.type != MIG_REC_END)
+                r = -EPROTO;
+            peer_error = r;
+            peer_done = true;
+        }
+        req_cv.notify_all();
+
+        if (peer_done)
+            return;
+    }
+}
+
+int MigrationSource::RunPostcopy() {
+    int r;
+    uint64_t next = 0, queued = 0, index = 0;
+    bool requested;
+    DirtyBitmap sent(npages);
+    auto start = std::chrono::steady_clock::now();
+
+    if ((r = SendHeader()))
+        return r;
+
+    if ((r = vm->Pause()))
+        return r;
+
+    if ((r = SendState())
+            || (r = SendRecord(MIG_REC_POSTCOPY, 0, nullptr, 0))
+            || (r = out->Flush()))
+        return r;
+
+    std::thread reader(&MigrationSource::RequestLoop, this);
+
+    while (queued < npages) {
+        {
+            std::lock_guard<std::mutex> lk(req_mtx);
+            if ((r = peer_error) || peer_done)
+                break;
+            requested = !requests.empty();
+            if (requested) {
+                index = requests.front();
+                requests.pop_front();
+            }
+        }
+
+        if (requested) {
+            if (index >= npages || sent.Test(index))
+                continue;
+            stats.pages_requested++;
+        } else {
+            while (sent.Test(next))
+                ++next;
+            index = next;
+        }
+
+        sent.Set(index);
+        queued++;
+        if ((r = SendPage(index)))
+            break;
+
+        // A vCPU is stalled on this page; do not let it wait for the batch
+        if (requested && ((r = FlushPages()) || (r = out->Flush())))
+            break;
+    }
+
+    if (!r && !((r = FlushPages()) || (r = SendRecord(MIG_REC_END, 0,
+                        nullptr, 0)) || (r = out->Flush()))) {
+        std::unique_lock<std::mutex> lk(req_mtx);
+        req_cv.wait(lk, [this] { return peer_done; });
+        r = peer_error;
+    } else {
+        shutdown(out->Fd(), SHUT_RDWR);  // unblocks the reader
+    }
+    reader.join();
+
+    if (r)
+        return r;
+
+    stats.iterations = 1;
+    stats.downtime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            resumed_at - start).count();
+    stats.total_ms = ms_since(start);
+    stats.bytes_sent = out->BytesWritten();
+    stats.bandwidth = stats.bytes_sent*1000 / std::max<uint64_t>(1,
+            stats.total_ms);
+
+    return 0;
+}
+
+
+MigrationDestination::MigrationDestination(VM* vm, Stream* in,
+        int listen_fd)
+        : vm(vm), in(in),
+          npages(vm->getConfig().ram_size / MIG_PAGE_SIZE),
+          bounce(new uint8_t[MIG_PAGE_SIZE]),
+          resident(npages), listen_fd(listen_fd) {}
+
+MigrationDestination::~MigrationDestination() {
+    uint64_t one = 1;
+
+    {
+        std::lock_guard<std::mutex> lk(chan_mtx);
+        if (!chan_error)
+            chan_error = -ECANCELED;
+    }
+    chan_cv.notify_all();
+    for (recv_channel& ch : channels) {
+        if (ch.thread.joinable()) {
+            shutdown(ch.stream->Fd(), SHUT_RDWR);
+            ch.thread.join();
+        }
+    }
+
+    if (fault_thread.joinable()) {
+        if (write(stop_fd, &one, sizeof(one)) < 0)
+            perror("MigrationDestination: write");
+        fault_thread.join();
+    }
+    if (uffd >= 0)
+        close(uffd);
+    if (stop_fd >= 0)
+        close(stop_fd);
+}
+
+int MigrationDestination::SendRecord(uint32_t type, uint64_t arg) {
+    int r;
+    mig_record rec = { .type = type, .len = 0, .arg = arg };
+    std::lock_guard<std::mutex> lk(write_mtx);
+
+    if ((r = in->Write(&rec, sizeof(rec))))
+        return r;
+
+    return in->Flush();
+}
+
+void MigrationDestination::FaultLoop() {
+    uffd_msg msg;
+    uint64_t index, expected;
+    uint64_t ram = reinterpret_cast<uint64_t>(vm->ram_start);
+    pollfd fds[2] = {
+        { .fd = uffd, .events = POLLIN, .revents = 0 },
+        { .fd = stop_fd, .events = POLLIN, .revents = 0 },
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror(("MigrationDestination::" + std::string(__func__)
+                        + ": poll").c_str());
+            return;
+        }
+        if (fds[1].revents)
+            return;
+
+        if (read(uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            perror(("MigrationDestination::" + std::string(__func__)
+                        + ": read").c_str());
+            return;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            continue;
+
+        // Several vCPUs can fault on the same page; ask only once
+        index = (msg.arg.pagefault.address - ram) / MIG_PAGE_SIZE;
+        expected = 0;
+        if (index >= npages
+                || !fault_ns[index].compare_exchange_strong(expected,
+                    now_ns()))
+            continue;
+
+        if (SendRecord(MIG_REC_PAGE_REQ, index))
+            return;
+    }
+}
+
+int MigrationDestination::StartPostcopy() {
+    uffdio_api api = { .api = UFFD_API, .features = 0, .ioctls = 0 };
+    uffdio_register reg = {};
+
+    // UFFDIO_COPY places MIG_PAGE_SIZE pages, which hugetlb mappings do
+    // not take
+    if (vm->getConfig().backing.is_hugetlb()) {
+        std::cerr << "MigrationDestination::" << __func__
+            << ": not with hugetlb guest RAM" << std::endl;
+        return -EOPNOTSUPP;
+    }
+
+    uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        perror(("MigrationDestination::" + std::string(__func__)
+                    + ": userfaultfd (see vm.unprivileged_userfaultfd)")
+                .c_str());
+        return -errno;
+    }
+
+    reg.range.start = reinterpret_cast<uint64_t>(vm->ram_start);
+    reg.range.len = vm->getConfig().ram_size;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+    if (ioctl(uffd, UFFDIO_API, &api) < 0
+            || ioctl(uffd, UFFDIO_REGISTER, &reg) < 0) {
+        perror(("MigrationDestination::" + std::string(__func__)
+                    + ": ioctl").c_str());
+        return -errno;
+    }
+
+    if ((stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror(("MigrationDestination::" + std::string(__func__)
+                    + ": eventfd").c_str());
+        return -errno;
+    }
+
+    postcopy = true;
+    fault_ns.reset(new std::atomic<uint64_t>[npages]());
+    fault_thread = std::thread(&MigrationDestination::FaultLoop, this);
+
+    std::cout << "MigrationDestination::" << __func__ << ": "
+        << npages << " pages registered with userfaultfd" << std::endl;
+
+    return 0;
+}
+
+// UFFDIO_COPY/ZEROPAGE fill the page atomically and wake whoever faulted
+// on it
+int MigrationDestination::PlacePage(uint64_t index, uint8_t enc,
+        const uint8_t* src) {
+    int r;
+    uint64_t t;
+    uint64_t dst = reinterpret_cast<uint64_t>(vm->ram_start)
+                 + index*MIG_PAGE_SIZE;
+    uffdio_copy copy = {
+        .dst = dst,
+        .src = reinterpret_cast<uint64_t>(src),
+        .len = MIG_PAGE_SIZE,
+        .mode = 0,
+        .copy = 0,
+    };
+    uffdio_zeropage zeropage = {
+        .range = { .start = dst, .len = MIG_PAGE_SIZE },
+        .mode = 0,
+        .zeropage = 0,
+    };
+
+    while ((r = enc == MIG_PAGE_ZERO ? ioctl(uffd, UFFDIO_ZEROPAGE, &zeropage)
+                                     : ioctl(uffd, UFFDIO_COPY, &copy)) < 0) {
+        if (errno == EAGAIN)
+            continue;
+        if (errno == EEXIST)
+            break;
+        perror(("MigrationDestination::" + std::string(__func__)
+                    + ": ioctl").c_str());
+        return -errno;
+    }
+
+    resident.Set(index);
+    if ((t = fault_ns[index].load()))
+        fault_latency_ns.push_back(now_ns() - t);
+
+    return 0;
+}
+
+int MigrationDestination::FinishPostcopy() {
+    int r;
+    uint64_t one = 1;
+    uffdio_range range = {
+        .start = reinterpret_cast<uint64_t>(vm->ram_start),
+        .len = vm->getConfig().ram_size,
+    };
+
+    pc_stats.resident_ms = ms_since(started_at);
+    if (resident.Count() != npages) {
+        std::cerr << "MigrationDestination::" << __func__ << ": only "
+            << resident.Count() << " of " << npages << " pages arrived"
+            << std::endl;
+        return -EPROTO;
+    }
+
+    if (write(stop_fd, &one, sizeof(one)) < 0) {
+        perror(("MigrationDestination::" + std::string(__func__)
+                    + ": write").c_str());
+        return -errno;
+    }
+    fault_thread.join();
+
+    if (ioctl(uffd, UFFDIO_UNREGISTER, &range) < 0) {
+        perror(("MigrationDestination::" + std::string(__func__)
+                    + ": ioctl").c_str());
+        return -errno;
+    }
+
+    pc_stats.faults = fault_latency_ns.size();
+    pc_stats.fault_p50_us = percentile(&fault_latency_ns, 50) / 1000;
+    pc_stats.fault_p90_us = percentile(&fault_latency_ns, 90) / 1000;
+    pc_stats.fault_p99_us = percentile(&fault_latency_ns, 99) / 1000;
+    pc_stats.fault_max_us = percentile(&fault_latency_ns, 100) / 1000;
+
+    if ((r = SendRecord(MIG_REC_END, 0)))
+        return r;
+
+    return 0;
+}
+
+int MigrationDestination::RecvHeader() {
+    int r;
+    mig_header hdr;
+
+    if ((r = in->Read(&hdr, sizeof(hdr))))
+        return r;
+
+    if (hdr.magic != MIG_MAGIC || hdr.version != MIG_VERSION) {
+        std::cerr << "MigrationDestination::" << __func__
+            << ": bad magic or version" << std::endl;
+        return -EPROTO;
+    }
+
+    if (hdr.vcpu_num != static_cast<uint32_t>(vm->getVcpuNum())
+            || hdr.ram_size != vm->getConfig().ram_size) {
+        std::cerr << "MigrationDestination::" << __func__
+            << ": machine mismatch: " << hdr.vcpu_num << " vCPUs, "
+            << hdr.ram_size << " bytes of RAM" << std::endl;
+        return -EINVAL;
+    }
+
+    if (hdr.channels)
+        return AcceptChannels(hdr.channels);
+
+    return 0;
+}
+
+int MigrationDestination::AcceptChannels(uint32_t count) {
+    int r;
+    mig_record rec;
+    std::unique_ptr<Stream> s;
+
+    if (listen_fd < 0 || count > MIG_MAX_CHANNELS) {
+        std::cerr << "MigrationDestination::" << __func__
+            << ": cannot take " << count << " channels" << std::endl;
+        return -EINVAL;
+    }
+
+    channels.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        if ((r = unix_accept(listen_fd)) < 0)
+            return r;
+        s.reset(new Stream(r));
+
+        if ((r = s->Read(&rec, sizeof(rec))))
+            return r;
+        if (rec.type != MIG_REC_CHANNEL || rec.arg >= count
+                || channels[rec.arg].stream) {
+            std::cerr << "MigrationDestination::" << __func__
+                << ": bad channel handshake" << std::endl;
+            return -EPROTO;
+        }
+
+        channels[rec.arg].stream = std::move(s);
+        channels[rec.arg].bounce.reset(new uint8_t[MIG_PAGE_SIZE]);
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        channels[i].thread = std::thread(&MigrationDestination::ChannelLoop,
+                this, i);
+
+    std::cout << "MigrationDestination::" << __func__ << ": receiving RAM "
+        "over " << count << " channels" << std::endl;
+
+    return 0;
+}
+
+void MigrationDestination::ChannelLoop(int id) {
+    int r;
+    mig_record rec;
+    recv_channel& ch = channels[id];
+
+    while (true) {
+        if ((r = ch.stream->Read(&rec, sizeof(rec))))
+            break;
+
+        if (rec.type == MIG_REC_PAGES) {
+            if ((r = RecvPages(ch.stream.get(), ch.bounce.get(), rec.arg,
+                            rec.len)))
+                break;
+        } else if (rec.type == MIG_REC_SYNC) {
+            // A page resent next round may come in on another channel, so
+            // nothing goes on until every channel is through this one.
+            std::unique_lock<std::mutex> lk(chan_mtx);
+            chan_synced++;
+            chan_cv.notify_all();
+            chan_cv.wait(lk, [&] {
+                return chan_released >= rec.arg || chan_error;
+            });
+            if (chan_error)
+                return;
+        } else if (rec.type == MIG_REC_END) {
+            return;
+        } else {
+            r = -EPROTO;
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(chan_mtx);
+        if (!chan_error)
+            chan_error = r;
+    }
+    chan_cv.notify_all();
+
+    // The main stream may be waiting for a sync that never comes
+    shutdown(in->Fd(), SHUT_RDWR);
+}
+
+int MigrationDestination::Sync(uint64_t round) {
+    std::unique_lock<std::mutex> lk(chan_mtx);
+
+    chan_cv.wait(lk, [this] {
+        return chan_synced == static_cast<int>(channels.size())
+            || chan_error;
+    });
+    if (chan_error)
+        return chan_error;
+
+    chan_synced = 0;
+    chan_released = round;
+    chan_cv.notify_all();
+
+    return 0;
+}
+
+// Channels call this concurrently, each with its own stream and buffer
+int MigrationDestination::RecvPages(Stream* s, uint8_t* buf, uint64_t count,
+        uint32_t len) {
+    int r;
+    mig_page_hdr hdr;
+    uint8_t* ram = static_cast<uint8_t*>(vm->ram_start);
+
+    for (uint64_t i = 0; i < count; ++i) {
+        if (len < sizeof(hdr))
+            return -EPROTO;
+        if ((r = s->Read(&hdr, sizeof(hdr))))
+            return r;
+        len -= sizeof(hdr);
+
+        if (hdr.index >= npages || len < hdr.len
+                || !((hdr.enc == MIG_PAGE_RAW && hdr.len == MIG_PAGE_SIZE)
+                    || (hdr.enc == MIG_PAGE_ZERO && hdr.len == 0)
+                    || (hdr.enc == MIG_PAGE_XBZRLE && hdr.len < MIG_PAGE_SIZE
+                        && !postcopy && resident.Test(hdr.index))
+                    || (hdr.enc == MIG_PAGE_LZ && hdr.len < MIG_PAGE_SIZE
+                        && !postcopy))) {
+            std::cerr << "MigrationDestination::" << __func__
+                << ": bad page " << hdr.index << std::endl;
+            return -EPROTO;
+        }
+
+        if (postcopy) {
+            if ((r = s->Read(buf, hdr.len))
+                    || (r = PlacePage(hdr.index, hdr.enc, buf)))
+                return r;
+        } else if (hdr.enc == MIG_PAGE_XBZRLE) {
+            if ((r = s->Read(buf, hdr.len)))
+                return r;
+            if (xbzrle_decode(buf, hdr.len,
+                        ram + hdr.index*MIG_PAGE_SIZE)) {
+                std::cerr << "MigrationDestination::" << __func__
+                    << ": bad delta for page " << hdr.index << std::endl;
+                return -EPROTO;
+            }
+        } else if (hdr.enc == MIG_PAGE_LZ) {
+            if ((r = s->Read(buf, hdr.len)))
+                return r;
+            if (lz_decompress(buf, hdr.len,
+                        ram + hdr.index*MIG_PAGE_SIZE, MIG_PAGE_SIZE)
+                    != static_cast<int>(MIG_PAGE_SIZE)) {
+                std::cerr << "MigrationDestination::" << __func__
+                    << ": bad compressed page " << hdr.index << std::endl;
+                return -EPROTO;
+            }
+            resident.SetAtomic(hdr.index);
+        } else if (hdr.enc == MIG_PAGE_ZERO) {
+            // Never touched here means still unpopulated, so already zero.
+            if (resident.Test(hdr.index))
+                std::memset(ram + hdr.index*MIG_PAGE_SIZE, 0, MIG_PAGE_SIZE);
+        } else {
+            // Straight into guest RAM, no bounce buffer
+            if ((r = s->Read(ram + hdr.index*MIG_PAGE_SIZE, hdr.len)))
+                return r;
+            resident.SetAtomic(hdr.index);
+        }
+        len -= hdr.len;
+    }
+    pages_received += count;
+
+    return len ? -EPROTO : 0;
+}
+
+int MigrationDestination::Run() {
+    int r;
+    mig_record rec;
+    std::vector<uint8_t> buf;
+    vm_device_state devices;
+
+    if ((r = RecvHeader()))
+        return r;
+
+    while (true) {
+        if ((r = in->Read(&rec, sizeof(rec))))
+            return r;
+
+        switch (rec.type) {
+            case MIG_REC_PAGES:
+                if ((r = RecvPages(in, bounce.get(), rec.arg, rec.len)))
+                    return r;
+                break;
+
+            case MIG_REC_SYNC:
+                if ((r = Sync(rec.arg)))
+                    return r;
+                break;
+
+            case MIG_REC_ITER_END:
+                std::cout << "MigrationDestination::" << __func__
+                    << ": iteration " << rec.arg + 1 << " done, "
+                    << pages_received << " pages so far" << std::endl;
+                break;
+
+            case MIG_REC_VCPU:
+                if (rec.arg >= static_cast<uint64_t>(vm->getVcpuNum()))
+                    return -EPROTO;
+                buf.resize(rec.len);
+                if ((r = in->Read(buf.data(), rec.len))
+                        || (r = vm->getVcpu(rec.arg)->LoadState(
+                                buf.data(), buf.size())))
+                    return r;
+                break;
+
+            case MIG_REC_DEVICES:
+                if (rec.len != sizeof(devices))
+                    return -EPROTO;
+                if ((r = in->Read(&devices, sizeof(devices)))
+                        || (r = vm->loadDeviceState(&devices)))
+                    return r;
+                break;
+
+            case MIG_REC_POSTCOPY:
+                if ((r = StartPostcopy()))
+                    return r;
+                started_at = std::chrono::steady_clock::now();
+                if ((r = vm->Start())
+                        || (r = SendRecord(MIG_REC_RESUMED, 0)))
+                    return r;
+                break;
+
+            case MIG_REC_END:
+                if (postcopy)
+                    return FinishPostcopy();
+
+                if ((r = vm->Start())
+                        || (r = SendRecord(MIG_REC_RESUMED, 0)))
+                    return r;
+
+                // The channels' END only follows the source seeing RESUMED
+                for (recv_channel& ch : channels)
+                    ch.thread.join();
+
+                return chan_error;
+
+            default:
+                std::cerr << "MigrationDestination::" << __func__
+                    << ": unknown record " << rec.type << std::endl;
+                return -EPROTO;
+        }
+    }
+}
+
+
+void print_migration_stats(const migration_stats& stats) {
+    std::cout << "migration: total " << stats.total_ms << "ms"
+        << ", downtime " << stats.downtime_ms << "ms"
+        << ", " << stats.iterations << " iterations"
+        << ", " << stats.pages_sent << " pages"
+        << " (" << stats.zero_pages << " zero, "
+        << stats.bytes_sent << " bytes)"
+        << ", " << stats.final_dirty_pages << " pages in the final round"
+        << ", " << stats.bandwidth / (1024*1024) << " MiB/s"
+        << ", " << stats.pages_requested << " pages on request"
+        << std::endl;
+
+    if (stats.vcpu_state_bytes)
+        std::cout << "vcpu state: " << stats.vcpu_state_bytes << " bytes"
+            << ", captured in " << stats.vcpu_save_us << "us"
+            << " (slowest vCPU " << stats.vcpu_save_max_us << "us)"
+            << std::endl;
+
+    if (stats.lz_pages || stats.lz_overflows) {
+        uint64_t permille = stats.lz_bytes*1000 / std::max<uint64_t>(1,
+                stats.lz_pages*MIG_PAGE_SIZE);
+
+        std::cout << "compress: " << stats.lz_pages << " pages in "
+            << stats.lz_bytes << " bytes (" << permille / 10 << "."
+            << permille % 10 << "%)"
+            << ", " << stats.lz_overflows << " sent in full"
+            << ", " << (stats.zero_pages + stats.lz_pages
+                    + stats.lz_overflows)*MIG_PAGE_SIZE
+                * 1000 / std::max<uint64_t>(1, stats.lz_worker_ns)
+            << " MB/s per worker"
+            << ", writer stalled " << stats.lz_writer_stall_ns / 1000000
+            << "ms, scanner stalled " << stats.lz_scanner_stall_ns / 1000000
+            << "ms" << std::endl;
+    }
+
+    if (stats.throttle_pct || stats.throttled_ms)
+        std::cout << "auto-converge: throttled to " << stats.throttle_pct
+            << "% at the stop, vCPUs slept " << stats.throttled_ms << "ms"
+            << ", guest got " << stats.guest_run_pct << "% of its vCPU time"
+            << std::endl;
+
+    for (size_t i = 0; i < stats.channels.size(); ++i) {
+        const mig_channel_stats& ch = stats.channels[i];
+
+        std::cout << "channel " << i << ": " << ch.pages << " pages"
+            << " (" << ch.zero_pages << " zero, " << ch.bytes << " bytes)"
+            << ", blocked sending " << ch.send_ns / 1000000 << "ms"
+            << ", waited at sync " << ch.wait_ns / 1000000 << "ms"
+            << std::endl;
+    }
+
+    if (!stats.xbzrle_hits && !stats.xbzrle_misses)
+        return;
+
+    std::cout << "xbzrle: hit rate " << stats.xbzrle_hits*100
+            / (stats.xbzrle_hits + stats.xbzrle_misses) << "%"
+        << " (" << stats.xbzrle_hits << "/"
+        << stats.xbzrle_hits + stats.xbzrle_misses << ")"
+        << ", " << stats.xbzrle_pages << " deltas in "
+        << stats.xbzrle_bytes << " bytes"
+        << ", " << stats.xbzrle_overflows << " sent in full"
+        << ", encode " << (stats.xbzrle_encode_ns ? stats.xbzrle_encode_pages
+                * MIG_PAGE_SIZE * 1000 / stats.xbzrle_encode_ns : 0)
+        << " MB/s" << std::endl;
+}
+
+void print_postcopy_stats(const postcopy_stats& stats) {
+    std::cout << "postcopy: " << stats.faults << " faults"
+        << ", latency p50 " << stats.fault_p50_us << "us"
+        << " p90 " << stats.fault_p90_us << "us"
+        << " p99 " << stats.fault_p99_us << "us"
+        << " max " << stats.fault_max_us << "us"
+        << ", all pages resident after " << stats.resident_ms << "ms"
+        << std::endl;
+}
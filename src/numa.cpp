@@ -0,0 +1,182 @@
+/*
+ *  src/numa.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <numa.hpp>
+
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <paging.hpp>
+
+
+constexpr int NUMA_MASK_WORDS = NUMA_MAX_NODES / 64;
+constexpr int NUMA_QUERY_PAGES = 4096;
+
+
+// Digits only; -1 if there are none or something else
+static long parse_num(const std::string& s) {
+    char* end;
+    long n;
+
+    if (s.empty() || s.find_first_not_of("0123456789") != std::string::npos)
+        return -1;
+    n = std::strtol(s.c_str(), &end, 10);
+
+    return *end ? -1 : n;
+}
+
+int numa_parse_nodes(const std::string& s, std::vector<int>* nodes) {
+    size_t pos = 0, comma;
+    long n;
+
+    nodes->clear();
+    do {
+        comma = s.find(',', pos);
+        n = parse_num(s.substr(pos, comma - pos));
+        if (n < 0 || n >= NUMA_MAX_NODES) {
+            std::cerr << "numa_parse_nodes: bad node list \"" << s << "\""
+                << std::endl;
+            nodes->clear();
+            return -EINVAL;
+        }
+        nodes->push_back(n);
+        pos = comma + 1;
+    } while (comma != std::string::npos);
+
+    return 0;
+}
+
+int numa_parse_cpulist(const std::string& s, std::vector<int>* cpus) {
+    size_t pos = 0, comma, dash;
+    std::string item;
+    long first, last;
+
+    cpus->clear();
+    do {
+        comma = s.find(',', pos);
+        item = s.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty())
+            continue;
+
+        dash = item.find('-');
+        first = parse_num(item.substr(0, dash));
+        last = dash == std::string::npos ? first
+                                         : parse_num(item.substr(dash + 1));
+        if (first < 0 || last < first) {
+            cpus->clear();
+            return -EINVAL;
+        }
+        for (long c = first; c <= last; ++c)
+            cpus->push_back(c);
+    } while (comma != std::string::npos);
+
+    return 0;
+}
+
+int numa_node_cpus(int node, std::vector<int>* cpus) {
+    const std::string path = NUMA_SYSFS_NODE + std::to_string(node)
+        + "/cpulist";
+    std::ifstream f(path);
+    std::string line;
+
+    if (!std::getline(f, line)) {
+        std::cerr << "numa_node_cpus: no host node " << node << " ("
+            << path << ")" << std::endl;
+        return -ENOENT;
+    }
+    if (numa_parse_cpulist(line, cpus) || cpus->empty()) {
+        std::cerr << "numa_node_cpus: node " << node << " has no CPUs"
+            << std::endl;
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+int numa_bind(void* addr, uint64_t len, int node) {
+    unsigned long mask[NUMA_MASK_WORDS] = {};
+
+    if (node < 0 || node >= NUMA_MAX_NODES)
+        return -EINVAL;
+    mask[node / 64] = 1UL << (node % 64);
+
+    // The kernel counts one node fewer than maxnode says
+    if (syscall(SYS_mbind, addr, len, MPOL_BIND, mask, NUMA_MAX_NODES + 1,
+                MPOL_MF_STRICT | MPOL_MF_MOVE) < 0) {
+        perror(("numa_bind: mbind node " + std::to_string(node)).c_str());
+        return -errno;
+    }
+
+    return 0;
+}
+
+int numa_count_pages(void* addr, uint64_t len, int node,
+        uint64_t* resident, uint64_t* on_node) {
+    std::vector<void*> pages;
+    std::vector<int> status;
+    uint8_t* p = static_cast<uint8_t*>(addr);
+    uint64_t n = len / PAGE_SIZE_4KB, chunk;
+
+    *resident = *on_node = 0;
+    pages.reserve(NUMA_QUERY_PAGES);
+    status.resize(NUMA_QUERY_PAGES);
+
+    for (uint64_t i = 0; i < n; i += chunk) {
+        chunk = std::min<uint64_t>(NUMA_QUERY_PAGES, n - i);
+        pages.clear();
+        for (uint64_t j = 0; j < chunk; ++j)
+            pages.push_back(p + (i + j)*PAGE_SIZE_4KB);
+
+        // No target nodes: only reports where each page is
+        if (syscall(SYS_move_pages, 0, chunk, pages.data(), nullptr,
+                    status.data(), 0) < 0) {
+            perror("numa_count_pages: move_pages");
+            return -errno;
+        }
+        for (uint64_t j = 0; j < chunk; ++j) {
+            if (status[j] < 0)
+                continue;
+            (*resident)++;
+            if (status[j] == node)
+                (*on_node)++;
+        }
+    }
+
+    return 0;
+}
+
+
+void print_numa_stats(const numa_stats& stats) {
+    for (size_t i = 0; i < stats.vcpus.size(); ++i) {
+        const numa_vcpu_stats& v = stats.vcpus[i];
+        const uint64_t total = v.local + v.remote;
+
+        std::cout << "numa: vCPU " << i << " on node " << v.node << " ("
+            << v.cpus << " CPUs): " << v.local << " local, " << v.remote
+            << " remote pages dirtied";
+        if (total)
+            std::cout << " (" << v.local*100 / total << "% local)";
+        std::cout << std::endl;
+    }
+
+    for (const numa_bank_stats& b : stats.banks)
+        std::cout << "numa: slot " << b.slot << " bound to node " << b.node
+            << ": " << b.resident << " pages resident, " << b.on_node
+            << " on node " << b.node << std::endl;
+}
@@ -0,0 +1,276 @@
+/*
+ *  src/pagestore.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <pagestore.hpp>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <hash.hpp>
+#include <util.hpp>
+#include <zeropage.hpp>
+
+
+PageStore::PageStore(const std::string& dir, int hash_threads)
+        : dir(dir), hash_threads(hash_threads > 0 ? hash_threads
+                : std::max(1U, std::thread::hardware_concurrency())) {}
+
+PageStore::~PageStore() {
+    if (pages_fd >= 0)
+        close(pages_fd);
+    if (index_fd >= 0)
+        close(index_fd);
+}
+
+int PageStore::Open() {
+    int r;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror(("PageStore::" + std::string(__func__) + ": " + dir).c_str());
+        return -errno;
+    }
+
+    pages_fd = open((dir + "/" + PAGESTORE_PAGES_FILE).c_str(),
+            O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    index_fd = open((dir + "/" + PAGESTORE_INDEX_FILE).c_str(),
+            O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (pages_fd < 0 || index_fd < 0) {
+        perror(("PageStore::" + std::string(__func__) + ": open").c_str());
+        return -errno;
+    }
+
+    if (flock(index_fd, LOCK_SH) < 0) {
+        perror(("PageStore::" + std::string(__func__) + ": flock").c_str());
+        return -errno;
+    }
+    r = Refresh();
+    flock(index_fd, LOCK_UN);
+
+    std::cout << "PageStore::" << __func__ << ": " << dir << ": "
+        << npages << " pages" << std::endl;
+
+    return r;
+}
+
+// Reads the index entries appended since the last call. Call with the
+// index locked.
+int PageStore::Refresh() {
+    struct stat pst, ist;
+    uint64_t slots;
+    std::vector<hash128> entries;
+    ssize_t r;
+
+    if (fstat(pages_fd, &pst) < 0 || fstat(index_fd, &ist) < 0) {
+        perror(("PageStore::" + std::string(__func__) + ": fstat").c_str());
+        return -errno;
+    }
+
+    // Whichever file is shorter bounds what was completely written
+    slots = std::min<uint64_t>(ist.st_size / sizeof(hash128),
+            pst.st_size / PAGESTORE_PAGE_SIZE);
+    if (slots <= npages)
+        return 0;
+
+    entries.resize(slots - npages);
+    r = pread(index_fd, entries.data(), entries.size()*sizeof(hash128),
+            npages*sizeof(hash128));
+    if (r != static_cast<ssize_t>(entries.size()*sizeof(hash128))) {
+        perror(("PageStore::" + std::string(__func__) + ": pread").c_str());
+        return r < 0 ? -errno : -EIO;
+    }
+
+    index.reserve(slots);
+    for (const hash128& h : entries)
+        index.emplace(h, npages++);
+
+    return 0;
+}
+
+// Each thread takes an equal share of the pages; zero pages are found on
+// the way and get PAGESTORE_ZERO in refs instead of a hash.
+void PageStore::Hash(const uint8_t* ram, uint64_t n,
+        std::vector<hash128>* hashes, std::vector<uint64_t>* refs) {
+    const int nthreads = std::min<uint64_t>(hash_threads,
+            std::max<uint64_t>(1, n));
+    std::vector<std::thread> threads;
+    auto work = [ram, n, nthreads, hashes, refs](int t) {
+        uint64_t end = n*(t + 1) / nthreads;
+
+        for (uint64_t i = n*t / nthreads; i < end; ++i) {
+            const uint8_t* page = ram + i*PAGESTORE_PAGE_SIZE;
+
+            if (is_zero_page(page))
+                (*refs)[i] = PAGESTORE_ZERO;
+            else
+                (*hashes)[i] = page_hash128(page, PAGESTORE_PAGE_SIZE);
+        }
+    };
+
+    for (int t = 1; t < nthreads; ++t)
+        threads.emplace_back(work, t);
+    work(0);
+    for (std::thread& th : threads)
+        th.join();
+
+    stats.hash_threads = nthreads;
+}
+
+int PageStore::Put(const uint8_t* ram, uint64_t n,
+        std::vector<uint64_t>* refs) {
+    int r = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<hash128> hashes(n), added;
+    std::vector<uint64_t> added_pages;  // of ram, for each of added
+    std::vector<uint8_t> stored(PAGESTORE_PAGE_SIZE);
+    uint64_t first_slot, run_page = 0, run_len = 0;
+
+    stats = pagestore_stats();
+    stats.pages = n;
+    refs->assign(n, 0);
+
+    Hash(ram, n, &hashes, refs);
+    stats.hash_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    if (flock(index_fd, LOCK_EX) < 0) {
+        perror(("PageStore::" + std::string(__func__) + ": flock").c_str());
+        return -errno;
+    }
+    if ((r = Refresh())) {
+        flock(index_fd, LOCK_UN);
+        return r;
+    }
+    first_slot = npages;
+
+    // New pages that are neighbours in RAM are neighbours in the store too,
+    // and go out in one pwrite.
+    auto flush = [&]() {
+        int r = pwrite_all(pages_fd, ram + run_page*PAGESTORE_PAGE_SIZE,
+                run_len*PAGESTORE_PAGE_SIZE,
+                (npages - run_len)*PAGESTORE_PAGE_SIZE);
+        run_len = 0;
+        return r;
+    };
+
+    // Whether page i of ram is what slot holds. A slot added by this Put()
+    // may not be written yet, so its page in ram stands in for it.
+    auto same = [&](uint64_t i, uint64_t slot, bool* eq) {
+        const uint8_t* page = ram + i*PAGESTORE_PAGE_SIZE;
+        const uint8_t* other = stored.data();
+        int r;
+
+        if (slot >= first_slot)
+            other = ram + added_pages[slot - first_slot]*PAGESTORE_PAGE_SIZE;
+        else if ((r = pread_all(pages_fd, stored.data(), PAGESTORE_PAGE_SIZE,
+                        slot*PAGESTORE_PAGE_SIZE)))
+            return r;
+        *eq = !std::memcmp(page, other, PAGESTORE_PAGE_SIZE);
+        return 0;
+    };
+
+    for (uint64_t i = 0; !r && i < n; ++i) {
+        if ((*refs)[i] == PAGESTORE_ZERO) {
+            stats.zero_pages++;
+            continue;
+        }
+
+        auto range = index.equal_range(hashes[i]);
+        uint64_t slot = PAGESTORE_ZERO;
+        bool eq = false;
+
+        for (auto it = range.first; !eq && it != range.second; ++it) {
+            if ((r = same(i, it->second, &eq)))
+                break;
+            slot = it->second;
+        }
+        if (r)
+            break;
+        if (eq) {
+            (*refs)[i] = slot;
+            if (slot >= first_slot)
+                stats.dup_local++;
+            else
+                stats.dup_store++;
+            continue;
+        }
+        if (range.first != range.second)
+            stats.collisions++;
+
+        if (run_len && run_page + run_len != i)
+            r = flush();
+        if (!run_len)
+            run_page = i;
+        run_len++;
+
+        index.emplace(hashes[i], npages);
+        (*refs)[i] = npages++;
+        added.push_back(hashes[i]);
+        added_pages.push_back(i);
+    }
+    if (!r && run_len)
+        r = flush();
+    // The data must be on disk before an index entry can name it
+    if (!r && !added.empty() && fdatasync(pages_fd) < 0) {
+        perror(("PageStore::" + std::string(__func__) + ": fdatasync")
+                .c_str());
+        r = -errno;
+    }
+    if (!r)
+        r = pwrite_all(index_fd, added.data(), added.size()*sizeof(hash128),
+                first_slot*sizeof(hash128));
+
+    // Forget the slots that did not make it, so the next Put() rewrites
+    // them
+    if (r) {
+        for (auto it = index.begin(); it != index.end(); ) {
+            if (it->second >= first_slot)
+                it = index.erase(it);
+            else
+                ++it;
+        }
+        npages = first_slot;
+    }
+    flock(index_fd, LOCK_UN);
+
+    stats.new_pages = added.size();
+    stats.store_pages = npages;
+
+    return r;
+}
+
+
+void print_pagestore_stats(const pagestore_stats& stats) {
+    const uint64_t stored = stats.pages - stats.zero_pages;
+
+    std::cout << "pagestore: " << stats.pages << " pages, "
+        << stats.zero_pages << " zero, " << stats.new_pages << " new, "
+        << stats.dup_local << " duplicates within, " << stats.dup_store
+        << " already stored, " << stats.collisions
+        << " hash collisions; dedup ratio "
+        << stored*100 / std::max<uint64_t>(1, stats.new_pages) / 100.0
+        << ":1, " << stats.store_pages << " pages in the store"
+        << std::endl;
+    std::cout << "pagestore: hashed " << stats.pages*PAGESTORE_PAGE_SIZE
+        << " bytes in " << stats.hash_ns / 1000 << "us on "
+        << stats.hash_threads << " threads ("
+        << stats.pages*PAGESTORE_PAGE_SIZE*1000
+            / std::max<uint64_t>(1, stats.hash_ns)
+        << " MB/s)" << std::endl;
+}
@@ -0,0 +1,163 @@
+/*
+ *  src/pipeline.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <pipeline.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <util.hpp>
+
+
+PagePipeline::PagePipeline(int nworkers, uint32_t batch_pages,
+        EncodeFunc encode, WriteFunc write)
+        : batch_pages(batch_pages ? batch_pages : 1),
+          encode(std::move(encode)), write(std::move(write)),
+          slots(2*(nworkers > 0 ? nworkers : 1)) {
+    if (nworkers <= 0)
+        nworkers = 1;
+
+    for (slot& s : slots)
+        s.batch.pages.reserve(this->batch_pages);
+
+    stats.worker_busy_ns.resize(nworkers);
+    for (int i = 0; i < nworkers; ++i)
+        workers.emplace_back(&PagePipeline::WorkerLoop, this, i);
+    writer = std::thread(&PagePipeline::WriterLoop, this);
+}
+
+PagePipeline::~PagePipeline() {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+
+    for (std::thread& t : workers)
+        t.join();
+    writer.join();
+}
+
+// Slots are freed in order by the writer, so the next one to fill is
+// always the oldest.
+PagePipeline::slot* PagePipeline::AcquireFree() {
+    std::unique_lock<std::mutex> lk(mtx);
+    slot* s = &slots[fill_seq % slots.size()];
+    auto start = std::chrono::steady_clock::now();
+
+    cv.wait(lk, [s] { return s->state == SLOT_FREE; });
+    stats.scanner_stall_ns += ns_since(start);
+
+    s->batch.pages.clear();
+
+    return s;
+}
+
+void PagePipeline::Publish(slot* s) {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        s->state = SLOT_FILLED;
+        fill_seq++;
+        stats.batches++;
+        stats.pages += s->batch.pages.size();
+    }
+    cv.notify_all();
+}
+
+void PagePipeline::Scan(const ScanFunc& scan) {
+    slot* s = AcquireFree();
+
+    scan([this, &s](uint64_t page) {
+        s->batch.pages.push_back(page);
+        if (s->batch.pages.size() == batch_pages) {
+            Publish(s);
+            s = AcquireFree();
+        }
+    });
+
+    if (!s->batch.pages.empty())
+        Publish(s);
+}
+
+void PagePipeline::WorkerLoop(int id) {
+    std::unique_lock<std::mutex> lk(mtx);
+    std::chrono::steady_clock::time_point start;
+    slot* s;
+
+    while (true) {
+        cv.wait(lk, [this] { return stop || work_seq < fill_seq; });
+        if (stop)
+            return;
+
+        s = &slots[work_seq++ % slots.size()];
+        s->state = SLOT_BUSY;
+        lk.unlock();
+
+        start = std::chrono::steady_clock::now();
+        s->batch.out.clear();
+        for (uint64_t page : s->batch.pages)
+            encode(id, page, &s->batch.out);
+
+        lk.lock();
+        stats.worker_busy_ns[id] += ns_since(start);
+        s->state = SLOT_ENCODED;
+        cv.notify_all();
+    }
+}
+
+void PagePipeline::WriterLoop() {
+    std::unique_lock<std::mutex> lk(mtx);
+    std::chrono::steady_clock::time_point start;
+    bool in_flight, skip;
+    slot* s;
+    int r;
+
+    while (!stop) {
+        s = &slots[write_seq % slots.size()];
+
+        if (write_seq < fill_seq && s->state == SLOT_ENCODED) {
+            // After an error the rest of the pass is drained unwritten
+            skip = error;
+            lk.unlock();
+            r = skip ? 0 : write(s->batch);
+            lk.lock();
+
+            if (r && !error)
+                error = r;
+            s->state = SLOT_FREE;
+            write_seq++;
+            cv.notify_all();
+            continue;
+        }
+
+        // Only waiting on a batch that is already out counts as a stall,
+        // not idling between passes.
+        in_flight = write_seq < fill_seq;
+        start = std::chrono::steady_clock::now();
+        cv.wait(lk);
+        if (in_flight)
+            stats.writer_stall_ns += ns_since(start);
+    }
+}
+
+int PagePipeline::Run(const ScanFunc& scan) {
+    int r;
+    std::thread scanner(&PagePipeline::Scan, this, std::cref(scan));
+
+    scanner.join();
+
+    std::unique_lock<std::mutex> lk(mtx);
+    cv.wait(lk, [this] { return write_seq == fill_seq; });
+    r = error;
+    error = 0;
+
+    return r;
+}
@@ -0,0 +1,335 @@
+/*
+ *  src/pool.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <pool.hpp>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <kvm.hpp>
+#include <stream.hpp>
+#include <util.hpp>
+#include <vm.hpp>
+
+
+static int write_str(int fd, const std::string& s) {
+    size_t off = 0;
+    ssize_t r;
+
+    while (off < s.size()) {
+        if ((r = write(fd, s.data() + off, s.size() - off)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        off += r;
+    }
+
+    return 0;
+}
+
+// One line, without the newline; -EPROTO if it does not fit
+static int read_line(int fd, std::string* line) {
+    char c;
+    ssize_t r;
+
+    line->clear();
+    while (line->size() < POOL_CMD_MAX) {
+        if ((r = read(fd, &c, 1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (r == 0 || c == '\n')
+            return 0;
+        line->push_back(c);
+    }
+
+    return -EPROTO;
+}
+
+static std::string stats_line(const pool_stats& st) {
+    return "served=" + std::to_string(st.served)
+        + " cold=" + std::to_string(st.cold)
+        + " serve_p50_us=" + std::to_string(st.serve_p50_us)
+        + " serve_p99_us=" + std::to_string(st.serve_p99_us)
+        + " serve_max_us=" + std::to_string(st.serve_max_us)
+        + " booted=" + std::to_string(st.booted)
+        + " boot_failures=" + std::to_string(st.boot_failures)
+        + " boot_p50_ms=" + std::to_string(st.boot_p50_ms)
+        + " refill_busy_ms=" + std::to_string(st.refill_busy_ms)
+        + " released=" + std::to_string(st.released) + "\n";
+}
+
+
+VMPool::VMPool(KVM* kvm, const vm_config& conf, pool_config pconf)
+        : kvm(kvm), conf(conf), pconf(pconf) {}
+
+VMPool::~VMPool() {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+    if (refill_thread.joinable())
+        refill_thread.join();
+
+    while (!leases.empty())
+        Release(leases.size() - 1);
+    ready.clear();
+
+    if (null_fd >= 0)
+        close(null_fd);
+}
+
+// Console output up to the marker goes nowhere
+int VMPool::BootOne(std::unique_ptr<VM>* out) {
+    int r;
+    VM* vm;
+
+    if ((r = kvm->kvmCreateVM(&vm, conf)) < 0)
+        return r;
+    out->reset(vm);
+
+    vm->setConsoleFd(null_fd);
+    vm->setConsoleMarker(pconf.marker);
+    if ((r = vm->initMachine()) || (r = vm->initRAM(pconf.cmdline))
+            || (r = vm->Start()))
+        return r;
+
+    if (!vm->waitConsoleMarker(pconf.boot_timeout_ms)) {
+        std::cerr << "VMPool::" << __func__ << ": no \"" << pconf.marker
+            << "\" within " << pconf.boot_timeout_ms << "ms" << std::endl;
+        return -ETIMEDOUT;
+    }
+
+    return vm->Pause();
+}
+
+void VMPool::RefillLoop() {
+    int r;
+    std::unique_ptr<VM> vm;
+    std::chrono::steady_clock::time_point t;
+    std::unique_lock<std::mutex> lk(mtx);
+
+    while (!stop) {
+        if (ready.size() >= static_cast<size_t>(pconf.size)) {
+            cv.wait(lk, [this] {
+                return stop || ready.size()
+                    < static_cast<size_t>(pconf.size);
+            });
+            continue;
+        }
+
+        lk.unlock();
+        t = std::chrono::steady_clock::now();
+        r = BootOne(&vm);
+        if (r)
+            vm.reset();
+        lk.lock();
+
+        refill_busy += std::chrono::steady_clock::now() - t;
+        if (r) {
+            stats.boot_failures++;
+            cv.wait_for(lk, std::chrono::milliseconds(POOL_BOOT_RETRY_MS),
+                    [this] { return stop; });
+            continue;
+        }
+        boot_us.push_back(us_since(t));
+        stats.booted++;
+        ready.push_back(std::move(vm));
+        cv.notify_all();
+    }
+}
+
+// The reply goes out before the guest is resumed, so it comes first on
+// the connection.
+int VMPool::Lease(int fd) {
+    int r;
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<VM> vm;
+    std::unique_lock<std::mutex> lk(mtx);
+
+    if (ready.empty())
+        stats.cold++;
+    cv.wait(lk, [this] { return stop || !ready.empty(); });
+    if (stop)
+        return -ECANCELED;
+    vm = std::move(ready.front());
+    ready.pop_front();
+    lk.unlock();
+    cv.notify_all();
+
+    leases.push_back({ fd, next_id++, nullptr });
+    if ((r = write_str(fd, "ok " + std::to_string(leases.back().id)
+                    + "\n"))) {
+        leases.back().vm = std::move(vm);
+        Release(leases.size() - 1);
+        return r;
+    }
+
+    vm->setConsoleFd(fd);
+    if ((r = vm->Resume())) {
+        leases.back().vm = std::move(vm);
+        Release(leases.size() - 1);
+        return r;
+    }
+    leases.back().vm = std::move(vm);
+
+    lk.lock();
+    serve_us.push_back(us_since(start));
+    stats.served++;
+
+    return 0;
+}
+
+// A client that is gone cannot take console output any more
+void VMPool::Release(size_t i) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (leases[i].vm) {
+        leases[i].vm->setConsoleFd(null_fd);
+        leases[i].vm.reset();
+    }
+    close(leases[i].fd);
+    leases.erase(leases.begin() + i);
+
+    std::lock_guard<std::mutex> lk(mtx);
+    stats.released++;
+    stats.release_us += us_since(start);
+}
+
+int VMPool::Serve(int fd) {
+    int r;
+    std::string cmd;
+
+    if ((r = read_line(fd, &cmd))) {
+        close(fd);
+        return r;
+    }
+
+    if (cmd == "get") {
+        if ((r = Lease(fd)))
+            std::cerr << "VMPool::" << __func__ << ": get: " << r
+                << std::endl;
+        return 0;
+    }
+
+    if (cmd == "stats")
+        r = write_str(fd, stats_line(Stats()));
+    else if (cmd == "quit")
+        r = write_str(fd, "bye\n");
+    else
+        r = write_str(fd, "error unknown command\n");
+    close(fd);
+
+    return cmd == "quit" ? 1 : 0;
+}
+
+int VMPool::Run(const char* path) {
+    int r = 0, listen_fd, fd;
+    std::vector<pollfd> fds;
+    char buf[256];
+
+    // Clients that hang up mid-write must not take the process with them
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+        perror(("VMPool::" + std::string(__func__) + ": open").c_str());
+        return -errno;
+    }
+    if ((listen_fd = unix_listen(path)) < 0)
+        return listen_fd;
+
+    refill_thread = std::thread(&VMPool::RefillLoop, this);
+
+    while (true) {
+        fds.assign(1, { listen_fd, POLLIN, 0 });
+        for (const lease& l : leases)
+            fds.push_back({ l.fd, POLLIN, 0 });
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror(("VMPool::" + std::string(__func__) + ": poll").c_str());
+            r = -errno;
+            break;
+        }
+
+        // Anything a client sends is ignored; EOF gives the VM back
+        for (size_t i = fds.size() - 1; i > 0; --i) {
+            if (!fds[i].revents)
+                continue;
+            if (read(fds[i].fd, buf, sizeof(buf)) <= 0)
+                Release(i - 1);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if ((fd = unix_accept(listen_fd)) < 0) {
+                r = fd;
+                break;
+            }
+            if (Serve(fd) == 1)
+                break;
+        }
+    }
+
+    close(listen_fd);
+    unlink(path);
+
+    return r;
+}
+
+pool_stats VMPool::Stats() {
+    std::lock_guard<std::mutex> lk(mtx);
+    pool_stats st = stats;
+    std::vector<uint64_t> samples;
+
+    samples = serve_us;
+    st.serve_p50_us = percentile(&samples, 50);
+    st.serve_p99_us = percentile(&samples, 99);
+    st.serve_max_us = percentile(&samples, 100);
+    samples = boot_us;
+    st.boot_p50_ms = percentile(&samples, 50) / 1000;
+    st.boot_max_ms = percentile(&samples, 100) / 1000;
+    st.refill_busy_ms = std::chrono::duration_cast<
+        std::chrono::milliseconds>(refill_busy).count();
+
+    return st;
+}
+
+
+void print_pool_stats(const pool_stats& stats) {
+    std::cout << "pool: " << stats.served << " VMs served (" << stats.cold
+        << " from an empty pool), request to running p50 "
+        << stats.serve_p50_us << "us, p99 " << stats.serve_p99_us
+        << "us, max " << stats.serve_max_us << "us" << std::endl;
+    std::cout << "pool: " << stats.booted << " VMs booted to the marker ("
+        << stats.boot_failures << " failed), boot p50 " << stats.boot_p50_ms
+        << "ms, max " << stats.boot_max_ms << "ms; refill "
+        << stats.booted*1000*1000 / std::max<uint64_t>(1,
+                stats.refill_busy_ms) / 1000.0
+        << " VMs/s while busy" << std::endl;
+    std::cout << "pool: " << stats.released << " VMs released, "
+        << stats.release_us / std::max<uint64_t>(1, stats.released)
+        << "us each" << std::endl;
+}
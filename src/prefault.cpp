@@ -0,0 +1,138 @@
+/*
+ *  src/prefault.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <prefault.hpp>
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <paging.hpp>
+
+
+// Linux 5.14; older headers do not have it
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+
+void prefault_split(const std::vector<prefault_range>& ranges,
+        uint64_t chunk, uint64_t align, std::vector<prefault_range>* chunks) {
+    std::vector<prefault_range> merged;
+
+    for (const prefault_range& r : ranges) {
+        if (!r.size)
+            continue;
+        merged.push_back({ r.offset & ~(align - 1), 0 });
+        merged.back().size = ((r.offset + r.size + align - 1) & ~(align - 1))
+            - merged.back().offset;
+    }
+    std::sort(merged.begin(), merged.end(),
+            [](const prefault_range& a, const prefault_range& b) {
+        return a.offset < b.offset;
+    });
+
+    chunks->clear();
+    for (size_t i = 0; i < merged.size(); ) {
+        uint64_t start = merged[i].offset;
+        uint64_t end = start + merged[i].size;
+
+        for (++i; i < merged.size() && merged[i].offset <= end; ++i)
+            end = std::max(end, merged[i].offset + merged[i].size);
+
+        // Chunk boundaries, so that no chunk shares a THP with another
+        for (uint64_t p = start; p < end; ) {
+            uint64_t next = std::min(end, (p & ~(chunk - 1)) + chunk);
+
+            chunks->push_back({ p, next - p });
+            p = next;
+        }
+    }
+}
+
+int prefault(void* base, const std::vector<prefault_range>& ranges,
+        uint64_t align, int threads, prefault_stats* stats) {
+    auto start = std::chrono::steady_clock::now();
+    uint8_t* ram = static_cast<uint8_t*>(base);
+    std::vector<prefault_range> chunks;
+    std::vector<std::thread> pool;
+    std::atomic<uint64_t> next{0};
+    std::atomic<int> err{0};
+    bool populate;
+
+    prefault_split(ranges, std::max(PREFAULT_CHUNK, align), align, &chunks);
+
+    // The advice is checked before the length, so this only asks whether
+    // the kernel knows it
+    populate = madvise(base, 0, MADV_POPULATE_WRITE) == 0;
+
+    auto work = [&]() {
+        uint64_t i;
+
+        while (!err.load(std::memory_order_relaxed)
+                && (i = next.fetch_add(1)) < chunks.size()) {
+            uint8_t* p = ram + chunks[i].offset;
+
+            if (!populate) {
+                for (uint64_t off = 0; off < chunks[i].size;
+                        off += PAGE_SIZE_4KB) {
+                    volatile uint8_t* b = p + off;
+                    *b = *b;
+                }
+            } else if (madvise(p, chunks[i].size, MADV_POPULATE_WRITE) < 0) {
+                int expected = 0;
+                err.compare_exchange_strong(expected, errno);
+            }
+        }
+    };
+
+    threads = std::max<uint64_t>(1, std::min<uint64_t>(threads,
+                chunks.size()));
+    for (int t = 1; t < threads; ++t)
+        pool.emplace_back(work);
+    work();
+    for (std::thread& th : pool)
+        th.join();
+
+    if (err) {
+        std::cerr << "prefault: madvise: " << strerror(err) << std::endl;
+        return -err;
+    }
+
+    *stats = prefault_stats();
+    stats->threads = threads;
+    stats->chunks = chunks.size();
+    for (const prefault_range& c : chunks)
+        stats->bytes += c.size;
+    stats->ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    stats->populate = populate;
+
+    return 0;
+}
+
+
+void print_prefault_stats(const prefault_stats& stats) {
+    const double ms = stats.ns / 1e6;
+
+    std::cout << "prefault: " << (stats.bytes >> 20) << " MiB in "
+        << stats.chunks << " chunks, " << stats.threads << " threads ("
+        << (stats.populate ? "MADV_POPULATE_WRITE" : "touch") << "): "
+        << ms << " ms";
+    if (stats.ns)
+        std::cout << ", " << stats.bytes / ms / 1e6 << " GB/s";
+    std::cout << std::endl;
+}
@@ -0,0 +1,163 @@
+/*
+ *  src/rambacking.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <rambacking.hpp>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include <membank.hpp>
+#include <paging.hpp>
+
+
+static const struct {
+    const char* name;
+    ram_backing_type type;
+    bool hugetlb;
+} ram_backing_names[] = {
+    { "memfd", RAM_BACKING_MEMFD, false },
+    { "anon", RAM_BACKING_ANON, false },
+    { "thp", RAM_BACKING_THP, false },
+    { "hugetlb", RAM_BACKING_HUGETLB, true },
+    { "memfd-hugetlb", RAM_BACKING_MEMFD_HUGETLB, true },
+};
+
+
+int ram_backing_parse(const std::string& s, ram_backing* backing) {
+    const size_t colon = s.find(':');
+    const std::string name = s.substr(0, colon);
+    const std::string size = colon == std::string::npos ? ""
+                                                        : s.substr(colon + 1);
+
+    for (const auto& e : ram_backing_names) {
+        if (name != e.name)
+            continue;
+
+        if (!e.hugetlb && colon != std::string::npos)
+            break;
+        if (e.hugetlb && (size.empty() || size == "2M"))
+            backing->page_size = RAM_HUGEPAGE_2MB;
+        else if (e.hugetlb && size == "1G")
+            backing->page_size = RAM_HUGEPAGE_1GB;
+        else if (e.hugetlb)
+            break;
+        else
+            backing->page_size = PAGE_SIZE_4KB;
+
+        backing->type = e.type;
+        return 0;
+    }
+
+    std::cerr << "ram_backing_parse: unknown backing \"" << s << "\""
+        << std::endl;
+
+    return -EINVAL;
+}
+
+std::string ram_backing_name(const ram_backing& backing) {
+    for (const auto& e : ram_backing_names) {
+        if (e.type != backing.type)
+            continue;
+        if (!e.hugetlb)
+            return e.name;
+        return std::string(e.name)
+            + (backing.page_size == RAM_HUGEPAGE_1GB ? ":1G" : ":2M");
+    }
+
+    return "unknown";
+}
+
+// Reserves align bytes more than needed and puts RAM on the aligned part,
+// since mmap() only promises page alignment
+int ram_backing_map(const ram_backing& backing, uint64_t size, void** addr,
+        int* fd) {
+    const uint64_t align = std::max<uint64_t>(MEMBANK_ALIGN,
+            backing.page_size);
+    const int huge = backing.is_hugetlb()
+        ? __builtin_ctzll(backing.page_size) << MAP_HUGE_SHIFT : 0;
+    const bool shared = backing.type == RAM_BACKING_MEMFD
+        || backing.type == RAM_BACKING_MEMFD_HUGETLB;
+    int flags = MAP_FIXED;
+    uint8_t *base, *aligned;
+    void* p;
+    // Keeps errno across the cleanup
+    auto fail = [fd](void* map, uint64_t len) {
+        int r = -errno;
+
+        if (map)
+            munmap(map, len);
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        return r;
+    };
+
+    *addr = nullptr;
+    *fd = -1;
+
+    if (size % backing.page_size) {
+        std::cerr << "ram_backing_map: " << size << " bytes is not a "
+            "multiple of the " << backing.page_size << " byte page"
+            << std::endl;
+        return -EINVAL;
+    }
+
+    if (shared) {
+        *fd = memfd_create("guest-ram", MFD_CLOEXEC
+                | (backing.is_hugetlb() ? MFD_HUGETLB | huge : 0));
+        if (*fd < 0) {
+            perror("ram_backing_map: memfd_create");
+            return -errno;
+        }
+        if (ftruncate(*fd, size) < 0) {
+            perror("ram_backing_map: ftruncate");
+            return fail(nullptr, 0);
+        }
+        flags |= MAP_SHARED;
+    } else {
+        flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+        if (backing.type == RAM_BACKING_HUGETLB)
+            flags |= MAP_HUGETLB | huge;
+    }
+
+    p = mmap(nullptr, size + align, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("ram_backing_map: mmap");
+        return fail(nullptr, 0);
+    }
+    base = static_cast<uint8_t*>(p);
+    aligned = reinterpret_cast<uint8_t*>(
+            (reinterpret_cast<uint64_t>(base) + align - 1) & ~(align - 1));
+
+    if (mmap(aligned, size, PROT_READ | PROT_WRITE, flags, *fd, 0)
+            == MAP_FAILED) {
+        perror("ram_backing_map: mmap (see /proc/sys/vm/nr_hugepages)");
+        return fail(base, size + align);
+    }
+    if (aligned != base)
+        munmap(base, aligned - base);
+    munmap(aligned + size, base + align - aligned);
+
+    if (backing.type == RAM_BACKING_THP
+            && madvise(aligned, size, MADV_HUGEPAGE) < 0) {
+        perror("ram_backing_map: madvise");
+        return fail(aligned, size);
+    }
+
+    *addr = aligned;
+
+    return 0;
+}
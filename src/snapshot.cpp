@@ -0,0 +1,1140 @@
+/*
+ *  src/snapshot.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <snapshot.hpp>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirty.hpp>
+#include <pagestore.hpp>
+#include <util.hpp>
+#include <vcpu.hpp>
+#include <vm.hpp>
+#include <zeropage.hpp>
+
+
+static uint64_t align_up(uint64_t x) {
+    return (x + SNAP_RAM_ALIGN - 1) & ~(SNAP_RAM_ALIGN - 1);
+}
+
+static std::string dir_of(const std::string& path) {
+    size_t slash = path.rfind('/');
+
+    return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+// How a layer names its parent: the bare name if both sit in the same
+// directory, so the chain can be moved as a whole, else an absolute path.
+static std::string parent_ref(const char* path, const char* parent) {
+    std::string p(parent);
+    char buf[PATH_MAX];
+
+    if (dir_of(path) == dir_of(p))
+        return p.substr(p.rfind('/') + 1);
+    if (p[0] != '/' && realpath(parent, buf))
+        return buf;
+    return p;
+}
+
+// The store is shared between snapshots in any directory, so it is named
+// by its absolute path.
+static std::string store_ref(const std::string& dir) {
+    char buf[PATH_MAX];
+
+    return realpath(dir.c_str(), buf) ? buf : dir;
+}
+
+// Writes pages[0..n) of ram, or the first n pages if pages is nullptr, to
+// consecutive slots from offset. Runs of non-zero pages that are also
+// consecutive in ram go out in one pwrite; zero pages are left as holes.
+static int write_pages(int fd, const uint8_t* ram, const uint64_t* pages,
+        uint64_t n, uint64_t offset, snapshot_stats* stats) {
+    int r;
+    uint64_t k = 0, first;
+    auto page = [pages](uint64_t k) { return pages ? pages[k] : k; };
+
+    while (k < n) {
+        if (is_zero_page(ram + page(k)*SNAP_PAGE_SIZE)) {
+            stats->zero_pages++;
+            ++k;
+            continue;
+        }
+
+        first = k++;
+        while (k < n && page(k) == page(k - 1) + 1
+                && !is_zero_page(ram + page(k)*SNAP_PAGE_SIZE))
+            ++k;
+
+        if ((r = pwrite_all(fd, ram + page(first)*SNAP_PAGE_SIZE,
+                        (k - first)*SNAP_PAGE_SIZE,
+                        offset + first*SNAP_PAGE_SIZE)))
+            return r;
+        stats->bytes_written += (k - first)*SNAP_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+// Everything but the page data, which goes at *data_offset. The file is
+// sized to hold it.
+static int write_layout(int fd, const snap_contents& c,
+        uint64_t* data_offset, snapshot_stats* stats) {
+    struct payload {
+        uint32_t type;
+        uint64_t arg;
+        const void* data;
+        uint64_t size;
+    };
+
+    int r;
+    const int vcpu_num = c.vcpu_state->size();
+    const bool layer = !c.parent.empty();
+    const bool stored = !layer && !c.store.empty();
+    std::vector<payload> payloads;
+    std::vector<snap_section> sections;
+    snap_header hdr;
+    uint64_t pos, data_size, npages;
+
+    for (int i = 0; i < vcpu_num; ++i)
+        payloads.push_back({ SNAP_SEC_VCPU, static_cast<uint64_t>(i),
+                (*c.vcpu_state)[i].data(), (*c.vcpu_state)[i].size() });
+    payloads.push_back({ SNAP_SEC_DEVICES, 0, c.devices,
+            sizeof(*c.devices) });
+    if (layer) {
+        npages = c.pages->size();
+        payloads.push_back({ SNAP_SEC_PARENT, 0, c.parent.data(),
+                c.parent.size() });
+        payloads.push_back({ SNAP_SEC_PAGES, npages, c.pages->data(),
+                npages*sizeof(uint64_t) });
+    } else if (stored) {
+        npages = 0;
+        payloads.push_back({ SNAP_SEC_STORE, 0, c.store.data(),
+                c.store.size() });
+        payloads.push_back({ SNAP_SEC_PAGE_REFS, c.refs->size(),
+                c.refs->data(), c.refs->size()*sizeof(uint64_t) });
+    } else {
+        npages = c.ram_size / SNAP_PAGE_SIZE;
+    }
+
+    pos = sizeof(hdr)
+        + (payloads.size() + (stored ? 0 : 1))*sizeof(snap_section);
+    for (const payload& pl : payloads) {
+        sections.push_back({ pl.type, 0, pl.arg, pos, pl.size });
+        pos += pl.size;
+    }
+    *data_offset = stored ? pos : align_up(pos);
+    data_size = npages*SNAP_PAGE_SIZE;
+    if (!stored)
+        sections.push_back({ layer ? SNAP_SEC_PAGE_DATA : SNAP_SEC_RAM, 0,
+                layer ? npages : 0, *data_offset, data_size });
+
+    hdr = {
+        .magic = SNAP_MAGIC,
+        .version = SNAP_VERSION,
+        .nsections = static_cast<uint32_t>(sections.size()),
+        .vcpu_num = static_cast<uint32_t>(vcpu_num),
+        .ram_size = c.ram_size,
+    };
+
+    r = pwrite_all(fd, &hdr, sizeof(hdr), 0);
+    if (!r)
+        r = pwrite_all(fd, sections.data(),
+                sections.size()*sizeof(snap_section), sizeof(hdr));
+    for (size_t i = 0; !r && i < payloads.size(); ++i)
+        r = pwrite_all(fd, payloads[i].data, payloads[i].size,
+                sections[i].offset);
+    if (!r && ftruncate(fd, *data_offset + data_size) < 0) {
+        perror((std::string(__func__) + ": ftruncate").c_str());
+        r = -errno;
+    }
+
+    stats->file_size = *data_offset + data_size;
+    stats->bytes_written += *data_offset;
+
+    return r;
+}
+
+static int open_tmp(const std::string& tmp) {
+    int fd;
+
+    fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror((std::string(__func__) + ": open").c_str());
+        return -errno;
+    }
+
+    return fd;
+}
+
+// The rename itself is only durable once the directory is synced
+static int sync_dir(const std::string& dir) {
+    int fd, r = 0;
+
+    if ((fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0
+            || fsync(fd) < 0) {
+        perror((std::string(__func__) + ": " + dir).c_str());
+        r = -errno;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    return r;
+}
+
+// If r is 0, syncs fd and renames tmp to path; closes fd either way
+static int finish_tmp(int fd, const std::string& tmp, const char* path,
+        int r) {
+    if (!r && fsync(fd) < 0) {
+        perror((std::string(__func__) + ": fsync").c_str());
+        r = -errno;
+    }
+    close(fd);
+
+    if (!r && rename(tmp.c_str(), path) < 0) {
+        perror((std::string(__func__) + ": rename").c_str());
+        r = -errno;
+    }
+    if (r)
+        unlink(tmp.c_str());
+    else
+        r = sync_dir(dir_of(path));
+
+    return r;
+}
+
+// Written under a temporary name, synced and renamed at the end, so a
+// crash never leaves a truncated snapshot behind.
+#ifndef UNITTEST
+static
+#endif
+int write_snapshot(const char* path, const snap_contents& c,
+        snapshot_stats* stats) {
+    int r, fd;
+    const bool layer = !c.parent.empty();
+    std::string tmp = std::string(path) + ".tmp";
+    uint64_t data_offset;
+
+    if ((fd = open_tmp(tmp)) < 0)
+        return fd;
+
+    r = write_layout(fd, c, &data_offset, stats);
+    if (!r && (layer || c.store.empty()))
+        r = write_pages(fd, c.ram, layer ? c.pages->data() : nullptr,
+                layer ? c.pages->size() : c.ram_size / SNAP_PAGE_SIZE,
+                data_offset, stats);
+
+    return finish_tmp(fd, tmp, path, r);
+}
+
+
+
+#ifndef UNITTEST
+static
+#endif
+int open_snapshot(const std::string& path, snap_file* f) {
+    int r;
+
+    f->path = path;
+    if ((f->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        perror((std::string(__func__) + ": " + path).c_str());
+        return -errno;
+    }
+    if (fstat(f->fd, &f->st) < 0) {
+        perror((std::string(__func__) + ": fstat").c_str());
+        return -errno;
+    }
+
+    if ((r = pread_all(f->fd, &f->hdr, sizeof(f->hdr), 0)))
+        return r;
+    if (f->hdr.magic != SNAP_MAGIC || f->hdr.version != SNAP_VERSION
+            || f->hdr.nsections > SNAP_MAX_SECTIONS) {
+        std::cerr << __func__ << ": " << path
+            << ": not a snapshot, or an unsupported version" << std::endl;
+        return -EINVAL;
+    }
+
+    f->sections.resize(f->hdr.nsections);
+    if ((r = pread_all(f->fd, f->sections.data(),
+                    f->sections.size()*sizeof(snap_section),
+                    sizeof(f->hdr))))
+        return r;
+
+    for (const snap_section& sec : f->sections) {
+        if (sec.offset > static_cast<uint64_t>(f->st.st_size)
+                || sec.size > static_cast<uint64_t>(f->st.st_size)
+                    - sec.offset) {
+            std::cerr << __func__ << ": " << path << ": section "
+                << sec.type << " past the end of the file" << std::endl;
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+// Newest first; the last one holds the full RAM, or refs to it.
+#ifndef UNITTEST
+static
+#endif
+int open_chain(const char* path, snap_chain* chain) {
+    int r;
+    std::string next(path), ref;
+    const snap_section* sec;
+
+    while (true) {
+        if (chain->size() == SNAP_MAX_LAYERS) {
+            std::cerr << __func__ << ": more than " << SNAP_MAX_LAYERS
+                << " layers" << std::endl;
+            return -ELOOP;
+        }
+        chain->emplace_back(new snap_file);
+        snap_file* f = chain->back().get();
+        if ((r = open_snapshot(next, f)))
+            return r;
+
+        if (f->hdr.vcpu_num != chain->front()->hdr.vcpu_num
+                || f->hdr.ram_size != chain->front()->hdr.ram_size) {
+            std::cerr << __func__ << ": " << next
+                << ": machine differs from its child" << std::endl;
+            return -EINVAL;
+        }
+
+        if ((sec = f->Find(SNAP_SEC_RAM))) {
+            if (sec->size != f->hdr.ram_size
+                    || sec->offset % SNAP_RAM_ALIGN)
+                return -EINVAL;
+            return 0;
+        }
+        if ((sec = f->Find(SNAP_SEC_PAGE_REFS))) {
+            if (sec->arg != f->hdr.ram_size / SNAP_PAGE_SIZE
+                    || sec->size != sec->arg*sizeof(uint64_t)
+                    || !f->Find(SNAP_SEC_STORE))
+                return -EINVAL;
+            return 0;
+        }
+
+        if (!(sec = f->Find(SNAP_SEC_PARENT)) || !sec->size
+                || sec->size >= PATH_MAX) {
+            std::cerr << __func__ << ": " << next
+                << ": neither RAM nor a parent" << std::endl;
+            return -EINVAL;
+        }
+        ref.resize(sec->size);
+        if ((r = pread_all(f->fd, &ref[0], ref.size(), sec->offset)))
+            return r;
+        next = ref[0] == '/' ? ref : dir_of(f->path) + "/" + ref;
+    }
+}
+
+// Restores the RAM of a base that lives in a page store. Each run of
+// pages whose slots are consecutive is one MAP_PRIVATE mapping of the
+// store's page file, up to SNAP_STORE_MAX_MAPS of them.
+static int map_store(const snap_file& base, uint8_t* ram,
+        snapshot_stats* stats) {
+    struct store_run {
+        uint64_t page, slot, len;
+    };
+
+    int r = 0, fd;
+    const uint64_t npages = base.hdr.ram_size / SNAP_PAGE_SIZE;
+    const snap_section* dir_sec = base.Find(SNAP_SEC_STORE);
+    const snap_section* refs_sec = base.Find(SNAP_SEC_PAGE_REFS);
+    std::vector<uint64_t> refs(npages);
+    std::vector<store_run> runs;
+    std::string dir;
+    struct stat st;
+    uint64_t k, first, slots;
+    void* p;
+
+    if (!dir_sec->size || dir_sec->size >= PATH_MAX)
+        return -EINVAL;
+    dir.resize(dir_sec->size);
+    if ((r = pread_all(base.fd, &dir[0], dir.size(), dir_sec->offset))
+            || (r = pread_all(base.fd, refs.data(), refs_sec->size,
+                    refs_sec->offset)))
+        return r;
+    if (dir[0] != '/')
+        dir = dir_of(base.path) + "/" + dir;
+
+    fd = open((dir + "/" + PAGESTORE_PAGES_FILE).c_str(),
+            O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror((std::string(__func__) + ": " + dir).c_str());
+        r = -errno;
+        if (fd >= 0)
+            close(fd);
+        return r;
+    }
+    slots = st.st_size / SNAP_PAGE_SIZE;
+
+    // Zero pages are not in the store; this also drops whatever was
+    // loaded into RAM before
+    p = mmap(ram, base.hdr.ram_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror((std::string(__func__) + ": mmap").c_str());
+        close(fd);
+        return -errno;
+    }
+
+    k = 0;
+    while (k < npages) {
+        if (refs[k] == PAGESTORE_ZERO) {
+            ++k;
+            continue;
+        }
+        if (refs[k] >= slots) {
+            std::cerr << __func__ << ": " << base.path << ": page " << k
+                << " refers past the end of " << dir << std::endl;
+            close(fd);
+            return -EINVAL;
+        }
+        first = k++;
+        while (k < npages && refs[k] != PAGESTORE_ZERO
+                && refs[k] == refs[k - 1] + 1 && refs[k] < slots)
+            ++k;
+        runs.push_back({ first, refs[first], k - first });
+    }
+
+    // The longest runs get the mappings
+    if (runs.size() > SNAP_STORE_MAX_MAPS)
+        std::nth_element(runs.begin(), runs.begin() + SNAP_STORE_MAX_MAPS,
+                runs.end(), [](const store_run& a, const store_run& b) {
+                    return a.len > b.len;
+                });
+
+    for (size_t i = 0; !r && i < runs.size(); ++i) {
+        uint8_t* dst = ram + runs[i].page*SNAP_PAGE_SIZE;
+        uint64_t len = runs[i].len*SNAP_PAGE_SIZE;
+        uint64_t off = runs[i].slot*SNAP_PAGE_SIZE;
+
+        if (i < SNAP_STORE_MAX_MAPS) {
+            p = mmap(dst, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, fd, off);
+            if (p == MAP_FAILED) {
+                perror((std::string(__func__) + ": mmap").c_str());
+                r = -errno;
+                break;
+            }
+            stats->store_mapped += runs[i].len;
+            stats->store_maps++;
+        } else {
+            r = pread_all(fd, dst, len, off);
+            stats->store_copied += runs[i].len;
+        }
+    }
+    close(fd);
+
+    return r;
+}
+
+// Puts the newest copy each layer holds over the full RAM already at
+// ram. Layers are walked newest first, and a page taken by one is
+// skipped in all older ones.
+#ifndef UNITTEST
+static
+#endif
+int overlay_layers(const snap_chain& chain, uint8_t* ram,
+        snapshot_stats* stats) {
+    int r;
+    const uint64_t npages = chain.front()->hdr.ram_size / SNAP_PAGE_SIZE;
+    DirtyBitmap taken(npages);
+    std::vector<uint64_t> pages;
+    const snap_section *idx_sec, *data_sec;
+    uint64_t k, first, n;
+    void* p;
+
+    stats->layers.clear();
+    for (const auto& f : chain) {
+        snap_layer_stats ls;
+
+        ls.path = f->path;
+        ls.disk_bytes = f->st.st_blocks*512;
+        stats->layers.push_back(ls);
+    }
+
+    for (size_t i = 0; i + 1 < chain.size(); ++i) {
+        const snap_file& f = *chain[i];
+        snap_layer_stats& ls = stats->layers[i];
+
+        idx_sec = f.Find(SNAP_SEC_PAGES);
+        data_sec = f.Find(SNAP_SEC_PAGE_DATA);
+        if (!idx_sec || !data_sec || idx_sec->arg > npages
+                || idx_sec->size != idx_sec->arg*sizeof(uint64_t)
+                || data_sec->size != idx_sec->arg*SNAP_PAGE_SIZE
+                || data_sec->offset % SNAP_RAM_ALIGN) {
+            std::cerr << __func__ << ": " << f.path << ": bad page sections"
+                << std::endl;
+            return -EINVAL;
+        }
+
+        n = idx_sec->arg;
+        pages.resize(n);
+        if ((r = pread_all(f.fd, pages.data(), idx_sec->size,
+                        idx_sec->offset)))
+            return r;
+        for (k = 0; k < n; ++k) {
+            if (pages[k] >= npages || (k && pages[k] <= pages[k - 1])) {
+                std::cerr << __func__ << ": " << f.path
+                    << ": page list out of order" << std::endl;
+                return -EINVAL;
+            }
+        }
+        ls.pages = n;
+
+        k = 0;
+        while (k < n) {
+            if (taken.Test(pages[k])) {
+                ++k;
+                continue;
+            }
+            first = k++;
+            while (k < n && pages[k] == pages[k - 1] + 1
+                    && !taken.Test(pages[k]))
+                ++k;
+
+            uint8_t* dst = ram + pages[first]*SNAP_PAGE_SIZE;
+            uint64_t len = (k - first)*SNAP_PAGE_SIZE;
+            uint64_t off = data_sec->offset + first*SNAP_PAGE_SIZE;
+
+            if (k - first >= SNAP_MAP_MIN_PAGES) {
+                p = mmap(dst, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, f.fd, off);
+                if (p == MAP_FAILED) {
+                    perror((std::string(__func__) + ": mmap").c_str());
+                    return -errno;
+                }
+                ls.pages_mapped += k - first;
+            } else {
+                if ((r = pread_all(f.fd, dst, len, off)))
+                    return r;
+                ls.pages_copied += k - first;
+            }
+            for (uint64_t j = first; j < k; ++j)
+                taken.Set(pages[j]);
+            ls.pages_used += k - first;
+        }
+    }
+
+    // A base in a page store counts what map_store() did, overridden
+    // pages included
+    stats->layers.back().pages = npages;
+    stats->layers.back().pages_used = npages - taken.Count();
+    if (chain.back()->Find(SNAP_SEC_RAM)) {
+        stats->layers.back().pages_mapped = npages - taken.Count();
+    } else {
+        stats->layers.back().pages_mapped = stats->store_mapped;
+        stats->layers.back().pages_copied = stats->store_copied;
+    }
+
+    return 0;
+}
+
+// State comes from the newest file only.
+#ifndef UNITTEST
+static
+#endif
+int read_state(const snap_file& f,
+        std::vector<std::vector<uint8_t>>* vcpu_state,
+        vm_device_state* devices) {
+    int r;
+    bool have_devices = false;
+
+    vcpu_state->assign(f.hdr.vcpu_num, {});
+    for (const snap_section& sec : f.sections) {
+        if (sec.type == SNAP_SEC_VCPU) {
+            if (sec.arg >= f.hdr.vcpu_num)
+                return -EINVAL;
+            (*vcpu_state)[sec.arg].resize(sec.size);
+            if ((r = pread_all(f.fd, (*vcpu_state)[sec.arg].data(),
+                            sec.size, sec.offset)))
+                return r;
+        } else if (sec.type == SNAP_SEC_DEVICES) {
+            if (sec.size != sizeof(*devices))
+                return -EINVAL;
+            if ((r = pread_all(f.fd, devices, sizeof(*devices),
+                            sec.offset)))
+                return r;
+            have_devices = true;
+        }
+    }
+
+    return have_devices ? 0 : -EINVAL;
+}
+
+
+Snapshot::Snapshot(VM* vm) : vm(vm) {}
+
+Snapshot::~Snapshot() {
+    StopLive();
+}
+
+uint64_t Snapshot::ResidentPages() const {
+    return resident_pages(vm->ram_start, vm->getConfig().ram_size);
+}
+
+// Folds the pages dirtied since the previous call into dirty
+int Snapshot::Collect() {
+    int r;
+    DirtyTracker* tracker = vm->getDirtyTracker();
+    std::lock_guard<std::mutex> lk(tracker->mtx);
+
+    if ((r = tracker->Harvest()) < 0)
+        return r;
+
+    const uint64_t* src = tracker->Bitmap().Data();
+    uint64_t* dst = dirty->Data();
+    uint64_t n = std::min(tracker->Bitmap().NumWords(), dirty->NumWords());
+
+    for (uint64_t i = 0; i < n; ++i)
+        dst[i] |= src[i];
+
+    return 0;
+}
+
+// Call with the guest stopped, right after a Save(), so the next layer
+// starts exactly where that one ended.
+int Snapshot::StartTracking() {
+    int r;
+
+    // A periodic harvester would steal the bits layers are made of
+    if (vm->getDirtyTracker())
+        vm->getDirtyTracker()->StopPeriodic();
+    if ((r = vm->enableDirtyLog(true)))
+        return r;
+
+    dirty.reset(new DirtyBitmap(vm->getConfig().ram_size / SNAP_PAGE_SIZE));
+    if ((r = Collect()))
+        return r;
+    dirty->Clear();
+
+    return 0;
+}
+
+int Snapshot::Save(const char* path, const char* parent) {
+    int r;
+    auto start = std::chrono::steady_clock::now();
+    const int vcpu_num = vm->getVcpuNum();
+    std::vector<std::vector<uint8_t>> vcpu_state(vcpu_num);
+    std::vector<uint64_t> pages, refs;
+    vm_device_state devices;
+    snap_contents c;
+
+    stats = snapshot_stats();
+    if (parent && !dirty) {
+        std::cerr << "Snapshot::" << __func__
+            << ": a layer needs StartTracking() first" << std::endl;
+        return -EINVAL;
+    }
+
+    for (int i = 0; i < vcpu_num; ++i) {
+        if ((r = vm->getVcpu(i)->SaveState(&vcpu_state[i])))
+            return r;
+        stats.vcpu_state_bytes += vcpu_state[i].size();
+        stats.vcpu_save_us += vm->getVcpu(i)->LastSaveNs() / 1000;
+    }
+    if ((r = vm->saveDeviceState(&devices)))
+        return r;
+
+    // Bits stay set until the file is in place, so a failed save loses
+    // nothing for the next one.
+    if (dirty && (r = Collect()))
+        return r;
+    if (parent) {
+        for (const dirty_run& run : *dirty)
+            for (uint64_t i = run.first; i < run.first + run.npages; ++i)
+                pages.push_back(i);
+        stats.dirty_pages = pages.size();
+    } else if (store) {
+        r = store->Put(static_cast<const uint8_t*>(vm->ram_start),
+                vm->getConfig().ram_size / SNAP_PAGE_SIZE, &refs);
+        stats.store = store->Stats();
+        stats.bytes_written += stats.store.new_pages*SNAP_PAGE_SIZE;
+        if (r)
+            return r;
+    }
+
+    c = {
+        .vcpu_state = &vcpu_state,
+        .devices = &devices,
+        .ram = static_cast<const uint8_t*>(vm->ram_start),
+        .ram_size = vm->getConfig().ram_size,
+        .parent = parent ? parent_ref(path, parent) : std::string(),
+        .pages = &pages,
+        .store = store && !parent ? store_ref(store->Dir()) : std::string(),
+        .refs = &refs,
+    };
+    if ((r = write_snapshot(path, c, &stats)))
+        return r;
+    if (dirty)
+        dirty->Clear();
+
+    stats.save_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    return 0;
+}
+
+// True if the caller is the first to take page
+bool Snapshot::Claim(uint64_t page) {
+    uint64_t bit = 1ULL << (page % 64);
+
+    return !(saved[page / 64].fetch_or(bit) & bit);
+}
+
+// Also wakes any vCPU waiting to write there
+int Snapshot::Unprotect(uint64_t page, uint64_t npages) {
+    uffdio_writeprotect wp = {
+        .range = {
+            .start = reinterpret_cast<uint64_t>(vm->ram_start)
+                + page*SNAP_PAGE_SIZE,
+            .len = npages*SNAP_PAGE_SIZE,
+        },
+        .mode = 0,
+    };
+
+    while (ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) < 0) {
+        if (errno == EAGAIN)
+            continue;
+        perror(("Snapshot::" + std::string(__func__) + ": ioctl").c_str());
+        return -errno;
+    }
+
+    return 0;
+}
+
+int Snapshot::StartLive() {
+    int probe;
+    const uint64_t ram_size = vm->getConfig().ram_size;
+    const uint64_t npages = ram_size / SNAP_PAGE_SIZE;
+    uffdio_api api = { .api = UFFD_API, .features = 0, .ioctls = 0 };
+    uffdio_register reg = {};
+    uffdio_writeprotect wp = {};
+    uint64_t features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+
+    // Pages are protected and copied SNAP_PAGE_SIZE at a time, which
+    // hugetlb mappings do not take
+    if (vm->getConfig().backing.is_hugetlb()) {
+        std::cerr << "Snapshot::" << __func__
+            << ": not with hugetlb guest RAM" << std::endl;
+        return -EOPNOTSUPP;
+    }
+
+    // UFFDIO_API may only be called once per fd, so ask a throwaway one
+    // what the kernel has.
+    probe = syscall(SYS_userfaultfd, O_CLOEXEC);
+    if (probe < 0 || ioctl(probe, UFFDIO_API, &api) < 0) {
+        perror(("Snapshot::" + std::string(__func__)
+                    + ": userfaultfd (see vm.unprivileged_userfaultfd)")
+                .c_str());
+        if (probe >= 0)
+            close(probe);
+        return -errno;
+    }
+    close(probe);
+    if (!(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        std::cerr << "Snapshot::" << __func__
+            << ": no userfaultfd write-protect on this kernel" << std::endl;
+        return -EOPNOTSUPP;
+    }
+    // Needed for shared guest RAM
+    features |= api.features & UFFD_FEATURE_WP_HUGETLBFS_SHMEM;
+
+    if ((uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK)) < 0) {
+        perror(("Snapshot::" + std::string(__func__)
+                    + ": userfaultfd").c_str());
+        return -errno;
+    }
+
+    api = { .api = UFFD_API, .features = features, .ioctls = 0 };
+    reg.range.start = reinterpret_cast<uint64_t>(vm->ram_start);
+    reg.range.len = ram_size;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    wp.range = reg.range;
+    wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+
+    if (ioctl(uffd, UFFDIO_API, &api) < 0
+            || ioctl(uffd, UFFDIO_REGISTER, &reg) < 0
+            || ioctl(uffd, UFFDIO_WRITEPROTECT, &wp) < 0) {
+        perror(("Snapshot::" + std::string(__func__) + ": ioctl").c_str());
+        return -errno;
+    }
+
+    if ((stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror(("Snapshot::" + std::string(__func__) + ": eventfd").c_str());
+        return -errno;
+    }
+
+    saved.reset(new std::atomic<uint64_t>[(npages + 63) / 64]());
+    bounce.reset(new uint8_t[SNAP_PAGE_SIZE]);
+    // Claim() lets each page fault at most once, so FaultLoop() never
+    // allocates while a vCPU waits on it
+    stall_ns.clear();
+    stall_ns.reserve(npages);
+    cbw_bytes = cbw_zero = 0;
+    live_error = 0;
+    fault_thread = std::thread(&Snapshot::FaultLoop, this);
+
+    return 0;
+}
+
+// Unregistering drops whatever write protection is left
+void Snapshot::StopLive() {
+    uint64_t one = 1;
+    uffdio_range range = {
+        .start = reinterpret_cast<uint64_t>(vm->ram_start),
+        .len = vm->getConfig().ram_size,
+    };
+
+    if (fault_thread.joinable()) {
+        if (write(stop_fd, &one, sizeof(one)) < 0)
+            perror(("Snapshot::" + std::string(__func__) + ": write")
+                    .c_str());
+        fault_thread.join();
+    }
+    if (uffd >= 0) {
+        if (ioctl(uffd, UFFDIO_UNREGISTER, &range) < 0)
+            perror(("Snapshot::" + std::string(__func__) + ": ioctl")
+                    .c_str());
+        close(uffd);
+        uffd = -1;
+    }
+    if (stop_fd >= 0) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+}
+
+// The stall is counted from reading the fault to the ioctl that lets the
+// vCPU go; the page is written out after that.
+void Snapshot::FaultLoop() {
+    int r;
+    uffd_msg msg;
+    uint64_t page;
+    bool zero;
+    const uint64_t npages = vm->getConfig().ram_size / SNAP_PAGE_SIZE;
+    const uint8_t* ram = static_cast<const uint8_t*>(vm->ram_start);
+    std::chrono::steady_clock::time_point t;
+    pollfd fds[2] = {
+        { .fd = uffd, .events = POLLIN, .revents = 0 },
+        { .fd = stop_fd, .events = POLLIN, .revents = 0 },
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror(("Snapshot::" + std::string(__func__) + ": poll").c_str());
+            live_error = -errno;
+            return;
+        }
+        if (fds[1].revents)
+            return;
+
+        if (read(uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            perror(("Snapshot::" + std::string(__func__) + ": read").c_str());
+            live_error = -errno;
+            return;
+        }
+        t = std::chrono::steady_clock::now();
+        if (msg.event != UFFD_EVENT_PAGEFAULT
+                || !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP))
+            continue;
+
+        // If the writer has the page, its Unprotect() wakes the vCPU
+        page = (msg.arg.pagefault.address
+                - reinterpret_cast<uint64_t>(ram)) / SNAP_PAGE_SIZE;
+        if (page >= npages || !Claim(page))
+            continue;
+
+        zero = is_zero_page(ram + page*SNAP_PAGE_SIZE);
+        if (!zero)
+            std::memcpy(bounce.get(), ram + page*SNAP_PAGE_SIZE,
+                    SNAP_PAGE_SIZE);
+        if ((r = Unprotect(page, 1))) {
+            live_error = r;
+            return;
+        }
+        stall_ns.push_back(std::chrono::duration_cast<
+                std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - t).count());
+
+        if (zero) {
+            cbw_zero++;
+            continue;
+        }
+        if ((r = pwrite_all(live_fd, bounce.get(), SNAP_PAGE_SIZE,
+                        live_offset + page*SNAP_PAGE_SIZE))) {
+            live_error = r;
+            return;
+        }
+        cbw_bytes += SNAP_PAGE_SIZE;
+    }
+}
+
+int Snapshot::SaveLive(const char* path) {
+    int r, resume_r, fd;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point stop;
+    const int vcpu_num = vm->getVcpuNum();
+    const uint64_t npages = vm->getConfig().ram_size / SNAP_PAGE_SIZE;
+    const uint8_t* ram = static_cast<const uint8_t*>(vm->ram_start);
+    std::vector<std::vector<uint8_t>> vcpu_state(vcpu_num);
+    std::string tmp = std::string(path) + ".tmp";
+    vm_device_state devices;
+    snap_contents c;
+    uint64_t k, first;
+
+    stats = snapshot_stats();
+    if ((fd = open_tmp(tmp)) < 0)
+        return fd;
+    live_fd = fd;
+
+    if ((r = vm->Pause()))
+        return finish_tmp(fd, tmp, path, r);
+    stop = std::chrono::steady_clock::now();
+
+    for (int i = 0; !r && i < vcpu_num; ++i) {
+        r = vm->getVcpu(i)->SaveState(&vcpu_state[i]);
+        stats.vcpu_state_bytes += vcpu_state[i].size();
+        stats.vcpu_save_us += vm->getVcpu(i)->LastSaveNs() / 1000;
+    }
+    if (!r)
+        r = vm->saveDeviceState(&devices);
+    if (!r)
+        r = StartLive();
+
+    resume_r = vm->Resume();
+    stats.stop_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - stop).count();
+    if (!r)
+        r = resume_r;
+
+    c = {
+        .vcpu_state = &vcpu_state,
+        .devices = &devices,
+        .ram = nullptr,
+        .ram_size = vm->getConfig().ram_size,
+        .parent = std::string(),
+        .pages = nullptr,
+        .store = std::string(),
+        .refs = nullptr,
+    };
+    if (!r)
+        r = write_layout(fd, c, &live_offset, &stats);
+
+    k = 0;
+    while (!r && k < npages) {
+        if (!Claim(k)) {
+            ++k;
+            continue;
+        }
+        first = k++;
+        while (k < npages && k - first < SNAP_LIVE_RUN_PAGES && Claim(k))
+            ++k;
+
+        r = write_pages(fd, ram + first*SNAP_PAGE_SIZE, nullptr, k - first,
+                live_offset + first*SNAP_PAGE_SIZE, &stats);
+        if (!r)
+            r = Unprotect(first, k - first);
+        if (!r)
+            r = live_error;
+    }
+
+    StopLive();
+    if (!r)
+        r = live_error;
+
+    stats.cbw_pages = stall_ns.size();
+    stats.bytes_written += cbw_bytes;
+    stats.zero_pages += cbw_zero;
+    for (uint64_t ns : stall_ns)
+        stats.stall_us += ns / 1000;
+    stats.stall_p99_us = percentile(&stall_ns, 99) / 1000;
+    stats.stall_max_us = percentile(&stall_ns, 100) / 1000;
+    stats.save_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    return finish_tmp(fd, tmp, path, r);
+}
+
+int Snapshot::Load(const char* path) {
+    int r;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::vector<uint8_t>> vcpu_state;
+    vm_device_state devices;
+    snap_chain chain;
+    const snap_section* ram;
+
+    stats = snapshot_stats();
+    if ((r = open_chain(path, &chain)))
+        return r;
+
+    const snap_file& top = *chain.front();
+    if (top.hdr.vcpu_num != static_cast<uint32_t>(vm->getVcpuNum())
+            || top.hdr.ram_size != vm->getConfig().ram_size) {
+        std::cerr << "Snapshot::" << __func__ << ": machine mismatch: "
+            << top.hdr.vcpu_num << " vCPUs, " << top.hdr.ram_size
+            << " bytes of RAM" << std::endl;
+        return -EINVAL;
+    }
+
+    if ((r = read_state(top, &vcpu_state, &devices)))
+        return r;
+    for (int i = 0; i < vm->getVcpuNum(); ++i) {
+        if ((r = vm->getVcpu(i)->LoadState(vcpu_state[i].data(),
+                        vcpu_state[i].size())))
+            return r;
+    }
+    if ((r = vm->loadDeviceState(&devices)))
+        return r;
+
+    // The mappings keep their own references to the files
+    ram = chain.back()->Find(SNAP_SEC_RAM);
+    if (ram)
+        r = vm->mapGuestRAM(chain.back()->fd, ram->offset);
+    else
+        r = map_store(*chain.back(), static_cast<uint8_t*>(vm->ram_start),
+                &stats);
+    if (r || (r = overlay_layers(chain, static_cast<uint8_t*>(
+                        vm->ram_start), &stats)))
+        return r;
+
+    stats.file_size = top.st.st_size;
+    stats.load_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    stats.pages_touched = ResidentPages();
+
+    return 0;
+}
+
+
+int snapshot_compact(const char* path, const char* out,
+        snapshot_stats* stats) {
+    int r;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::vector<uint8_t>> vcpu_state;
+    vm_device_state devices;
+    snap_chain chain;
+    snap_contents c;
+    void* ram;
+
+    *stats = snapshot_stats();
+    if ((r = open_chain(path, &chain))
+            || (r = read_state(*chain.front(), &vcpu_state, &devices)))
+        return r;
+
+    const snap_file& base = *chain.back();
+    const snap_section* base_ram = base.Find(SNAP_SEC_RAM);
+    if (base_ram)
+        ram = mmap(nullptr, base.hdr.ram_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE, base.fd, base_ram->offset);
+    else
+        ram = mmap(nullptr, base.hdr.ram_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ram == MAP_FAILED) {
+        perror((std::string(__func__) + ": mmap").c_str());
+        return -errno;
+    }
+
+    r = base_ram ? 0 : map_store(base, static_cast<uint8_t*>(ram), stats);
+    if (!r)
+        r = overlay_layers(chain, static_cast<uint8_t*>(ram), stats);
+    if (!r) {
+        c = {
+            .vcpu_state = &vcpu_state,
+            .devices = &devices,
+            .ram = static_cast<const uint8_t*>(ram),
+            .ram_size = base.hdr.ram_size,
+            .parent = std::string(),
+            .pages = nullptr,
+            .store = std::string(),
+            .refs = nullptr,
+        };
+        r = write_snapshot(out, c, stats);
+    }
+    munmap(ram, base.hdr.ram_size);
+
+    stats->save_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    return r;
+}
+
+
+void print_snapshot_stats(const snapshot_stats& stats) {
+    if (stats.save_ms || stats.bytes_written)
+        std::cout << "snapshot: saved in " << stats.save_ms << "ms, "
+            << stats.bytes_written << " bytes written, "
+            << stats.zero_pages << " zero pages left as holes, "
+            << stats.file_size << " bytes apparent size" << std::endl;
+
+    if (stats.vcpu_state_bytes)
+        std::cout << "snapshot: " << stats.vcpu_state_bytes
+            << " bytes of vCPU state captured in " << stats.vcpu_save_us
+            << "us" << std::endl;
+
+    if (stats.stop_us)
+        std::cout << "snapshot: live, guest stopped for " << stats.stop_us
+            << "us, " << stats.cbw_pages << " pages copied before write ("
+            << stats.cbw_pages*1000 / std::max<uint64_t>(1, stats.save_ms)
+            << " pages/s), write stalls " << stats.stall_us << "us in total"
+            << ", p99 " << stats.stall_p99_us << "us, max "
+            << stats.stall_max_us << "us" << std::endl;
+
+    if (stats.store.pages)
+        print_pagestore_stats(stats.store);
+
+    if (stats.store_mapped || stats.store_copied)
+        std::cout << "snapshot: " << stats.store_mapped + stats.store_copied
+            << " pages from the page store, " << stats.store_mapped
+            << " mapped in " << stats.store_maps << " mappings, "
+            << stats.store_copied << " copied" << std::endl;
+
+    if (stats.dirty_pages)
+        std::cout << "snapshot: layer of " << stats.dirty_pages
+            << " pages dirtied since the parent" << std::endl;
+
+    if (stats.load_us)
+        std::cout << "snapshot: loaded in " << stats.load_us << "us, "
+            << stats.pages_touched << " RAM pages touched" << std::endl;
+
+    for (size_t i = 0; i < stats.layers.size(); ++i) {
+        const snap_layer_stats& ls = stats.layers[i];
+
+        std::cout << "snapshot: layer " << i << " " << ls.path << ": "
+            << ls.disk_bytes << " bytes on disk, " << ls.pages << " pages"
+            << ", " << ls.pages_used << " in use (" << ls.pages_mapped
+            << " mapped, " << ls.pages_copied << " copied)" << std::endl;
+    }
+}
@@ -0,0 +1,209 @@
+/*
+ *  src/stream.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <stream.hpp>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+
+int Stream::WriteAll(const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    ssize_t r;
+
+    while (size) {
+        r = write(fd, p, size);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror(("Stream::" + std::string(__func__) + ": write").c_str());
+            return -errno;
+        }
+        p += r;
+        size -= r;
+        bytes_written += r;
+    }
+
+    return 0;
+}
+
+int Stream::Flush() {
+    int r;
+
+    if (!wlen)
+        return 0;
+    r = WriteAll(wbuf.get(), wlen);
+    wlen = 0;
+
+    return r;
+}
+
+int Stream::Write(const void* data, size_t size) {
+    int r;
+
+    if (wlen + size > STREAM_BUF_SIZE) {
+        if ((r = Flush()))
+            return r;
+    }
+
+    if (size >= STREAM_BUF_SIZE)
+        return WriteAll(data, size);
+
+    std::memcpy(wbuf.get() + wlen, data, size);
+    wlen += size;
+
+    return 0;
+}
+
+int Stream::Read(void* data, size_t size) {
+    uint8_t* p = static_cast<uint8_t*>(data);
+    ssize_t r;
+    size_t n;
+
+    while (size) {
+        if (rpos == rlen) {
+            // Large reads go straight to the destination.
+            if (size >= STREAM_BUF_SIZE) {
+                r = read(fd, p, size);
+            } else {
+                r = read(fd, rbuf.get(), STREAM_BUF_SIZE);
+                rpos = 0;
+                rlen = r > 0 ? r : 0;
+            }
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror(("Stream::" + std::string(__func__)
+                            + ": read").c_str());
+                return -errno;
+            }
+            if (r == 0) {
+                std::cerr << "Stream::" << __func__ << ": unexpected EOF"
+                    << std::endl;
+                return -EPIPE;
+            }
+            bytes_read += r;
+            if (size >= STREAM_BUF_SIZE) {
+                p += r;
+                size -= r;
+                continue;
+            }
+        }
+
+        n = std::min(size, rlen - rpos);
+        std::memcpy(p, rbuf.get() + rpos, n);
+        rpos += n;
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+Stream::Stream(int fd)
+        : fd(fd),
+          wbuf(new uint8_t[STREAM_BUF_SIZE]),
+          rbuf(new uint8_t[STREAM_BUF_SIZE]) {}
+
+Stream::~Stream() {
+    Flush();
+    if (fd >= 0)
+        close(fd);
+}
+
+
+static int unix_addr(const char* path, sockaddr_un* addr) {
+    std::memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(addr->sun_path)) {
+        std::cerr << __func__ << ": path too long: " << path << std::endl;
+        return -ENAMETOOLONG;
+    }
+    std::strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    return 0;
+}
+
+int unix_listen(const char* path) {
+    int fd, r;
+    sockaddr_un addr;
+
+    if ((r = unix_addr(path, &addr)))
+        return r;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror((std::string(__func__) + ": socket").c_str());
+        return -errno;
+    }
+
+    unlink(path);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+            || listen(fd, SOMAXCONN) < 0) {
+        perror((std::string(__func__) + ": bind/listen").c_str());
+        r = -errno;
+        close(fd);
+        return r;
+    }
+
+    std::cout << __func__ << ": listening on " << path << std::endl;
+
+    return fd;
+}
+
+int unix_accept(int listen_fd) {
+    int fd;
+
+    while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC)) < 0) {
+        if (errno == EINTR)
+            continue;
+        perror((std::string(__func__) + ": accept4").c_str());
+        return -errno;
+    }
+
+    return fd;
+}
+
+int unix_connect(const char* path, int timeout_ms) {
+    int fd, r;
+    sockaddr_un addr;
+    auto deadline = std::chrono::steady_clock::now()
+                  + std::chrono::milliseconds(timeout_ms);
+
+    if ((r = unix_addr(path, &addr)))
+        return r;
+
+    // The peer may not be listening yet; keep trying until the deadline.
+    while (true) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+            perror((std::string(__func__) + ": socket").c_str());
+            return -errno;
+        }
+        if (!connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)))
+            return fd;
+
+        r = -errno;
+        close(fd);
+        if ((r != -ENOENT && r != -ECONNREFUSED)
+                || std::chrono::steady_clock::now() >= deadline) {
+            errno = -r;
+            perror((std::string(__func__) + ": connect").c_str());
+            return r;
+        }
+        std::this_thread::sleep_for(
+                std::chrono::milliseconds(UNIX_CONNECT_RETRY_MS));
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ *  src/timeline.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <timeline.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+void BootTimeline::Mark(const std::string& name) {
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    std::lock_guard<std::mutex> lk(mtx);
+
+    events.push_back({ name, ns });
+}
+
+void BootTimeline::MarkOnce(const std::string& name) {
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    std::lock_guard<std::mutex> lk(mtx);
+
+    for (const timeline_event& e : events) {
+        if (e.name == name)
+            return;
+    }
+    events.push_back({ name, ns });
+}
+
+std::vector<timeline_event> BootTimeline::Events() const {
+    std::lock_guard<std::mutex> lk(mtx);
+
+    return events;
+}
+
+
+// Marks from different threads can land out of order by a few ns; a
+// phase is never negative
+std::vector<timeline_event> timeline_phases(
+        const std::vector<timeline_event>& events) {
+    std::vector<timeline_event> phases;
+    uint64_t prev = 0;
+
+    for (const timeline_event& e : events) {
+        phases.push_back({ e.name, e.ns > prev ? e.ns - prev : 0 });
+        prev = std::max(prev, e.ns);
+    }
+
+    return phases;
+}
+
+std::string timeline_format(const std::vector<timeline_event>& events) {
+    std::string s = "{\"boot_timeline_ns\":[";
+
+    for (size_t i = 0; i < events.size(); ++i) {
+        if (i)
+            s += ",";
+        s += "[\"" + events[i].name + "\"," + std::to_string(events[i].ns)
+            + "]";
+    }
+
+    return s + "]}";
+}
@@ -7,22 +7,31 @@
 
 #include <vcpu.hpp>
 
+#include <pthread.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <linux/kvm.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <ios>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <dirty.hpp>
 #include <kvm.hpp>
 #include <pio.hpp>
+#include <vm.hpp>
 
 
 #ifdef GUEST_DEBUG
@@ -95,7 +104,7 @@ int Vcpu::SetSregs(vcpu_sregs *sregs) {
     return 0;
 }
 
-int Vcpu::InitRegs(uint64_t rip, uint64_t rsi) {
+int Vcpu::InitRegs(uint64_t rip, uint64_t rsi, uint64_t rbx) {
     int r;
     vcpu_regs  regs;
 
@@ -104,6 +113,7 @@ int Vcpu::InitRegs(uint64_t rip, uint64_t rsi) {
 
     regs.rip = rip;
     regs.rsi = rsi;
+    regs.rbx = rbx;
     regs.rflags = RF_INIT;
 
     if ((r = SetRegs(&regs)))
@@ -421,6 +431,10 @@ int Vcpu::Run() {
             perror("Vcpu::run(): cannot recover");
             return -errno;
         }
+        // KVM leaves exit_reason alone on EINTR; without this the previous
+        // exit would be handled a second time.
+        if (errno == EINTR)
+            run->exit_reason = KVM_EXIT_INTR;
     }
 
     return r;
@@ -453,6 +467,11 @@ int Vcpu::RunOnce() {
         case KVM_EXIT_MMIO:
             return 1;  // unimplemented
 
+        case KVM_EXIT_DIRTY_RING_FULL:
+            // KVM refuses to re-enter until the ring has been reset, and
+            // everything in it must reach the tracker first.
+            return vm->reapDirtyRing(this) < 0;
+
         default:
         /*
          *  no plan for support these below
@@ -486,6 +505,37 @@ int Vcpu::RunOnce() {
     }
 }
 
+uint32_t Vcpu::CollectDirtyRing(DirtyRing* ring) {
+    uint32_t n = 0;
+    const int node = vm->getVcpuNode(cpu_id);
+    kvm_dirty_gfn* gfn;
+
+    if (!dirty_gfns)
+        return 0;
+
+    while (true) {
+        gfn = &dirty_gfns[dirty_fetch_index % dirty_ring_entries];
+        if (!(__atomic_load_n(&gfn->flags, __ATOMIC_ACQUIRE)
+                    & KVM_DIRTY_GFN_F_DIRTY))
+            break;
+
+        if (ring)
+            ring->Mark(gfn->slot, gfn->offset);
+        if (ring && node >= 0) {
+            if (vm->getBankNode(gfn->slot) == node)
+                numa_local.fetch_add(1, std::memory_order_relaxed);
+            else
+                numa_remote.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        __atomic_store_n(&gfn->flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+        dirty_fetch_index++;
+        n++;
+    }
+
+    return n;
+}
+
 int Vcpu::RunLoop() {
     int r;
 
@@ -500,6 +550,9 @@ int Vcpu::RunLoop() {
     std::cout << "Vcpu::" << __func__ << ": cpu " << cpu_id
         << " is running" << std::endl;
 
+    throttle_since = std::chrono::steady_clock::now();
+    vm->getTimeline()->MarkOnce("first_kvm_run");
+
     while (true) {
 
 #ifdef GUEST_DEBUG
@@ -523,12 +576,12 @@ run_loop_start:
                         std::cout.setf(std::ios::hex, std::ios::basefield);
                         std::cout << "regs.rip: " << regs.rip << std::endl;
 
-                        inst_hva_base = reinterpret_cast<char*>(
-                                vm->ram_start) + regs.rip;
+                        inst_hva_base = static_cast<char*>(
+                                vm->gpaToHva(regs.rip, 16));
 
                         DumpRegs();
 
-                        for (int i = 0; i < 16; ++i) {
+                        for (int i = 0; inst_hva_base && i < 16; ++i) {
                             bin = *inst_hva_base++;
                             std::cout
                                 << std::setfill('0')
@@ -588,9 +641,270 @@ run_loop_start:
 
             return 1;
         }
+
+        // Kicks come from Pause(), Stop() and the throttle ticker
+        if (run->exit_reason == KVM_EXIT_INTR) {
+            if (vm->isPausePending() && !vm->isStopPending())
+                vm->parkVcpu();
+            if (vm->isStopPending())
+                return 0;
+            run->immediate_exit = 0;
+        }
+
+        Throttle();
     }
 }
 
+// Sleeps pct/(100 - pct) times as long as the vCPU ran since the last
+// sleep, so it gets (100 - pct)% of the wall clock. The throttle ticker
+// kicks the vCPU every slice, so a guest that never exits is caught too.
+// The sleep goes a slice at a time so that Pause() is not held up.
+void Vcpu::Throttle() {
+    int pct = vm->getThrottle();
+    auto now = std::chrono::steady_clock::now();
+    auto slice = std::chrono::milliseconds(VCPU_THROTTLE_SLICE_MS);
+    std::chrono::nanoseconds ran = now - throttle_since, left;
+
+    if (!pct) {
+        throttle_since = now;
+        return;
+    }
+    if (ran < slice)
+        return;
+
+    // Running long before the throttle came on does not count
+    left = std::min<std::chrono::nanoseconds>(ran, 2*slice)*pct / (100 - pct);
+
+    while (left.count() > 0 && !vm->isPausePending()) {
+        std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(left,
+                    slice));
+        throttle_since = std::chrono::steady_clock::now();
+        throttled_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                throttle_since - now).count();
+        left -= throttle_since - now;
+        now = throttle_since;
+    }
+    throttle_since = std::chrono::steady_clock::now();
+}
+
+void Vcpu::Kick() {
+    if (!thread)
+        return;
+
+    __atomic_store_n(&run->immediate_exit, 1, __ATOMIC_RELEASE);
+    pthread_kill(thread, SIG_VCPU_KICK);
+}
+
+// Drops the MSRs KVM lists but this vCPU cannot read, e.g. for features
+// CPUID does not expose. KVM_GET_MSRS stops at the first one it fails on
+// and returns how many it read; an error or more than were asked for
+// throws, as this runs from the constructor.
+std::vector<uint32_t> Vcpu::ProbeMSRs() {
+    std::vector<uint32_t> indices = kvm->getMSRIndexList();
+    std::vector<uint8_t> buf;
+    kvm_msrs* msrs;
+    int r;
+
+    while (true) {
+        buf.assign(sizeof(kvm_msrs) + indices.size()*sizeof(kvm_msr_entry),
+                0);
+        msrs = reinterpret_cast<kvm_msrs*>(buf.data());
+        msrs->nmsrs = indices.size();
+        for (size_t i = 0; i < indices.size(); ++i)
+            msrs->entries[i].index = indices[i];
+
+        r = kvmIoctl(KVM_GET_MSRS, msrs);
+        if (r < 0)
+            throw std::runtime_error("Vcpu::" + std::string(__func__)
+                    + ": KVM_GET_MSRS: " + strerror(-r));
+        if (static_cast<size_t>(r) > indices.size())
+            throw std::runtime_error("Vcpu::" + std::string(__func__)
+                    + ": KVM_GET_MSRS read " + std::to_string(r) + " of "
+                    + std::to_string(indices.size()) + " MSRs");
+        if (static_cast<size_t>(r) == indices.size())
+            return indices;
+        indices.erase(indices.begin() + r);
+    }
+}
+
+void Vcpu::InitState() {
+    const kvm_cap& cap = kvm->getCap();
+    std::vector<uint32_t> msr_indices = ProbeMSRs();
+    uint32_t xsave_len;
+    size_t off = 0;
+    kvm_msrs* msrs;
+
+    xsave_len = std::max<uint32_t>(sizeof(kvm_xsave), cap.xsave2);
+
+    state_reqs.push_back({VCPU_STATE_SREGS, KVM_GET_SREGS, KVM_SET_SREGS,
+            sizeof(vcpu_sregs), nullptr});
+    state_reqs.push_back({VCPU_STATE_REGS, KVM_GET_REGS, KVM_SET_REGS,
+            sizeof(vcpu_regs), nullptr});
+    if (cap.xsave2)
+        state_reqs.push_back({VCPU_STATE_XSAVE, KVM_GET_XSAVE2,
+                KVM_SET_XSAVE, xsave_len, nullptr});
+    else if (cap.xsave)
+        state_reqs.push_back({VCPU_STATE_XSAVE, KVM_GET_XSAVE,
+                KVM_SET_XSAVE, xsave_len, nullptr});
+    else
+        state_reqs.push_back({VCPU_STATE_FPU, KVM_GET_FPU, KVM_SET_FPU,
+                sizeof(kvm_fpu), nullptr});
+    if (cap.xcrs)
+        state_reqs.push_back({VCPU_STATE_XCRS, KVM_GET_XCRS, KVM_SET_XCRS,
+                sizeof(kvm_xcrs), nullptr});
+    state_reqs.push_back({VCPU_STATE_MP_STATE, KVM_GET_MP_STATE,
+            KVM_SET_MP_STATE, sizeof(kvm_mp_state), nullptr});
+    state_reqs.push_back({VCPU_STATE_LAPIC, KVM_GET_LAPIC, KVM_SET_LAPIC,
+            sizeof(kvm_lapic_state), nullptr});
+    state_reqs.push_back({VCPU_STATE_MSRS, KVM_GET_MSRS, KVM_SET_MSRS,
+            static_cast<uint32_t>(sizeof(kvm_msrs)
+                + msr_indices.size()*sizeof(kvm_msr_entry)), nullptr});
+    if (cap.vcpu_events)
+        state_reqs.push_back({VCPU_STATE_EVENTS, KVM_GET_VCPU_EVENTS,
+                KVM_SET_VCPU_EVENTS, sizeof(kvm_vcpu_events), nullptr});
+    if (cap.debugregs)
+        state_reqs.push_back({VCPU_STATE_DEBUGREGS, KVM_GET_DEBUGREGS,
+                KVM_SET_DEBUGREGS, sizeof(kvm_debugregs), nullptr});
+
+    for (const state_req& req : state_reqs)
+        state_size += sizeof(vcpu_state_entry) + req.len;
+    state_buf.assign(state_size, 0);
+    for (state_req& req : state_reqs) {
+        req.buf = state_buf.data() + off;
+        off += req.len;
+    }
+
+    msrs = nullptr;
+    for (state_req& req : state_reqs)
+        if (req.type == VCPU_STATE_MSRS)
+            msrs = reinterpret_cast<kvm_msrs*>(req.buf);
+    msrs->nmsrs = msr_indices.size();
+    for (size_t i = 0; i < msr_indices.size(); ++i)
+        msrs->entries[i].index = msr_indices[i];
+
+    std::cout << "Vcpu::" << __func__ << ": " << state_reqs.size()
+        << " entries, " << msr_indices.size() << " of "
+        << kvm->getMSRIndexList().size() << " MSRs, " << state_size
+        << " bytes" << std::endl;
+}
+
+int Vcpu::SaveState(std::vector<uint8_t>* out) {
+    int r;
+    auto start = std::chrono::steady_clock::now();
+    vcpu_state_entry e;
+    uint8_t* p;
+
+    // Every GET goes straight into out; only the MSR indices are copied.
+    out->resize(state_size);
+    p = out->data();
+    for (const state_req& req : state_reqs) {
+        e = { .type = req.type, .len = req.len };
+        std::memcpy(p, &e, sizeof(e));
+        p += sizeof(e);
+        if (req.type == VCPU_STATE_MSRS)
+            std::memcpy(p, req.buf, req.len);
+
+        r = kvmIoctl(req.get, p);
+        if (r < 0 || (req.type == VCPU_STATE_MSRS && static_cast<uint32_t>(r)
+                    != reinterpret_cast<kvm_msrs*>(p)->nmsrs)) {
+            std::cerr << "Vcpu::" << __func__ << ": cpu " << cpu_id
+                << ": cannot get entry " << req.type << ": "
+                << (r < 0 ? strerror(-r) : "short MSR read") << std::endl;
+            return r < 0 ? r : -EIO;
+        }
+        p += req.len;
+    }
+
+    last_save_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    return 0;
+}
+
+int Vcpu::LoadState(const uint8_t* data, size_t size) {
+    int r;
+    vcpu_state_entry e;
+    const uint8_t* payload;
+    std::vector<uint8_t> msr_buf;
+    uint8_t* buf;
+    kvm_msrs* msrs;
+
+    for (size_t off = 0; off + sizeof(e) <= size; off += sizeof(e) + e.len) {
+        std::memcpy(&e, data + off, sizeof(e));
+        if (off + sizeof(e) + e.len > size) {
+            std::cerr << "Vcpu::" << __func__ << ": cpu " << cpu_id
+                << ": truncated state" << std::endl;
+            return -EINVAL;
+        }
+    }
+
+    // In state_reqs order. Sregs go first: KVM derives the mode from them
+    // when loading regs, and they carry the APIC base. The LAPIC precedes
+    // the MSRs, as in QEMU, because KVM drops a TSC deadline written while
+    // the LAPIC timer is not in TSC-deadline mode. Events need the LAPIC
+    // too.
+    for (state_req& req : state_reqs) {
+        payload = nullptr;
+        for (size_t off = 0; off + sizeof(e) <= size;
+                off += sizeof(e) + e.len) {
+            std::memcpy(&e, data + off, sizeof(e));
+            if (e.type == req.type) {
+                payload = data + off + sizeof(e);
+                break;
+            }
+        }
+        if (!payload)
+            continue;
+
+        buf = req.buf;
+        if (req.type == VCPU_STATE_MSRS) {
+            // The source may have saved a different set of MSRs.
+            if (e.len < sizeof(kvm_msrs)) {
+                e.len = 0;
+            } else {
+                msr_buf.assign(payload, payload + e.len);
+                buf = msr_buf.data();
+                msrs = reinterpret_cast<kvm_msrs*>(buf);
+                if (e.len != sizeof(kvm_msrs)
+                        + msrs->nmsrs*sizeof(kvm_msr_entry))
+                    e.len = 0;
+            }
+        } else if (req.type == VCPU_STATE_XSAVE && e.len <= req.len
+                && e.len >= sizeof(kvm_xsave)) {
+            // Hosts differ in how much extended state they save.
+            std::memset(buf, 0, req.len);
+            std::memcpy(buf, payload, e.len);
+        } else if (e.len == req.len) {
+            std::memcpy(buf, payload, e.len);
+        } else {
+            e.len = 0;
+        }
+        if (!e.len) {
+            std::cerr << "Vcpu::" << __func__ << ": cpu " << cpu_id
+                << ": bad length for entry " << e.type << std::endl;
+            return -EINVAL;
+        }
+
+        r = kvmIoctl(req.set, buf);
+        if (r < 0) {
+            std::cerr << "Vcpu::" << __func__ << ": cpu " << cpu_id
+                << ": cannot set entry " << req.type << ": "
+                << strerror(-r) << std::endl;
+            return r;
+        }
+        msrs = reinterpret_cast<kvm_msrs*>(buf);
+        if (req.type == VCPU_STATE_MSRS
+                && static_cast<uint32_t>(r) != msrs->nmsrs) {
+            std::cerr << "Vcpu::" << __func__ << ": cpu " << cpu_id
+                << ": cannot set MSR 0x" << std::hex
+                << msrs->entries[r].index << std::dec << std::endl;
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 Vcpu::Vcpu(int vcpu_fd, KVM* kvm, VM* vm, int cpu_id)
     : BaseClass(vcpu_fd), kvm(kvm), vm(vm), cpu_id(cpu_id) {
     std::cout << "Constructing Vcpu..." << std::endl;
@@ -609,6 +923,7 @@ Vcpu::Vcpu(int vcpu_fd, KVM* kvm, VM* vm, int cpu_id)
         kvm_cpuid->entries[i].edx = KVM_CPUID_EDX;
     }
     kvmIoctlCtor(KVM_SET_CPUID2, kvm_cpuid);
+    InitState();
 
     run = static_cast<kvm_run*>(mmap(NULL, kvm->mmap_size
                 , PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0));
@@ -621,7 +936,29 @@ Vcpu::Vcpu(int vcpu_fd, KVM* kvm, VM* vm, int cpu_id)
         std::cout << "Vcpu.run mmaped: " << run << std::endl;
     }
 
+    // The dirty ring lives at KVM_DIRTY_LOG_PAGE_OFFSET pages into the
+    // vCPU fd, right after the kvm_run mapping.
+    dirty_ring_entries = vm->getDirtyRingEntries();
+    if (dirty_ring_entries) {
+        void* ring = mmap(NULL, dirty_ring_entries*sizeof(kvm_dirty_gfn),
+                PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+                KVM_DIRTY_LOG_PAGE_OFFSET*getpagesize());
+        if (ring == MAP_FAILED) {
+            perror("Vcpu.dirty_gfns: mmap");
+            throw std::runtime_error("Vcpu::" + std::string(__func__)
+                    + ": " + strerror(errno));
+        }
+        dirty_gfns = static_cast<kvm_dirty_gfn*>(ring);
+        std::cout << "Vcpu.dirty_gfns mmaped: " << ring << std::endl;
+    }
+
     std::cout << "Constructed Vcpu." << std::endl;
 }
 
-Vcpu::~Vcpu() {}
+Vcpu::~Vcpu() {
+    if (dirty_gfns)
+        munmap(dirty_gfns, dirty_ring_entries*sizeof(kvm_dirty_gfn));
+    if (run && run != MAP_FAILED)
+        munmap(run, kvm->mmap_size);
+    free(kvm_cpuid);
+}
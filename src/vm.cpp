@@ -7,6 +7,8 @@
 
 #include <vm.hpp>
 
+#include <pthread.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <linux/kvm.h>
@@ -14,24 +16,35 @@
 #include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <exception>
 #include <ios>
 #include <iostream>
+#include <mutex>
 #include <new>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include <boot.hpp>
 #include <cmos.hpp>
 #include <com1.hpp>
+#include <dirty.hpp>
+#include <image.hpp>
+#include <membank.hpp>
+#include <numa.hpp>
 #include <paging.hpp>
 #include <pci.hpp>
 #include <pio.hpp>
 #include <post.hpp>
+#include <prefault.hpp>
+#include <rambacking.hpp>
 #include <util.hpp>
 
 
@@ -96,6 +109,46 @@ int VM::createPIT2() {
     return r;
 }
 
+int VM::enableDirtyRing() {
+    int r;
+    uint32_t ring_bytes = vm_conf.dirty_ring_entries*sizeof(kvm_dirty_gfn);
+    kvm_enable_cap cap = {};
+
+    if (!vm_conf.dirty_ring_entries)
+        return 0;
+
+    // KVM_CHECK_EXTENSION on the VM returns the largest ring in bytes
+    r = kvmIoctl(KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+    if (r <= 0) {
+        std::cerr << "VM::" << __func__
+            << ": KVM_CAP_DIRTY_LOG_RING unsupported" << std::endl;
+        return -ENOTSUP;
+    }
+    if (ring_bytes > static_cast<uint32_t>(r)
+            || (ring_bytes & (ring_bytes - 1))
+            || ring_bytes < static_cast<uint32_t>(getpagesize())) {
+        std::cerr << "VM::" << __func__ << ": invalid ring size "
+            << ring_bytes << " (power of two, page size to "
+            << r << " bytes)" << std::endl;
+        return -EINVAL;
+    }
+
+    cap.cap = KVM_CAP_DIRTY_LOG_RING;
+    cap.args[0] = ring_bytes;
+
+    r = kvmIoctl(KVM_ENABLE_CAP, &cap);
+
+    if (r < 0) {
+        perror(("VM::" + std::string(__func__) + ": kvmIoctl").c_str());
+        return -errno;
+    }
+
+    std::cout << "VM::" << __func__ << ": " << vm_conf.dirty_ring_entries
+        << " entries per vCPU" << std::endl;
+
+    return 0;
+}
+
 int VM::createVcpu() {
     int r;
     vcpus = reinterpret_cast<Vcpu*>(
@@ -111,23 +164,35 @@ int VM::createVcpu() {
         std::cout << "VM::" << __func__ << ": "
             << "fd=" << r << " cpu_id= " << i << std::endl;
         new(&vcpus[i]) Vcpu(r, kvm, this, i);
+        vcpus_created++;
         std::cout << "&VM.vcpus[" << i << "]: " << &vcpus[i] << std::endl;
     }
 
     return 0;
 }
 
+Vcpu* VM::getVcpu(int i) {
+    return &vcpus[i];
+}
+
+// Backed by a memfd unless configured otherwise, so that other VMs can
+// map it privately; see VMFork.
 int VM::allocGuestRAM() {
-    // not caring about hugetlbpage
-    ram_start = mmap(NULL, vm_conf.ram_size, (PROT_READ|PROT_WRITE),
-            (MAP_SHARED|MAP_ANONYMOUS), -1, 0);
+    int r;
 
-    if (ram_start == MAP_FAILED) {
-        perror(("VM::" + std::string(__func__) + ": mmap").c_str());
-        return -errno;
-    }
+    if ((r = membank_layout(vm_conf.ram_size, vm_conf.mem_bank_size,
+                    kvm->getCap().nr_slots, &mem_banks)))
+        return r;
+
+    if ((r = ram_backing_map(vm_conf.backing, vm_conf.ram_size, &ram_start,
+                    &ram_fd)))
+        return r;
     std::cout << "VM::" << __func__ << ": VM.ram_start mmaped: "
-        << ram_start << std::endl;
+        << ram_start << " (" << ram_backing_name(vm_conf.backing) << ")"
+        << std::endl;
+
+    if ((r = bindMemBanks()))
+        return r;
 
     /*
     if (madvise(ram_start, vm_conf.ram_size, MADV_MERGEABLE) < 0) {
@@ -142,28 +207,410 @@ int VM::allocGuestRAM() {
     return 0;
 }
 
-int VM::setUserMemRegion() {
-    // TMP implementation
-    // We don't implement membank yet. So there's a limitation of ram_size!
-    // RECOMMENDED: userspace_addr[0:20] == guest_phys_addr[0:20]
+// Same address, so the memslot keeps pointing at the right place; KVM
+// drops its view of the old pages when they are unmapped.
+int VM::mapGuestRAM(int fd, uint64_t offset) {
+    void* p = mmap(ram_start, vm_conf.ram_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, fd, offset);
+
+    if (p == MAP_FAILED) {
+        perror(("VM::" + std::string(__func__) + ": mmap").c_str());
+        return -errno;
+    }
+
+    if (ram_fd >= 0) {
+        close(ram_fd);
+        ram_fd = -1;
+    }
+
+    // The policy went with the old mapping
+    return bindMemBanks();
+}
+
+// Before the guest touches anything, so that every page is allocated on
+// its bank's node in the first place
+int VM::bindMemBanks() {
     int r;
-    user_memory_region = {
-        .slot = 0,
-        .flags = 0,
-        .guest_phys_addr = 0,
-        .memory_size = vm_conf.ram_size,
-        .userspace_addr = reinterpret_cast<uint64_t>(ram_start),
+
+    if (vm_conf.numa_nodes.empty())
+        return 0;
+
+    if (numa_cpus.empty()) {
+        numa_cpus.resize(vm_conf.numa_nodes.size());
+        for (size_t i = 0; i < numa_cpus.size(); ++i) {
+            if ((r = numa_node_cpus(vm_conf.numa_nodes[i], &numa_cpus[i])))
+                return r;
+        }
+    }
+
+    for (const mem_bank& b : mem_banks) {
+        if ((r = numa_bind(static_cast<uint8_t*>(ram_start) + b.offset,
+                        b.size, getBankNode(b.slot))))
+            return r;
+        std::cout << "VM::" << __func__ << ": slot " << b.slot
+            << " bound to node " << getBankNode(b.slot) << std::endl;
+    }
+
+    return 0;
+}
+
+// The initramfs replaces the RAM under it with a copy-on-write mapping of
+// its file only if
+// - map_initramfs asks for it;
+// - RAM has no memfd (ram_fd < 0): VMFork maps a child's RAM from the
+//   parent's memfd, and the mapping over ram_start would leave the
+//   initramfs out of the memfd, so children would see none;
+// - RAM is not hugetlb: a 4 KiB file mapping cannot replace part of a
+//   huge page;
+// - dst is page-aligned, as MAP_FIXED requires.
+bool VM::mapsInitramfs(const void* dst) const {
+    return vm_conf.map_initramfs && ram_fd < 0
+        && !vm_conf.backing.is_hugetlb()
+        && reinterpret_cast<uintptr_t>(dst) % PAGE_SIZE_4KB == 0;
+}
+
+int VM::loadInitramfs() {
+    const uint64_t size = initramfs.Size();
+    void* dst = gpaToHva(INITRAMFS_ADDR, size);
+
+    if (!size)
+        return 0;
+    if (!dst)
+        return -EINVAL;
+
+    if (mapsInitramfs(dst)) {
+        int r = initramfs.MapAt(dst, 0);
+
+        if (!r) {
+            load_st.mapped = size;
+            std::cout << "initramfs mapped into guest RAM: " << dst
+                << std::endl;
+        }
+        return r;
+    }
+    if (vm_conf.map_initramfs)
+        std::cout << "VM::" << __func__ << ": can't map the initramfs into "
+            << ram_backing_name(vm_conf.backing) << " guest RAM at " << dst
+            << ", copying it instead" << std::endl;
+
+    std::memcpy(dst, initramfs.Data(), size);
+    load_st.copied += size;
+    std::cout << "initramfs copied to guest RAM: " << dst << std::endl;
+
+    return 0;
+}
+
+// Segments land where their physical addresses say, so they must stay
+// clear of the boot data below HIGHMEM_BASE and of the initramfs
+int VM::loadElfKernel() {
+    const uint64_t ramdisk_end = INITRAMFS_ADDR + initramfs.Size();
+    const int threads = vm_conf.kernel_load_threads > 0
+        ? vm_conf.kernel_load_threads
+        : std::max(1U, std::thread::hardware_concurrency());
+    std::vector<uint8_t*> dst;
+
+    for (const elf_segment& s : kernel_elf.segments) {
+        uint8_t* p = static_cast<uint8_t*>(gpaToHva(s.paddr, s.memsz));
+
+        if (!p || s.paddr < HIGHMEM_BASE
+                || (s.paddr < ramdisk_end
+                    && INITRAMFS_ADDR < s.paddr + s.memsz)) {
+            std::cerr << "VM::" << __func__ << ": segment at 0x" << std::hex
+                << s.paddr << "-0x" << s.paddr + s.memsz << std::dec
+                << " does not fit" << std::endl;
+            return -EINVAL;
+        }
+        dst.push_back(p);
+        load_st.copied += s.filesz;
+    }
+
+    load_st.threads = elf_load(kernel.Data(), kernel_elf.segments, dst,
+            threads);
+    std::cout << "VM::" << __func__ << ": " << dst.size()
+        << " segments loaded" << std::endl;
+
+    return 0;
+}
+
+int VM::writePvhStartInfo(uint64_t ramdisk_size,
+        const std::vector<e820entry>& e820) {
+    pvh_boot_info info;
+    hvm_start_info& si = info.start_info;
+    void* dst = gpaToHva(PVH_START_INFO_ADDR, sizeof(info));
+
+    if (!dst || e820.size() > BOOT_E820_MAP_MAX)
+        return -EINVAL;
+
+    si.cmdline_paddr = COMMANDLINE_ADDR;
+    si.memmap_paddr = PVH_START_INFO_ADDR + offsetof(pvh_boot_info, memmap);
+    si.memmap_entries = e820.size();
+    for (size_t i = 0; i < e820.size(); ++i)
+        info.memmap[i] = { e820[i].addr, e820[i].size, e820[i].type, 0 };
+    if (ramdisk_size) {
+        si.nr_modules = 1;
+        si.modlist_paddr = PVH_START_INFO_ADDR
+            + offsetof(pvh_boot_info, module);
+        info.module.paddr = INITRAMFS_ADDR;
+        info.module.size = ramdisk_size;
+    }
+
+    std::memcpy(dst, &info, sizeof(info));
+    std::cout << "VM::" << __func__ << ": at " << dst << std::endl;
+
+    return 0;
+}
+
+int VM::getLoadStats(load_stats* stats) {
+    uint64_t copied;
+
+    *stats = load_st;
+    if (!load_st.mapped)
+        return 0;
+
+    // The pages writes have turned into anonymous copies
+    copied = private_pages(gpaToHva(INITRAMFS_ADDR, load_st.mapped),
+            load_st.mapped) * PAGE_SIZE_4KB;
+    stats->saved = load_st.mapped - std::min(copied, load_st.mapped);
+
+    return 0;
+}
+
+// After initMachine() bound the banks, so that the pages come from the
+// right nodes
+int VM::prefaultRAM() {
+    std::vector<prefault_range> ranges;
+    int r;
+
+    if (!vm_conf.prefault_threads)
+        return 0;
+
+    if (vm_conf.prefault_boot)
+        bootRanges(&ranges);
+    else
+        ranges.push_back({ 0, vm_conf.ram_size });
+
+    if ((r = prefault(ram_start, ranges, vm_conf.backing.page_size,
+                    vm_conf.prefault_threads, &prefault_st)))
+        return r;
+    print_prefault_stats(prefault_st);
+
+    return 0;
+}
+
+// Where initRAM() will copy the boot data, the kernel and the initramfs,
+// as offsets into RAM. A bzImage's share is bounded by its file size, a
+// vmlinux's are its segments. A mapped initramfs replaces the RAM under
+// it, so that is left out.
+void VM::bootRanges(std::vector<prefault_range>* ranges) {
+    std::vector<std::pair<uint64_t, uint64_t>> gpa = {
+        { 0, HIGHMEM_BASE },  // boot_params, cmdline, page tables, EBDA
     };
 
-    r = kvmIoctl(KVM_SET_USER_MEMORY_REGION, &user_memory_region);
+    if (!mapsInitramfs(gpaToHva(INITRAMFS_ADDR, initramfs.Size())))
+        gpa.push_back({ INITRAMFS_ADDR, initramfs.Size() });
+
+    if (kernel_elf.segments.empty())
+        gpa.push_back({ HIGHMEM_BASE, kernel.Size() });
+    for (const elf_segment& s : kernel_elf.segments)
+        gpa.push_back({ s.paddr, s.memsz });
+
+    ranges->clear();
+    for (const auto& [start, size] : gpa) {
+        for (const mem_bank& b : mem_banks) {
+            uint64_t first = std::max(start, b.gpa);
+            uint64_t last = std::min(start + size, b.gpa + b.size);
+
+            if (first < last)
+                ranges->push_back({ b.offset + first - b.gpa, last - first });
+        }
+    }
+}
+
+int VM::getBankNode(uint32_t slot) const {
+    const std::vector<int>& nodes = vm_conf.numa_nodes;
+    return nodes.empty() ? -1 : nodes[slot % nodes.size()];
+}
+
+int VM::getVcpuNode(int i) const {
+    const std::vector<int>& nodes = vm_conf.numa_nodes;
+    return nodes.empty() ? -1 : nodes[i % nodes.size()];
+}
+
+// Not fatal: an unpinned vCPU still runs, only its numbers mean less
+void VM::pinVcpu(int i) {
+    const std::vector<int>& cpus = numa_cpus[i % numa_cpus.size()];
+    cpu_set_t set;
+    int r;
+
+    CPU_ZERO(&set);
+    for (int c : cpus)
+        CPU_SET(c, &set);
+
+    r = pthread_setaffinity_np(vcpu_threads[i].native_handle(), sizeof(set),
+            &set);
+    if (r)
+        std::cerr << "VM::" << __func__ << ": vCPU " << i << ": "
+            << strerror(r) << std::endl;
+    else
+        std::cout << "VM::" << __func__ << ": vCPU " << i << " pinned to "
+            << cpus.size() << " CPUs of node " << getVcpuNode(i)
+            << std::endl;
+}
+
+int VM::getNumaStats(numa_stats* stats, bool banks) {
+    int r;
+    numa_bank_stats bs;
+
+    stats->vcpus.clear();
+    stats->banks.clear();
+    if (vm_conf.numa_nodes.empty())
+        return 0;
+
+    for (int i = 0; i < vcpus_created; ++i)
+        stats->vcpus.push_back({ getVcpuNode(i),
+                static_cast<int>(numa_cpus[i % numa_cpus.size()].size()),
+                vcpus[i].NumaLocal(), vcpus[i].NumaRemote() });
+    if (!banks)
+        return 0;
+
+    for (const mem_bank& b : mem_banks) {
+        bs.slot = b.slot;
+        bs.node = getBankNode(b.slot);
+        if ((r = numa_count_pages(static_cast<uint8_t*>(ram_start)
+                        + b.offset, b.size, bs.node, &bs.resident,
+                        &bs.on_node)))
+            return r;
+        stats->banks.push_back(bs);
+    }
+
+    return 0;
+}
+
+void* VM::gpaToHva(uint64_t gpa, uint64_t len) {
+    uint64_t offset = membank_offset(mem_banks, gpa, len);
+
+    if (offset == MEMBANK_NONE)
+        return nullptr;
+
+    return static_cast<uint8_t*>(ram_start) + offset;
+}
+
+int VM::setMemSlot(const mem_bank& bank, uint32_t flags) {
+    int r;
+    kvm_userspace_memory_region region = {
+        .slot = bank.slot,
+        .flags = flags,
+        .guest_phys_addr = bank.gpa,
+        .memory_size = bank.size,
+        .userspace_addr = reinterpret_cast<uint64_t>(ram_start) + bank.offset,
+    };
+
+    r = kvmIoctl(KVM_SET_USER_MEMORY_REGION, &region);
 
     if (r < 0) {
         perror(("VM::" + std::string(__func__) + ": kmvIoctl").c_str());
         return -errno;
     }
-    std::cout << "VM::" << __func__ << ": registered" << std::endl;
 
-    return r;
+    return 0;
+}
+
+// RECOMMENDED: userspace_addr[0:20] == guest_phys_addr[0:20]; banks are
+// MEMBANK_ALIGN aligned in both, and so is ram_start; see
+// ram_backing_map().
+int VM::setUserMemRegion() {
+    int r;
+
+    mem_flags = vm_conf.dirty_log ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+
+    for (const mem_bank& b : mem_banks) {
+        if ((r = setMemSlot(b, mem_flags)))
+            return r;
+        std::cout << "VM::" << __func__ << ": slot " << b.slot << ": gpa 0x"
+            << std::hex << b.gpa << "-0x" << b.gpa + b.size << std::dec
+            << " (" << (b.size >> 20) << "MiB) at +0x" << std::hex
+            << b.offset << std::dec << std::endl;
+    }
+
+    if (vm_conf.dirty_log)
+        dirty_tracker.reset(newDirtyTracker());
+
+    return 0;
+}
+
+DirtyTracker* VM::newDirtyTracker() {
+    // KVM_GET_DIRTY_LOG is refused once the rings are enabled, so the
+    // backend is fixed by the configuration.
+    if (vm_conf.dirty_ring_entries)
+        return new DirtyRing(this, mem_banks, vm_conf.dirty_ring_reap_ms);
+
+    return new DirtyLog(this, mem_banks);
+}
+
+int VM::reapDirtyRing(Vcpu* vcpu) {
+    int r;
+
+    {
+        std::lock_guard<std::mutex> lk(tracker_mtx);
+        if (dirty_tracker && vm_conf.dirty_ring_entries)
+            return static_cast<DirtyRing*>(dirty_tracker.get())
+                ->ReapVcpu(vcpu);
+    }
+
+    // Logging was turned off with entries still queued; drop them.
+    if (vcpu->CollectDirtyRing(nullptr) == 0)
+        return 0;
+
+    r = kvmIoctl(KVM_RESET_DIRTY_RINGS, 0);
+    if (r < 0) {
+        perror(("VM::" + std::string(__func__) + ": kvmIoctl").c_str());
+        return -errno;
+    }
+
+    return 0;
+}
+
+// Toggling KVM_MEM_LOG_DIRTY_PAGES on a live slot is allowed by KVM, so
+// migration can turn logging on only for the time it needs it. A vCPU
+// with a full ring may be reaping it meanwhile, so the tracker is swapped
+// under tracker_mtx. The old one is destroyed after the lock is released;
+// its reaper thread never takes tracker_mtx.
+int VM::enableDirtyLog(bool enable) {
+    int r;
+    bool enabled = mem_flags & KVM_MEM_LOG_DIRTY_PAGES;
+    std::unique_ptr<DirtyTracker> old;
+
+    if (enable == enabled)
+        return 0;
+
+    if (!enable) {
+        std::lock_guard<std::mutex> lk(tracker_mtx);
+        old = std::move(dirty_tracker);
+    }
+    old.reset();
+
+    if (enable)
+        mem_flags |= KVM_MEM_LOG_DIRTY_PAGES;
+    else
+        mem_flags &= ~KVM_MEM_LOG_DIRTY_PAGES;
+
+    for (const mem_bank& b : mem_banks) {
+        if ((r = setMemSlot(b, mem_flags)))
+            return r;
+    }
+
+    if (enable) {
+        DirtyTracker* t = newDirtyTracker();
+        std::lock_guard<std::mutex> lk(tracker_mtx);
+
+        dirty_tracker.reset(t);
+    }
+
+    std::cout << "VM::" << __func__ << ": dirty logging "
+        << (enable ? "enabled" : "disabled") << " on "
+        << mem_banks.size() << " slots" << std::endl;
+
+    return 0;
 }
 
 int VM::registerPIOHandler(uint16_t port_start, uint16_t port_end,
@@ -268,10 +715,11 @@ int VM::initMachine() {
     addIODev(new CMOS(this));
     addIODev(new COM1(this));
 
-    for (const InitMachineFunc e : initmachine_func) {
-        r = (this->*e)();
+    for (const InitMachineStep& e : initmachine_func) {
+        r = (this->*e.func)();
         if (r < 0)
             return r;
+        timeline.Mark(e.name);
     }
 
     std::cout << "VM::" << __func__ << ": success" << std::endl;
@@ -326,12 +774,9 @@ int VM::initRAM(std::string cmdline) {
                 reinterpret_cast<uint8_t*>(ram_start)+EBDA_START));
     ebda* ebda_end;
 
-    char* ramdisk_image = reinterpret_cast<char*>(ram_start)
-                                + INITRAMFS_ADDR;
-    char* kernel_image  = reinterpret_cast<char*>(ram_start)
-                                + HIGHMEM_BASE;
-    std::streamsize ramdisk_size, kernel_size;
-    std::ios::pos_type kernel_load_offset;
+    void* kernel_image;
+    uint64_t ramdisk_size, kernel_size, kernel_load_offset;
+    std::chrono::steady_clock::time_point load_start;
 
     char* cmdline_start = reinterpret_cast<char*>(ram_start)
                                 + COMMANDLINE_ADDR;
@@ -343,6 +788,12 @@ int VM::initRAM(std::string cmdline) {
 
     ebda ebda_data = gen_ebda(vm_conf.vcpu_num);
 
+    if (prefaultRAM()) {
+        std::cerr << "couldn't prefault guest RAM" << std::endl;
+        return 1;
+    }
+    timeline.Mark("initram_prefault");
+
     std::cout << "ebda generated" << '\n';
     std::cout << "ebda_data.fps.checksum: "
         << +ebda_data.fps.checksum << '\n';
@@ -364,16 +815,19 @@ int VM::initRAM(std::string cmdline) {
     ebda_end = std::copy_n(&ebda_data, 1, ebda_start);
     std::cout << "ebda_data copied to guest RAM: " << ebda_start << std::endl;
     std::cout << "ebda_end: " << ebda_end << std::endl;
+    timeline.Mark("initram_ebda");
 
     // initramfs
-    ramdisk_size = get_ifs_size(initramfs);
+    load_st = load_stats();
+    load_start = std::chrono::steady_clock::now();
+    ramdisk_size = initramfs.Size();
     std::cout << "initramfs size: " << ramdisk_size << std::endl;
-    if (!initramfs.read(ramdisk_image, ramdisk_size)) {
+    if (loadInitramfs()) {
         std::cerr << "couldn't read from initramfs" << std::endl;
         return 1;
     }
-    std::cout << "initramfs copied to guest RAM: "
-        << static_cast<void*>(ramdisk_image) << std::endl;
+    load_st.ns = ns_since(load_start);
+    timeline.Mark("initram_initramfs");
 
     // cmdline
     // FIXME: should check commandline size before do this
@@ -387,40 +841,53 @@ int VM::initRAM(std::string cmdline) {
 
     // bootparam
     boot_params bp;
-
-    kernel.seekg(SETUP_HEADER_ADDR, std::ios::beg);
-    kernel.read(reinterpret_cast<char*>(&bp.header), sizeof(bp.header));
-    if (!kernel) {
-        kernel.seekg(0, std::ios::beg);
+    std::vector<e820entry> e820;
+
+    if (!kernel_elf.segments.empty()) {
+        // A vmlinux has no setup header; this is what its 64-bit entry
+        // looks at of one
+        bp.header.boot_flag        = BOOT_HDR_BOOT_FLAG;
+        bp.header.header           = BOOT_HDR_MAGIC;
+        bp.header.kernel_alignmnet = BOOT_HDR_KERNEL_ALIGN;
+        std::cout << "bootparam setup header has been "
+            "made up for the ELF kernel" << std::endl;
+    } else if (kernel.Size() < SETUP_HEADER_ADDR + sizeof(bp.header)) {
         std::cerr << "Couldn't read a setup header "
             "from the kernel image" << std::endl;
         return 1;
-    }
-    kernel.seekg(0, std::ios::beg);
-    std::cout << "bootparam setup header has been "
-        "loaded from the kernel image" << std::endl;
-
-    if (bp.header.is_valid()) {
-        std::cout << "bootparam setup header is valid" << std::endl;
     } else {
-        std::cerr << "bootparam setup header is invalid "
-            "or the boot protocol version is old" << std::endl;
-        return 1;
-    }
+        std::memcpy(&bp.header, kernel.Data() + SETUP_HEADER_ADDR,
+                sizeof(bp.header));
+        std::cout << "bootparam setup header has been "
+            "loaded from the kernel image" << std::endl;
+
+        if (bp.header.is_valid()) {
+            std::cout << "bootparam setup header is valid" << std::endl;
+        } else {
+            std::cerr << "bootparam setup header is invalid "
+                "or the boot protocol version is old" << std::endl;
+            return 1;
+        }
 
-    if (bp.header.check_setup_sects())
-        std::cout << "The value of setup_sects has been "
-            "modified to 4" << std::endl;
+        if (bp.header.check_setup_sects())
+            std::cout << "The value of setup_sects has been "
+                "modified to 4" << std::endl;
+
+        if (boot_long_mode
+                && !(bp.header.xloadflags & BOOT_HDR_XLF_KERNEL_64)) {
+            std::cerr << "the kernel has no 64-bit entry" << std::endl;
+            return 1;
+        }
+    }
 
     std::cout << "Writing to bootparam..." << std::endl;
 
-    bp.add_e820_entry(REALMODE_IVT_START,
-            EBDA_START-REALMODE_IVT_START, BOOT_E820_TYPE_RAM);
-    bp.add_e820_entry(EBDA_START,
-            VGARAM_START-EBDA_START, BOOT_E820_TYPE_RESERVED);
-    bp.add_e820_entry(MBBIOS_START, MBBIOS_SIZE, BOOT_E820_TYPE_RESERVED);
-    bp.add_e820_entry(HIGHMEM_BASE,
-            vm_conf.ram_size-HIGHMEM_BASE, BOOT_E820_TYPE_RAM);
+    if (membank_e820(mem_banks, &e820)) {
+        std::cerr << "too many e820 entries" << std::endl;
+        return 1;
+    }
+    for (const e820entry& e : e820)
+        bp.add_e820_entry(e.addr, e.size, e.type);
 
     // change later to print these writing processs
     // some kind of setter?
@@ -440,28 +907,50 @@ int VM::initRAM(std::string cmdline) {
         << static_cast<void*>(boot_params_start) << std::endl;
     std::cout << "boot_params_end: "
         << static_cast<void*>(boot_params_end) << std::endl;
+    timeline.Mark("initram_boot_params");
 
     // kernel
-    assert(!vm_conf.is_64bit_boot);  // to be implemented
-    kernel_load_offset = (bp.header.setup_sects+1) * SECT_SIZE;
-    kernel.seekg(kernel_load_offset, std::ios::beg);
-    kernel_size = get_ifs_size(kernel) - kernel_load_offset;
-    if (!kernel.read(kernel_image, kernel_size)) {
-        std::cerr << "couldn't load kernel image" << std::endl;
+    load_start = std::chrono::steady_clock::now();
+    if (!kernel_elf.segments.empty()) {
+        if (loadElfKernel()) {
+            std::cerr << "couldn't load kernel image" << std::endl;
+            return 1;
+        }
+    } else {
+        kernel_load_offset = (bp.header.setup_sects+1) * SECT_SIZE;
+        kernel_size = kernel.Size()
+            - std::min(kernel_load_offset, kernel.Size());
+        kernel_image = gpaToHva(HIGHMEM_BASE, kernel_size);
+        if (!kernel_size || !kernel_image) {
+            std::cerr << "couldn't load kernel image" << std::endl;
+            return 1;
+        }
+        // The whole payload in one go, straight from the mapped file
+        std::memcpy(kernel_image, kernel.Data() + kernel_load_offset,
+                kernel_size);
+        load_st.copied += kernel_size;
+        std::cout << "kernel image copied to guest RAM: " << kernel_image
+            << std::endl;
+        std::cout << "kernel load offset (setupsz): "
+            << kernel_load_offset << std::endl;
+    }
+    load_st.ns += ns_since(load_start);
+    timeline.Mark("initram_kernel");
+    getLoadStats(&load_st);
+    print_load_stats(load_st);
+
+    if (boot_pvh && writePvhStartInfo(ramdisk_size, e820)) {
+        std::cerr << "couldn't write the PVH start info" << std::endl;
         return 1;
     }
-    std::cout << "kernel image copied to guest RAM: "
-        << static_cast<void*>(kernel_image) << std::endl;
-    std::cout << "kernel load offset (setupsz): "
-        << kernel_load_offset << std::endl;
-    kernel.seekg(0, std::ios::beg);
 
     // boot page table
-    if (vm_conf.is_64bit_boot) {
+    if (boot_long_mode) {
         createPageTable(BOOT_PAGETABLE_BASE);
         std::cout << "boot page table created at: "
             << BOOT_PAGETABLE_BASE << std::endl;
     }
+    timeline.Mark("initram_entry");
 
     std::cout << "VM::" << __func__ << ": success" << std::endl;
 
@@ -469,26 +958,46 @@ int VM::initRAM(std::string cmdline) {
 }
 
 int VM::initVcpuRegs() {
+    int r;
+
     for (int i = 0; i < vm_conf.vcpu_num; ++i) {
-        if ((vcpus+i)->InitRegs(HIGHMEM_BASE, BOOT_PARAMS_ADDR))
-            return 1;
+        if ((r = (vcpus+i)->InitRegs(boot_entry, BOOT_PARAMS_ADDR,
+                        boot_pvh ? PVH_START_INFO_ADDR : 0)))
+            return r;
     }
     std::cout << "VM::" << __func__ << ": success" << std::endl;
     return 0;
 }
 
 int VM::initVcpuSregs() {
-    assert(!vm_conf.is_64bit_boot);
+    int r;
+
     for (int i = 0; i < vm_conf.vcpu_num; ++i) {
-        if ((vcpus+i)->InitSregs(vm_conf.is_64bit_boot))
-            return 1;
+        if ((r = (vcpus+i)->InitSregs(boot_long_mode)))
+            return r;
     }
     std::cout << "VM::" << __func__ << ": success" << std::endl;
     return 0;
 }
 
-int VM::Boot() {
-    std::vector<std::thread> threads;
+static void vcpu_kick_handler(int) {}
+
+// The handler does nothing; its only job is to make a blocked KVM_RUN
+// return with EINTR. Installed without SA_RESTART for that reason.
+static void install_vcpu_kick_handler() {
+    static std::once_flag once;
+
+    std::call_once(once, [] {
+        struct sigaction sa = {};
+        sa.sa_handler = vcpu_kick_handler;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIG_VCPU_KICK, &sa, nullptr) < 0)
+            perror("install_vcpu_kick_handler: sigaction");
+    });
+}
+
+int VM::Start() {
+    install_vcpu_kick_handler();
 
 #ifdef GUEST_DEBUG
     for (int i = 0; i < vm_conf.vcpu_num; ++i) {
@@ -498,18 +1007,243 @@ int VM::Boot() {
     }
 #endif  // GUEST_DEBUG
 
+    if (dirty_tracker && vm_conf.dirty_log_interval_ms > 0) {
+        dirty_tracker->StartPeriodic(vm_conf.dirty_log_interval_ms,
+                [this](const DirtyBitmap&, const dirty_log_stats& st) {
+            std::cout << "DirtyTracker: round " << st.rounds
+                << ": " << st.last_dirty_pages << " pages"
+                << " in " << st.last_runs << " runs"
+                << " (" << st.last_harvest_ns / 1000 << "us)" << std::endl;
+            // Bank residency is move_pages(2) over all of RAM, which
+            // costs more than a round; only every NUMA_BANK_STATS_MS and
+            // once more in Join()
+            if (!vm_conf.numa_nodes.empty()) {
+                const int every = std::max(1, NUMA_BANK_STATS_MS
+                        / vm_conf.dirty_log_interval_ms);
+                numa_stats ns;
+                if (getNumaStats(&ns, st.rounds % every == 0) == 0)
+                    print_numa_stats(ns);
+            }
+        });
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(run_mtx);
+        vcpus_alive = vm_conf.vcpu_num;
+    }
 
+    timeline.MarkOnce("vcpu_start");
     for (int i = 0; i < vm_conf.vcpu_num; ++i) {
         std::cout << "VM::" << __func__ << ": Booting vCPU["
             << i << "]" << std::endl;
-        threads.emplace_back(&Vcpu::RunLoop, &vcpus[i]);
+        vcpu_threads.emplace_back([this, i] {
+            vcpus[i].RunLoop();
+            vcpuExited();
+        });
+        vcpus[i].SetThread(vcpu_threads.back().native_handle());
+        if (!numa_cpus.empty())
+            pinVcpu(i);
     }
 
-    for (auto& e : threads) {
+    return 0;
+}
+
+int VM::Join() {
+    const bool ran = !vcpu_threads.empty();
+
+    for (auto& e : vcpu_threads) {
         if (e.joinable()) {
             e.join();
         }
     }
+    vcpu_threads.clear();
+
+    setThrottle(0);
+    if (dirty_tracker)
+        dirty_tracker->StopPeriodic();
+
+    if (ran && !vm_conf.numa_nodes.empty()) {
+        numa_stats ns;
+        if (getNumaStats(&ns) == 0)
+            print_numa_stats(ns);
+    }
+
+    return 0;
+}
+
+int VM::Boot() {
+    int r;
+
+    if ((r = Start()))
+        return r;
+
+    return Join();
+}
+
+// Every vCPU ends up in parkVcpu() after a KVM_RUN with immediate_exit set,
+// which also completes any in-flight PIO, so the register state read after
+// Pause() returns is consistent. A kick that lands between two KVM_RUNs is
+// lost, hence the re-kick on timeout.
+int VM::Pause() {
+    std::unique_lock<std::mutex> lk(run_mtx);
+
+    pause_req = true;
+    while (vcpus_parked < vcpus_alive) {
+        for (int i = 0; i < vm_conf.vcpu_num; ++i)
+            vcpus[i].Kick();
+        run_cv.wait_for(lk, std::chrono::milliseconds(1));
+    }
+
+    return 0;
+}
+
+int VM::Resume() {
+    {
+        std::lock_guard<std::mutex> lk(run_mtx);
+        pause_req = false;
+    }
+    run_cv.notify_all();
+
+    return 0;
+}
+
+void VM::parkVcpu() {
+    std::unique_lock<std::mutex> lk(run_mtx);
+
+    vcpus_parked++;
+    run_cv.notify_all();
+    run_cv.wait(lk, [this] { return !pause_req || stop_req; });
+    vcpus_parked--;
+}
+
+// Parked vCPUs are let go and return from RunLoop() like running ones;
+// the kicks repeat for the same reason as in Pause().
+int VM::Stop() {
+    std::unique_lock<std::mutex> lk(run_mtx);
+
+    stop_req = true;
+    run_cv.notify_all();
+    while (vcpus_alive > 0) {
+        for (int i = 0; i < vm_conf.vcpu_num; ++i)
+            vcpus[i].Kick();
+        run_cv.wait_for(lk, std::chrono::milliseconds(1));
+    }
+    lk.unlock();
+
+    return Join();
+}
+
+int VM::setThrottle(int pct) {
+    if (pct < 0 || pct > VCPU_THROTTLE_MAX_PCT)
+        return -EINVAL;
+
+    {
+        std::lock_guard<std::mutex> lk(throttle_mtx);
+        if (pct != throttle_pct)
+            std::cout << "VM::" << __func__ << ": vCPUs throttled to "
+                << pct << "%" << std::endl;
+        throttle_pct = pct;
+    }
+    throttle_cv.notify_all();
+
+    if (!pct && throttle_thread.joinable())
+        throttle_thread.join();
+    else if (pct && !throttle_thread.joinable())
+        throttle_thread = std::thread(&VM::throttleLoop, this);
+
+    return 0;
+}
+
+// Makes sure every vCPU gets back to Vcpu::Throttle() once a slice
+void VM::throttleLoop() {
+    std::unique_lock<std::mutex> lk(throttle_mtx);
+
+    while (!throttle_cv.wait_for(lk,
+                std::chrono::milliseconds(VCPU_THROTTLE_SLICE_MS),
+                [this] { return throttle_pct == 0; })) {
+        for (int i = 0; i < vm_conf.vcpu_num; ++i)
+            vcpus[i].Kick();
+    }
+}
+
+void VM::vcpuExited() {
+    std::lock_guard<std::mutex> lk(run_mtx);
+
+    vcpus_alive--;
+    run_cv.notify_all();
+}
+
+// One pass over fixed-size records: nothing here allocates, as it runs
+// with the guest stopped.
+int VM::saveDeviceState(vm_device_state* state) {
+    int r;
+    size_t n = 0;
+
+    *state = {};
+    state->pic_master.chip_id = KVM_IRQCHIP_PIC_MASTER;
+    state->pic_slave.chip_id  = KVM_IRQCHIP_PIC_SLAVE;
+    state->ioapic.chip_id     = KVM_IRQCHIP_IOAPIC;
+
+    if ((r = kvmIoctl(KVM_GET_PIT2, &state->pit)) < 0
+            || (r = kvmIoctl(KVM_GET_IRQCHIP, &state->pic_master)) < 0
+            || (r = kvmIoctl(KVM_GET_IRQCHIP, &state->pic_slave)) < 0
+            || (r = kvmIoctl(KVM_GET_IRQCHIP, &state->ioapic)) < 0
+            || (r = kvmIoctl(KVM_GET_CLOCK, &state->clock)) < 0) {
+        perror(("VM::" + std::string(__func__) + ": kvmIoctl").c_str());
+        return -errno;
+    }
+
+    pci.SaveState(&state->pci);
+    for (const auto& e : iodev) {
+        if (!e->StateSize())
+            continue;
+        if (n == VM_IODEV_STATE_NUM || e->StateSize() > IODEV_STATE_MAX) {
+            std::cerr << "VM::" << __func__ << ": no room for the device at "
+                << e->port << std::endl;
+            return -ENOSPC;
+        }
+        state->iodev[n].port = e->port;
+        state->iodev[n].len  = e->StateSize();
+        e->SaveState(state->iodev[n].data);
+        n++;
+    }
+
+    return 0;
+}
+
+int VM::loadDeviceState(const vm_device_state* state) {
+    int r;
+    kvm_clock_data clock = state->clock;
+
+    // Resume the clock where it stopped rather than at the host's time
+    clock.flags = 0;
+
+    if ((r = kvmIoctl(KVM_SET_PIT2, &state->pit)) < 0
+            || (r = kvmIoctl(KVM_SET_IRQCHIP, &state->pic_master)) < 0
+            || (r = kvmIoctl(KVM_SET_IRQCHIP, &state->pic_slave)) < 0
+            || (r = kvmIoctl(KVM_SET_IRQCHIP, &state->ioapic)) < 0
+            || (r = kvmIoctl(KVM_SET_CLOCK, &clock)) < 0) {
+        perror(("VM::" + std::string(__func__) + ": kvmIoctl").c_str());
+        return -errno;
+    }
+
+    if ((r = pci.LoadState(&state->pci)))
+        return r;
+    for (const iodev_state& s : state->iodev) {
+        if (!s.len)
+            continue;
+        auto it = std::find_if(iodev.begin(), iodev.end(),
+                [&s](const std::unique_ptr<IODev>& e) {
+                    return e->port == s.port;
+                });
+        if (it == iodev.end() || (*it)->StateSize() != s.len) {
+            std::cerr << "VM::" << __func__ << ": no device at " << s.port
+                << " for a " << s.len << " byte record" << std::endl;
+            return -EINVAL;
+        }
+        if ((r = (*it)->LoadState(s.data)))
+            return r;
+    }
 
     return 0;
 }
@@ -543,26 +1277,94 @@ int VM::flapIRQLine(uint32_t irq) {
     return 0;
 }
 
+void VM::setConsoleMarker(const std::string& marker) {
+    std::lock_guard<std::mutex> lk(console_mtx);
+
+    console_marker = marker;
+    console_tail.clear();
+    console_marker_seen = false;
+}
+
+// Keeps the last marker-length bytes; called from the vCPU thread
+void VM::consoleOutput(char c) {
+    std::lock_guard<std::mutex> lk(console_mtx);
+
+    if (!console_output_seen) {
+        console_output_seen = true;
+        timeline.Mark("first_com1_byte");
+    }
+    if (console_marker.empty() || console_marker_seen)
+        return;
+
+    console_tail.push_back(c);
+    if (console_tail.size() > console_marker.size())
+        console_tail.erase(0, 1);
+    if (console_tail == console_marker) {
+        console_marker_seen = true;
+        timeline.MarkOnce("console_marker");
+        console_cv.notify_all();
+    }
+}
+
+bool VM::waitConsoleMarker(int timeout_ms) {
+    std::unique_lock<std::mutex> lk(console_mtx);
+
+    return console_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms),
+            [this] { return console_marker_seen; });
+}
+
 VM::VM(int vm_fd, KVM* kvm, vm_config vm_conf)\
-        : BaseClass(vm_fd), kvm(kvm), vm_conf(vm_conf) {
+        : BaseClass(vm_fd), kvm(kvm), vm_conf(vm_conf),
+          kernel(vm_conf.kernel_path), initramfs(vm_conf.initramfs_path) {
     std::cout << "Constructing VM..." << std::endl;
 
-    kernel.open(vm_conf.kernel_path, std::ios::in | std::ios::binary);
-    initramfs.open(vm_conf.initramfs_path, std::ios::in | std::ios::binary);
-
-    if (!kernel)
+    if (kernel.Open())
         throw std::runtime_error("Cloud not open the kernel: "
                 + std::string(vm_conf.kernel_path));
-    if (!initramfs)
+    if (initramfs.Open())
         throw std::runtime_error("Cloud not open the initramfs: "
                 + std::string(vm_conf.initramfs_path));
 
-    if (is_kernel_elf(kernel))
-        throw std::runtime_error("VM::"+std::string(__func__)+
-                ": the kernel is elf file");
-    std::cout << "Verified that the kernel is not an elf file" << std::endl;
+    if (is_kernel_elf(kernel.Data(), kernel.Size())) {
+        if (elf_parse(kernel.Data(), kernel.Size(), &kernel_elf))
+            throw std::runtime_error("VM::"+std::string(__func__)+
+                    ": the kernel is an elf file but not a vmlinux");
+        boot_pvh = !vm_conf.is_64bit_boot && kernel_elf.pvh_entry;
+        boot_long_mode = !boot_pvh;
+        boot_entry = boot_pvh ? kernel_elf.pvh_entry : kernel_elf.entry;
+        if (!vm_conf.is_64bit_boot && !boot_pvh)
+            std::cout << "The kernel has no PVH entry" << std::endl;
+        std::cout << "The kernel is an elf file; entering at 0x" << std::hex
+            << boot_entry << std::dec << (boot_pvh ? " (PVH)" : " (64-bit)")
+            << std::endl;
+    } else {
+        boot_long_mode = vm_conf.is_64bit_boot;
+        boot_entry = HIGHMEM_BASE
+            + (boot_long_mode ? BOOT_ENTRY_64_OFFSET : 0);
+        std::cout << "Verified that the kernel is not an elf file"
+            << std::endl;
+    }
 
+    timeline.Mark("vm_created");
     std::cout << "Constructed VM." << std::endl;
 }
 
-VM::~VM() {}
+VM::~VM() {
+    if (!vcpu_threads.empty())
+        Stop();
+    setThrottle(0);
+
+    // Dirty rings live in the vCPU mappings
+    if (dirty_tracker)
+        dirty_tracker->StopPeriodic();
+    dirty_tracker.reset();
+
+    for (int i = 0; i < vcpus_created; ++i)
+        vcpus[i].~Vcpu();
+    operator delete[](vcpus);
+
+    if (ram_start)
+        munmap(ram_start, vm_conf.ram_size);
+    if (ram_fd >= 0)
+        close(ram_fd);
+}
@@ -0,0 +1,187 @@
+/*
+ *  src/xbzrle.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <xbzrle.hpp>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+
+static int put_uleb128(uint8_t* dst, size_t dst_len, size_t pos,
+        uint64_t v) {
+    do {
+        if (pos >= dst_len)
+            return -1;
+        dst[pos++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+
+    return pos;
+}
+
+static int get_uleb128(const uint8_t* src, size_t len, size_t* pos,
+        uint64_t* v) {
+    int shift = 0;
+
+    *v = 0;
+    do {
+        if (*pos >= len || shift > 56)
+            return -EINVAL;
+        *v |= static_cast<uint64_t>(src[*pos] & 0x7f) << shift;
+        shift += 7;
+    } while (src[(*pos)++] & 0x80);
+
+    return 0;
+}
+
+static uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+int xbzrle_encode(const uint8_t* old_page, const uint8_t* new_page,
+        uint8_t* dst, size_t dst_len) {
+    size_t i = 0, start;
+    int pos = 0;
+
+    while (i < XBZRLE_PAGE_SIZE) {
+        // unchanged run, a word at a time where possible
+        start = i;
+        while (i + 8 <= XBZRLE_PAGE_SIZE
+                && load64(old_page + i) == load64(new_page + i))
+            i += 8;
+        while (i < XBZRLE_PAGE_SIZE && old_page[i] == new_page[i])
+            ++i;
+        if (i == XBZRLE_PAGE_SIZE)
+            break;
+        if ((pos = put_uleb128(dst, dst_len, pos, i - start)) < 0)
+            return -1;
+
+        // changed run; isolated unchanged bytes are cheaper to carry
+        // along than to encode as a run of their own
+        start = i;
+        while (i < XBZRLE_PAGE_SIZE && (old_page[i] != new_page[i]
+                    || (i + 1 < XBZRLE_PAGE_SIZE
+                        && old_page[i+1] != new_page[i+1])))
+            ++i;
+        if ((pos = put_uleb128(dst, dst_len, pos, i - start)) < 0
+                || pos + (i - start) > dst_len)
+            return -1;
+        for (size_t j = start; j < i; ++j)
+            dst[pos++] = old_page[j] ^ new_page[j];
+    }
+
+    return pos;
+}
+
+int xbzrle_decode(const uint8_t* src, size_t len, uint8_t* page) {
+    size_t pos = 0, off = 0;
+    uint64_t skip, n;
+
+    while (pos < len) {
+        if (get_uleb128(src, len, &pos, &skip)
+                || get_uleb128(src, len, &pos, &n)
+                || skip > XBZRLE_PAGE_SIZE || n > XBZRLE_PAGE_SIZE
+                || off + skip + n > XBZRLE_PAGE_SIZE
+                || pos + n > len)
+            return -EINVAL;
+
+        off += skip;
+        for (uint64_t j = 0; j < n; ++j)
+            page[off + j] ^= src[pos + j];
+        off += n;
+        pos += n;
+    }
+
+    return 0;
+}
+
+
+PageCache::PageCache(uint64_t capacity)
+        : capacity(capacity),
+          data(new uint8_t[capacity*XBZRLE_PAGE_SIZE]),
+          slot_index(capacity), prev(capacity, NIL), next(capacity, NIL) {
+    map.reserve(capacity);
+    free_slots.reserve(capacity);
+    for (uint64_t i = capacity; i > 0; --i)
+        free_slots.push_back(i - 1);
+}
+
+void PageCache::Unlink(uint32_t slot) {
+    if (prev[slot] != NIL)
+        next[prev[slot]] = next[slot];
+    else
+        head = next[slot];
+    if (next[slot] != NIL)
+        prev[next[slot]] = prev[slot];
+    else
+        tail = prev[slot];
+    prev[slot] = next[slot] = NIL;
+}
+
+void PageCache::PushFront(uint32_t slot) {
+    prev[slot] = NIL;
+    next[slot] = head;
+    if (head != NIL)
+        prev[head] = slot;
+    head = slot;
+    if (tail == NIL)
+        tail = slot;
+}
+
+uint8_t* PageCache::Lookup(uint64_t index) {
+    auto it = map.find(index);
+
+    if (it == map.end()) {
+        stats.misses++;
+        return nullptr;
+    }
+
+    stats.hits++;
+    if (head != it->second) {
+        Unlink(it->second);
+        PushFront(it->second);
+    }
+
+    return data.get() + static_cast<uint64_t>(it->second)*XBZRLE_PAGE_SIZE;
+}
+
+void PageCache::Insert(uint64_t index, const uint8_t* page) {
+    uint32_t slot;
+
+    if (!capacity)
+        return;
+
+    if (free_slots.empty()) {
+        slot = tail;
+        Unlink(slot);
+        map.erase(slot_index[slot]);
+        stats.evictions++;
+    } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+
+    std::memcpy(data.get() + static_cast<uint64_t>(slot)*XBZRLE_PAGE_SIZE,
+            page, XBZRLE_PAGE_SIZE);
+    slot_index[slot] = index;
+    map.emplace(index, slot);
+    PushFront(slot);
+}
+
+void PageCache::Erase(uint64_t index) {
+    auto it = map.find(index);
+
+    if (it == map.end())
+        return;
+
+    Unlink(it->second);
+    free_slots.push_back(it->second);
+    map.erase(it);
+}
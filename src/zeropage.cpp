@@ -0,0 +1,114 @@
+/*
+ *  src/zeropage.cpp
+ *
+ *  Copyright (C) 2023  Yuma Ueda <cyan@0x00a1e9.dev>
+ */
+
+
+#include <zeropage.hpp>
+
+#include <immintrin.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <cpufeat.hpp>
+
+
+// All kernels OR a block of words together and test once per block: a
+// zero page has to be read in full anyway, and a dirty one usually shows
+// up in the first block.
+
+__attribute__((target("avx2")))
+static bool zero_page_avx2(const void* page) {
+    const __m256i* p = static_cast<const __m256i*>(page);
+
+    for (size_t i = 0; i < ZERO_PAGE_SIZE / sizeof(*p); i += 8) {
+        __m256i acc = _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_or_si256(_mm256_load_si256(p+i),
+                                    _mm256_load_si256(p+i+1)),
+                    _mm256_or_si256(_mm256_load_si256(p+i+2),
+                                    _mm256_load_si256(p+i+3))),
+                _mm256_or_si256(
+                    _mm256_or_si256(_mm256_load_si256(p+i+4),
+                                    _mm256_load_si256(p+i+5)),
+                    _mm256_or_si256(_mm256_load_si256(p+i+6),
+                                    _mm256_load_si256(p+i+7))));
+        if (!_mm256_testz_si256(acc, acc))
+            return false;
+    }
+
+    return true;
+}
+
+__attribute__((target("sse2")))
+static bool zero_page_sse2(const void* page) {
+    const __m128i* p = static_cast<const __m128i*>(page);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (size_t i = 0; i < ZERO_PAGE_SIZE / sizeof(*p); i += 8) {
+        __m128i acc = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_or_si128(_mm_load_si128(p+i),
+                                 _mm_load_si128(p+i+1)),
+                    _mm_or_si128(_mm_load_si128(p+i+2),
+                                 _mm_load_si128(p+i+3))),
+                _mm_or_si128(
+                    _mm_or_si128(_mm_load_si128(p+i+4),
+                                 _mm_load_si128(p+i+5)),
+                    _mm_or_si128(_mm_load_si128(p+i+6),
+                                 _mm_load_si128(p+i+7))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+            return false;
+    }
+
+    return true;
+}
+
+static bool zero_page_scalar(const void* page) {
+    const uint64_t* p = static_cast<const uint64_t*>(page);
+
+    for (size_t i = 0; i < ZERO_PAGE_SIZE / sizeof(*p); i += 8) {
+        if (p[i] | p[i+1] | p[i+2] | p[i+3] | p[i+4] | p[i+5] | p[i+6]
+                | p[i+7])
+            return false;
+    }
+
+    return true;
+}
+
+static bool always_supported() {
+    return true;
+}
+
+
+const zero_page_kernel zero_page_kernels[] = {
+    { "avx2",   zero_page_avx2,   cpuSupportsAVX2 },
+    { "sse2",   zero_page_sse2,   cpuSupportsSSE2 },
+    { "scalar", zero_page_scalar, always_supported },
+};
+
+const size_t ZERO_PAGE_KERNEL_NUM =
+    sizeof(zero_page_kernels) / sizeof(zero_page_kernels[0]);
+
+
+static const zero_page_kernel* select_zero_page_kernel() {
+    for (size_t i = 0; i < ZERO_PAGE_KERNEL_NUM; ++i) {
+        if (zero_page_kernels[i].supported())
+            return &zero_page_kernels[i];
+    }
+
+    return &zero_page_kernels[ZERO_PAGE_KERNEL_NUM - 1];
+}
+
+static const zero_page_kernel* const selected = select_zero_page_kernel();
+
+
+bool is_zero_page(const void* page) {
+    return selected->func(page);
+}
+
+const char* zero_page_kernel_name() {
+    return selected->name;
+}
@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+#include <compress.hpp>
+#include <pipeline.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+int round_trip(const std::vector<uint8_t>& src) {
+    std::vector<uint16_t> table(LZ_HASH_ENTRIES);
+    std::vector<uint8_t> packed(src.size() + src.size() / 255 + 16);
+    std::vector<uint8_t> unpacked(src.size());
+
+    int len = lz_compress(src.data(), src.size(), packed.data(),
+            packed.size(), table.data());
+    EXPECT_GE(len, 0);
+    EXPECT_EQ(static_cast<int>(src.size()), lz_decompress(packed.data(), len,
+                unpacked.data(), unpacked.size()));
+    EXPECT_EQ(src, unpacked);
+
+    return len;
+}
+
+TEST(LzTest, CompressiblePage) {
+    std::vector<uint8_t> page(4096);
+
+    for (size_t i = 0; i < page.size(); ++i)
+        page[i] = "lmigtester "[i % 11];
+    ASSERT_LT(round_trip(page), 64);
+}
+
+TEST(LzTest, IncompressiblePage) {
+    std::vector<uint8_t> page(4096);
+    uint32_t x = 12345;
+
+    for (uint8_t& b : page) {
+        x = x * 1103515245 + 12345;
+        b = x >> 24;
+    }
+    round_trip(page);
+
+    // does not fit in less than a page
+    std::vector<uint16_t> table(LZ_HASH_ENTRIES);
+    std::vector<uint8_t> packed(page.size() - 1);
+    ASSERT_EQ(-1, lz_compress(page.data(), page.size(), packed.data(),
+                packed.size(), table.data()));
+}
+
+TEST(LzTest, ShortAndLongRuns) {
+    round_trip(std::vector<uint8_t>(1, 7));
+    round_trip(std::vector<uint8_t>(9, 7));
+    round_trip(std::vector<uint8_t>(4096, 0));
+
+    std::vector<uint8_t> mixed(4096, 0);
+    std::memset(mixed.data() + 300, 0xab, 700);  // long match after literals
+    for (size_t i = 2000; i < 2300; ++i)
+        mixed[i] = i * 7;
+    round_trip(mixed);
+}
+
+TEST(LzTest, RejectsBadOffset) {
+    const uint8_t bad[] = {0x10, 'a', 0x05, 0x00};  // offset beyond output
+    uint8_t out[64];
+
+    ASSERT_EQ(-1, lz_decompress(bad, sizeof(bad), out, sizeof(out)));
+}
+
+TEST(PagePipelineTest, WritesInScanOrder) {
+    std::vector<uint64_t> written;
+    PagePipeline pipeline(3, 5,
+        [](int, uint64_t page, std::vector<uint8_t>* out) {
+            out->push_back(page & 0xff);
+        },
+        [&written](const page_batch& batch) {
+            for (size_t i = 0; i < batch.pages.size(); ++i) {
+                EXPECT_EQ(batch.pages[i] & 0xff, batch.out[i]);
+                written.push_back(batch.pages[i]);
+            }
+            return 0;
+        });
+
+    for (int pass = 0; pass < 2; ++pass) {
+        written.clear();
+        ASSERT_EQ(0, pipeline.Run(
+                    [](const std::function<void(uint64_t)>& emit) {
+            for (uint64_t i = 0; i < 1000; ++i)
+                emit(i);
+        }));
+
+        ASSERT_EQ(1000u, written.size());
+        for (uint64_t i = 0; i < 1000; ++i)
+            ASSERT_EQ(i, written[i]);
+    }
+    ASSERT_EQ(400u, pipeline.Stats().batches);
+}
+
+TEST(PagePipelineTest, ReportsWriteError) {
+    PagePipeline pipeline(2, 4,
+        [](int, uint64_t, std::vector<uint8_t>*) {},
+        [](const page_batch&) { return -5; });
+
+    ASSERT_EQ(-5, pipeline.Run([](const std::function<void(uint64_t)>& emit) {
+        for (uint64_t i = 0; i < 100; ++i)
+            emit(i);
+    }));
+}
+
+}  // namespace
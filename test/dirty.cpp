@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+#include <dirty.hpp>
+
+#include <vector>
+
+namespace {
+
+std::vector<dirty_run> collect_runs(const DirtyBitmap& bitmap) {
+    std::vector<dirty_run> runs;
+    for (const dirty_run& run : bitmap)
+        runs.push_back(run);
+    return runs;
+}
+
+TEST(DirtyBitmapTest, Empty) {
+    DirtyBitmap bitmap(4096);
+    ASSERT_EQ(0u, bitmap.Count());
+    ASSERT_TRUE(bitmap.begin() == bitmap.end());
+}
+
+TEST(DirtyBitmapTest, RunsWithinAndAcrossWords) {
+    DirtyBitmap bitmap(1024);
+
+    bitmap.Set(0);
+    for (uint64_t i = 10; i < 13; ++i)
+        bitmap.Set(i);
+    for (uint64_t i = 60; i < 200; ++i)  // spans three words
+        bitmap.Set(i);
+    bitmap.Set(1023);
+
+    std::vector<dirty_run> runs = collect_runs(bitmap);
+    ASSERT_EQ(4u, runs.size());
+    ASSERT_EQ(0u, runs[0].first);
+    ASSERT_EQ(1u, runs[0].npages);
+    ASSERT_EQ(10u, runs[1].first);
+    ASSERT_EQ(3u, runs[1].npages);
+    ASSERT_EQ(60u, runs[2].first);
+    ASSERT_EQ(140u, runs[2].npages);
+    ASSERT_EQ(1023u, runs[3].first);
+    ASSERT_EQ(1u, runs[3].npages);
+    ASSERT_EQ(145u, bitmap.Count());
+}
+
+TEST(DirtyBitmapTest, SkipsLongCleanStretches) {
+    DirtyBitmap bitmap(1 << 20);
+
+    bitmap.Set(3);
+    bitmap.SetAtomic((1 << 20) - 64);
+
+    std::vector<dirty_run> runs = collect_runs(bitmap);
+    ASSERT_EQ(2u, runs.size());
+    ASSERT_EQ(3u, runs[0].first);
+    ASSERT_EQ(static_cast<uint64_t>((1 << 20) - 64), runs[1].first);
+
+    bitmap.Clear();
+    ASSERT_TRUE(bitmap.begin() == bitmap.end());
+}
+
+TEST(DirtyBitmapTest, FullBitmapIsOneRun) {
+    DirtyBitmap bitmap(256);
+
+    for (uint64_t i = 0; i < 256; ++i)
+        bitmap.Set(i);
+
+    std::vector<dirty_run> runs = collect_runs(bitmap);
+    ASSERT_EQ(1u, runs.size());
+    ASSERT_EQ(0u, runs[0].first);
+    ASSERT_EQ(256u, runs[0].npages);
+}
+
+}  // namespace
@@ -0,0 +1,126 @@
+#include <gtest/gtest.h>
+#include <dirtyrate.hpp>
+#include <hash.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+constexpr uint64_t RAM_PAGES = 1024;
+
+dirty_rate_config all_pages() {
+    dirty_rate_config conf;
+
+    // More samples than pages: every page is sampled
+    conf.samples_per_gb = UINT32_MAX;
+    conf.wss_windows = 3;
+    conf.seed = 1;
+
+    return conf;
+}
+
+TEST(PageHashTest, SeesOneBitFlip) {
+    std::vector<uint8_t> page(DIRTY_RATE_PAGE_SIZE, 0);
+    uint64_t h = page_hash64(page.data(), page.size());
+
+    page[DIRTY_RATE_PAGE_SIZE - 1] = 0x80;
+    EXPECT_NE(h, page_hash64(page.data(), page.size()));
+    page[DIRTY_RATE_PAGE_SIZE - 1] = 0;
+    EXPECT_EQ(h, page_hash64(page.data(), page.size()));
+}
+
+TEST(PageHashTest, WideHashExtendsNarrow) {
+    std::vector<uint8_t> page(DIRTY_RATE_PAGE_SIZE, 0x11);
+    hash128 h = page_hash128(page.data(), page.size());
+
+    EXPECT_EQ(h.lo, page_hash64(page.data(), page.size()));
+    EXPECT_NE(h.lo, h.hi);
+
+    page[0] ^= 1;
+    hash128 g = page_hash128(page.data(), page.size());
+    EXPECT_NE(h.lo, g.lo);
+    EXPECT_NE(h.hi, g.hi);
+}
+
+TEST(DirtyRateTest, IdleRamIsClean) {
+    std::vector<uint8_t> ram(RAM_PAGES*DIRTY_RATE_PAGE_SIZE, 0x5a);
+    DirtyRateEstimator est(ram.data(), ram.size(), all_pages());
+
+    est.Sample();
+    EXPECT_EQ(RAM_PAGES, est.Estimate().sample_pages);
+    EXPECT_EQ(0u, est.Estimate().dirty_samples);
+    EXPECT_EQ(0u, est.Estimate().dirty_pages_per_s);
+    EXPECT_EQ(0u, est.Estimate().wss_pages);
+}
+
+TEST(DirtyRateTest, WorkingSetSpansWindows) {
+    std::vector<uint8_t> ram(RAM_PAGES*DIRTY_RATE_PAGE_SIZE, 0);
+    DirtyRateEstimator est(ram.data(), ram.size(), all_pages());
+
+    for (uint64_t i = 0; i < 10; ++i)
+        ram[i*DIRTY_RATE_PAGE_SIZE]++;
+    est.Sample();
+    EXPECT_EQ(10u, est.Estimate().dirty_samples);
+    EXPECT_GT(est.Estimate().dirty_pages_per_s, 0u);
+
+    for (uint64_t i = 100; i < 120; ++i)
+        ram[i*DIRTY_RATE_PAGE_SIZE]++;
+    est.Sample();
+    EXPECT_EQ(20u, est.Estimate().dirty_samples);
+    EXPECT_EQ(30u, est.Estimate().wss_pages);
+
+    // The first window's pages age out after wss_windows
+    est.Sample();
+    est.Sample();
+    EXPECT_EQ(0u, est.Estimate().dirty_samples);
+    EXPECT_EQ(20u, est.Estimate().wss_pages);
+    EXPECT_EQ(3u, est.Estimate().wss_windows);
+}
+
+TEST(DirtyRateTest, SamplesAreDistinct) {
+    std::vector<uint8_t> ram(RAM_PAGES*DIRTY_RATE_PAGE_SIZE, 0);
+    dirty_rate_config conf;
+
+    conf.samples_per_gb = (1 << 30) / DIRTY_RATE_PAGE_SIZE / 2;
+    conf.seed = 7;
+
+    DirtyRateEstimator est(ram.data(), ram.size(), conf);
+    EXPECT_EQ(RAM_PAGES / 2, est.Estimate().sample_pages);
+}
+
+TEST(PredictDowntimeTest, IdleGuestConvergesAtOnce) {
+    dirty_rate_estimate est;
+    est.ram_pages = 262144;  // 1 GiB
+
+    downtime_prediction p = predict_downtime(est, 1ULL << 30, 300, 30);
+    EXPECT_TRUE(p.converges);
+    EXPECT_EQ(1, p.iterations);
+    EXPECT_EQ(0u, p.downtime_ms);
+    EXPECT_EQ(1000u, p.total_ms);
+}
+
+TEST(PredictDowntimeTest, SmallWorkingSetConverges) {
+    dirty_rate_estimate est;
+    est.ram_pages = 262144;
+    est.dirty_pages_per_s = 1000000;  // faster than the link...
+    est.wss_pages = 2560;             // ...but only 10 MiB of it
+
+    downtime_prediction p = predict_downtime(est, 100 << 20, 300, 30);
+    EXPECT_TRUE(p.converges);
+    EXPECT_EQ(1, p.iterations);
+    EXPECT_EQ(100u, p.downtime_ms);
+}
+
+TEST(PredictDowntimeTest, FastDirtierDoesNotConverge) {
+    dirty_rate_estimate est;
+    est.ram_pages = 262144;
+    est.dirty_pages_per_s = 100000;  // 400 MB/s against 100 MiB/s
+
+    downtime_prediction p = predict_downtime(est, 100 << 20, 300, 30);
+    EXPECT_FALSE(p.converges);
+    EXPECT_EQ(30, p.iterations);
+    EXPECT_GT(p.downtime_ms, 300u);
+}
+
+}  // namespace
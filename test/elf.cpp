@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include <elf.hpp>
+
+#include <elf.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <paging.hpp>
+
+namespace {
+
+constexpr uint64_t KERNEL_PADDR = 0x100'0000;
+constexpr uint64_t TEXT_OFFSET = 0x1000;
+constexpr uint64_t TEXT_SIZE = 0x3000;
+constexpr uint64_t PVH_ENTRY = KERNEL_PADDR + 0x40;
+
+// One PT_LOAD of TEXT_SIZE bytes plus a 3MB .bss, and a PT_NOTE with the
+// PVH entry, the way vmlinux is laid out
+class ElfTest : public ::testing::Test {
+ protected:
+    void SetUp() override {
+        Elf64_Ehdr ehdr = {};
+        Elf64_Phdr phdr[2] = {};
+        Elf64_Nhdr nhdr = { 4, 4, ELF_NOTE_PVH_ENTRY };
+        uint32_t pvh = PVH_ENTRY;
+        const uint64_t note = sizeof(ehdr) + sizeof(phdr);
+
+        image.resize(TEXT_OFFSET + TEXT_SIZE);
+        for (uint64_t i = 0; i < TEXT_SIZE; ++i)
+            image[TEXT_OFFSET + i] = i * 7 + 1;
+
+        std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+        ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+        ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+        ehdr.e_type = ET_EXEC;
+        ehdr.e_machine = EM_X86_64;
+        ehdr.e_entry = KERNEL_PADDR;
+        ehdr.e_phoff = sizeof(ehdr);
+        ehdr.e_phentsize = sizeof(Elf64_Phdr);
+        ehdr.e_phnum = 2;
+
+        phdr[0].p_type = PT_LOAD;
+        phdr[0].p_offset = TEXT_OFFSET;
+        phdr[0].p_paddr = KERNEL_PADDR;
+        phdr[0].p_filesz = TEXT_SIZE;
+        phdr[0].p_memsz = TEXT_SIZE + 3*PAGE_SIZE_2MB;
+        phdr[1].p_type = PT_NOTE;
+        phdr[1].p_offset = note;
+        phdr[1].p_filesz = sizeof(nhdr) + 4 + sizeof(pvh);
+
+        std::memcpy(image.data(), &ehdr, sizeof(ehdr));
+        std::memcpy(image.data() + sizeof(ehdr), phdr, sizeof(phdr));
+        std::memcpy(image.data() + note, &nhdr, sizeof(nhdr));
+        std::memcpy(image.data() + note + sizeof(nhdr), "Xen", 4);
+        std::memcpy(image.data() + note + sizeof(nhdr) + 4, &pvh,
+                sizeof(pvh));
+    }
+
+    Elf64_Ehdr* ehdr() { return reinterpret_cast<Elf64_Ehdr*>(image.data()); }
+    Elf64_Phdr* phdr() {
+        return reinterpret_cast<Elf64_Phdr*>(image.data() + sizeof(Elf64_Ehdr));
+    }
+
+    std::vector<uint8_t> image;
+};
+
+TEST_F(ElfTest, ParsesSegmentsAndPvhNote) {
+    elf_kernel k;
+
+    ASSERT_EQ(0, elf_parse(image.data(), image.size(), &k));
+    EXPECT_EQ(KERNEL_PADDR, k.entry);
+    EXPECT_EQ(PVH_ENTRY, k.pvh_entry);
+    ASSERT_EQ(1u, k.segments.size());
+    EXPECT_EQ(KERNEL_PADDR, k.segments[0].paddr);
+    EXPECT_EQ(TEXT_OFFSET, k.segments[0].offset);
+    EXPECT_EQ(TEXT_SIZE, k.segments[0].filesz);
+    EXPECT_EQ(TEXT_SIZE + 3*PAGE_SIZE_2MB, k.segments[0].memsz);
+
+    // Without the note there is only the 64-bit entry
+    phdr()[1].p_type = PT_NULL;
+    ASSERT_EQ(0, elf_parse(image.data(), image.size(), &k));
+    EXPECT_EQ(0u, k.pvh_entry);
+}
+
+TEST_F(ElfTest, RejectsWhatIsNotAVmlinux) {
+    elf_kernel k;
+
+    EXPECT_EQ(-ENOEXEC, elf_parse(image.data(), 16, &k));
+
+    ehdr()->e_machine = EM_386;
+    EXPECT_EQ(-ENOEXEC, elf_parse(image.data(), image.size(), &k));
+    ehdr()->e_machine = EM_X86_64;
+
+    // Truncated: the segment runs past the end of the file
+    EXPECT_EQ(-ENOEXEC, elf_parse(image.data(), image.size() - 1, &k));
+
+    ehdr()->e_entry = KERNEL_PADDR - 1;
+    EXPECT_EQ(-ENOEXEC, elf_parse(image.data(), image.size(), &k));
+    ehdr()->e_entry = KERNEL_PADDR;
+
+    phdr()[0].p_filesz = phdr()[0].p_memsz + 1;
+    EXPECT_EQ(-ENOEXEC, elf_parse(image.data(), image.size(), &k));
+}
+
+TEST_F(ElfTest, LoadsAndZeroesInParallel) {
+    elf_kernel k;
+    std::vector<uint8_t> ram;
+
+    ASSERT_EQ(0, elf_parse(image.data(), image.size(), &k));
+    ram.assign(k.segments[0].memsz, 0xcc);
+
+    // The segment is 4 chunks; no more threads than that
+    EXPECT_EQ(4, elf_load(image.data(), k.segments, { ram.data() }, 8));
+    EXPECT_EQ(0, std::memcmp(image.data() + TEXT_OFFSET, ram.data(),
+                TEXT_SIZE));
+    for (uint64_t i = TEXT_SIZE; i < ram.size(); ++i)
+        ASSERT_EQ(0, ram[i]) << "at " << i;
+}
+
+}  // namespace
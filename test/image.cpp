@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+#include <image.hpp>
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <paging.hpp>
+#include <util.hpp>
+
+namespace {
+
+class BootImageTest : public ::testing::Test {
+ protected:
+    void SetUp() override {
+        int fd = mkstemp(path);
+
+        ASSERT_GE(fd, 0);
+        for (uint64_t i = 0; i < sizeof(data); ++i)
+            data[i] = i * 7;
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(data)),
+                write(fd, data, sizeof(data)));
+        close(fd);
+    }
+    void TearDown() override { unlink(path); }
+
+    char path[32] = "/tmp/bootimage-XXXXXX";
+    uint8_t data[2*PAGE_SIZE_4KB + 100];
+};
+
+TEST_F(BootImageTest, MapsTheFile) {
+    BootImage image(path);
+
+    ASSERT_EQ(0, image.Open());
+    ASSERT_EQ(sizeof(data), image.Size());
+    EXPECT_EQ(0, std::memcmp(data, image.Data(), sizeof(data)));
+}
+
+TEST_F(BootImageTest, EmptyOrMissing) {
+    BootImage null("/dev/null"), missing("/nonexistent/bootimage");
+
+    ASSERT_EQ(0, null.Open());
+    EXPECT_EQ(0u, null.Size());
+    EXPECT_EQ(nullptr, null.Data());
+    EXPECT_EQ(-ENOENT, missing.Open());
+}
+
+TEST_F(BootImageTest, MapAtIsCopyOnWrite) {
+    const uint64_t len = 4*PAGE_SIZE_4KB;
+    BootImage image(path), again(path);
+    uint8_t* ram = static_cast<uint8_t*>(mmap(nullptr, len,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+    ASSERT_NE(MAP_FAILED, ram);
+    ASSERT_EQ(0, image.Open());
+    EXPECT_EQ(-EINVAL, image.MapAt(ram + 1, 0));
+    EXPECT_EQ(-EINVAL, image.MapAt(ram, 1));
+    ASSERT_EQ(0, image.MapAt(ram, 0));
+
+    EXPECT_EQ(0, std::memcmp(data, ram, sizeof(data)));
+    EXPECT_EQ(0, ram[sizeof(data)]);  // the rest of the last page
+    EXPECT_EQ(0u, private_pages(ram, 3*PAGE_SIZE_4KB));
+
+    ram[PAGE_SIZE_4KB] ^= 0xff;
+    EXPECT_EQ(1u, private_pages(ram, 3*PAGE_SIZE_4KB));
+
+    // The file itself is untouched
+    ASSERT_EQ(0, again.Open());
+    EXPECT_EQ(data[PAGE_SIZE_4KB], again.Data()[PAGE_SIZE_4KB]);
+    munmap(ram, len);
+}
+
+}  // namespace
@@ -0,0 +1,52 @@
+#include <gtest/gtest.h>
+#include <cmos.hpp>
+#include <com1.hpp>
+#include <iodev.hpp>
+
+#include <cstdint>
+
+namespace {
+
+TEST(IODevStateTest, RecordsFit) {
+    EXPECT_LE(sizeof(com1_state), IODEV_STATE_MAX);
+    EXPECT_LE(sizeof(cmos_state), IODEV_STATE_MAX);
+}
+
+TEST(IODevStateTest, CMOSRoundTrip) {
+    CMOS src(nullptr), dst(nullptr);
+    uint8_t record[IODEV_STATE_MAX];
+    char index = 0x40, value = 0x5a, out = 0;
+
+    src.Write(PIO_PORT_CMOS_INDEX, &index, 1);
+    src.Write(PIO_PORT_CMOS_DATA, &value, 1);
+
+    ASSERT_EQ(src.StateSize(), sizeof(cmos_state));
+    src.SaveState(record);
+    ASSERT_EQ(dst.LoadState(record), 0);
+
+    dst.Write(PIO_PORT_CMOS_INDEX, &index, 1);
+    dst.Read(PIO_PORT_CMOS_DATA, &out, 1);
+    EXPECT_EQ(out, value);
+}
+
+TEST(IODevStateTest, COM1RoundTrip) {
+    COM1 src(nullptr), dst(nullptr);
+    uint8_t record[IODEV_STATE_MAX];
+    char lcr = static_cast<char>(COM1_REG_LCR_DLAB), dll = 0x03;
+    const com1_state* s = reinterpret_cast<const com1_state*>(record);
+
+    src.Write(PIO_PORT_COM1_LCR, &lcr, 1);
+    src.Write(PIO_PORT_COM1_THR_RBR_DLL, &dll, 1);
+
+    ASSERT_EQ(src.StateSize(), sizeof(com1_state));
+    src.SaveState(record);
+    EXPECT_EQ(s->LCR, COM1_REG_LCR_DLAB);
+    EXPECT_EQ(s->DLL, 0x03);
+
+    ASSERT_EQ(dst.LoadState(record), 0);
+    dst.SaveState(record);
+    EXPECT_EQ(s->LCR, COM1_REG_LCR_DLAB);
+    EXPECT_EQ(s->DLL, 0x03);
+}
+
+}  // namespace
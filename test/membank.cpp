@@ -0,0 +1,109 @@
+#include <gtest/gtest.h>
+#include <membank.hpp>
+
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+#include <boot.hpp>
+
+namespace {
+
+constexpr uint64_t MiB = 1ULL << 20;
+constexpr uint64_t GiB = 1ULL << 30;
+
+TEST(MemBankTest, SmallRAMIsOneBank) {
+    std::vector<mem_bank> banks;
+
+    ASSERT_EQ(0, membank_layout(1*GiB, 0, 32, &banks));
+    ASSERT_EQ(1u, banks.size());
+    EXPECT_EQ(0u, banks[0].slot);
+    EXPECT_EQ(0u, banks[0].gpa);
+    EXPECT_EQ(1*GiB, banks[0].size);
+    EXPECT_EQ(0u, banks[0].offset);
+}
+
+TEST(MemBankTest, RelocatesAboveTheHole) {
+    std::vector<mem_bank> banks;
+
+    ASSERT_EQ(0, membank_layout(6*GiB, 0, 32, &banks));
+    ASSERT_EQ(2u, banks.size());
+    EXPECT_EQ(0u, banks[0].gpa);
+    EXPECT_EQ(MEMBANK_HOLE_START, banks[0].size);
+    EXPECT_EQ(1u, banks[1].slot);
+    EXPECT_EQ(MEMBANK_HIGH_BASE, banks[1].gpa);
+    EXPECT_EQ(6*GiB - MEMBANK_HOLE_START, banks[1].size);
+    EXPECT_EQ(MEMBANK_HOLE_START, banks[1].offset);
+
+    // Nothing lands on the pages KVM and the local APIC take
+    for (const mem_bank& b : banks) {
+        EXPECT_FALSE(TSS_BASE >= b.gpa && TSS_BASE < b.gpa + b.size);
+        EXPECT_FALSE(APIC_BASE >= b.gpa && APIC_BASE < b.gpa + b.size);
+    }
+}
+
+TEST(MemBankTest, BankSizeOnlySplits) {
+    std::vector<mem_bank> whole, split;
+
+    ASSERT_EQ(0, membank_layout(5*GiB, 0, 32, &whole));
+    ASSERT_EQ(0, membank_layout(5*GiB, 1*GiB, 32, &split));
+    ASSERT_EQ(5u, split.size());
+
+    for (uint32_t i = 0; i < split.size(); ++i) {
+        EXPECT_EQ(i, split[i].slot);
+        EXPECT_LE(split[i].size, 1*GiB);
+        EXPECT_EQ(membank_offset(whole, split[i].gpa, split[i].size),
+                split[i].offset);
+    }
+}
+
+TEST(MemBankTest, RejectsBadSizes) {
+    std::vector<mem_bank> banks;
+
+    EXPECT_EQ(-EINVAL, membank_layout(0, 0, 32, &banks));
+    EXPECT_EQ(-EINVAL, membank_layout(1*GiB + 4096, 0, 32, &banks));
+    EXPECT_EQ(-EINVAL, membank_layout(1*GiB, 3*MiB, 32, &banks));
+    EXPECT_EQ(-EINVAL, membank_layout(4*GiB, 0, 1, &banks));
+    EXPECT_TRUE(banks.empty());
+}
+
+TEST(MemBankTest, OffsetStaysInOneBank) {
+    std::vector<mem_bank> banks;
+
+    ASSERT_EQ(0, membank_layout(4*GiB, 0, 32, &banks));
+    EXPECT_EQ(HIGHMEM_BASE, membank_offset(banks, HIGHMEM_BASE, 4096));
+    EXPECT_EQ(MEMBANK_HOLE_START + 4096,
+            membank_offset(banks, MEMBANK_HIGH_BASE + 4096, 4096));
+    EXPECT_EQ(MEMBANK_NONE, membank_offset(banks, TSS_BASE, 1));
+    EXPECT_EQ(MEMBANK_NONE,
+            membank_offset(banks, MEMBANK_HOLE_START - 4096, 8192));
+    EXPECT_EQ(MEMBANK_NONE, membank_offset(banks, 5*GiB, 1));
+}
+
+TEST(MemBankTest, E820FollowsTheBanks) {
+    std::vector<mem_bank> banks;
+    std::vector<e820entry> map;
+
+    ASSERT_EQ(0, membank_layout(6*GiB, 1*GiB, 32, &banks));
+    ASSERT_EQ(0, membank_e820(banks, &map));
+    ASSERT_EQ(6u, map.size());
+
+    EXPECT_EQ(REALMODE_IVT_START, map[0].addr);
+    EXPECT_EQ(BOOT_E820_TYPE_RAM, map[0].type);
+    EXPECT_EQ(BOOT_E820_TYPE_RESERVED, map[1].type);
+    EXPECT_EQ(MBBIOS_START, map[2].addr);
+
+    // The banks below the hole merge into one entry, as do those above
+    EXPECT_EQ(HIGHMEM_BASE, map[3].addr);
+    EXPECT_EQ(MEMBANK_HOLE_START - HIGHMEM_BASE, map[3].size);
+    EXPECT_EQ(BOOT_E820_TYPE_RAM, map[3].type);
+
+    EXPECT_EQ(TSS_BASE, map[4].addr);
+    EXPECT_EQ(BOOT_E820_TYPE_RESERVED, map[4].type);
+
+    EXPECT_EQ(MEMBANK_HIGH_BASE, map[5].addr);
+    EXPECT_EQ(6*GiB - MEMBANK_HOLE_START, map[5].size);
+    EXPECT_EQ(BOOT_E820_TYPE_RAM, map[5].type);
+}
+
+}  // namespace
@@ -0,0 +1,38 @@
+#include <gtest/gtest.h>
+#include <numa.hpp>
+
+#include <cerrno>
+#include <vector>
+
+namespace {
+
+TEST(NumaTest, ParseNodes) {
+    std::vector<int> nodes;
+
+    ASSERT_EQ(0, numa_parse_nodes("0,1,1", &nodes));
+    EXPECT_EQ((std::vector<int>{ 0, 1, 1 }), nodes);
+    ASSERT_EQ(0, numa_parse_nodes("3", &nodes));
+    EXPECT_EQ((std::vector<int>{ 3 }), nodes);
+
+    EXPECT_EQ(-EINVAL, numa_parse_nodes("", &nodes));
+    EXPECT_EQ(-EINVAL, numa_parse_nodes("0,", &nodes));
+    EXPECT_EQ(-EINVAL, numa_parse_nodes("0,-1", &nodes));
+    EXPECT_EQ(-EINVAL, numa_parse_nodes("1024", &nodes));
+    EXPECT_TRUE(nodes.empty());
+}
+
+TEST(NumaTest, ParseCpulist) {
+    std::vector<int> cpus;
+
+    ASSERT_EQ(0, numa_parse_cpulist("0-3,8,10-11", &cpus));
+    EXPECT_EQ((std::vector<int>{ 0, 1, 2, 3, 8, 10, 11 }), cpus);
+    // sysfs prints an empty line for a node without CPUs
+    ASSERT_EQ(0, numa_parse_cpulist("", &cpus));
+    EXPECT_TRUE(cpus.empty());
+
+    EXPECT_EQ(-EINVAL, numa_parse_cpulist("3-1", &cpus));
+    EXPECT_EQ(-EINVAL, numa_parse_cpulist("0-x", &cpus));
+    EXPECT_TRUE(cpus.empty());
+}
+
+}  // namespace
@@ -0,0 +1,119 @@
+#include <gtest/gtest.h>
+#include <pagestore.hpp>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <hash.hpp>
+
+namespace {
+
+constexpr uint64_t PAGES = 8;
+
+class PageStoreTest : public ::testing::Test {
+ protected:
+    void SetUp() override {
+        char tmpl[] = "/tmp/pagestore-test-XXXXXX";
+
+        ASSERT_NE(mkdtemp(tmpl), nullptr);
+        dir = tmpl;
+        std::fill(std::begin(ram), std::end(ram), 0);
+    }
+
+    void TearDown() override {
+        unlink((dir + "/" + PAGESTORE_PAGES_FILE).c_str());
+        unlink((dir + "/" + PAGESTORE_INDEX_FILE).c_str());
+        rmdir(dir.c_str());
+    }
+
+    void Fill(uint64_t page, uint8_t value) {
+        std::fill(ram + page*PAGESTORE_PAGE_SIZE,
+                ram + (page + 1)*PAGESTORE_PAGE_SIZE, value);
+    }
+
+    std::string dir;
+    alignas(64) uint8_t ram[PAGES*PAGESTORE_PAGE_SIZE];
+};
+
+TEST_F(PageStoreTest, StoresEachPageOnce) {
+    std::vector<uint64_t> refs;
+
+    // 0 and 3 are the same, 1 and 2 differ, the rest are zero
+    Fill(0, 0xaa);
+    Fill(1, 0xbb);
+    Fill(2, 0xcc);
+    Fill(3, 0xaa);
+    {
+        PageStore store(dir, 2);
+
+        ASSERT_EQ(store.Open(), 0);
+        ASSERT_EQ(store.Put(ram, PAGES, &refs), 0);
+        EXPECT_EQ(store.Stats().new_pages, 3u);
+        EXPECT_EQ(store.Stats().dup_local, 1u);
+        EXPECT_EQ(store.Stats().zero_pages, PAGES - 4);
+        EXPECT_EQ(refs[0], refs[3]);
+        EXPECT_EQ(refs[1], refs[0] + 1);
+        EXPECT_EQ(refs[4], PAGESTORE_ZERO);
+    }
+
+    // A second snapshot only adds what changed
+    Fill(2, 0xdd);
+    PageStore store(dir, 1);
+    ASSERT_EQ(store.Open(), 0);
+    EXPECT_EQ(store.NumPages(), 3u);
+    ASSERT_EQ(store.Put(ram, PAGES, &refs), 0);
+    EXPECT_EQ(store.Stats().new_pages, 1u);
+    EXPECT_EQ(store.Stats().dup_store, 3u);
+    EXPECT_EQ(refs[2], 3u);
+}
+
+// page_hash128() is not collision-resistant: a page whose hash matches a
+// stored one but whose bytes do not must get a slot of its own
+TEST_F(PageStoreTest, StoresACollisionSeparately) {
+    std::vector<uint64_t> refs;
+    uint8_t stored[PAGESTORE_PAGE_SIZE];
+    hash128 h;
+    int fd;
+
+    Fill(0, 0xaa);
+    {
+        PageStore store(dir, 1);
+
+        ASSERT_EQ(store.Open(), 0);
+        ASSERT_EQ(store.Put(ram, 1, &refs), 0);
+        ASSERT_EQ(refs[0], 0u);
+    }
+
+    // Make slot 0 claim the hash of the page put next
+    Fill(0, 0xbb);
+    h = page_hash128(ram, PAGESTORE_PAGE_SIZE);
+    fd = open((dir + "/" + PAGESTORE_INDEX_FILE).c_str(), O_WRONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(pwrite(fd, &h, sizeof(h), 0), ssize_t(sizeof(h)));
+    close(fd);
+
+    PageStore store(dir, 1);
+    ASSERT_EQ(store.Open(), 0);
+    ASSERT_EQ(store.Put(ram, 1, &refs), 0);
+    EXPECT_EQ(store.Stats().collisions, 1u);
+    EXPECT_EQ(store.Stats().new_pages, 1u);
+    EXPECT_EQ(store.Stats().dup_store, 0u);
+    ASSERT_EQ(refs[0], 1u);
+
+    fd = open((dir + "/" + PAGESTORE_PAGES_FILE).c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(pread(fd, stored, sizeof(stored), PAGESTORE_PAGE_SIZE),
+            ssize_t(sizeof(stored)));
+    close(fd);
+    EXPECT_EQ(0, std::memcmp(stored, ram, sizeof(stored)));
+}
+
+}  // namespace
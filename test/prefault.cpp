@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+#include <prefault.hpp>
+
+#include <sys/mman.h>
+
+#include <cstdint>
+#include <vector>
+
+#include <paging.hpp>
+
+namespace {
+
+TEST(PrefaultTest, SplitsIntoChunks) {
+    std::vector<prefault_range> chunks;
+
+    prefault_split({ { 0, 5*PAGE_SIZE_2MB } }, PAGE_SIZE_2MB,
+            PAGE_SIZE_4KB, &chunks);
+    ASSERT_EQ(5u, chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        EXPECT_EQ(i*PAGE_SIZE_2MB, chunks[i].offset);
+        EXPECT_EQ(PAGE_SIZE_2MB, chunks[i].size);
+    }
+}
+
+TEST(PrefaultTest, AlignsAndMerges) {
+    std::vector<prefault_range> chunks;
+
+    // Out of order, overlapping once aligned, and an empty one
+    prefault_split({ { 0x3000, 0x10 }, { 0x100, 0x1000 }, { 0x9000, 0 },
+            { 0x1800, 0x100 }, { 0x1f'f800, 0x10 } }, PAGE_SIZE_2MB,
+            PAGE_SIZE_4KB, &chunks);
+    ASSERT_EQ(3u, chunks.size());
+    EXPECT_EQ(0x0u, chunks[0].offset);
+    EXPECT_EQ(0x2000u, chunks[0].size);
+    EXPECT_EQ(0x3000u, chunks[1].offset);
+    EXPECT_EQ(0x1000u, chunks[1].size);
+    EXPECT_EQ(0x1f'f000u, chunks[2].offset);
+    EXPECT_EQ(0x1000u, chunks[2].size);
+}
+
+TEST(PrefaultTest, ChunksStopAtBoundaries) {
+    std::vector<prefault_range> chunks;
+
+    prefault_split({ { 0x1f'f000, 0x2000 } }, PAGE_SIZE_2MB, PAGE_SIZE_4KB,
+            &chunks);
+    ASSERT_EQ(2u, chunks.size());
+    EXPECT_EQ(0x1f'f000u, chunks[0].offset);
+    EXPECT_EQ(0x1000u, chunks[0].size);
+    EXPECT_EQ(PAGE_SIZE_2MB, chunks[1].offset);
+    EXPECT_EQ(0x1000u, chunks[1].size);
+}
+
+TEST(PrefaultTest, PopulatesAndKeepsData) {
+    const uint64_t size = 4*PAGE_SIZE_2MB;
+    prefault_stats stats;
+    uint8_t* p = static_cast<uint8_t*>(mmap(nullptr, size,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    std::vector<unsigned char> vec(size / PAGE_SIZE_4KB);
+
+    ASSERT_NE(MAP_FAILED, p);
+    p[PAGE_SIZE_2MB + 7] = 0x5a;
+    ASSERT_EQ(0, prefault(p, { { 0, size } }, PAGE_SIZE_4KB, 3, &stats));
+    EXPECT_EQ(3, stats.threads);
+    EXPECT_EQ(4u, stats.chunks);
+    EXPECT_EQ(size, stats.bytes);
+    EXPECT_EQ(0x5a, p[PAGE_SIZE_2MB + 7]);
+
+    ASSERT_EQ(0, mincore(p, size, vec.data()));
+    for (unsigned char v : vec)
+        EXPECT_TRUE(v & 1);
+    munmap(p, size);
+}
+
+}  // namespace
@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+#include <rambacking.hpp>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <string>
+
+#include <membank.hpp>
+
+namespace {
+
+TEST(RamBackingTest, ParseAndName) {
+    const char* names[] = {
+        "memfd", "anon", "thp", "hugetlb:2M", "hugetlb:1G",
+        "memfd-hugetlb:2M", "memfd-hugetlb:1G",
+    };
+
+    for (const char* name : names) {
+        ram_backing b;
+        ASSERT_EQ(0, ram_backing_parse(name, &b)) << name;
+        EXPECT_EQ(name, ram_backing_name(b));
+    }
+}
+
+TEST(RamBackingTest, HugetlbDefaultsTo2M) {
+    ram_backing b;
+
+    ASSERT_EQ(0, ram_backing_parse("hugetlb", &b));
+    EXPECT_EQ(RAM_BACKING_HUGETLB, b.type);
+    EXPECT_EQ(RAM_HUGEPAGE_2MB, b.page_size);
+    EXPECT_TRUE(b.is_hugetlb());
+
+    ASSERT_EQ(0, ram_backing_parse("thp", &b));
+    EXPECT_FALSE(b.is_hugetlb());
+}
+
+TEST(RamBackingTest, RejectsUnknown) {
+    ram_backing b;
+
+    EXPECT_EQ(-EINVAL, ram_backing_parse("", &b));
+    EXPECT_EQ(-EINVAL, ram_backing_parse("hugetlbfs", &b));
+    EXPECT_EQ(-EINVAL, ram_backing_parse("hugetlb:4K", &b));
+    EXPECT_EQ(-EINVAL, ram_backing_parse("thp:2M", &b));
+}
+
+TEST(RamBackingTest, MapsAligned) {
+    const uint64_t size = 3*MEMBANK_ALIGN;
+    const char* names[] = { "memfd", "anon", "thp" };
+
+    for (const char* name : names) {
+        ram_backing b;
+        void* addr;
+        int fd;
+
+        ASSERT_EQ(0, ram_backing_parse(name, &b));
+        ASSERT_EQ(0, ram_backing_map(b, size, &addr, &fd)) << name;
+        EXPECT_EQ(0u, reinterpret_cast<uint64_t>(addr) % MEMBANK_ALIGN);
+        EXPECT_EQ(b.type == RAM_BACKING_MEMFD, fd >= 0) << name;
+
+        static_cast<uint8_t*>(addr)[size - 1] = 1;
+        munmap(addr, size);
+        if (fd >= 0)
+            close(fd);
+    }
+}
+
+}  // namespace
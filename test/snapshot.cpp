@@ -0,0 +1,236 @@
+#include <gtest/gtest.h>
+#include <snapshot.hpp>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <vm.hpp>
+
+namespace {
+
+constexpr uint64_t PAGES = 32;
+
+class SnapshotTest : public ::testing::Test {
+ protected:
+    void SetUp() override {
+        char tmpl[] = "/tmp/snapshot-test-XXXXXX";
+
+        ASSERT_NE(mkdtemp(tmpl), nullptr);
+        dir = tmpl;
+        std::fill(std::begin(ram), std::end(ram), 0);
+        std::memset(static_cast<void*>(&devices), 0x5a, sizeof(devices));
+        vcpu_state = { { 1, 2, 3 }, { 4, 5, 6, 7 } };
+    }
+
+    void TearDown() override {
+        for (const std::string& f : files)
+            unlink(f.c_str());
+        rmdir(dir.c_str());
+    }
+
+    void Fill(uint64_t page, uint8_t value) {
+        std::fill(ram + page*SNAP_PAGE_SIZE, ram + (page + 1)*SNAP_PAGE_SIZE,
+                value);
+    }
+
+    // A full snapshot of ram, or with parent a layer of the given pages
+    int Write(const std::string& name, const std::string& parent = "",
+            const std::vector<uint64_t>& pages = {}) {
+        snap_contents c = {
+            .vcpu_state = &vcpu_state,
+            .devices = &devices,
+            .ram = ram,
+            .ram_size = sizeof(ram),
+            .parent = parent,
+            .pages = &pages,
+            .store = std::string(),
+            .refs = nullptr,
+        };
+
+        files.push_back(Path(name));
+        stats = snapshot_stats();
+        return write_snapshot(files.back().c_str(), c, &stats);
+    }
+
+    std::string Path(const std::string& name) { return dir + "/" + name; }
+
+    std::string dir;
+    std::vector<std::string> files;
+    std::vector<std::vector<uint8_t>> vcpu_state;
+    vm_device_state devices;
+    snapshot_stats stats;
+    alignas(64) uint8_t ram[PAGES*SNAP_PAGE_SIZE];
+};
+
+TEST_F(SnapshotTest, RoundTripsSections) {
+    snap_file f;
+    std::vector<std::vector<uint8_t>> vcpu_back;
+    vm_device_state devices_back;
+    std::vector<uint8_t> ram_back(sizeof(ram));
+    const snap_section* sec;
+
+    Fill(0, 0x11);
+    Fill(1, 0x22);
+    Fill(7, 0x77);
+    ASSERT_EQ(0, Write("full"));
+    EXPECT_EQ(PAGES - 3, stats.zero_pages);
+    EXPECT_NE(0, access((Path("full") + ".tmp").c_str(), F_OK));
+    ASSERT_EQ(0, open_snapshot(Path("full"), &f));
+
+    EXPECT_EQ(SNAP_MAGIC, f.hdr.magic);
+    EXPECT_EQ(2u, f.hdr.vcpu_num);
+    EXPECT_EQ(sizeof(ram), f.hdr.ram_size);
+    ASSERT_NE(nullptr, sec = f.Find(SNAP_SEC_RAM));
+    EXPECT_EQ(0u, sec->offset % SNAP_RAM_ALIGN);
+    ASSERT_EQ(sizeof(ram), sec->size);
+    EXPECT_EQ(nullptr, f.Find(SNAP_SEC_PARENT));
+
+    ASSERT_EQ(static_cast<ssize_t>(sizeof(ram)),
+            pread(f.fd, ram_back.data(), sizeof(ram), sec->offset));
+    EXPECT_EQ(0, std::memcmp(ram, ram_back.data(), sizeof(ram)));
+
+    ASSERT_EQ(0, read_state(f, &vcpu_back, &devices_back));
+    EXPECT_EQ(vcpu_state, vcpu_back);
+    EXPECT_EQ(0, std::memcmp(&devices, &devices_back, sizeof(devices)));
+}
+
+TEST_F(SnapshotTest, RejectsWhatIsNotASnapshot) {
+    snap_file f, g;
+
+    Fill(0, 0x11);
+    ASSERT_EQ(0, Write("full"));
+    // Cut short: the RAM section runs past the end
+    ASSERT_EQ(0, truncate(Path("full").c_str(), SNAP_RAM_ALIGN));
+    EXPECT_EQ(-EINVAL, open_snapshot(Path("full"), &f));
+    EXPECT_EQ(-ENOENT, open_snapshot(Path("missing"), &g));
+}
+
+// The view a chain should resolve to, read the way Load() builds it: the
+// base's RAM, then the layers over it
+class SnapshotChainTest : public SnapshotTest {
+ protected:
+    void SetUp() override {
+        SnapshotTest::SetUp();
+        view = static_cast<uint8_t*>(mmap(nullptr, sizeof(ram),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0));
+        ASSERT_NE(MAP_FAILED, view);
+
+        // base: 0-3 and 20-35 filled; l1: 1, 2; l2: 2, 5 and a run of
+        // 16 that is mapped rather than read
+        for (uint64_t i = 0; i < 4; ++i)
+            Fill(i, 0x10 + i);
+        for (uint64_t i = 20; i < PAGES; ++i)
+            Fill(i, 0x30);
+        ASSERT_EQ(0, Write("base"));
+        Fill(1, 0xa1);
+        Fill(2, 0xa2);
+        ASSERT_EQ(0, Write("l1", "base", { 1, 2 }));
+        Fill(2, 0xb2);
+        Fill(5, 0xb5);
+        std::vector<uint64_t> l2 = { 2, 5 };
+        for (uint64_t i = PAGES - 16; i < PAGES; ++i) {
+            Fill(i, 0xbf);
+            l2.push_back(i);
+        }
+        vcpu_state[0] = { 9, 9 };
+        ASSERT_EQ(0, Write("l2", "l1", l2));
+    }
+
+    void TearDown() override {
+        munmap(view, sizeof(ram));
+        SnapshotTest::TearDown();
+    }
+
+    int Overlay(const std::string& name, snap_chain* chain) {
+        const snap_section* sec;
+        int r;
+
+        stats = snapshot_stats();
+        if ((r = open_chain(Path(name).c_str(), chain)))
+            return r;
+        sec = chain->back()->Find(SNAP_SEC_RAM);
+        if (!sec || pread(chain->back()->fd, view, sec->size, sec->offset)
+                != static_cast<ssize_t>(sec->size))
+            return -EIO;
+        return overlay_layers(*chain, view, &stats);
+    }
+
+    uint8_t* view = nullptr;
+};
+
+TEST_F(SnapshotChainTest, ResolvesTheNewestPage) {
+    snap_chain chain;
+
+    ASSERT_EQ(0, Overlay("l2", &chain));
+    ASSERT_EQ(3u, chain.size());
+    EXPECT_EQ(Path("l2"), chain[0]->path);
+    EXPECT_EQ(Path("base"), chain[2]->path);
+
+    // ram holds what l2 was written from, which is the newest of all
+    EXPECT_EQ(0, std::memcmp(ram, view, sizeof(ram)));
+    EXPECT_EQ(0xa1, view[1*SNAP_PAGE_SIZE]);
+    EXPECT_EQ(0xb2, view[2*SNAP_PAGE_SIZE]);
+    EXPECT_EQ(0x13, view[3*SNAP_PAGE_SIZE]);
+
+    ASSERT_EQ(3u, stats.layers.size());
+    EXPECT_EQ(18u, stats.layers[0].pages_used);
+    EXPECT_EQ(16u, stats.layers[0].pages_mapped);
+    EXPECT_EQ(2u, stats.layers[0].pages_copied);
+    EXPECT_EQ(2u, stats.layers[1].pages);
+    EXPECT_EQ(1u, stats.layers[1].pages_used);  // 2 is l2's
+    EXPECT_EQ(PAGES - 19, stats.layers[2].pages_used);
+}
+
+TEST_F(SnapshotChainTest, CompactsToTheOverlaidView) {
+    snap_chain chain, compacted;
+    snapshot_stats st;
+    std::vector<std::vector<uint8_t>> vcpu_back;
+    vm_device_state devices_back;
+    std::vector<uint8_t> ram_back(sizeof(ram));
+    const snap_section* sec;
+
+    ASSERT_EQ(0, Overlay("l2", &chain));
+    files.push_back(Path("compact"));
+    ASSERT_EQ(0, snapshot_compact(Path("l2").c_str(),
+                Path("compact").c_str(), &st));
+
+    // A full snapshot on its own, with the newest state
+    ASSERT_EQ(0, open_chain(Path("compact").c_str(), &compacted));
+    ASSERT_EQ(1u, compacted.size());
+    ASSERT_NE(nullptr, sec = compacted[0]->Find(SNAP_SEC_RAM));
+    ASSERT_EQ(static_cast<ssize_t>(sizeof(ram)), pread(compacted[0]->fd,
+                ram_back.data(), sizeof(ram), sec->offset));
+    EXPECT_EQ(0, std::memcmp(view, ram_back.data(), sizeof(ram)));
+    ASSERT_EQ(0, read_state(*compacted[0], &vcpu_back, &devices_back));
+    EXPECT_EQ(vcpu_state, vcpu_back);
+}
+
+TEST_F(SnapshotChainTest, RejectsABrokenParent) {
+    snap_chain missing, corrupt;
+    const uint32_t bad = 0;
+    int fd;
+
+    ASSERT_EQ(0, Write("orphan", "nonexistent", { 1 }));
+    EXPECT_EQ(-ENOENT, open_chain(Path("orphan").c_str(), &missing));
+
+    // No magic at the bottom of the chain
+    fd = open(Path("base").c_str(), O_WRONLY);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(static_cast<ssize_t>(sizeof(bad)),
+            pwrite(fd, &bad, sizeof(bad), 0));
+    close(fd);
+    EXPECT_EQ(-EINVAL, open_chain(Path("l2").c_str(), &corrupt));
+}
+
+}  // namespace
@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+#include <timeline.hpp>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+TEST(BootTimelineTest, MarksInOrderAndOnce) {
+    BootTimeline t;
+    std::vector<timeline_event> events;
+
+    t.Mark("a");
+    t.MarkOnce("b");
+    t.MarkOnce("b");
+    std::thread([&t] { t.MarkOnce("c"); }).join();
+    t.Mark("a");
+
+    events = t.Events();
+    ASSERT_EQ(4u, events.size());
+    EXPECT_EQ("a", events[0].name);
+    EXPECT_EQ("b", events[1].name);
+    EXPECT_EQ("c", events[2].name);
+    EXPECT_EQ("a", events[3].name);
+    for (size_t i = 1; i < events.size(); ++i)
+        EXPECT_LE(events[i - 1].ns, events[i].ns);
+}
+
+TEST(BootTimelineTest, Phases) {
+    const std::vector<timeline_event> events = {
+        { "vm_created", 100 }, { "createVcpu", 350 },
+        { "first_kvm_run", 340 }, { "first_com1_byte", 1000 },
+    };
+    std::vector<timeline_event> phases = timeline_phases(events);
+
+    ASSERT_EQ(4u, phases.size());
+    EXPECT_EQ("vm_created", phases[0].name);
+    EXPECT_EQ(100u, phases[0].ns);
+    EXPECT_EQ(250u, phases[1].ns);
+    EXPECT_EQ(0u, phases[2].ns);  // marked from another thread, late
+    EXPECT_EQ(650u, phases[3].ns);
+}
+
+TEST(BootTimelineTest, FormatsOneLine) {
+    EXPECT_EQ("{\"boot_timeline_ns\":[]}", timeline_format({}));
+    EXPECT_EQ("{\"boot_timeline_ns\":[[\"vm_created\",12],"
+            "[\"console_marker\",3456]]}",
+            timeline_format({ { "vm_created", 12 },
+                    { "console_marker", 3456 } }));
+}
+
+}  // namespace
@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+#include <vcpu.hpp>
+
+#include <linux/kvm.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <kvm.hpp>
+#include <vm.hpp>
+
+namespace {
+
+constexpr uint32_t MSR_IA32_TSC          = 0x10;
+constexpr uint32_t MSR_IA32_TSC_DEADLINE = 0x6e0;
+constexpr uint32_t APIC_SPIV             = 0xf0;
+constexpr uint32_t APIC_LVTT             = 0x320;
+constexpr uint32_t APIC_SPIV_ENABLE      = 1 << 8;
+constexpr uint32_t APIC_LVTT_MODE_MASK   = 3 << 17;
+constexpr uint32_t APIC_LVTT_TSCDEADLINE = 2 << 17;
+
+class VcpuStateTest : public ::testing::Test {
+ protected:
+    void SetUp() override {
+        int fd = KVM::getKVMFD();
+
+        ASSERT_GE(fd, 0);
+        kvm.reset(new KVM(fd));
+        for (std::unique_ptr<VM>* vm : { &src, &dst }) {
+            VM* p;
+
+            ASSERT_GE(kvm->kvmCreateVM(&p, conf), 0);
+            vm->reset(p);
+            ASSERT_EQ(0, (*vm)->initMachine());
+        }
+    }
+
+    // The payload of the entry of type in a SaveState() record
+    static uint8_t* Find(std::vector<uint8_t>* state, uint32_t type) {
+        vcpu_state_entry e;
+
+        for (size_t off = 0; off + sizeof(e) <= state->size();
+                off += sizeof(e) + e.len) {
+            std::memcpy(&e, state->data() + off, sizeof(e));
+            if (e.type == type)
+                return state->data() + off + sizeof(e);
+        }
+        return nullptr;
+    }
+
+    static kvm_msr_entry* FindMSR(std::vector<uint8_t>* state,
+            uint32_t index) {
+        kvm_msrs* msrs = reinterpret_cast<kvm_msrs*>(
+                Find(state, VCPU_STATE_MSRS));
+
+        for (uint32_t i = 0; msrs && i < msrs->nmsrs; ++i) {
+            if (msrs->entries[i].index == index)
+                return &msrs->entries[i];
+        }
+        return nullptr;
+    }
+
+    static uint32_t* LapicReg(std::vector<uint8_t>* state, uint32_t reg) {
+        uint8_t* lapic = Find(state, VCPU_STATE_LAPIC);
+
+        return lapic ? reinterpret_cast<uint32_t*>(
+                reinterpret_cast<kvm_lapic_state*>(lapic)->regs + reg)
+            : nullptr;
+    }
+
+    const vm_config conf {
+        .vcpu_num = 1,
+        .ram_size = 16 << 20,
+        .kernel_path = "/dev/null",
+        .initramfs_path = "/dev/null",
+        .is_64bit_boot = false,
+    };
+    std::unique_ptr<KVM> kvm;
+    std::unique_ptr<VM> src, dst;
+};
+
+// KVM ignores a TSC deadline written while the LAPIC timer is not in
+// TSC-deadline mode, so an armed deadline only survives with the LAPIC
+// loaded before the MSRs
+TEST_F(VcpuStateTest, KeepsAnArmedTSCDeadline) {
+    std::vector<uint8_t> state, back;
+    kvm_msr_entry *tsc, *deadline;
+    uint32_t *spiv, *lvtt;
+    uint64_t when;
+
+    ASSERT_EQ(0, src->getVcpu(0)->SaveState(&state));
+    ASSERT_NE(nullptr, spiv = LapicReg(&state, APIC_SPIV));
+    ASSERT_NE(nullptr, lvtt = LapicReg(&state, APIC_LVTT));
+    tsc = FindMSR(&state, MSR_IA32_TSC);
+    deadline = FindMSR(&state, MSR_IA32_TSC_DEADLINE);
+    if (!tsc || !deadline)
+        GTEST_SKIP() << "KVM saves no TSC or TSC deadline MSR";
+
+    *spiv |= APIC_SPIV_ENABLE;
+    *lvtt = APIC_LVTT_TSCDEADLINE | 0xec;
+    when = tsc->data + (1ULL << 40);
+    deadline->data = when;
+
+    ASSERT_EQ(0, dst->getVcpu(0)->LoadState(state.data(), state.size()));
+    ASSERT_EQ(0, dst->getVcpu(0)->SaveState(&back));
+    if ((*LapicReg(&back, APIC_LVTT) & APIC_LVTT_MODE_MASK)
+            != APIC_LVTT_TSCDEADLINE)
+        GTEST_SKIP() << "the vCPU has no TSC-deadline timer";
+    ASSERT_NE(nullptr, deadline = FindMSR(&back, MSR_IA32_TSC_DEADLINE));
+    EXPECT_EQ(when, deadline->data);
+}
+
+}  // namespace
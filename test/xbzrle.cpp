@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+#include <xbzrle.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+TEST(XbzrleTest, RoundTrip) {
+    std::vector<uint8_t> old_page(XBZRLE_PAGE_SIZE, 0x11);
+    std::vector<uint8_t> new_page(old_page);
+    std::vector<uint8_t> delta(XBZRLE_PAGE_SIZE);
+
+    new_page[0] = 0x22;
+    new_page[2] = 0x33;  // one unchanged byte in between
+    for (size_t i = 1000; i < 1300; ++i)
+        new_page[i] = i;
+    new_page[XBZRLE_PAGE_SIZE - 1] = 0;
+
+    int len = xbzrle_encode(old_page.data(), new_page.data(),
+            delta.data(), delta.size());
+    ASSERT_GT(len, 0);
+    ASSERT_LT(len, 400);
+
+    ASSERT_EQ(0, xbzrle_decode(delta.data(), len, old_page.data()));
+    ASSERT_EQ(new_page, old_page);
+}
+
+TEST(XbzrleTest, IdenticalPageIsEmpty) {
+    std::vector<uint8_t> page(XBZRLE_PAGE_SIZE, 0x5a);
+    uint8_t delta[16];
+
+    ASSERT_EQ(0, xbzrle_encode(page.data(), page.data(), delta,
+                sizeof(delta)));
+}
+
+TEST(XbzrleTest, OverflowFallsBack) {
+    std::vector<uint8_t> old_page(XBZRLE_PAGE_SIZE, 0);
+    std::vector<uint8_t> new_page(XBZRLE_PAGE_SIZE, 0xff);
+    std::vector<uint8_t> delta(XBZRLE_PAGE_SIZE - 1);
+
+    ASSERT_EQ(-1, xbzrle_encode(old_page.data(), new_page.data(),
+                delta.data(), delta.size()));
+}
+
+TEST(XbzrleTest, RejectsOutOfBoundsDelta) {
+    std::vector<uint8_t> page(XBZRLE_PAGE_SIZE);
+    const uint8_t delta[] = {0xff, 0x1f, 0x01, 0xaa};  // skip 4095, 1 byte
+
+    ASSERT_EQ(0, xbzrle_decode(delta, sizeof(delta), page.data()));
+    const uint8_t bad[] = {0x80, 0x20, 0x01, 0xaa};  // skip 4096, 1 byte
+    ASSERT_NE(0, xbzrle_decode(bad, sizeof(bad), page.data()));
+}
+
+TEST(PageCacheTest, EvictsLeastRecentlyUsed) {
+    PageCache cache(2);
+    std::vector<uint8_t> page(XBZRLE_PAGE_SIZE);
+
+    page[0] = 1;
+    cache.Insert(10, page.data());
+    page[0] = 2;
+    cache.Insert(20, page.data());
+
+    ASSERT_EQ(1, cache.Lookup(10)[0]);  // 20 is now the oldest
+    page[0] = 3;
+    cache.Insert(30, page.data());
+
+    ASSERT_EQ(nullptr, cache.Lookup(20));
+    ASSERT_EQ(1, cache.Lookup(10)[0]);
+    ASSERT_EQ(3, cache.Lookup(30)[0]);
+    ASSERT_EQ(1u, cache.Stats().evictions);
+    ASSERT_EQ(3u, cache.Stats().hits);
+    ASSERT_EQ(1u, cache.Stats().misses);
+
+    cache.Erase(10);
+    ASSERT_EQ(1u, cache.Size());
+    ASSERT_EQ(nullptr, cache.Lookup(10));
+}
+
+}  // namespace
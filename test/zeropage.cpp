@@ -0,0 +1,35 @@
+#include <gtest/gtest.h>
+#include <zeropage.hpp>
+
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+TEST(ZeroPageTest, KernelsAgree) {
+    alignas(64) static uint8_t page[ZERO_PAGE_SIZE];
+    const size_t offsets[] = {0, 31, 32, 127, 128, 2048, ZERO_PAGE_SIZE - 1};
+
+    for (size_t k = 0; k < ZERO_PAGE_KERNEL_NUM; ++k) {
+        const zero_page_kernel& kernel = zero_page_kernels[k];
+        if (!kernel.supported())
+            continue;
+
+        std::memset(page, 0, sizeof(page));
+        ASSERT_TRUE(kernel.func(page)) << kernel.name;
+
+        for (size_t off : offsets) {
+            page[off] = 0x80;
+            ASSERT_FALSE(kernel.func(page)) << kernel.name << " " << off;
+            page[off] = 0;
+        }
+    }
+}
+
+TEST(ZeroPageTest, ScalarAlwaysAvailable) {
+    const zero_page_kernel& last = zero_page_kernels[ZERO_PAGE_KERNEL_NUM - 1];
+    ASSERT_STREQ("scalar", last.name);
+    ASSERT_TRUE(last.supported());
+}
+
+}  // namespace